@@ -641,6 +641,9 @@ pub mod ffi {
         fn get_container(&self) -> bool;
         fn get_machineid_compat(&self) -> bool;
         fn get_etc_group_members(&self) -> Vec<String>;
+        fn get_memoize_file_triggers(&self) -> Vec<String>;
+        fn get_memoize_file_trigger_inputs(&self, package: &str) -> Vec<String>;
+        fn get_parallel_post_scripts(&self) -> Vec<String>;
         fn get_boot_location_is_modules(&self) -> bool;
         fn use_kernel_install(&self) -> bool;
         fn get_ima(&self) -> bool;
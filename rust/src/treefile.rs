@@ -500,7 +500,9 @@ fn treefile_merge(dest: &mut TreeComposeConfig, src: &mut TreeComposeConfig) {
         postprocess,
         add_files,
         remove_files,
-        remove_from_packages
+        remove_from_packages,
+        memoize_file_triggers,
+        parallel_post_scripts
     );
 
     merge_hashset_field(&mut dest.bootstrap_packages, &mut src.bootstrap_packages);
@@ -1395,6 +1397,36 @@ impl Treefile {
             .unwrap_or_default()
     }
 
+    pub(crate) fn get_memoize_file_triggers(&self) -> Vec<String> {
+        self.parsed
+            .base
+            .memoize_file_triggers
+            .iter()
+            .flatten()
+            .map(|t| t.package().to_string())
+            .collect()
+    }
+
+    pub(crate) fn get_parallel_post_scripts(&self) -> Vec<String> {
+        self.parsed
+            .base
+            .parallel_post_scripts
+            .clone()
+            .unwrap_or_default()
+    }
+
+    /// Paths the file triggers of `package` read besides the files they match.
+    pub(crate) fn get_memoize_file_trigger_inputs(&self, package: &str) -> Vec<String> {
+        self.parsed
+            .base
+            .memoize_file_triggers
+            .iter()
+            .flatten()
+            .filter(|t| t.package() == package)
+            .flat_map(|t| t.extra_inputs().iter().cloned())
+            .collect()
+    }
+
     pub(crate) fn get_ima(&self) -> bool {
         self.parsed.base.ima.unwrap_or(false)
     }
@@ -1497,6 +1529,19 @@ impl Treefile {
                 .into());
             }
         }
+        for trigger in config.base.memoize_file_triggers.iter().flatten() {
+            if let Some(p) = trigger.extra_inputs().iter().find(|p| !p.starts_with('/')) {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidInput,
+                    format!(
+                        "memoize-file-triggers: extra-inputs of {} must be absolute: {}",
+                        trigger.package(),
+                        p
+                    ),
+                )
+                .into());
+            }
+        }
         Ok(())
     }
 
@@ -2124,6 +2169,39 @@ pub(crate) enum BootLocation {
     KernelInstall,
 }
 
+/// An entry in `memoize-file-triggers`: either just a package name, or a package
+/// along with paths its file triggers read besides the files they match.
+#[derive(Clone, Serialize, Deserialize, Debug, PartialEq, Eq)]
+#[serde(untagged)]
+pub(crate) enum MemoizeFileTrigger {
+    Package(String),
+    WithInputs(MemoizeFileTriggerInputs),
+}
+
+#[derive(Clone, Serialize, Deserialize, Debug, PartialEq, Eq)]
+#[serde(rename_all = "kebab-case")]
+#[serde(deny_unknown_fields)]
+pub(crate) struct MemoizeFileTriggerInputs {
+    pub(crate) package: String,
+    pub(crate) extra_inputs: Vec<String>,
+}
+
+impl MemoizeFileTrigger {
+    pub(crate) fn package(&self) -> &str {
+        match self {
+            MemoizeFileTrigger::Package(p) => p,
+            MemoizeFileTrigger::WithInputs(i) => &i.package,
+        }
+    }
+
+    pub(crate) fn extra_inputs(&self) -> &[String] {
+        match self {
+            MemoizeFileTrigger::Package(_) => &[],
+            MemoizeFileTrigger::WithInputs(i) => &i.extra_inputs,
+        }
+    }
+}
+
 #[derive(Clone, Serialize, Deserialize, Debug, PartialEq, Eq)]
 #[serde(rename_all = "kebab-case")]
 #[serde(tag = "type")]
@@ -2618,6 +2696,10 @@ pub(crate) struct BaseComposeConfigFields {
     pub(crate) no_initramfs: Option<bool>,
     #[serde(skip_serializing_if = "Option::is_none")]
     pub(crate) readonly_executables: Option<bool>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub(crate) memoize_file_triggers: Option<Vec<MemoizeFileTrigger>>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub(crate) parallel_post_scripts: Option<Vec<String>>,
 
     // Tree layout options
     #[serde(skip_serializing_if = "Option::is_none")]
@@ -3446,6 +3528,71 @@ pub(crate) mod tests {
         "});
     }
 
+    #[test]
+    fn basic_memoize_file_triggers() {
+        let treefile = new_test_tf_basic(
+            VALID_PRELUDE.to_string()
+                + indoc! {"
+                    memoize-file-triggers:
+                      - glib2
+                      - package: glibc
+                        extra-inputs:
+                          - /etc/ld.so.conf
+                          - /etc/ld.so.conf.d
+                "},
+        )
+        .unwrap();
+        assert_eq!(treefile.get_memoize_file_triggers(), vec!["glib2", "glibc"]);
+        assert!(treefile.get_memoize_file_trigger_inputs("glib2").is_empty());
+        assert_eq!(
+            treefile.get_memoize_file_trigger_inputs("glibc"),
+            vec!["/etc/ld.so.conf", "/etc/ld.so.conf.d"]
+        );
+        assert!(treefile
+            .get_memoize_file_trigger_inputs("fontconfig")
+            .is_empty());
+    }
+
+    #[test]
+    fn basic_parallel_post_scripts() {
+        let treefile = new_test_tf_basic(
+            VALID_PRELUDE.to_string()
+                + indoc! {"
+                    parallel-post-scripts:
+                      - fontconfig
+                      - shared-mime-info
+                "},
+        )
+        .unwrap();
+        assert_eq!(
+            treefile.get_parallel_post_scripts(),
+            vec!["fontconfig", "shared-mime-info"]
+        );
+        let treefile = new_test_tf_basic(VALID_PRELUDE).unwrap();
+        assert!(treefile.get_parallel_post_scripts().is_empty());
+    }
+
+    #[test]
+    fn test_invalid_memoize_file_triggers() {
+        // Relative paths
+        assert!(new_test_tf_basic(
+            VALID_PRELUDE.to_string()
+                + indoc! {"
+                    memoize-file-triggers:
+                      - package: glibc
+                        extra-inputs:
+                          - etc/ld.so.conf
+                "}
+        )
+        .is_err());
+        // Unknown fields
+        test_invalid(indoc! {"
+            memoize-file-triggers:
+              - package: glibc
+                extra-input: /etc/ld.so.conf
+        "});
+    }
+
     #[test]
     fn basic_boot_kernel_install() {
         let treefile = append_and_parse(indoc! {"
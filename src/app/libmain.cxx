@@ -32,7 +32,10 @@
 
 #include "rpmostree-builtins.h"
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-file-contexts.h"
 #include "rpmostree-polkit-agent.h"
+#include "rpmostree-search-index.h"
+#include "rpmostree-trigger-cache.h"
 #include "rpmostree-util.h"
 #include "rpmostreemain.h"
 
@@ -578,6 +581,9 @@ c_unit_tests ()
 {
   // Add unit tests to a new C/C++ file here.
   rpmostreed_utils_tests ();
+  rpmostree_search_index_tests ();
+  rpmostree_trigger_cache_tests ();
+  rpmostree_file_contexts_tests ();
 }
 
 } /* namespace */
@@ -246,11 +246,17 @@ rpmostree_load_os_proxies (RPMOSTreeSysroot *sysroot_proxy, const char *opt_osna
   if (g_dbus_connection_get_unique_name (connection) != NULL)
     bus_name = BUS_NAME;
 
+  /* With a transaction queue, our calls return once the transactions ahead
+   * of them are done, however long that takes */
+  const int timeout = rpmostree_sysroot_get_transaction_queue (sysroot_proxy)
+                          ? G_MAXINT
+                          : DEFAULT_DBUS_TIMEOUT_MILLIS;
+
   glnx_unref_object RPMOSTreeOS *os_proxy = rpmostree_os_proxy_new_sync (
       connection, G_DBUS_PROXY_FLAGS_NONE, bus_name, os_object_path, cancellable, error);
   if (os_proxy == NULL)
     return FALSE;
-  g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (os_proxy), DEFAULT_DBUS_TIMEOUT_MILLIS);
+  g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (os_proxy), timeout);
 
   glnx_unref_object RPMOSTreeOSExperimental *ret_osexperimental_proxy = NULL;
   if (out_osexperimental_proxy)
@@ -259,8 +265,7 @@ rpmostree_load_os_proxies (RPMOSTreeSysroot *sysroot_proxy, const char *opt_osna
           connection, G_DBUS_PROXY_FLAGS_NONE, bus_name, os_object_path, cancellable, error);
       if (!ret_osexperimental_proxy)
         return FALSE;
-      g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (ret_osexperimental_proxy),
-                                        DEFAULT_DBUS_TIMEOUT_MILLIS);
+      g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (ret_osexperimental_proxy), timeout);
     }
 
   *out_os_proxy = util::move_nullify (os_proxy);
@@ -596,6 +601,20 @@ impl_transaction_get_response_sync (GDBusConnection *connection, const char *tra
   gulong signal_handler
       = g_signal_connect (transaction, "g-signal", G_CALLBACK (on_transaction_progress), tp);
 
+  /* The daemon rate-limits progress signals by default; allow asking for
+   * every update instead. */
+  if (g_getenv ("RPMOSTREE_CLIENT_FULL_PROGRESS"))
+    {
+      GVariantDict opts;
+      g_variant_dict_init (&opts, NULL);
+      g_variant_dict_insert (&opts, "full-verbosity", "b", TRUE);
+      g_autoptr (GError) local_error = NULL;
+      /* Older daemons don't have this method; that's fine */
+      if (!rpmostree_transaction_call_set_progress_options_sync (
+              transaction, g_variant_dict_end (&opts), cancellable, &local_error))
+        g_debug ("Failed to set progress options: %s", local_error->message);
+    }
+
   /* Tell the server we're ready to receive signals. */
   if (!rpmostree_transaction_call_start_sync (transaction, &just_started, cancellable, error))
     {
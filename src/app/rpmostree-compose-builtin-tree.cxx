@@ -295,6 +295,13 @@ try_load_previous_sepolicy (RpmOstreeTreeComposeContext *self, GCancellable *can
 
   rpmostree_context_set_sepolicy (self->corectx, sepolicy);
 
+  glnx_autofd int selinux_rootfs_dfd = -1;
+  if (!glnx_opendirat (self->workdir_dfd, "selinux.tmp", TRUE, &selinux_rootfs_dfd, error))
+    return FALSE;
+  if (!rpmostree_context_load_sepolicy_file_contexts (self->corectx, selinux_rootfs_dfd,
+                                                      cancellable, error))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -487,18 +494,17 @@ install_packages (RpmOstreeTreeComposeContext *self, gboolean *out_unmodified,
   CXX_TRY ((*self->treefile_rs)->sanitycheck_externals (), error);
 
   /* --- Downloading packages --- */
-  if (!rpmostree_context_download (self->corectx, cancellable, error))
+  /* In the unified core path, imports into the pkgcache are overlapped with downloads */
+  if (opt_unified_core && !opt_download_only_rpms)
+    {
+      if (!rpmostree_context_download_and_import (self->corectx, cancellable, error))
+        return FALSE;
+    }
+  else if (!rpmostree_context_download (self->corectx, cancellable, error))
     return FALSE;
 
   if (opt_download_only || opt_download_only_rpms)
-    {
-      if (opt_unified_core && !opt_download_only_rpms)
-        {
-          if (!rpmostree_context_import (self->corectx, cancellable, error))
-            return FALSE;
-        }
-      return TRUE; /* 🔚 Early return */
-    }
+    return TRUE; /* 🔚 Early return */
 
   /* Before we install packages, inject /etc/{passwd,group} if configured. */
   g_assert (self->repo);
@@ -509,8 +515,6 @@ install_packages (RpmOstreeTreeComposeContext *self, gboolean *out_unmodified,
 
   if (opt_unified_core)
     {
-      if (!rpmostree_context_import (self->corectx, cancellable, error))
-        return FALSE;
       rpmostree_context_set_tmprootfs_dfd (self->corectx, rootfs_dfd);
       if (!rpmostree_context_assemble (self->corectx, cancellable, error))
         return FALSE;
@@ -525,6 +529,9 @@ install_packages (RpmOstreeTreeComposeContext *self, gboolean *out_unmodified,
             return FALSE;
 
           rpmostree_context_set_sepolicy (self->corectx, sepolicy);
+          if (!rpmostree_context_load_sepolicy_file_contexts (self->corectx, rootfs_dfd,
+                                                              cancellable, error))
+            return FALSE;
 
           if (!rpmostree_context_force_relabel (self->corectx, cancellable, error))
             return FALSE;
@@ -29,6 +29,7 @@
 
 #include "rpmostree-core.h"
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-file-contexts.h"
 #include "rpmostree-kernel.h"
 #include "rpmostree-origin.h"
 #include "rpmostree-output.h"
@@ -36,6 +37,7 @@
 #include "rpmostree-rpm-util.h"
 #include "rpmostree-sysroot-core.h"
 #include "rpmostree-sysroot-upgrader.h"
+#include "rpmostree-trigger-cache.h"
 
 #include "ostree-repo.h"
 
@@ -48,12 +50,12 @@
  */
 
 /* For all packages in the sack, generate a cached refspec and add it
- * to @referenced_pkgs. This is necessary to implement garbage
+ * to @refs. This is necessary to implement garbage
  * collection of layered package refs.
  */
 static gboolean
-add_package_refs_to_set (RpmOstreeRefSack *rsack, GHashTable *referenced_pkgs,
-                         GCancellable *cancellable, GError **error)
+add_package_refs_to_set (RpmOstreeRefSack *rsack, GPtrArray *refs, GCancellable *cancellable,
+                         GError **error)
 {
   g_autoptr (GPtrArray) pkglist = NULL;
   hy_autoquery HyQuery query = hy_query_create (rsack->sack);
@@ -69,17 +71,134 @@ add_package_refs_to_set (RpmOstreeRefSack *rsack, GHashTable *referenced_pkgs,
       for (guint i = 0; i < pkglist->len; i++)
         {
           auto pkg = static_cast<DnfPackage *> (pkglist->pdata[i]);
-          g_autofree char *pkgref = rpmostree_get_cache_branch_pkg (pkg);
-          g_hash_table_add (referenced_pkgs, util::move_nullify (pkgref));
+          g_ptr_array_add (refs, rpmostree_get_cache_branch_pkg (pkg));
         }
     }
 
   return TRUE;
 }
 
+/* Same as add_package_refs_to_set(), but from the rpmostree.rpmdb.pkglist
+ * metadata of @checksum, which saves loading the rpmdb. Sets @out_found to
+ * %FALSE if the commit predates that metadata.
+ */
+static gboolean
+add_commit_package_refs_to_set (OstreeRepo *repo, const char *checksum, GPtrArray *refs,
+                                gboolean *out_found, GError **error)
+{
+  g_autoptr (GVariant) commit = NULL;
+  if (!ostree_repo_load_commit (repo, checksum, &commit, NULL, error))
+    return FALSE;
+
+  g_autoptr (GVariant) meta = g_variant_get_child_value (commit, 0);
+  g_autoptr (GVariantDict) meta_dict = g_variant_dict_new (meta);
+  g_autoptr (GVariant) pkglist_v = g_variant_dict_lookup_value (
+      meta_dict, "rpmostree.rpmdb.pkglist", G_VARIANT_TYPE ("a(sssss)"));
+  if (!pkglist_v || g_variant_n_children (pkglist_v) == 0)
+    {
+      *out_found = FALSE;
+      return TRUE;
+    }
+
+  const guint n = g_variant_n_children (pkglist_v);
+  for (guint i = 0; i < n; i++)
+    {
+      const char *name, *epoch, *version, *release, *arch;
+      g_variant_get_child (pkglist_v, i, "(&s&s&s&s&s)", &name, &epoch, &version, &release,
+                           &arch);
+      /* Match dnf_package_get_evr(), which omits a zero epoch */
+      g_autofree char *evr = g_str_equal (epoch, "0")
+                                 ? g_strdup_printf ("%s-%s", version, release)
+                                 : g_strdup_printf ("%s:%s-%s", epoch, version, release);
+      g_ptr_array_add (refs, rpmostree_get_cache_branch_for_n_evr_a (name, evr, arch));
+    }
+
+  *out_found = TRUE;
+  return TRUE;
+}
+
+/* Deployment checksum -> GPtrArray of the pkgcache refs for the packages in
+ * it. This never changes for a given commit, and cleanup runs after every
+ * deployment, so remember it for as long as the commit stays deployed.
+ */
+G_LOCK_DEFINE_STATIC (pkgcache_refs_cache);
+static GHashTable *pkgcache_refs_cache;
+
+static GPtrArray *
+get_deployment_pkgcache_refs (OstreeSysroot *sysroot, OstreeRepo *repo,
+                              OstreeDeployment *deployment, GCancellable *cancellable,
+                              GError **error)
+{
+  const char *csum = ostree_deployment_get_csum (deployment);
+
+  G_LOCK (pkgcache_refs_cache);
+  auto cached = pkgcache_refs_cache
+                    ? static_cast<GPtrArray *> (g_hash_table_lookup (pkgcache_refs_cache, csum))
+                    : NULL;
+  if (cached)
+    g_ptr_array_ref (cached);
+  G_UNLOCK (pkgcache_refs_cache);
+  if (cached)
+    return cached;
+
+  g_autoptr (GPtrArray) refs = g_ptr_array_new_with_free_func (g_free);
+  gboolean found = FALSE;
+  if (!add_commit_package_refs_to_set (repo, csum, refs, &found, error))
+    return NULL;
+
+  /* Older layered commits don't have the pkglist; reuse the existing rpmdb
+   * checkout rather than the commit object. */
+  if (!found)
+    {
+      g_autofree char *deployment_dirpath
+          = ostree_sysroot_get_deployment_dirpath (sysroot, deployment);
+      g_autoptr (RpmOstreeRefSack) rsack = rpmostree_get_refsack_for_root (
+          ostree_sysroot_get_fd (sysroot), deployment_dirpath, error);
+      if (rsack == NULL)
+        return NULL;
+
+      if (!add_package_refs_to_set (rsack, refs, cancellable, error))
+        return NULL;
+    }
+
+  G_LOCK (pkgcache_refs_cache);
+  if (!pkgcache_refs_cache)
+    pkgcache_refs_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                 (GDestroyNotify)g_ptr_array_unref);
+  g_hash_table_replace (pkgcache_refs_cache, g_strdup (csum), g_ptr_array_ref (refs));
+  G_UNLOCK (pkgcache_refs_cache);
+
+  return util::move_nullify (refs);
+}
+
+/* Drop cached pkgcache refs for commits that are no longer deployed */
+static void
+prune_pkgcache_refs_cache (GPtrArray *deployments)
+{
+  G_LOCK (pkgcache_refs_cache);
+  if (pkgcache_refs_cache)
+    {
+      GHashTableIter it;
+      gpointer key;
+      g_hash_table_iter_init (&it, pkgcache_refs_cache);
+      while (g_hash_table_iter_next (&it, &key, NULL))
+        {
+          gboolean deployed = FALSE;
+          for (guint i = 0; i < deployments->len && !deployed; i++)
+            {
+              auto deployment = static_cast<OstreeDeployment *> (deployments->pdata[i]);
+              deployed = g_str_equal (key, ostree_deployment_get_csum (deployment));
+            }
+          if (!deployed)
+            g_hash_table_iter_remove (&it);
+        }
+    }
+  G_UNLOCK (pkgcache_refs_cache);
+}
+
 /* Loop over all deployments, gathering all referenced NEVRAs for
- * layered packages.  Then delete any cached pkg refs that aren't in
- * that set.
+ * layered packages.  Then delete any cached pkg refs and file trigger
+ * results that aren't in that set.
  */
 static gboolean
 generate_pkgcache_refs (OstreeSysroot *sysroot, OstreeRepo *repo, guint *out_n_freed,
@@ -109,19 +228,12 @@ generate_pkgcache_refs (OstreeSysroot *sysroot, OstreeRepo *repo, guint *out_n_f
        */
       if (base_commit)
         {
-          g_autofree char *deployment_dirpath
-              = ostree_sysroot_get_deployment_dirpath (sysroot, deployment);
-
-          /* We could do this via the commit object, but it's faster
-           * to reuse the existing rpmdb checkout.
-           */
-          g_autoptr (RpmOstreeRefSack) rsack = rpmostree_get_refsack_for_root (
-              ostree_sysroot_get_fd (sysroot), deployment_dirpath, error);
-          if (rsack == NULL)
-            return FALSE;
-
-          if (!add_package_refs_to_set (rsack, referenced_pkgs, cancellable, error))
+          g_autoptr (GPtrArray) refs
+              = get_deployment_pkgcache_refs (sysroot, repo, deployment, cancellable, error);
+          if (!refs)
             return glnx_prefix_error (error, "Deployment index=%d", i);
+          for (guint j = 0; j < refs->len; j++)
+            g_hash_table_add (referenced_pkgs, g_strdup ((const char *)refs->pdata[j]));
         }
 
       /* also add any inactive local replacements */
@@ -137,6 +249,8 @@ generate_pkgcache_refs (OstreeSysroot *sysroot, OstreeRepo *repo, guint *out_n_f
         }
     }
 
+  prune_pkgcache_refs_cache (deployments);
+
   guint n_freed = 0;
   /* Loop over layered refs */
   g_autoptr (GHashTable) pkg_refs = NULL;
@@ -152,6 +266,13 @@ generate_pkgcache_refs (OstreeSysroot *sysroot, OstreeRepo *repo, guint *out_n_f
       n_freed++;
     }
 
+  /* And cached file trigger results of packages we just dropped */
+  guint n_triggers_freed = 0;
+  if (!rpmostree_trigger_cache_prune (repo, referenced_pkgs, &n_triggers_freed, cancellable,
+                                      error))
+    return FALSE;
+  n_freed += n_triggers_freed;
+
   *out_n_freed = n_freed;
   return TRUE;
 }
@@ -177,6 +298,10 @@ syscore_regenerate_refs (OstreeSysroot *sysroot, OstreeRepo *repo, guint *out_n_
   if (!generate_pkgcache_refs (sysroot, repo, out_n_pkgcache_freed, cancellable, error))
     return FALSE;
 
+  /* Keep the file_contexts of the last few policies for selective relabeling */
+  if (!rpmostree_file_contexts_prune (repo, 3, cancellable, error))
+    return FALSE;
+
   /* Delete our temporary ref */
   ostree_repo_transaction_set_ref (repo, NULL, RPMOSTREE_TMP_BASE_REF, NULL);
 
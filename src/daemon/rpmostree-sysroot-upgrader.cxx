@@ -914,6 +914,9 @@ prepare_context_for_assembly (RpmOstreeSysrootUpgrader *self, const char *tmproo
     return FALSE;
 
   rpmostree_context_set_sepolicy (self->ctx, sepolicy);
+  if (!rpmostree_context_load_sepolicy_file_contexts (self->ctx, self->tmprootfs_dfd, cancellable,
+                                                      error))
+    return FALSE;
 
   if (self->flags & RPMOSTREE_SYSROOT_UPGRADER_FLAGS_PKGCACHE_ONLY)
     rpmostree_context_set_pkgcache_only (self->ctx, TRUE);
@@ -941,6 +944,8 @@ prep_local_assembly (RpmOstreeSysrootUpgrader *self, GCancellable *cancellable,
     return FALSE;
 
   self->ctx = rpmostree_context_new_client (self->repo);
+  rpmostree_context_set_import_memory_budget (
+      self->ctx, rpmostreed_get_import_memory_budget (rpmostreed_daemon_get ()));
 
   g_autofree char *tmprootfs_abspath = glnx_fdrel_abspath (self->tmprootfs_dfd, ".");
 
@@ -1245,9 +1250,7 @@ rpmostree_sysroot_upgrader_import_pkgs (RpmOstreeSysrootUpgrader *self, GCancell
 
   if (self->layering_type == RPMOSTREE_SYSROOT_UPGRADER_LAYERING_RPMMD_REPOS)
     {
-      if (!rpmostree_context_download (self->ctx, cancellable, error))
-        return FALSE;
-      if (!rpmostree_context_import (self->ctx, cancellable, error))
+      if (!rpmostree_context_download_and_import (self->ctx, cancellable, error))
         return FALSE;
     }
 
@@ -1368,6 +1371,8 @@ rpmostree_sysroot_upgrader_deploy (RpmOstreeSysrootUpgrader *self,
   if (!perform_local_assembly (self, cancellable, error))
     return FALSE;
 
+  rpmostreecxx::Phase phase (RPMOSTREE_PHASE_DEPLOY);
+
   /* make sure we have a known target to deploy */
   const char *target_revision = self->final_revision ?: self->base_revision;
   g_assert (target_revision);
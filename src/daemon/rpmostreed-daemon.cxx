@@ -21,6 +21,7 @@
 #include "rpmostree-origin.h"
 #include "rpmostree-util.h"
 #include "rpmostreed-daemon.h"
+#include "rpmostreed-diff-cache.h"
 #include "rpmostreed-sysroot.h"
 #include "rpmostreed-types.h"
 #include "rpmostreed-utils.h"
@@ -77,6 +78,9 @@ struct _RpmostreedDaemon
   RpmostreedAutomaticUpdatePolicy auto_update_policy;
   gboolean lock_layering;
   gboolean disable_recommends;
+  gboolean transaction_queue;
+  char *transaction_metrics_file;
+  guint64 import_memory_budget;
 
   GDBusConnection *connection;
   GDBusObjectManagerServer *object_manager;
@@ -178,6 +182,7 @@ daemon_finalize (GObject *object)
     g_source_remove (self->rerender_status_id);
 
   g_free (self->sysroot_path);
+  g_free (self->transaction_metrics_file);
   G_OBJECT_CLASS (rpmostreed_daemon_parent_class)->finalize (object);
 
   _daemon_instance = NULL;
@@ -408,6 +413,25 @@ rpmostreed_get_disable_recommends (RpmostreedDaemon *self)
   return self->disable_recommends;
 }
 
+gboolean
+rpmostreed_get_transaction_queue (RpmostreedDaemon *self)
+{
+  return self->transaction_queue;
+}
+
+const char *
+rpmostreed_get_transaction_metrics_file (RpmostreedDaemon *self)
+{
+  return self->transaction_metrics_file;
+}
+
+/* In bytes; 0 means the default */
+guint64
+rpmostreed_get_import_memory_budget (RpmostreedDaemon *self)
+{
+  return self->import_memory_budget;
+}
+
 /* in-place version of g_ascii_strdown */
 static inline void
 ascii_strdown_inplace (char *str)
@@ -444,6 +468,16 @@ rpmostreed_daemon_reload_config (RpmostreedDaemon *self, gboolean *out_changed,
   self->lock_layering = get_config_bool (config, "LockLayering", FALSE);
   /* flip polarity here since default FALSE is less error-prone */
   self->disable_recommends = !get_config_bool (config, "Recommends", TRUE);
+  self->transaction_queue = get_config_bool (config, "TransactionQueue", FALSE);
+  g_free (self->transaction_metrics_file);
+  self->transaction_metrics_file = get_config_str (config, "TransactionMetricsFile", NULL);
+  if (self->transaction_metrics_file && !*self->transaction_metrics_file)
+    g_clear_pointer (&self->transaction_metrics_file, g_free);
+  /* in MiB; 0 means half of physical memory */
+  self->import_memory_budget = get_config_uint64 (config, "ImportMemoryBudget", 0) * 1024 * 1024;
+  /* in MiB; 0 disables caching */
+  rpmostreed_diff_cache_set_max_size (get_config_uint64 (config, "RpmDiffCacheSize", 16) * 1024
+                                      * 1024);
 
   gboolean changed = FALSE;
 
@@ -61,6 +61,9 @@ gboolean rpmostreed_daemon_reload_config (RpmostreedDaemon *self, gboolean *out_
 RpmostreedAutomaticUpdatePolicy rpmostreed_get_automatic_update_policy (RpmostreedDaemon *self);
 gboolean rpmostreed_get_lock_layering (RpmostreedDaemon *self);
 gboolean rpmostreed_get_disable_recommends (RpmostreedDaemon *self);
+gboolean rpmostreed_get_transaction_queue (RpmostreedDaemon *self);
+const char *rpmostreed_get_transaction_metrics_file (RpmostreedDaemon *self);
+guint64 rpmostreed_get_import_memory_budget (RpmostreedDaemon *self);
 
 G_END_DECLS
 
@@ -19,6 +19,7 @@
 #include "config.h"
 
 #include <libglnx.h>
+#include <rpm/rpmver.h>
 #include <systemd/sd-journal.h>
 
 #include "rpmostree-core.h"
@@ -30,6 +31,7 @@
 #include "rpmostree-types.h"
 #include "rpmostree-util.h"
 #include "rpmostreed-deployment-utils.h"
+#include "rpmostreed-diff-cache.h"
 #include "rpmostreed-errors.h"
 #include "rpmostreed-utils.h"
 
@@ -403,27 +405,6 @@ rpm_diff_clear (RpmDiff *diff)
 
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (RpmDiff, rpm_diff_clear);
 
-static GVariant *
-single_pkg_variant_new (RpmOstreePkgTypes type, RpmOstreePackage *pkg)
-{
-  return g_variant_ref_sink (g_variant_new ("(usss)", type, rpm_ostree_package_get_name (pkg),
-                                            rpm_ostree_package_get_evr (pkg),
-                                            rpm_ostree_package_get_arch (pkg)));
-}
-
-static GVariant *
-modified_pkg_variant_new (RpmOstreePkgTypes type, RpmOstreePackage *pkg_old,
-                          RpmOstreePackage *pkg_new)
-{
-  const char *name_old = rpm_ostree_package_get_name (pkg_old);
-  const char *name_new = rpm_ostree_package_get_name (pkg_new);
-  g_assert_cmpstr (name_old, ==, name_new);
-  return g_variant_ref_sink (
-      g_variant_new ("(us(ss)(ss))", type, name_old, rpm_ostree_package_get_evr (pkg_old),
-                     rpm_ostree_package_get_arch (pkg_old), rpm_ostree_package_get_evr (pkg_new),
-                     rpm_ostree_package_get_arch (pkg_new)));
-}
-
 static GVariant *
 modified_dnfpkg_variant_new (RpmOstreePkgTypes type, RpmOstreePackage *pkg_old, DnfPackage *pkg_new)
 {
@@ -436,41 +417,93 @@ modified_dnfpkg_variant_new (RpmOstreePkgTypes type, RpmOstreePackage *pkg_old,
                      dnf_package_get_arch (pkg_new)));
 }
 
+/* Whether @a and @b are the same version per rpm_ostree_package_cmp() */
+static gboolean
+evr_equal (const char *a, const char *b)
+{
+  rpmver v1 = rpmverParse (a);
+  rpmver v2 = rpmverParse (b);
+  const gboolean ret = rpmverCmp (v1, v2) == 0;
+  rpmverFree (v1);
+  rpmverFree (v2);
+  return ret;
+}
+
+/* Returns the (sss) name, evr, arch variant of @key in @options */
+static GVariant *
+diff_entry_lookup_pkg (GVariant *options, const char *key)
+{
+  g_autoptr (GVariantDict) dict = g_variant_dict_new (options);
+  GVariant *pkg = g_variant_dict_lookup_value (dict, key, G_VARIANT_TYPE ("(sss)"));
+  g_assert (pkg);
+  return pkg;
+}
+
+/* Adds the diff between the rpmdbs of the two commits to @diff. If
+ * @out_modified_new is set, it is filled with the new versions of modified pkgs
+ * as (sss) name, evr, arch variants. */
 static gboolean
 rpm_diff_add_db_diff (RpmDiff *diff, OstreeRepo *repo, RpmOstreePkgTypes type,
                       const char *old_checksum, const char *new_checksum,
                       GPtrArray **out_modified_new, GCancellable *cancellable, GError **error)
 {
-  g_autoptr (GPtrArray) removed = NULL;
-  g_autoptr (GPtrArray) added = NULL;
-  g_autoptr (GPtrArray) modified_old = NULL;
-  g_autoptr (GPtrArray) modified_new = NULL;
-
-  /* Use allow_noent; we'll just skip over the rpm diff if there's no data */
-  RpmOstreeDbDiffExtFlags flags = RPM_OSTREE_DB_DIFF_EXT_ALLOW_NOENT;
-  if (!rpm_ostree_db_diff_ext (repo, old_checksum, new_checksum, flags, &removed, &added,
-                               &modified_old, &modified_new, cancellable, error))
+  /* Use allow_noent; we'll just skip over the rpm diff if there's no data. This
+   * goes through the daemon's diff cache since the commits are immutable. */
+  g_autoptr (GVariant) db_diff = NULL;
+  if (!rpmostreed_db_diff_variant (repo, old_checksum, new_checksum, TRUE, &db_diff, cancellable,
+                                   error))
     return FALSE;
 
   /* check if allow_noent kicked in */
-  if (!removed)
+  if (!db_diff)
     return TRUE; /* NB: early return */
 
-  g_assert_cmpuint (modified_old->len, ==, modified_new->len);
-  for (guint i = 0; i < removed->len; i++)
-    g_ptr_array_add (diff->removed, single_pkg_variant_new (
-                                        type, static_cast<RpmOstreePackage *> (removed->pdata[i])));
-  for (guint i = 0; i < added->len; i++)
-    g_ptr_array_add (diff->added, single_pkg_variant_new (
-                                      type, static_cast<RpmOstreePackage *> (added->pdata[i])));
-  for (guint i = 0; i < modified_old->len; i++)
+  g_autoptr (GPtrArray) modified_new
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  const guint n = g_variant_n_children (db_diff);
+  for (guint i = 0; i < n; i++)
     {
-      auto old_pkg = static_cast<RpmOstreePackage *> (modified_old->pdata[i]);
-      auto new_pkg = static_cast<RpmOstreePackage *> (modified_new->pdata[i]);
-      if (rpm_ostree_package_cmp (old_pkg, new_pkg) < 0)
-        g_ptr_array_add (diff->upgraded, modified_pkg_variant_new (type, old_pkg, new_pkg));
-      else
-        g_ptr_array_add (diff->downgraded, modified_pkg_variant_new (type, old_pkg, new_pkg));
+      const char *name;
+      guint32 difftype;
+      g_autoptr (GVariant) options = NULL;
+      g_variant_get_child (db_diff, i, "(&su@a{sv})", &name, &difftype, &options);
+      switch (difftype)
+        {
+        case RPM_OSTREE_PACKAGE_ADDED:
+        case RPM_OSTREE_PACKAGE_REMOVED:
+          {
+            const gboolean added = difftype == RPM_OSTREE_PACKAGE_ADDED;
+            g_autoptr (GVariant) pkg
+                = diff_entry_lookup_pkg (options, added ? "NewPackage" : "PreviousPackage");
+            const char *evr, *arch;
+            g_variant_get (pkg, "(&s&s&s)", NULL, &evr, &arch);
+            g_ptr_array_add (added ? diff->added : diff->removed,
+                             g_variant_ref_sink (g_variant_new ("(usss)", type, name, evr, arch)));
+          }
+          break;
+        case RPM_OSTREE_PACKAGE_UPGRADED:
+        case RPM_OSTREE_PACKAGE_DOWNGRADED:
+          {
+            g_autoptr (GVariant) old_pkg = diff_entry_lookup_pkg (options, "PreviousPackage");
+            g_autoptr (GVariant) new_pkg = diff_entry_lookup_pkg (options, "NewPackage");
+            const char *old_evr, *old_arch, *new_evr, *new_arch;
+            g_variant_get (old_pkg, "(&s&s&s)", NULL, &old_evr, &old_arch);
+            g_variant_get (new_pkg, "(&s&s&s)", NULL, &new_evr, &new_arch);
+            /* The diff variant counts packages which compare equal as upgraded,
+             * but we've always reported those as downgraded. */
+            const gboolean upgraded
+                = difftype == RPM_OSTREE_PACKAGE_UPGRADED
+                  && !(evr_equal (old_evr, new_evr) && g_str_equal (old_arch, new_arch));
+            g_ptr_array_add (upgraded ? diff->upgraded : diff->downgraded,
+                             g_variant_ref_sink (g_variant_new ("(us(ss)(ss))", type, name,
+                                                                old_evr, old_arch, new_evr,
+                                                                new_arch)));
+            g_ptr_array_add (modified_new, util::move_nullify (new_pkg));
+          }
+          break;
+        default:
+          g_assert_not_reached ();
+        }
     }
 
   if (out_modified_new)
@@ -621,20 +654,22 @@ rpmmd_diff_guess (OstreeRepo *repo, const char *base_checksum, const char *layer
   return TRUE;
 }
 
-/* try to find the exact same RpmOstreePackage pkgs in the sack */
+/* try to find the exact same pkgs in the sack, given as (sss) name, evr, arch variants */
 static GPtrArray *
-rpm_ostree_pkgs_to_dnf (DnfSack *sack, GPtrArray *rpm_ostree_pkgs)
+pkg_variants_to_dnf (DnfSack *sack, GPtrArray *pkg_variants)
 {
   g_autoptr (GPtrArray) dnf_pkgs = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
 
-  const guint n = rpm_ostree_pkgs->len;
+  const guint n = pkg_variants->len;
   for (guint i = 0; i < n; i++)
     {
-      auto pkg = static_cast<RpmOstreePackage *> (rpm_ostree_pkgs->pdata[i]);
+      const char *name, *evr, *arch;
+      g_variant_get (static_cast<GVariant *> (pkg_variants->pdata[i]), "(&s&s&s)", &name, &evr,
+                     &arch);
       hy_autoquery HyQuery query = hy_query_create (sack);
-      hy_query_filter (query, HY_PKG_NAME, HY_EQ, rpm_ostree_package_get_name (pkg));
-      hy_query_filter (query, HY_PKG_EVR, HY_EQ, rpm_ostree_package_get_evr (pkg));
-      hy_query_filter (query, HY_PKG_ARCH, HY_EQ, rpm_ostree_package_get_arch (pkg));
+      hy_query_filter (query, HY_PKG_NAME, HY_EQ, name);
+      hy_query_filter (query, HY_PKG_EVR, HY_EQ, evr);
+      hy_query_filter (query, HY_PKG_ARCH, HY_EQ, arch);
       g_autoptr (GPtrArray) pkgs = hy_query_run (query);
 
       /* 0 --> ostree stream is out of sync with rpmmd repos probably? */
@@ -820,9 +855,9 @@ rpmostreed_update_generate_variant (OstreeDeployment *booted_deployment,
 
       if (ostree_modified_new)
         {
-          /* recall that @ostree_modified_new is an array of RpmOstreePackage; try to find
+          /* recall that @ostree_modified_new is an array of (sss) variants; try to find
            * the same pkg in the rpmmd so that we can search for advisories afterwards */
-          g_autoptr (GPtrArray) pkgs = rpm_ostree_pkgs_to_dnf (sack, ostree_modified_new);
+          g_autoptr (GPtrArray) pkgs = pkg_variants_to_dnf (sack, ostree_modified_new);
           for (guint i = 0; i < pkgs->len; i++)
             g_ptr_array_add (new_packages, g_object_ref (pkgs->pdata[i]));
         }
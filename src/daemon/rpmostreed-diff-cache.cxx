@@ -0,0 +1,152 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <libglnx.h>
+
+#include "rpmostree-package-variants.h"
+#include "rpmostree-util.h"
+#include "rpmostreed-diff-cache.h"
+
+/* Clients like `status -v` and Cockpit keep asking for the rpm diff between
+ * the same pair of commits. Since commits are immutable, we can hold on to
+ * the diffs we computed; they never go stale, so the cache is only bounded by
+ * size (RpmDiffCacheSize= in rpm-ostreed.conf), evicting the least recently
+ * used diffs first. */
+
+typedef struct
+{
+  char *key;
+  GVariant *value;
+  gsize size;
+} DiffCacheEntry;
+
+static void
+diff_cache_entry_free (DiffCacheEntry *entry)
+{
+  g_free (entry->key);
+  g_variant_unref (entry->value);
+  g_free (entry);
+}
+
+static GMutex diff_cache_lock;
+static GHashTable *diff_cache; /* key -> GList link in diff_cache_lru */
+static GQueue diff_cache_lru = G_QUEUE_INIT; /* DiffCacheEntry, most recently used first */
+static guint64 diff_cache_size;
+static guint64 diff_cache_max_size = 16 * 1024 * 1024;
+static guint64 diff_cache_hits;
+static guint64 diff_cache_misses;
+
+/* Called with diff_cache_lock held */
+static void
+diff_cache_evict_to (guint64 max_size)
+{
+  while (diff_cache_size > max_size)
+    {
+      auto entry = static_cast<DiffCacheEntry *> (g_queue_pop_tail (&diff_cache_lru));
+      g_assert (entry);
+      g_hash_table_remove (diff_cache, entry->key);
+      diff_cache_size -= entry->size;
+      diff_cache_entry_free (entry);
+    }
+}
+
+/* Set the maximum total size in bytes of the cached diffs; 0 disables the
+ * cache. */
+void
+rpmostreed_diff_cache_set_max_size (guint64 max_size)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&diff_cache_lock);
+  diff_cache_max_size = max_size;
+  diff_cache_evict_to (max_size);
+}
+
+/* Returns a new ref to the cached value for @key, or %NULL */
+static GVariant *
+diff_cache_lookup (const char *key)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&diff_cache_lock);
+  GList *link = diff_cache ? static_cast<GList *> (g_hash_table_lookup (diff_cache, key)) : NULL;
+  if (!link)
+    {
+      diff_cache_misses++;
+      return NULL;
+    }
+
+  diff_cache_hits++;
+  g_queue_unlink (&diff_cache_lru, link);
+  g_queue_push_head_link (&diff_cache_lru, link);
+  auto entry = static_cast<DiffCacheEntry *> (link->data);
+  return g_variant_ref (entry->value);
+}
+
+static void
+diff_cache_insert (const char *key, GVariant *value)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&diff_cache_lock);
+  const gsize size = g_variant_get_size (value) + strlen (key);
+  if (size > diff_cache_max_size)
+    return;
+  if (!diff_cache)
+    diff_cache = g_hash_table_new (g_str_hash, g_str_equal);
+  /* we may have raced with another thread computing the same diff */
+  if (g_hash_table_contains (diff_cache, key))
+    return;
+
+  diff_cache_evict_to (diff_cache_max_size - size);
+
+  DiffCacheEntry *entry = g_new0 (DiffCacheEntry, 1);
+  entry->key = g_strdup (key);
+  entry->value = g_variant_ref (value);
+  entry->size = size;
+  g_queue_push_head (&diff_cache_lru, entry);
+  g_hash_table_insert (diff_cache, entry->key, diff_cache_lru.head);
+  diff_cache_size += size;
+
+  g_debug ("Cached rpm diff %s (%" G_GSIZE_FORMAT " bytes); cache is %" G_GUINT64_FORMAT
+           " bytes, %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses",
+           key, size, diff_cache_size, diff_cache_hits, diff_cache_misses);
+}
+
+/* Like rpm_ostree_db_diff_variant(), but memoized on the resolved commits. */
+gboolean
+rpmostreed_db_diff_variant (OstreeRepo *repo, const char *from_rev, const char *to_rev,
+                            gboolean allow_noent, GVariant **out_variant, GCancellable *cancellable,
+                            GError **error)
+{
+  g_autofree char *from_checksum = NULL;
+  if (!ostree_repo_resolve_rev (repo, from_rev, FALSE, &from_checksum, error))
+    return FALSE;
+  g_autofree char *to_checksum = NULL;
+  if (!ostree_repo_resolve_rev (repo, to_rev, FALSE, &to_checksum, error))
+    return FALSE;
+
+  g_autofree char *key = g_strdup_printf ("%s:%s:%d", from_checksum, to_checksum, !!allow_noent);
+  g_autoptr (GVariant) value = diff_cache_lookup (key);
+  if (!value)
+    {
+      if (!rpm_ostree_db_diff_variant (repo, from_checksum, to_checksum, allow_noent, &value,
+                                       cancellable, error))
+        return FALSE;
+      /* a missing rpmdb is cheap to rediscover; only cache real diffs */
+      if (value)
+        diff_cache_insert (key, value);
+    }
+
+  *out_variant = util::move_nullify (value);
+  return TRUE;
+}
@@ -81,14 +81,26 @@ os_constructed (GObject *object)
   G_OBJECT_CLASS (rpmostreed_osexperimental_parent_class)->constructed (object);
 }
 
+/* Transactions started from here wait in the same queue as the OS ones */
+static gboolean
+osexperimental_authorize_method (GDBusInterfaceSkeleton *interface,
+                                 GDBusMethodInvocation *invocation)
+{
+  return !rpmostreed_sysroot_maybe_queue_txn (rpmostreed_sysroot_get (), interface, invocation);
+}
+
 static void
 rpmostreed_osexperimental_class_init (RpmostreedOSExperimentalClass *klass)
 {
   GObjectClass *gobject_class;
+  GDBusInterfaceSkeletonClass *gdbus_interface_skeleton_class;
 
   gobject_class = G_OBJECT_CLASS (klass);
   gobject_class->dispose = os_dispose;
   gobject_class->constructed = os_constructed;
+
+  gdbus_interface_skeleton_class = G_DBUS_INTERFACE_SKELETON_CLASS (klass);
+  gdbus_interface_skeleton_class->g_authorize_method = osexperimental_authorize_method;
 }
 
 static void
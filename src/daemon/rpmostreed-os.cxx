@@ -25,10 +25,13 @@
 #include "rpmostree-core.h"
 #include "rpmostree-origin.h"
 #include "rpmostree-package-variants.h"
+#include "rpmostree-rpm-util.h"
+#include "rpmostree-search-index.h"
 #include "rpmostree-sysroot-core.h"
 #include "rpmostree-util.h"
 #include "rpmostreed-daemon.h"
 #include "rpmostreed-deployment-utils.h"
+#include "rpmostreed-diff-cache.h"
 #include "rpmostreed-errors.h"
 #include "rpmostreed-os.h"
 #include "rpmostreed-sysroot.h"
@@ -48,6 +51,15 @@ struct _RpmostreedOS
   RPMOSTreeOSSkeleton parent_instance;
   gboolean on_session_bus;
   guint signal_id;
+
+  /* Warm sack for query methods; see os_query_load_dnf_context() */
+  GMutex sack_cache_lock;
+  char *sack_cache_key;
+  DnfContext *sack_cache;
+  /* Held by query workers for as long as they use libdnf, since neither
+   * setting up a context (which touches global librpm state) nor libsolv
+   * pools may be used from multiple threads at once */
+  GMutex sack_query_lock;
 };
 
 struct _RpmostreedOSClass
@@ -70,6 +82,15 @@ G_DEFINE_TYPE_WITH_CODE (RpmostreedOS, rpmostreed_os, RPMOSTREE_TYPE_OS_SKELETON
 /* ----------------------------------------------------------------------------------------------------
  */
 
+/* Drop the cached sack, so the next query reloads rpm-md */
+static void
+os_clear_sack_cache (RpmostreedOS *self)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->sack_cache_lock);
+  g_clear_pointer (&self->sack_cache_key, g_free);
+  g_clear_object (&self->sack_cache);
+}
+
 static void
 sysroot_changed (RpmostreedSysroot *sysroot, gpointer user_data)
 {
@@ -79,10 +100,21 @@ sysroot_changed (RpmostreedSysroot *sysroot, gpointer user_data)
 
   g_debug ("os: handling sysroot change");
 
+  /* Deployments or configuration changed; either may change the repos */
+  os_clear_sack_cache (self);
+
   if (!rpmostreed_os_load_internals (self, error))
     g_warning ("%s", local_error->message);
 }
 
+/* Finish authorizing @invocation; if it's for a transaction which has to
+ * wait for another one, it's queued and we tell GDBus not to run it now. */
+static gboolean
+os_authorized_or_queued (GDBusInterfaceSkeleton *interface, GDBusMethodInvocation *invocation)
+{
+  return !rpmostreed_sysroot_maybe_queue_txn (rpmostreed_sysroot_get (), interface, invocation);
+}
+
 static gboolean
 os_authorize_method (GDBusInterfaceSkeleton *interface, GDBusMethodInvocation *invocation)
 {
@@ -102,7 +134,7 @@ os_authorize_method (GDBusInterfaceSkeleton *interface, GDBusMethodInvocation *i
       return FALSE;
     }
   if (authorized)
-    return TRUE;
+    return os_authorized_or_queued (interface, invocation);
 
   g_autoptr (PolkitAuthority) authority
       = rpmostreed_sysroot_get_polkit_authority (sysroot, &local_error);
@@ -279,9 +311,10 @@ os_authorize_method (GDBusInterfaceSkeleton *interface, GDBusMethodInvocation *i
       g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_ACCESS_DENIED,
                                              "rpmostreed OS operation %s not allowed for user",
                                              method_name);
+      return FALSE;
     }
 
-  return authorized;
+  return os_authorized_or_queued (interface, invocation);
 }
 
 static void
@@ -301,9 +334,21 @@ os_dispose (GObject *object)
 
   self->signal_id = 0;
 
+  os_clear_sack_cache (self);
+
   G_OBJECT_CLASS (rpmostreed_os_parent_class)->dispose (object);
 }
 
+static void
+os_finalize (GObject *object)
+{
+  RpmostreedOS *self = RPMOSTREED_OS (object);
+  g_mutex_clear (&self->sack_cache_lock);
+  g_mutex_clear (&self->sack_query_lock);
+
+  G_OBJECT_CLASS (rpmostreed_os_parent_class)->finalize (object);
+}
+
 static void
 os_constructed (GObject *object)
 {
@@ -334,6 +379,7 @@ rpmostreed_os_class_init (RpmostreedOSClass *klass)
 
   gobject_class = G_OBJECT_CLASS (klass);
   gobject_class->dispose = os_dispose;
+  gobject_class->finalize = os_finalize;
   gobject_class->constructed = os_constructed;
 
   gdbus_interface_skeleton_class = G_DBUS_INTERFACE_SKELETON_CLASS (klass);
@@ -343,6 +389,8 @@ rpmostreed_os_class_init (RpmostreedOSClass *klass)
 static void
 rpmostreed_os_init (RpmostreedOS *self)
 {
+  g_mutex_init (&self->sack_cache_lock);
+  g_mutex_init (&self->sack_query_lock);
 }
 
 /* ----------------------------------------------------------------------------------------------------
@@ -357,92 +405,191 @@ new_variant_diff_result (GVariant *diff, GVariant *details)
 /* ----------------------------------------------------------------------------------------------------
  */
 
-static gboolean
-get_deployments_rpm_diff (const char *arg_deployid0, const char *arg_deployid1,
-                          GVariant **out_value, GError **error)
+/* Read-only methods don't take the sysroot lock, so there's no reason for
+ * them to hold up the main loop (and with it status queries and every other
+ * method) while they e.g. load rpm-md or walk commit history. Their handlers
+ * resolve whatever they need from the sysroot on the main thread into an
+ * OsQuery, and the expensive part then runs in a worker thread against that
+ * snapshot. The worker completes the invocation itself.
+ *
+ * The daemon's OstreeSysroot and OstreeRepo are reloaded and written to by
+ * transactions, so the snapshot never shares them with the worker: it gets
+ * its own copy of the deployment, the paths and checksums it needs, and a
+ * separately opened repo.
+ */
+struct OsQuery;
+typedef GVariant *(*OsQueryFunc) (OsQuery *query, GCancellable *cancellable, GError **error);
+
+struct OsQuery
 {
-  g_autoptr (GCancellable) cancellable = NULL;
-  RpmostreedSysroot *global_sysroot;
-  OstreeSysroot *ot_sysroot = NULL;
-  OstreeRepo *ot_repo = NULL;
-  g_autoptr (GVariant) value = NULL;
+  RpmostreedOS *self;
+  GDBusMethodInvocation *invocation;
+  OsQueryFunc func;
+  /* Whether func sets up a dnf context; see sack_query_lock */
+  gboolean uses_dnf;
+
+  /* The daemon's sysroot; only for handlers on the main thread, and dropped
+   * before the worker runs */
+  OstreeSysroot *sysroot;
+  /* Opened for this query; the worker's view of the repo */
+  OstreeRepo *repo;
+
+  /* Merge or base deployment the query is relative to; a copy once the
+   * worker runs */
+  OstreeDeployment *deployment;
+  char *deployment_root;
+  char *cfg_deployment_root; /* Where the repos and passwd are taken from */
+
+  /* For diffs: the refspec passed to the cached details, and the commit to
+   * diff against; if the latter is NULL, it's resolved from version. */
+  char *refspec;
+  char *target;
+  char *version;
+  gboolean details_use_target;
+  char *checksum; /* base commit for GetDeploymentsRpmDiff */
+
+  char **names;
+};
 
-  global_sysroot = rpmostreed_sysroot_get ();
+static void
+os_query_free (OsQuery *query)
+{
+  g_clear_object (&query->self);
+  g_clear_object (&query->invocation);
+  g_clear_object (&query->sysroot);
+  g_clear_object (&query->repo);
+  g_clear_object (&query->deployment);
+  g_free (query->deployment_root);
+  g_free (query->cfg_deployment_root);
+  g_free (query->refspec);
+  g_free (query->target);
+  g_free (query->version);
+  g_free (query->checksum);
+  g_strfreev (query->names);
+  g_free (query);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (OsQuery, os_query_free);
 
-  ot_sysroot = rpmostreed_sysroot_get_root (global_sysroot);
-  ot_repo = rpmostreed_sysroot_get_repo (global_sysroot);
+/* Must be called on the main thread */
+static OsQuery *
+os_query_new (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation, OsQueryFunc func,
+              GError **error)
+{
+  g_autoptr (OsQuery) query = g_new0 (OsQuery, 1);
+  query->self = RPMOSTREED_OS (g_object_ref (interface));
+  query->invocation = G_DBUS_METHOD_INVOCATION (g_object_ref (invocation));
+  query->func = func;
+  g_autoptr (OstreeRepo) live_repo = NULL;
+  if (!rpmostreed_sysroot_load_state (rpmostreed_sysroot_get (), NULL, &query->sysroot,
+                                      &live_repo, error))
+    return NULL;
+  query->repo = ostree_repo_open_at (ostree_repo_get_dfd (live_repo), ".", NULL, error);
+  if (!query->repo)
+    return NULL;
+  return util::move_nullify (query);
+}
 
-  rust::Str deploy_id0 (arg_deployid0 ?: "");
-  CXX_TRY_VAR (ref0, rpmostreecxx::deployment_checksum_for_id (*ot_sysroot, deploy_id0), error);
+static void
+os_query_thread (GTask *task, gpointer source, gpointer task_data, GCancellable *cancellable)
+{
+  auto query = static_cast<OsQuery *> (task_data);
+  g_autoptr (GError) local_error = NULL;
 
-  rust::Str deploy_id1 (arg_deployid1 ?: "");
-  CXX_TRY_VAR (ref1, rpmostreecxx::deployment_checksum_for_id (*ot_sysroot, deploy_id1), error);
+  g_autoptr (GMutexLocker) locker = NULL;
+  if (query->uses_dnf)
+    locker = g_mutex_locker_new (&query->self->sack_query_lock);
 
-  if (!rpm_ostree_db_diff_variant (ot_repo, ref0.c_str (), ref1.c_str (), FALSE, &value,
-                                   cancellable, error))
-    return FALSE;
+  GVariant *result = query->func (query, cancellable, &local_error);
+  if (!result)
+    g_dbus_method_invocation_take_error (query->invocation, util::move_nullify (local_error));
+  else
+    g_dbus_method_invocation_return_value (query->invocation, result);
+}
 
-  *out_value = util::move_nullify (value);
+/* Takes ownership of @query and completes its invocation from a worker */
+static gboolean
+os_query_run (OsQuery *query)
+{
+  /* Transactions may change the deployments we looked at while the worker
+   * runs; see OsQuery */
+  g_clear_object (&query->sysroot);
+  if (query->deployment)
+    {
+      g_autoptr (OstreeDeployment) live_deployment = util::move_nullify (query->deployment);
+      query->deployment = ostree_deployment_clone (live_deployment);
+    }
+
+  g_autoptr (GTask) task = g_task_new (query->self, NULL, NULL, NULL);
+  g_task_set_task_data (task, query, (GDestroyNotify)os_query_free);
+  g_task_run_in_thread (task, os_query_thread);
   return TRUE;
 }
 
-static gboolean
-os_handle_get_deployments_rpm_diff (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
-                                    const char *arg_deployid0, const char *arg_deployid1)
+/* Shared by the GetCached*RpmDiff methods */
+static GVariant *
+query_cached_rpm_diff (OsQuery *query, GCancellable *cancellable, GError **error)
 {
-  GError *local_error = NULL;
-  g_autoptr (GVariant) value = NULL;
+  g_autofree char *checksum = g_strdup (query->target);
+  if (!checksum)
+    {
+      if (!rpmostreed_repo_lookup_cached_version (query->repo, query->refspec, query->version,
+                                                  cancellable, &checksum, error))
+        return (GVariant *)glnx_prefix_error_null (error, "Looking up cached version");
+    }
 
-  gboolean is_ok = get_deployments_rpm_diff (arg_deployid0, arg_deployid1, &value, &local_error);
-  if (!is_ok)
-    return os_throw_dbus_invocation_error (invocation, &local_error);
+  g_autoptr (GVariant) value = NULL;
+  if (!rpmostreed_db_diff_variant (query->repo, ostree_deployment_get_csum (query->deployment),
+                                   checksum, FALSE, &value, cancellable, error))
+    return (GVariant *)glnx_prefix_error_null (error, "Assembling diff");
 
-  g_assert (value != NULL);
-  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(@a(sua{sv}))", value));
+  g_autoptr (GVariant) details = rpmostreed_commit_generate_cached_details_variant (
+      query->deployment, query->repo, query->refspec,
+      query->details_use_target ? checksum : NULL, error);
+  if (!details)
+    return (GVariant *)glnx_prefix_error_null (error, "Generating cached details");
 
-  return TRUE;
+  return new_variant_diff_result (value, details);
 }
 
-static gboolean
-get_cached_update_rpm_diff (const gchar *name, const char *arg_deployid, GVariant **out_value,
-                            GVariant **out_details, GError **error)
-{
-  RpmostreedSysroot *global_sysroot;
-  g_autoptr (RpmOstreeOrigin) origin = NULL;
-  OstreeSysroot *ot_sysroot = NULL;
-  OstreeRepo *ot_repo = NULL;
-  GCancellable *cancellable = NULL;
-  g_autoptr (GVariant) value = NULL;
-  g_autoptr (GVariant) details = NULL;
+/* ----------------------------------------------------------------------------------------------------
+ */
 
-  global_sysroot = rpmostreed_sysroot_get ();
+static GVariant *
+query_deployments_rpm_diff (OsQuery *query, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GVariant) value = NULL;
+  if (!rpmostreed_db_diff_variant (query->repo, query->checksum, query->target, FALSE, &value,
+                                   cancellable, error))
+    return NULL;
 
-  ot_sysroot = rpmostreed_sysroot_get_root (global_sysroot);
-  ot_repo = rpmostreed_sysroot_get_repo (global_sysroot);
+  return g_variant_new ("(@a(sua{sv}))", value);
+}
 
-  rust::Str os_name (name ?: "");
-  rust::Str deploy_id (arg_deployid ?: "");
-  CXX_TRY_VAR (base_deploymentv,
-               rpmostreecxx::deployment_get_base (*ot_sysroot, deploy_id, os_name), error);
-  glnx_unref_object OstreeDeployment *base_deployment = base_deploymentv;
+static gboolean
+os_handle_get_deployments_rpm_diff (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
+                                    const char *arg_deployid0, const char *arg_deployid1)
+{
+  GError *local_error = NULL;
+  GError **error = &local_error;
 
-  origin = rpmostree_origin_parse_deployment (base_deployment, error);
-  if (!origin)
-    return FALSE;
+  g_autoptr (OsQuery) query
+      = os_query_new (interface, invocation, query_deployments_rpm_diff, error);
+  if (!query)
+    return os_throw_dbus_invocation_error (invocation, error);
 
-  auto r = rpmostree_origin_get_refspec (origin);
-  if (!rpm_ostree_db_diff_variant (ot_repo, ostree_deployment_get_csum (base_deployment),
-                                   r.refspec.c_str (), FALSE, &value, cancellable, error))
-    return FALSE;
+  rust::Str deploy_id0 (arg_deployid0 ?: "");
+  auto ref0 = ROSCXX_VAL (deployment_checksum_for_id (*query->sysroot, deploy_id0), error);
+  if (!ref0)
+    return os_throw_dbus_invocation_error (invocation, error);
 
-  details = rpmostreed_commit_generate_cached_details_variant (base_deployment, ot_repo,
-                                                               r.refspec.c_str (), NULL, error);
-  if (!details)
-    return FALSE;
+  rust::Str deploy_id1 (arg_deployid1 ?: "");
+  auto ref1 = ROSCXX_VAL (deployment_checksum_for_id (*query->sysroot, deploy_id1), error);
+  if (!ref1)
+    return os_throw_dbus_invocation_error (invocation, error);
 
-  *out_value = util::move_nullify (value);
-  *out_details = util::move_nullify (details);
-  return TRUE;
+  query->checksum = g_strdup (ref0->c_str ());
+  query->target = g_strdup (ref1->c_str ());
+  return os_query_run (util::move_nullify (query));
 }
 
 static gboolean
@@ -450,20 +597,28 @@ os_handle_get_cached_update_rpm_diff (RPMOSTreeOS *interface, GDBusMethodInvocat
                                       const char *arg_deployid)
 {
   GError *local_error = NULL;
-  g_autoptr (GVariant) value = NULL;
-  g_autoptr (GVariant) details = NULL;
+  GError **error = &local_error;
 
-  const gchar *name = rpmostree_os_get_name (interface);
+  g_autoptr (OsQuery) query = os_query_new (interface, invocation, query_cached_rpm_diff, error);
+  if (!query)
+    return os_throw_dbus_invocation_error (invocation, error);
 
-  gboolean is_ok = get_cached_update_rpm_diff (name, arg_deployid, &value, &details, &local_error);
-  if (!is_ok)
-    return os_throw_dbus_invocation_error (invocation, &local_error);
+  rust::Str os_name (rpmostree_os_get_name (interface) ?: "");
+  rust::Str deploy_id (arg_deployid ?: "");
+  auto base_deploymentv
+      = ROSCXX_VAL (deployment_get_base (*query->sysroot, deploy_id, os_name), error);
+  if (!base_deploymentv)
+    return os_throw_dbus_invocation_error (invocation, error);
+  query->deployment = *base_deploymentv;
 
-  g_assert (value != NULL);
-  g_assert (details != NULL);
-  g_dbus_method_invocation_return_value (invocation, new_variant_diff_result (value, details));
+  g_autoptr (RpmOstreeOrigin) origin = rpmostree_origin_parse_deployment (query->deployment, error);
+  if (!origin)
+    return os_throw_dbus_invocation_error (invocation, error);
 
-  return TRUE;
+  auto r = rpmostree_origin_get_refspec (origin);
+  query->refspec = g_strdup (r.refspec.c_str ());
+  query->target = g_strdup (query->refspec);
+  return os_query_run (util::move_nullify (query));
 }
 
 static gboolean refresh_cached_update (RpmostreedOS *, GError **error);
@@ -867,6 +1022,10 @@ os_handle_refresh_md (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
     }
   g_assert (transaction != NULL);
 
+  /* The refreshed rpm-md supersedes whatever sack we have cached */
+  g_signal_connect_object (transaction, "closed", G_CALLBACK (os_clear_sack_cache), interface,
+                           G_CONNECT_SWAPPED);
+
   const char *client_address = rpmostreed_transaction_get_client_address (transaction);
   rpmostree_os_complete_refresh_md (interface, invocation, client_address);
 
@@ -910,30 +1069,68 @@ os_handle_modify_yum_repo (RPMOSTreeOS *interface, GDBusMethodInvocation *invoca
   return TRUE;
 }
 
-static DnfContext *
-os_create_dnf_context_simple (RPMOSTreeOS *interface, gboolean with_sack, gboolean enable_filelists,
-                              GCancellable *cancellable, GError **error)
+/* Compute what a loaded sack depends on: the deployment we configured the
+ * repos from, the sack flags, and the state of each repo's cached rpm-md. If
+ * any of it changes, the sack is stale. */
+static char *
+compute_sack_cache_key (DnfContext *dnfctx, OstreeDeployment *cfg_merge_deployment,
+                        const char *deployment_root, DnfContextSetupSackFlags flags)
 {
-  glnx_unref_object OstreeSysroot *ot_sysroot = NULL;
-  const gchar *os_name = rpmostree_os_get_name (interface);
-
-  if (!rpmostreed_sysroot_load_state (rpmostreed_sysroot_get (), cancellable, &ot_sysroot, NULL,
-                                      error))
+  if (!cfg_merge_deployment)
     return NULL;
 
-  g_autoptr (OstreeDeployment) cfg_merge_deployment
-      = ostree_sysroot_get_merge_deployment (ot_sysroot, os_name);
-  g_autofree char *deployment_root = NULL;
-  OstreeDeployment *booted_deployment = ostree_sysroot_get_booted_deployment (ot_sysroot);
+  g_autoptr (GString) key = g_string_new ("");
+  g_string_append_printf (key, "%s.%d;%s;%u", ostree_deployment_get_csum (cfg_merge_deployment),
+                          ostree_deployment_get_deployserial (cfg_merge_deployment),
+                          deployment_root, (guint)flags);
+
+  g_autoptr (GPtrArray) repos
+      = rpmostree_get_enabled_rpmmd_repos (dnfctx, DNF_REPO_ENABLED_PACKAGES);
+  for (guint i = 0; i < repos->len; i++)
+    {
+      auto repo = static_cast<DnfRepo *> (repos->pdata[i]);
+      g_autofree char *repomd
+          = g_build_filename (dnf_repo_get_location (repo), "repodata", "repomd.xml", NULL);
+      struct stat stbuf = {};
+      if (!glnx_fstatat_allow_noent (AT_FDCWD, repomd, &stbuf, 0, NULL))
+        return NULL;
+      g_string_append_printf (key, ";%s:%" G_GUINT64_FORMAT ".%ld:%" G_GUINT64_FORMAT,
+                              dnf_repo_get_id (repo), (guint64)stbuf.st_mtim.tv_sec,
+                              stbuf.st_mtim.tv_nsec, (guint64)stbuf.st_size);
+    }
+
+  return g_string_free (util::move_nullify (key), FALSE);
+}
+
+/* Resolve the deployments a dnf context for @query will be set up from; must be
+ * called on the main thread. */
+static void
+os_query_prepare_dnf (OsQuery *query, RPMOSTreeOS *interface)
+{
+  query->uses_dnf = TRUE;
+
+  const gchar *os_name = rpmostree_os_get_name (interface);
+
+  query->deployment = ostree_sysroot_get_merge_deployment (query->sysroot, os_name);
+  OstreeDeployment *booted_deployment = ostree_sysroot_get_booted_deployment (query->sysroot);
   /* Prefer booted deployment, if it matches the os_name */
   if (!booted_deployment
       || g_strcmp0 (os_name, ostree_deployment_get_osname (booted_deployment)) != 0)
-    deployment_root = rpmostree_get_deployment_root (ot_sysroot, cfg_merge_deployment);
+    query->deployment_root = rpmostree_get_deployment_root (query->sysroot, query->deployment);
   else
-    deployment_root = rpmostree_get_deployment_root (ot_sysroot, booted_deployment);
+    query->deployment_root = rpmostree_get_deployment_root (query->sysroot, booted_deployment);
+  query->cfg_deployment_root = rpmostree_get_deployment_root (query->sysroot, query->deployment);
+}
+
+static DnfContext *
+os_query_load_dnf_context (OsQuery *query, gboolean with_sack, gboolean enable_filelists,
+                           GCancellable *cancellable, GError **error)
+{
+  RpmostreedOS *self = query->self;
+  OstreeDeployment *cfg_merge_deployment = query->deployment;
+  const char *deployment_root = query->deployment_root;
 
-  OstreeRepo *ot_repo = ostree_sysroot_repo (ot_sysroot);
-  g_autoptr (RpmOstreeContext) ctx = rpmostree_context_new_client (ot_repo);
+  g_autoptr (RpmOstreeContext) ctx = rpmostree_context_new_client (query->repo);
 
   /* We could bypass rpmostree_context_setup() here and call dnf_context_setup() ourselves
    * since we're not actually going to perform any installation. Though it does provide us
@@ -945,47 +1142,59 @@ os_create_dnf_context_simple (RPMOSTreeOS *interface, gboolean with_sack, gboole
   rpmostree_context_set_dnf_caching (ctx, RPMOSTREE_CONTEXT_DNF_CACHE_FOREVER);
 
   /* point libdnf to our repos dir */
-  rpmostree_context_configure_from_deployment (ctx, ot_sysroot, cfg_merge_deployment);
+  rpmostree_context_configure_from_deployment_root (ctx, query->cfg_deployment_root);
 
   auto flags = (DnfContextSetupSackFlags)(DNF_CONTEXT_SETUP_SACK_FLAG_SKIP_RPMDB
                                           | DNF_CONTEXT_SETUP_SACK_FLAG_SKIP_FILELISTS
                                           | DNF_CONTEXT_SETUP_SACK_FLAG_LOAD_UPDATEINFO);
 
-  char *download_filelists = (char *)"false";
-  if (g_getenv ("DOWNLOAD_FILELISTS"))
-    {
-      download_filelists = (char *)(g_getenv ("DOWNLOAD_FILELISTS"));
-      for (int i = 0; i < strlen (download_filelists); i++)
-        {
-          download_filelists[i] = tolower (download_filelists[i]);
-        }
-    }
+  /* Compare case-insensitively rather than lowercasing the environment in
+   * place; we may be running in several query threads at once. */
+  const char *download_filelists = g_getenv ("DOWNLOAD_FILELISTS") ?: "false";
 
   /* check if filelist optimization is disabled */
-  if (strcmp (download_filelists, "true") == 0 || enable_filelists)
+  if (g_ascii_strcasecmp (download_filelists, "true") == 0 || enable_filelists)
     {
       flags = (DnfContextSetupSackFlags)(DNF_CONTEXT_SETUP_SACK_FLAG_SKIP_RPMDB
                                          | DNF_CONTEXT_SETUP_SACK_FLAG_LOAD_UPDATEINFO);
     }
 
-  if (with_sack && !rpmostree_context_download_metadata (ctx, flags, cancellable, error))
-    return NULL;
   DnfContext *dnfctx = rpmostree_context_get_dnf (ctx);
+  if (!with_sack)
+    return static_cast<DnfContext *> (g_object_ref (dnfctx));
+
+  /* Loading rpm-md into libsolv is by far the most expensive part of a query;
+   * reuse the last sack if nothing it depends on changed. */
+  g_autofree char *cache_key
+      = compute_sack_cache_key (dnfctx, cfg_merge_deployment, deployment_root, flags);
+  if (cache_key)
+    {
+      g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->sack_cache_lock);
+      if (self->sack_cache && g_str_equal (cache_key, self->sack_cache_key))
+        return static_cast<DnfContext *> (g_object_ref (self->sack_cache));
+    }
+
+  if (!rpmostree_context_download_metadata (ctx, flags, cancellable, error))
+    return NULL;
+
+  if (cache_key)
+    {
+      g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->sack_cache_lock);
+      g_free (self->sack_cache_key);
+      self->sack_cache_key = util::move_nullify (cache_key);
+      g_set_object (&self->sack_cache, dnfctx);
+    }
+
   return static_cast<DnfContext *> (g_object_ref (dnfctx));
 }
 
-static gboolean
-os_handle_list_repos (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation)
+static GVariant *
+query_list_repos (OsQuery *query, GCancellable *cancellable, GError **error)
 {
-  GError *local_error = NULL;
-  g_autoptr (DnfContext) dnfctx = NULL;
-
-  sd_journal_print (LOG_INFO, "Handling ListRepos for caller %s",
-                    g_dbus_method_invocation_get_sender (invocation));
-
-  dnfctx = os_create_dnf_context_simple (interface, FALSE, FALSE, NULL, &local_error);
+  g_autoptr (DnfContext) dnfctx
+      = os_query_load_dnf_context (query, FALSE, FALSE, cancellable, error);
   if (dnfctx == NULL)
-    return os_throw_dbus_invocation_error (invocation, &local_error);
+    return NULL;
 
   GVariantBuilder builder;
 
@@ -1008,9 +1217,23 @@ os_handle_list_repos (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation)
     }
 
   GVariant *repos_result = g_variant_builder_end (&builder);
-  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(@aa{sv})", repos_result));
+  return g_variant_new ("(@aa{sv})", repos_result);
+}
 
-  return TRUE;
+static gboolean
+os_handle_list_repos (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation)
+{
+  GError *local_error = NULL;
+
+  sd_journal_print (LOG_INFO, "Handling ListRepos for caller %s",
+                    g_dbus_method_invocation_get_sender (invocation));
+
+  g_autoptr (OsQuery) query = os_query_new (interface, invocation, query_list_repos, &local_error);
+  if (!query)
+    return os_throw_dbus_invocation_error (invocation, &local_error);
+
+  os_query_prepare_dnf (query, interface);
+  return os_query_run (util::move_nullify (query));
 }
 
 static gboolean
@@ -1077,33 +1300,26 @@ os_add_package_info_to_builder (DnfPackage *pkg, GVariantBuilder *builder, const
   g_variant_builder_add_value (builder, g_variant_dict_end (&pkg_dict));
 }
 
-static gboolean
-os_handle_what_provides (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
-                         const gchar *const *provides)
+static GVariant *
+query_what_provides (OsQuery *query, GCancellable *cancellable, GError **error)
 {
-  GError *local_error = NULL;
-  g_autoptr (GCancellable) cancellable = NULL;
-  g_autoptr (DnfContext) dnfctx = NULL;
-
-  sd_journal_print (LOG_INFO, "Handling WhatProvides for caller %s",
-                    g_dbus_method_invocation_get_sender (invocation));
-
-  dnfctx = os_create_dnf_context_simple (interface, TRUE, FALSE, cancellable, &local_error);
+  g_autoptr (DnfContext) dnfctx
+      = os_query_load_dnf_context (query, TRUE, FALSE, cancellable, error);
   if (dnfctx == NULL)
-    return os_throw_dbus_invocation_error (invocation, &local_error);
+    return NULL;
 
   GVariantBuilder builder;
 
   g_autoptr (GPtrArray) pkglist = NULL;
-  hy_autoquery HyQuery query = hy_query_create (dnf_context_get_sack (dnfctx));
+  hy_autoquery HyQuery hyquery = hy_query_create (dnf_context_get_sack (dnfctx));
 
-  hy_query_filter_provides_in (query, (gchar **)provides);
-  hy_query_filter_latest_per_arch (query, TRUE);
+  hy_query_filter_provides_in (hyquery, query->names);
+  hy_query_filter_latest_per_arch (hyquery, TRUE);
 
   /* Using such type will handle empty arrays gracefully */
   g_variant_builder_init (&builder, (const GVariantType *)"aa{sv}");
 
-  pkglist = hy_query_run (query);
+  pkglist = hy_query_run (hyquery);
   for (guint i = 0; i < pkglist->len; i++)
     {
       auto pkg = static_cast<DnfPackage *> (g_ptr_array_index (pkglist, i));
@@ -1111,41 +1327,52 @@ os_handle_what_provides (RPMOSTreeOS *interface, GDBusMethodInvocation *invocati
     }
 
   GVariant *pkgs_result = g_variant_builder_end (&builder);
-  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(@aa{sv})", pkgs_result));
-
-  return TRUE;
+  return g_variant_new ("(@aa{sv})", pkgs_result);
 }
 
 static gboolean
-os_handle_get_packages (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
-                        const gchar *const *names)
+os_handle_what_provides (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
+                         const gchar *const *provides)
 {
   GError *local_error = NULL;
-  g_autoptr (GCancellable) cancellable = NULL;
-  g_autoptr (DnfContext) dnfctx = NULL;
 
-  sd_journal_print (LOG_INFO, "Handling GetPackages for caller %s",
+  sd_journal_print (LOG_INFO, "Handling WhatProvides for caller %s",
                     g_dbus_method_invocation_get_sender (invocation));
 
-  dnfctx = os_create_dnf_context_simple (interface, TRUE, FALSE, cancellable, &local_error);
-  if (dnfctx == NULL)
+  g_autoptr (OsQuery) query
+      = os_query_new (interface, invocation, query_what_provides, &local_error);
+  if (!query)
     return os_throw_dbus_invocation_error (invocation, &local_error);
 
-  hy_autoquery HyQuery query = hy_query_create (dnf_context_get_sack (dnfctx));
+  os_query_prepare_dnf (query, interface);
+  query->names = g_strdupv ((char **)provides);
+  return os_query_run (util::move_nullify (query));
+}
+
+static GVariant *
+query_get_packages (OsQuery *query, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (DnfContext) dnfctx
+      = os_query_load_dnf_context (query, TRUE, FALSE, cancellable, error);
+  if (dnfctx == NULL)
+    return NULL;
+
+  hy_autoquery HyQuery hyquery = hy_query_create (dnf_context_get_sack (dnfctx));
 
   GVariantBuilder builder;
   /* Using such type will handle empty arrays gracefully */
   g_variant_builder_init (&builder, (const GVariantType *)"aa{sv}");
 
+  const char *const *names = query->names;
   for (guint i = 0; names[i] != NULL; i++)
     {
       g_autoptr (GPtrArray) pkglist = NULL;
 
-      hy_query_clear (query);
-      hy_query_filter (query, HY_PKG_NAME, HY_EQ, names[i]);
-      hy_query_filter_latest_per_arch (query, TRUE);
+      hy_query_clear (hyquery);
+      hy_query_filter (hyquery, HY_PKG_NAME, HY_EQ, names[i]);
+      hy_query_filter_latest_per_arch (hyquery, TRUE);
 
-      pkglist = hy_query_run (query);
+      pkglist = hy_query_run (hyquery);
       for (guint j = 0; j < pkglist->len; j++)
         {
           auto pkg = static_cast<DnfPackage *> (g_ptr_array_index (pkglist, j));
@@ -1154,9 +1381,26 @@ os_handle_get_packages (RPMOSTreeOS *interface, GDBusMethodInvocation *invocatio
     }
 
   GVariant *pkgs_result = g_variant_builder_end (&builder);
-  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(@aa{sv})", pkgs_result));
+  return g_variant_new ("(@aa{sv})", pkgs_result);
+}
 
-  return TRUE;
+static gboolean
+os_handle_get_packages (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
+                        const gchar *const *names)
+{
+  GError *local_error = NULL;
+
+  sd_journal_print (LOG_INFO, "Handling GetPackages for caller %s",
+                    g_dbus_method_invocation_get_sender (invocation));
+
+  g_autoptr (OsQuery) query
+      = os_query_new (interface, invocation, query_get_packages, &local_error);
+  if (!query)
+    return os_throw_dbus_invocation_error (invocation, &local_error);
+
+  os_query_prepare_dnf (query, interface);
+  query->names = g_strdupv ((char **)names);
+  return os_query_run (util::move_nullify (query));
 }
 
 /* helper function to sort and search within a set of (const gchar *) */
@@ -1200,10 +1444,21 @@ apply_search_filter (HyQuery *query, int keyname, const gchar *const name, int c
     }
 }
 
+/* Clear @query, keeping it restricted to @candidates if set; see
+ * rpmostree_search_index_lookup(). */
+static void
+reset_search_query (HyQuery query, const char *const *candidates)
+{
+  hy_query_clear (query);
+  if (candidates)
+    hy_query_filter_in (query, HY_PKG_NAME, HY_EQ, (const char **)candidates);
+}
+
 /* helper function to filter package query results */
 static void
 search_packages_by_filter (HyQuery query, GVariantBuilder *builder, const gchar *const *names,
-                           std::vector<int> keynames, const gchar *id)
+                           std::vector<int> keynames, const gchar *id,
+                           const char *const *candidates)
 {
   std::set<const gchar *, cstrless> result_set;
   hy_autoquery HyQuery intermediate_query = hy_query_clone (query);
@@ -1223,14 +1478,14 @@ search_packages_by_filter (HyQuery query, GVariantBuilder *builder, const gchar
   /* Name/Summary matches */
   if (keynames.size () < 2)
     {
-      hy_query_clear (query);
+      reset_search_query (query, candidates);
       for (guint i = 0; names[i] != NULL; i++)
         {
           apply_search_filter (&query, keynames[0], names[i], HY_EQ);
         }
       query_results_to_builder (query, builder, id, &result_set);
 
-      hy_query_clear (query);
+      reset_search_query (query, candidates);
       for (guint i = 0; names[i] != NULL; i++)
         {
           apply_search_filter (&query, keynames[0], names[i], HY_SUBSTR);
@@ -1253,7 +1508,7 @@ search_packages_by_filter (HyQuery query, GVariantBuilder *builder, const gchar
           hy_query_clear (intermediate_query);
           for (guint j = 0; j < keynames.size (); j++)
             {
-              hy_query_clear (query);
+              reset_search_query (query, candidates);
               apply_search_filter (&query, keynames[j], names[i], HY_EQ);
 
               if (j != 0)
@@ -1266,7 +1521,7 @@ search_packages_by_filter (HyQuery query, GVariantBuilder *builder, const gchar
                   intermediate_query = hy_query_clone (query);
                 }
 
-              hy_query_clear (query);
+              reset_search_query (query, candidates);
               apply_search_filter (&query, keynames[j], names[i], HY_SUBSTR);
               hy_query_union (intermediate_query, query);
             }
@@ -1293,11 +1548,11 @@ search_packages_by_filter (HyQuery query, GVariantBuilder *builder, const gchar
     {
       for (guint i = 0; i < keynames.size (); i++)
         {
-          hy_query_clear (query);
+          reset_search_query (query, candidates);
           apply_search_filter (&query, keynames[i], first_term, HY_EQ);
           intermediate_query = hy_query_clone (query);
 
-          hy_query_clear (query);
+          reset_search_query (query, candidates);
           apply_search_filter (&query, keynames[i], first_term, HY_SUBSTR);
           hy_query_union (intermediate_query, query);
 
@@ -1314,12 +1569,51 @@ search_packages_by_filter (HyQuery query, GVariantBuilder *builder, const gchar
     }
 }
 
+static GVariant *
+query_search (OsQuery *query, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (DnfContext) dnfctx
+      = os_query_load_dnf_context (query, TRUE, FALSE, cancellable, error);
+  if (dnfctx == NULL)
+    return NULL;
+
+  hy_autoquery HyQuery hyquery = hy_query_create (dnf_context_get_sack (dnfctx));
+
+  GVariantBuilder builder;
+  g_variant_builder_init (&builder, (const GVariantType *)"aa{sv}");
+
+  const char *const *names = query->names;
+
+  /* Narrow the queries below down to the names the search index says may
+   * match; if it can't help, every package gets considered. */
+  g_autoptr (GError) local_error = NULL;
+  g_auto (GStrv) candidates
+      = rpmostree_search_index_lookup (dnfctx, names, cancellable, &local_error);
+  if (local_error)
+    sd_journal_print (LOG_WARNING, "Failed to use search index: %s", local_error->message);
+
+  if (!candidates || *candidates)
+    {
+      const char *const *c = (const char *const *)candidates;
+      std::vector<int> keynames_a = { HY_PKG_NAME, HY_PKG_SUMMARY };
+      search_packages_by_filter (hyquery, &builder, names, keynames_a, "match_group_a", c);
+
+      std::vector<int> keynames_b = { HY_PKG_NAME };
+      search_packages_by_filter (hyquery, &builder, names, keynames_b, "match_group_b", c);
+
+      std::vector<int> keynames_c = { HY_PKG_SUMMARY };
+      search_packages_by_filter (hyquery, &builder, names, keynames_c, "match_group_c", c);
+    }
+
+  GVariant *pkgs_result = g_variant_builder_end (&builder);
+  return g_variant_new ("(@aa{sv})", pkgs_result);
+}
+
 static gboolean
 os_handle_search (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
                   const gchar *const *names)
 {
   GError *local_error = NULL;
-  g_autoptr (GCancellable) cancellable = NULL;
 
   sd_journal_print (LOG_INFO, "Handling Search for caller %s",
                     g_dbus_method_invocation_get_sender (invocation));
@@ -1331,29 +1625,13 @@ os_handle_search (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
       return TRUE;
     }
 
-  g_autoptr (DnfContext) dnfctx
-      = os_create_dnf_context_simple (interface, TRUE, FALSE, cancellable, &local_error);
-  if (dnfctx == NULL)
+  g_autoptr (OsQuery) query = os_query_new (interface, invocation, query_search, &local_error);
+  if (!query)
     return os_throw_dbus_invocation_error (invocation, &local_error);
 
-  hy_autoquery HyQuery query = hy_query_create (dnf_context_get_sack (dnfctx));
-
-  GVariantBuilder builder;
-  g_variant_builder_init (&builder, (const GVariantType *)"aa{sv}");
-
-  std::vector<int> keynames_a = { HY_PKG_NAME, HY_PKG_SUMMARY };
-  search_packages_by_filter (query, &builder, names, keynames_a, "match_group_a");
-
-  std::vector<int> keynames_b = { HY_PKG_NAME };
-  search_packages_by_filter (query, &builder, names, keynames_b, "match_group_b");
-
-  std::vector<int> keynames_c = { HY_PKG_SUMMARY };
-  search_packages_by_filter (query, &builder, names, keynames_c, "match_group_c");
-
-  GVariant *pkgs_result = g_variant_builder_end (&builder);
-  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(@aa{sv})", pkgs_result));
-
-  return TRUE;
+  os_query_prepare_dnf (query, interface);
+  query->names = g_strdupv ((char **)names);
+  return os_query_run (util::move_nullify (query));
 }
 
 /* This is an older variant of Cleanup, kept for backcompat */
@@ -1670,54 +1948,34 @@ static gboolean
 os_handle_get_cached_rebase_rpm_diff (RPMOSTreeOS *interface, GDBusMethodInvocation *invocation,
                                       const char *arg_refspec, const char *const *arg_packages)
 {
-  RpmostreedSysroot *global_sysroot;
-  g_autoptr (GCancellable) cancellable = NULL;
-  OstreeSysroot *ot_sysroot = NULL;
-  OstreeRepo *ot_repo = NULL;
-  const gchar *name;
-  glnx_unref_object OstreeDeployment *base_deployment = NULL;
-  g_autoptr (RpmOstreeOrigin) origin = NULL;
-  g_autofree gchar *comp_ref = NULL;
   GError *local_error = NULL;
-  g_autoptr (GVariant) value = NULL;
-  g_autoptr (GVariant) details = NULL;
+  GError **error = &local_error;
 
   /* TODO: Totally ignoring packages for now */
 
-  global_sysroot = rpmostreed_sysroot_get ();
-
-  ot_sysroot = rpmostreed_sysroot_get_root (global_sysroot);
-  ot_repo = rpmostreed_sysroot_get_repo (global_sysroot);
+  g_autoptr (OsQuery) query = os_query_new (interface, invocation, query_cached_rpm_diff, error);
+  if (!query)
+    return os_throw_dbus_invocation_error (invocation, error);
 
-  name = rpmostree_os_get_name (interface);
-  base_deployment = ostree_sysroot_get_merge_deployment (ot_sysroot, name);
-  if (base_deployment == NULL)
+  const char *name = rpmostree_os_get_name (interface);
+  query->deployment = ostree_sysroot_get_merge_deployment (query->sysroot, name);
+  if (query->deployment == NULL)
     {
       local_error
           = g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED, "No deployments found for os %s", name);
-      return os_throw_dbus_invocation_error (invocation, &local_error);
+      return os_throw_dbus_invocation_error (invocation, error);
     }
 
-  origin = rpmostree_origin_parse_deployment (base_deployment, &local_error);
+  g_autoptr (RpmOstreeOrigin) origin = rpmostree_origin_parse_deployment (query->deployment, error);
   if (!origin)
-    return os_throw_dbus_invocation_error (invocation, &local_error);
+    return os_throw_dbus_invocation_error (invocation, error);
 
   auto r = rpmostree_origin_get_refspec (origin);
-  if (!rpmostreed_refspec_parse_partial (arg_refspec, r.refspec.c_str (), &comp_ref, &local_error))
-    return os_throw_dbus_invocation_error (invocation, &local_error);
-
-  if (!rpm_ostree_db_diff_variant (ot_repo, ostree_deployment_get_csum (base_deployment), comp_ref,
-                                   FALSE, &value, cancellable, &local_error))
-    return os_throw_dbus_invocation_error (invocation, &local_error);
-
-  details = rpmostreed_commit_generate_cached_details_variant (base_deployment, ot_repo, comp_ref,
-                                                               NULL, &local_error);
-  if (!details)
-    return os_throw_dbus_invocation_error (invocation, &local_error);
-
-  g_dbus_method_invocation_return_value (invocation, new_variant_diff_result (value, details));
+  if (!rpmostreed_refspec_parse_partial (arg_refspec, r.refspec.c_str (), &query->refspec, error))
+    return os_throw_dbus_invocation_error (invocation, error);
 
-  return TRUE;
+  query->target = g_strdup (query->refspec);
+  return os_query_run (util::move_nullify (query));
 }
 
 static gboolean
@@ -1762,64 +2020,42 @@ os_handle_download_rebase_rpm_diff (RPMOSTreeOS *interface, GDBusMethodInvocatio
 }
 
 static gboolean
-get_cached_deploy_rpm_diff (RPMOSTreeOS *interface, const char *arg_revision, GVariant **out_value,
-                            GVariant **out_details, GError **error)
+prepare_cached_deploy_rpm_diff (OsQuery *query, const char *osname, const char *arg_revision,
+                                GError **error)
 {
-  g_autoptr (GCancellable) cancellable = NULL;
-  g_autoptr (GVariant) value = NULL;
-  g_autoptr (GVariant) details = NULL;
-
   if (arg_revision == NULL)
     return glnx_throw (error, "Missing revision");
 
-  OstreeSysroot *ot_sysroot = rpmostreed_sysroot_get_root (rpmostreed_sysroot_get ());
-  OstreeRepo *ot_repo = rpmostreed_sysroot_get_repo (rpmostreed_sysroot_get ());
-
-  const char *osname = rpmostree_os_get_name (interface);
-  glnx_unref_object OstreeDeployment *base_deployment
-      = ostree_sysroot_get_merge_deployment (ot_sysroot, osname);
-  if (base_deployment == NULL)
+  query->deployment = ostree_sysroot_get_merge_deployment (query->sysroot, osname);
+  if (query->deployment == NULL)
     return glnx_throw (error, "No deployments found for OS '%s'", osname);
 
-  g_autoptr (RpmOstreeOrigin) origin = rpmostree_origin_parse_deployment (base_deployment, error);
+  g_autoptr (RpmOstreeOrigin) origin = rpmostree_origin_parse_deployment (query->deployment, error);
   if (origin == NULL)
     return glnx_prefix_error (error, "Parsing origin for deployment");
 
-  const char *base_checksum = ostree_deployment_get_csum (base_deployment);
-
   auto r = rpmostree_origin_get_refspec (origin);
+  query->refspec = g_strdup (r.refspec.c_str ());
+  query->details_use_target = TRUE;
+
   CXX_TRY_VAR (parsed_revision, rpmostreecxx::parse_revision (arg_revision), error);
-  g_autofree char *checksum = NULL;
   switch (parsed_revision.kind)
     {
     case rpmostreecxx::ParsedRevisionKind::Checksum:
       {
-        checksum = g_strdup (parsed_revision.value.c_str ());
+        query->target = g_strdup (parsed_revision.value.c_str ());
       }
       break;
     case rpmostreecxx::ParsedRevisionKind::Version:
       {
-        if (!rpmostreed_repo_lookup_cached_version (ot_repo, r.refspec.c_str (),
-                                                    parsed_revision.value.c_str (), cancellable,
-                                                    &checksum, error))
-          return glnx_prefix_error (error, "Looking up cached version");
+        /* Walking the history is the slow part; leave it to the worker */
+        query->version = g_strdup (parsed_revision.value.c_str ());
       }
       break;
     default:
       return glnx_throw (error, "Invalid revision kind");
     }
 
-  if (!rpm_ostree_db_diff_variant (ot_repo, base_checksum, checksum, FALSE, &value, cancellable,
-                                   error))
-    return glnx_prefix_error (error, "Assembling diff");
-
-  details = rpmostreed_commit_generate_cached_details_variant (base_deployment, ot_repo,
-                                                               r.refspec.c_str (), checksum, error);
-  if (details == NULL)
-    return glnx_prefix_error (error, "Generating cached details");
-
-  *out_value = util::move_nullify (value);
-  *out_details = util::move_nullify (details);
   return TRUE;
 }
 
@@ -1828,20 +2064,18 @@ os_handle_get_cached_deploy_rpm_diff (RPMOSTreeOS *interface, GDBusMethodInvocat
                                       const char *arg_revision, const char *const *arg_packages)
 {
   GError *local_error = NULL;
-  g_autoptr (GVariant) value = NULL;
-  g_autoptr (GVariant) details = NULL;
+  GError **error = &local_error;
 
   /* XXX Ignoring arg_packages for now. */
-  gboolean is_ok
-      = get_cached_deploy_rpm_diff (interface, arg_revision, &value, &details, &local_error);
-  if (!is_ok)
-    return os_throw_dbus_invocation_error (invocation, &local_error);
+  g_autoptr (OsQuery) query = os_query_new (interface, invocation, query_cached_rpm_diff, error);
+  if (!query)
+    return os_throw_dbus_invocation_error (invocation, error);
 
-  g_assert (value != NULL);
-  g_assert (details != NULL);
-  g_dbus_method_invocation_return_value (invocation, new_variant_diff_result (value, details));
+  if (!prepare_cached_deploy_rpm_diff (query, rpmostree_os_get_name (interface), arg_revision,
+                                       error))
+    return os_throw_dbus_invocation_error (invocation, error);
 
-  return TRUE;
+  return os_query_run (util::move_nullify (query));
 }
 
 static gboolean
@@ -20,6 +20,7 @@
 #include "ostree.h"
 
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-origin.h"
 #include "rpmostree-util.h"
 #include "rpmostreed-daemon.h"
 #include "rpmostreed-deployment-utils.h"
@@ -71,12 +72,19 @@ struct _RpmostreedSysroot
   struct stat repo_last_stat;
   RpmostreedTransaction *transaction;
   guint close_transaction_timeout_id;
+  /* Queue of QueuedTxnCall; see rpmostreed_sysroot_maybe_queue_txn() */
+  GQueue txn_queue;
+  guint txn_queue_idle_id;
   PolkitAuthority *authority;
   gboolean on_session_bus;
 
   GHashTable *os_interfaces;
   GHashTable *osexperimental_interfaces;
 
+  /* cache key (char*) -> deployment variant (GVariant*); see
+   * deployment_variant_cache_key() */
+  GHashTable *deployment_variants;
+
   GFileMonitor *monitor;
   guint sig_changed;
 };
@@ -134,6 +142,58 @@ handle_get_os (RPMOSTreeSysroot *object, GDBusMethodInvocation *invocation, cons
   return TRUE;
 }
 
+/* Compute a string capturing the cheap inputs that go into
+ * rpmostreed_deployment_generate_variant() for @deployment: its id (which
+ * includes the checksum), its state, its origin and what its ref currently
+ * resolves to. This is computed for every deployment on every reload, so it
+ * must not read anything from the repo beyond that ref. The remaining inputs
+ * are the remote configuration and GPG keyrings, against which the signatures
+ * are verified; ReloadConfig drops the whole cache for those. */
+static char *
+deployment_variant_cache_key (RpmostreedSysroot *self, OstreeDeployment *deployment,
+                              const char *booted_id, GError **error)
+{
+  g_autoptr (GString) key = g_string_new (NULL);
+
+  auto id = rpmostreecxx::deployment_generate_id (*deployment);
+  g_string_append_printf (key, "%s;%s;", id.c_str (), booted_id ?: "");
+  g_string_append_printf (key, "staged=%d;pinned=%d;unlocked=%d;",
+                          ostree_deployment_is_staged (deployment),
+                          ostree_deployment_is_pinned (deployment),
+                          (int)ostree_deployment_get_unlocked (deployment));
+  if (ostree_deployment_is_staged (deployment))
+    g_string_append_printf (key, "locked=%d;",
+                            g_file_test ("/run/ostree/staged-deployment-locked",
+                                         G_FILE_TEST_EXISTS));
+
+  CXX_TRY_VAR (live_state, rpmostreecxx::get_live_apply_state (*self->ot_sysroot, *deployment),
+               error);
+  g_string_append_printf (key, "live=%s,%s;", live_state.inprogress.c_str (),
+                          live_state.commit.c_str ());
+
+  GKeyFile *origin_kf = ostree_deployment_get_origin (deployment);
+  if (origin_kf)
+    {
+      g_autofree char *origin_data = g_key_file_to_data (origin_kf, NULL, NULL);
+      g_string_append_printf (key, "origin=%s;", origin_data);
+    }
+
+  g_autoptr (RpmOstreeOrigin) origin = rpmostree_origin_parse_deployment (deployment, error);
+  if (!origin)
+    return NULL;
+  auto r = rpmostree_origin_get_refspec (origin);
+  if (r.kind == rpmostreecxx::RefspecType::Ostree)
+    {
+      /* The pending base commit depends on the ref, not the deployment */
+      g_autofree char *pending_rev = NULL;
+      if (!ostree_repo_resolve_rev (self->repo, r.refspec.c_str (), TRUE, &pending_rev, error))
+        return NULL;
+      g_string_append_printf (key, "pending=%s;", pending_rev ?: "");
+    }
+
+  return g_string_free (util::move_nullify (key), FALSE);
+}
+
 static gboolean
 sysroot_populate_deployments_unlocked (RpmostreedSysroot *self, gboolean *out_changed,
                                        GError **error)
@@ -189,15 +249,33 @@ sysroot_populate_deployments_unlocked (RpmostreedSysroot *self, gboolean *out_ch
   /* Add deployment interfaces */
   g_autoptr (GPtrArray) deployments = ostree_sysroot_get_deployments (self->ot_sysroot);
 
+  /* Only regenerate the variants of deployments whose inputs changed; this
+   * also drops the entries of deployments which no longer exist. */
+  g_autoptr (GHashTable) new_variants = g_hash_table_new_full (
+      g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+  guint n_regenerated = 0;
   for (guint i = 0; deployments != NULL && i < deployments->len; i++)
     {
       auto deployment = static_cast<OstreeDeployment *> (deployments->pdata[i]);
-      GVariant *variant = NULL;
-      if (!rpmostreed_deployment_generate_variant (self->ot_sysroot, deployment, booted_id,
-                                                   self->repo, TRUE, &variant, error))
+      g_autofree char *key = deployment_variant_cache_key (self, deployment, booted_id, error);
+      if (!key)
         return glnx_prefix_error (error, "Reading deployment %u", i);
 
+      g_autoptr (GVariant) variant = NULL;
+      auto cached = static_cast<GVariant *> (g_hash_table_lookup (self->deployment_variants, key));
+      if (cached)
+        variant = g_variant_ref (cached);
+      else
+        {
+          if (!rpmostreed_deployment_generate_variant (self->ot_sysroot, deployment, booted_id,
+                                                       self->repo, TRUE, &variant, error))
+            return glnx_prefix_error (error, "Reading deployment %u", i);
+          g_variant_ref_sink (variant);
+          n_regenerated++;
+        }
+
       g_variant_builder_add_value (&builder, variant);
+      g_hash_table_replace (new_variants, util::move_nullify (key), util::move_nullify (variant));
 
       const char *deployment_os = ostree_deployment_get_osname (deployment);
 
@@ -234,8 +312,11 @@ sysroot_populate_deployments_unlocked (RpmostreedSysroot *self, gboolean *out_ch
         }
     }
 
+  g_hash_table_unref (self->deployment_variants);
+  self->deployment_variants = util::move_nullify (new_variants);
+
   rpmostree_sysroot_set_deployments (RPMOSTREE_SYSROOT (self), g_variant_builder_end (&builder));
-  g_debug ("finished deployments");
+  g_debug ("finished deployments (%u regenerated)", n_regenerated);
 
   if (out_changed)
     *out_changed = TRUE;
@@ -284,6 +365,8 @@ reset_config_properties (RpmostreedSysroot *self, GError **error)
   const char *policy_str = rpmostree_auto_update_policy_to_str (policy, NULL);
   g_assert (policy_str);
   rpmostree_sysroot_set_automatic_update_policy (RPMOSTREE_SYSROOT (self), policy_str);
+  rpmostree_sysroot_set_transaction_queue (RPMOSTREE_SYSROOT (self),
+                                           rpmostreed_get_transaction_queue (daemon));
 
   return TRUE;
 }
@@ -345,6 +428,12 @@ reload_config (RpmostreedSysroot *self, GError **error)
   if (config_changed && !reset_config_properties (self, error))
     return glnx_prefix_error (error, "Remapping properties");
 
+  /* Remotes or their keyrings may have changed, which the cached deployment
+   * variants don't account for; drop them, and make sure they're regenerated
+   * below even if the sysroot and repo look unchanged */
+  g_hash_table_remove_all (self->deployment_variants);
+  memset (&self->repo_last_stat, 0, sizeof (self->repo_last_stat));
+
   gboolean sysroot_changed = FALSE;
   if (!sysroot_reload_ostree_configs_and_deployments (self, &sysroot_changed, error))
     return glnx_prefix_error (error, "Reloading ostree details");
@@ -378,6 +467,160 @@ handle_reload_config (RPMOSTreeSysroot *object, GDBusMethodInvocation *invocatio
   return TRUE;
 }
 
+/* A transaction method call waiting for the active transaction to finish */
+typedef struct
+{
+  RpmostreedSysroot *sysroot;
+  GDBusInterfaceSkeleton *interface;
+  /* Owned; handed over to the method handler when dispatched */
+  GDBusMethodInvocation *invocation;
+  guint name_watch_id; /* Drops the call if the caller goes away */
+} QueuedTxnCall;
+
+static void
+queued_txn_call_free (QueuedTxnCall *call)
+{
+  if (call->name_watch_id > 0)
+    g_bus_unwatch_name (call->name_watch_id);
+  g_clear_object (&call->interface);
+  g_assert (call->invocation == NULL);
+  g_free (call);
+}
+
+/* There's no point in starting a transaction nobody is waiting for. We can
+ * only tell that a caller gave up once it disconnects, which is why clients
+ * shouldn't time out queued calls (see the TransactionQueue property). */
+static void
+on_queued_txn_caller_vanished (GDBusConnection *connection, const char *name, gpointer user_data)
+{
+  auto call = static_cast<QueuedTxnCall *> (user_data);
+  RpmostreedSysroot *self = call->sysroot;
+  if (!g_queue_remove (&self->txn_queue, call))
+    return;
+
+  GDBusMethodInvocation *invocation = util::move_nullify (call->invocation);
+  sd_journal_print (LOG_INFO, "Dropping queued %s; caller %s disconnected",
+                    g_dbus_method_invocation_get_method_name (invocation), name);
+  g_dbus_method_invocation_return_error (invocation, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                         "Caller disconnected");
+  queued_txn_call_free (call);
+}
+
+/* Run the method handler for @call as if it had just come in; it was already
+ * authorized when it was queued. */
+static void
+queued_txn_call_dispatch (QueuedTxnCall *call)
+{
+  GDBusMethodInvocation *invocation = util::move_nullify (call->invocation);
+  sd_journal_print (LOG_INFO, "Starting queued %s for caller %s",
+                    g_dbus_method_invocation_get_method_name (invocation),
+                    g_dbus_method_invocation_get_sender (invocation));
+
+  GDBusInterfaceVTable *vtable = g_dbus_interface_skeleton_get_vtable (call->interface);
+  vtable->method_call (g_dbus_method_invocation_get_connection (invocation),
+                       g_dbus_method_invocation_get_sender (invocation),
+                       g_dbus_method_invocation_get_object_path (invocation),
+                       g_dbus_method_invocation_get_interface_name (invocation),
+                       g_dbus_method_invocation_get_method_name (invocation),
+                       g_dbus_method_invocation_get_parameters (invocation), invocation,
+                       call->interface);
+  queued_txn_call_free (call);
+}
+
+static gboolean
+dispatch_queued_txns (gpointer data)
+{
+  auto self = static_cast<RpmostreedSysroot *> (data);
+  self->txn_queue_idle_id = 0;
+
+  /* Calls may fail without starting a transaction; move on to the next one
+   * in that case. */
+  while (self->transaction == NULL && !g_queue_is_empty (&self->txn_queue))
+    queued_txn_call_dispatch (static_cast<QueuedTxnCall *> (g_queue_pop_head (&self->txn_queue)));
+
+  /* Identical requests waiting behind the one we just started can simply
+   * join it, as they would have if they'd come in while it was running. */
+  if (self->transaction != NULL)
+    {
+      GList *l = self->txn_queue.head;
+      while (l != NULL)
+        {
+          GList *next = l->next;
+          auto call = static_cast<QueuedTxnCall *> (l->data);
+          if (rpmostreed_transaction_is_compatible (self->transaction, call->invocation))
+            {
+              g_queue_delete_link (&self->txn_queue, l);
+              queued_txn_call_dispatch (call);
+            }
+          l = next;
+        }
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Whether @invocation is for a method which starts (or joins) a transaction,
+ * i.e. one which returns a transaction address */
+static gboolean
+method_starts_txn (GDBusInterfaceSkeleton *interface, GDBusMethodInvocation *invocation)
+{
+  const char *method_name = g_dbus_method_invocation_get_method_name (invocation);
+  GDBusMethodInfo *info
+      = g_dbus_interface_info_lookup_method (g_dbus_interface_skeleton_get_info (interface),
+                                             method_name);
+  if (!info || !info->out_args)
+    return FALSE;
+  for (GDBusArgInfo **arg = info->out_args; *arg; arg++)
+    {
+      if (g_str_equal ((*arg)->name, "transaction_address"))
+        return TRUE;
+    }
+  return FALSE;
+}
+
+/* Called from the g-authorize-method handlers of interfaces once @invocation
+ * is authorized. If it's for a method which starts a transaction,
+ * TransactionQueue is enabled and another transaction is in the way, take
+ * @invocation and dispatch it once that transaction is done, and return TRUE;
+ * the caller should then return FALSE from g-authorize-method. */
+gboolean
+rpmostreed_sysroot_maybe_queue_txn (RpmostreedSysroot *self, GDBusInterfaceSkeleton *interface,
+                                    GDBusMethodInvocation *invocation)
+{
+  RpmostreedDaemon *daemon = rpmostreed_daemon_get ();
+  if (!rpmostreed_get_transaction_queue (daemon) || rpmostreed_daemon_is_rebooting (daemon))
+    return FALSE;
+  if (!method_starts_txn (interface, invocation))
+    return FALSE;
+
+  /* Keep FIFO order with calls that are about to be dispatched */
+  if (g_queue_is_empty (&self->txn_queue))
+    {
+      if (self->transaction == NULL)
+        return FALSE;
+      /* Joining the active transaction is handled by the method itself */
+      if (rpmostreed_transaction_is_compatible (self->transaction, invocation))
+        return FALSE;
+    }
+
+  QueuedTxnCall *call = g_new0 (QueuedTxnCall, 1);
+  call->sysroot = self;
+  call->interface = (GDBusInterfaceSkeleton *)g_object_ref (interface);
+  call->invocation = (GDBusMethodInvocation *)g_object_ref (invocation);
+  const char *sender = g_dbus_method_invocation_get_sender (invocation);
+  if (sender)
+    call->name_watch_id = g_bus_watch_name_on_connection (
+        g_dbus_method_invocation_get_connection (invocation), sender, G_BUS_NAME_WATCHER_FLAGS_NONE,
+        NULL, on_queued_txn_caller_vanished, call, NULL);
+  g_queue_push_tail (&self->txn_queue, call);
+
+  sd_journal_print (LOG_INFO, "Queued %s for caller %s (position %u)",
+                    g_dbus_method_invocation_get_method_name (invocation),
+                    g_dbus_method_invocation_get_sender (invocation),
+                    g_queue_get_length (&self->txn_queue));
+  return TRUE;
+}
+
 /* ----------------------------------------------------------------------------------------------------
  */
 static void
@@ -417,6 +660,17 @@ sysroot_dispose (GObject *object)
   g_hash_table_remove_all (self->os_interfaces);
   g_hash_table_remove_all (self->osexperimental_interfaces);
 
+  if (self->txn_queue_idle_id > 0)
+    g_source_remove (self->txn_queue_idle_id);
+  self->txn_queue_idle_id = 0;
+  while (!g_queue_is_empty (&self->txn_queue))
+    {
+      auto call = static_cast<QueuedTxnCall *> (g_queue_pop_head (&self->txn_queue));
+      g_dbus_method_invocation_return_error (util::move_nullify (call->invocation), G_IO_ERROR,
+                                             G_IO_ERROR_CANCELLED, "Daemon is shutting down");
+      queued_txn_call_free (call);
+    }
+
   g_clear_object (&self->transaction);
   g_clear_object (&self->authority);
 
@@ -431,6 +685,7 @@ sysroot_finalize (GObject *object)
 
   g_hash_table_unref (self->os_interfaces);
   g_hash_table_unref (self->osexperimental_interfaces);
+  g_hash_table_unref (self->deployment_variants);
 
   g_clear_object (&self->monitor);
 
@@ -447,6 +702,9 @@ rpmostreed_sysroot_init (RpmostreedSysroot *self)
       = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_object_unref);
   self->osexperimental_interfaces
       = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_object_unref);
+  self->deployment_variants
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+  g_queue_init (&self->txn_queue);
 
   self->monitor = NULL;
 }
@@ -804,6 +1062,11 @@ rpmostreed_sysroot_set_txn (RpmostreedSysroot *self, RpmostreedTransaction *txn)
       g_autoptr (GVariant) v = g_variant_ref_sink (g_variant_new ("(sss)", "", "", ""));
       rpmostree_sysroot_set_active_transaction ((RPMOSTreeSysroot *)self, v);
       rpmostree_sysroot_set_active_transaction_path ((RPMOSTreeSysroot *)self, "");
+
+      /* Don't dispatch from here; we may be in the middle of the old
+       * transaction's signal emission */
+      if (!g_queue_is_empty (&self->txn_queue) && self->txn_queue_idle_id == 0)
+        self->txn_queue_idle_id = g_idle_add (dispatch_queued_txns, self);
     }
 }
 
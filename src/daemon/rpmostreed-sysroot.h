@@ -57,6 +57,10 @@ gboolean rpmostreed_sysroot_prep_for_txn (RpmostreedSysroot *self,
 
 gboolean rpmostreed_sysroot_has_txn (RpmostreedSysroot *self);
 
+gboolean rpmostreed_sysroot_maybe_queue_txn (RpmostreedSysroot *self,
+                                             GDBusInterfaceSkeleton *interface,
+                                             GDBusMethodInvocation *invocation);
+
 void rpmostreed_sysroot_finish_txn (RpmostreedSysroot *self, RpmostreedTransaction *txn);
 
 void rpmostreed_sysroot_set_txn (RpmostreedSysroot *self, RpmostreedTransaction *txn);
@@ -29,9 +29,11 @@
 #include "rpmostree-importer.h"
 #include "rpmostree-output.h"
 #include "rpmostree-rpm-util.h"
+#include "rpmostree-search-index.h"
 #include "rpmostree-sysroot-core.h"
 #include "rpmostree-sysroot-upgrader.h"
 #include "rpmostree-util.h"
+#include "rpmostree-worker-pool.h"
 #include "rpmostreed-daemon.h"
 #include "rpmostreed-deployment-utils.h"
 #include "rpmostreed-sysroot.h"
@@ -338,7 +340,7 @@ package_diff_transaction_execute (RpmostreedTransaction *transaction, GCancellab
       if (!apply_revision_override (transaction, repo, progress, origin, FALSE, self->revision,
                                     cancellable, error))
         return FALSE;
-      rpmostree_transaction_emit_progress_end (RPMOSTREE_TRANSACTION (transaction));
+      rpmostreed_transaction_emit_progress_end (transaction);
     }
   else if (upgrading)
     {
@@ -359,7 +361,7 @@ package_diff_transaction_execute (RpmostreedTransaction *transaction, GCancellab
     if (!rpmostree_sysroot_upgrader_pull_base (upgrader, "/usr/share/rpm", (OstreeRepoPullFlags)0,
                                                progress, &changed, cancellable, error))
       return FALSE;
-    rpmostree_transaction_emit_progress_end (RPMOSTREE_TRANSACTION (transaction));
+    rpmostreed_transaction_emit_progress_end (transaction);
   }
 
   if (!changed)
@@ -629,6 +631,90 @@ unixfdlist_to_ptrarray (GUnixFDList *fdl)
   return ret;
 }
 
+/* State for importing a batch of local RPMs on a bounded set of worker
+ * threads, the same way rpmostree_context_import() does for repo packages. */
+typedef struct
+{
+  OstreeRepo *repo;
+  OstreeSePolicy *policy;
+  GPtrArray *fds;
+  guint next;
+  guint n_done;
+  GPtrArray *results; /* sha256:nevra, indexed like @fds */
+  GCancellable *cancellable;
+  std::unique_ptr<rpmostreecxx::Progress> progress;
+  RpmOstreeWorkerPool pool;
+} LocalRpmImports;
+
+typedef struct
+{
+  LocalRpmImports *imports;
+  guint index;
+  int fd;
+} LocalRpmImportTaskData;
+
+static void
+local_rpm_import_task_data_free (LocalRpmImportTaskData *tdata)
+{
+  glnx_close_fd (&tdata->fd);
+  g_free (tdata);
+}
+
+static void
+import_local_rpm_in_thread (GTask *task, gpointer source, gpointer task_data,
+                            GCancellable *cancellable)
+{
+  g_autoptr (GError) local_error = NULL;
+  auto tdata = static_cast<LocalRpmImportTaskData *> (task_data);
+  g_autofree char *sha256_nevra = NULL;
+  /* Transfer fd to import */
+  if (!import_local_rpm (tdata->imports->repo, tdata->imports->policy, &tdata->fd, &sha256_nevra,
+                         cancellable, &local_error))
+    g_task_return_error (task, util::move_nullify (local_error));
+  else
+    g_task_return_pointer (task, util::move_nullify (sha256_nevra), g_free);
+}
+
+/* Called on completion of a local RPM import; runs on the transaction thread */
+static void
+on_local_rpm_import_done (GObject *obj, GAsyncResult *res, gpointer user_data)
+{
+  auto imports = static_cast<LocalRpmImports *> (user_data);
+  auto tdata = static_cast<LocalRpmImportTaskData *> (g_task_get_task_data (G_TASK (res)));
+  GError *local_error = NULL;
+  char *sha256_nevra = static_cast<char *> (g_task_propagate_pointer (G_TASK (res), &local_error));
+  if (sha256_nevra)
+    imports->results->pdata[tdata->index] = sha256_nevra;
+
+  imports->n_done++;
+  imports->progress->nitems_update (imports->n_done);
+  rpmostree_worker_pool_job_done (&imports->pool, local_error);
+}
+
+static gboolean
+local_rpm_import_start (RpmOstreeWorkerPool *pool, gpointer user_data, gboolean *out_started,
+                        GError **error)
+{
+  auto imports = static_cast<LocalRpmImports *> (user_data);
+  *out_started = imports->next < imports->fds->len;
+  if (!*out_started)
+    return TRUE;
+
+  const guint i = imports->next++;
+  auto tdata = g_new0 (LocalRpmImportTaskData, 1);
+  tdata->imports = imports;
+  tdata->index = i;
+  /* Steal fd from the ptrarray */
+  tdata->fd = GPOINTER_TO_INT (imports->fds->pdata[i]);
+  imports->fds->pdata[i] = GINT_TO_POINTER (-1);
+
+  g_autoptr (GTask) task
+      = g_task_new (NULL, imports->cancellable, on_local_rpm_import_done, imports);
+  g_task_set_task_data (task, tdata, (GDestroyNotify)local_rpm_import_task_data_free);
+  g_task_run_in_thread (task, import_local_rpm_in_thread);
+  return TRUE;
+}
+
 // XXX: Convert out_pkgs to return a rust::Vec<StringMapping> once all the related origin fields
 // have migrated to the treefile. Then simplify related treefile APIs.
 static gboolean
@@ -656,22 +742,29 @@ import_many_local_rpms (OstreeRepo *repo, GUnixFDList *fdl, GPtrArray **out_pkgs
   if (policy == NULL)
     return FALSE;
 
-  g_autoptr (GPtrArray) pkgs = g_ptr_array_new_with_free_func (g_free);
-
   g_autoptr (GPtrArray) fds = unixfdlist_to_ptrarray (fdl);
-  for (guint i = 0; i < fds->len; i++)
-    {
-      /* Steal fd from the ptrarray */
-      glnx_autofd int fd = GPOINTER_TO_INT (fds->pdata[i]);
-      fds->pdata[i] = GINT_TO_POINTER (-1);
-      g_autofree char *sha256_nevra = NULL;
-      /* Transfer fd to import */
-      if (!import_local_rpm (repo, policy, &fd, &sha256_nevra, cancellable, error))
+  LocalRpmImports imports = {};
+  imports.repo = repo;
+  imports.policy = policy;
+  imports.fds = fds;
+  /* We're CPU bound, so just use processors */
+  rpmostree_worker_pool_init (&imports.pool, g_get_num_processors (), local_rpm_import_start,
+                              &imports);
+  /* Results are stored in fd order regardless of completion order */
+  g_autoptr (GPtrArray) pkgs = g_ptr_array_new_full (fds->len, g_free);
+  g_ptr_array_set_size (pkgs, fds->len);
+  imports.results = pkgs;
+  imports.cancellable = cancellable;
+
+  if (fds->len > 0)
+    {
+      imports.progress
+          = rpmostreecxx::progress_nitems_begin (fds->len, "Importing local packages");
+      if (!rpmostree_worker_pool_run (&imports.pool, error))
         return FALSE;
-
-      g_ptr_array_add (pkgs, util::move_nullify (sha256_nevra));
     }
-
+  if (imports.progress)
+    imports.progress->end ("");
   if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
     return FALSE;
   txn.initialized = FALSE;
@@ -1158,7 +1251,7 @@ deploy_transaction_execute (RpmostreedTransaction *transaction, GCancellable *ca
                              OSTREE_REPO_PULL_FLAGS_NONE, progress, cancellable, error))
         return glnx_prefix_error (error, "Pulling commit %s from local repo", rev);
       ostree_async_progress_finish (progress);
-      rpmostree_transaction_emit_progress_end (RPMOSTREE_TRANSACTION (transaction));
+      rpmostreed_transaction_emit_progress_end (transaction);
 
       /* as far as the rest of the code is concerned, we're rebasing to :SHA256 now */
       g_clear_pointer (&self->refspec, g_free);
@@ -1185,7 +1278,7 @@ deploy_transaction_execute (RpmostreedTransaction *transaction, GCancellable *ca
                                     deploy_has_bool_option (self, "skip-branch-check"),
                                     self->revision, cancellable, error))
         return FALSE;
-      rpmostree_transaction_emit_progress_end (RPMOSTREE_TRANSACTION (transaction));
+      rpmostreed_transaction_emit_progress_end (transaction);
     }
   else
     {
@@ -1488,7 +1581,7 @@ deploy_transaction_execute (RpmostreedTransaction *transaction, GCancellable *ca
       if (!rpmostree_sysroot_upgrader_pull_base (upgrader, NULL, (OstreeRepoPullFlags)flags,
                                                  progress, &base_changed, cancellable, error))
         return FALSE;
-      rpmostree_transaction_emit_progress_end (RPMOSTREE_TRANSACTION (transaction));
+      rpmostreed_transaction_emit_progress_end (transaction);
 
       if (base_changed)
         changed = TRUE;
@@ -2352,6 +2445,12 @@ refresh_md_transaction_execute (RpmostreedTransaction *transaction, GCancellable
   if (!rpmostree_context_download_metadata (ctx, flags, cancellable, error))
     return FALSE;
 
+  /* Rebuild the Search index now rather than on the first query. It's just a
+   * cache, so don't fail the refresh over it. */
+  g_autoptr (GError) local_error = NULL;
+  if (!rpmostree_search_index_update (rpmostree_context_get_dnf (ctx), cancellable, &local_error))
+    sd_journal_print (LOG_WARNING, "Failed to update search index: %s", local_error->message);
+
   return TRUE;
 }
 
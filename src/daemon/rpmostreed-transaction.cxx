@@ -22,10 +22,13 @@
 #include <libglnx.h>
 #include <optional>
 #include <stdexcept>
+#include <sys/resource.h>
 #include <systemd/sd-journal.h>
 #include <systemd/sd-login.h>
 
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-output.h"
+#include "rpmostree-trace.h"
 #include "rpmostreed-daemon.h"
 #include "rpmostreed-errors.h"
 #include "rpmostreed-sysroot.h"
@@ -35,6 +38,34 @@
 // generated, but there's no point because there can be at most one transaction.
 #define CLIENT_TRANSACTION_PATH "/run/rpm-ostree-transaction.sock"
 
+// Unless a client asks for full verbosity, progress signals are emitted at
+// most this often (i.e. 10 Hz), and messages are batched over the same period.
+#define SIGNAL_COALESCE_INTERVAL_MS 100
+// Flush batched messages early once they grow past this size
+#define MESSAGE_BATCH_MAX_BYTES 4096
+
+#define RPMOSTREE_MESSAGE_TXN_PHASE                                                                \
+  SD_ID128_MAKE (4f, ab, be, 50, a7, b9, 4d, 34, 8f, 8b, aa, 8d, ab, 67, 73, 4e)
+
+/* Resource usage of the daemon at a point in time, or between two */
+typedef struct
+{
+  gint64 wall_usec;
+  gint64 user_usec;
+  gint64 system_usec;
+  guint64 read_bytes;
+  guint64 write_bytes;
+} ResourceSample;
+
+typedef struct
+{
+  guint depth; /* Only the outermost of nested begin/end pairs is measured */
+  guint count;
+  ResourceSample start;
+  ResourceSample total;
+  guint64 peak_rss;
+} PhaseMetrics;
+
 struct _RpmostreedTransactionPrivate
 {
   GDBusMethodInvocation *invocation;
@@ -64,6 +95,23 @@ struct _RpmostreedTransactionPrivate
   GVariant *finished_params;
 
   guint watch_id;
+
+  /* Coalescing of progress and message signals, which are emitted from the
+   * execute thread; see transaction_flush_signals(). Only one kind of signal
+   * is ever held back at a time, so their relative order is preserved. */
+  GMutex signal_lock;
+  gboolean full_verbosity;
+  gint64 last_progress_emit;
+  char *pending_percent_text;
+  guint pending_percent;
+  GVariant *pending_download; /* (@(tt)@(uu)@(uuu)@(uuut)@(uu)@(tt)) */
+  GString *pending_messages;
+  gint64 pending_messages_since;
+  guint signal_flush_id;
+
+  /* Only touched from the execute thread */
+  PhaseMetrics phase_metrics[RPMOSTREE_N_PHASES];
+  char *metrics_file;
 };
 
 enum
@@ -214,6 +262,182 @@ transaction_owner_vanished_cb (GDBusConnection *connection, const char *name, gp
     }
 }
 
+/* Emit whatever progress or messages are being held back; called with
+ * signal_lock held. */
+static void
+transaction_flush_signals_locked (RpmostreedTransaction *self)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  RPMOSTreeTransaction *transaction = RPMOSTREE_TRANSACTION (self);
+
+  if (priv->pending_messages)
+    {
+      g_autoptr (GString) messages = util::move_nullify (priv->pending_messages);
+      rpmostree_transaction_emit_message (transaction, messages->str);
+    }
+  if (priv->pending_percent_text)
+    {
+      g_autofree char *text = util::move_nullify (priv->pending_percent_text);
+      rpmostree_transaction_emit_percent_progress (transaction, text, priv->pending_percent);
+      priv->last_progress_emit = g_get_monotonic_time ();
+    }
+  if (priv->pending_download)
+    {
+      g_autoptr (GVariant) v = util::move_nullify (priv->pending_download);
+      g_autoptr (GVariant) arg_time = g_variant_get_child_value (v, 0);
+      g_autoptr (GVariant) arg_outstanding = g_variant_get_child_value (v, 1);
+      g_autoptr (GVariant) arg_metadata = g_variant_get_child_value (v, 2);
+      g_autoptr (GVariant) arg_delta = g_variant_get_child_value (v, 3);
+      g_autoptr (GVariant) arg_content = g_variant_get_child_value (v, 4);
+      g_autoptr (GVariant) arg_transfer = g_variant_get_child_value (v, 5);
+      rpmostree_transaction_emit_download_progress (transaction, arg_time, arg_outstanding,
+                                                    arg_metadata, arg_delta, arg_content,
+                                                    arg_transfer);
+      priv->last_progress_emit = g_get_monotonic_time ();
+    }
+}
+
+static gboolean
+transaction_signal_flush_cb (gpointer data)
+{
+  RpmostreedTransaction *self = RPMOSTREED_TRANSACTION (data);
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&priv->signal_lock);
+  priv->signal_flush_id = 0;
+  transaction_flush_signals_locked (self);
+  return G_SOURCE_REMOVE;
+}
+
+/* Make sure held back signals go out within SIGNAL_COALESCE_INTERVAL_MS even
+ * if nothing else happens; this runs on the main loop since the execute
+ * thread doesn't necessarily iterate its own. */
+static void
+transaction_schedule_flush_locked (RpmostreedTransaction *self)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  if (priv->signal_flush_id > 0)
+    return;
+  priv->signal_flush_id = g_timeout_add_full (G_PRIORITY_DEFAULT, SIGNAL_COALESCE_INTERVAL_MS,
+                                              transaction_signal_flush_cb, g_object_ref (self),
+                                              g_object_unref);
+}
+
+/* Flush anything held back, and return a locker the caller holds while
+ * emitting a signal which must not be reordered with it. */
+static GMutexLocker *
+transaction_flush_signals (RpmostreedTransaction *self)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  GMutexLocker *locker = g_mutex_locker_new (&priv->signal_lock);
+  transaction_flush_signals_locked (self);
+  return locker;
+}
+
+static void
+transaction_emit_message (RpmostreedTransaction *self, const char *text)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&priv->signal_lock);
+
+  /* Clients print each message on its own line, so a batch is just the
+   * messages joined with newlines. */
+  if (priv->full_verbosity)
+    {
+      transaction_flush_signals_locked (self);
+      rpmostree_transaction_emit_message (RPMOSTREE_TRANSACTION (self), text);
+      return;
+    }
+
+  const gint64 now = g_get_monotonic_time ();
+  if (!priv->pending_messages)
+    {
+      /* Progress must go out before the message that follows it */
+      transaction_flush_signals_locked (self);
+      priv->pending_messages = g_string_new (text);
+      priv->pending_messages_since = now;
+    }
+  else
+    {
+      g_string_append_c (priv->pending_messages, '\n');
+      g_string_append (priv->pending_messages, text);
+    }
+
+  if (priv->pending_messages->len >= MESSAGE_BATCH_MAX_BYTES
+      || now - priv->pending_messages_since >= SIGNAL_COALESCE_INTERVAL_MS * 1000)
+    transaction_flush_signals_locked (self);
+  else
+    transaction_schedule_flush_locked (self);
+}
+
+/* Returns TRUE if a progress signal should be emitted right away; otherwise
+ * the caller should store it as pending. The caller must have dropped its own
+ * kind of pending progress already. Called with signal_lock held. */
+static gboolean
+transaction_progress_due_locked (RpmostreedTransaction *self)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+
+  /* Messages and the other kind of progress must go out before this one */
+  transaction_flush_signals_locked (self);
+
+  const gint64 now = g_get_monotonic_time ();
+  if (priv->full_verbosity || now - priv->last_progress_emit >= SIGNAL_COALESCE_INTERVAL_MS * 1000)
+    {
+      priv->last_progress_emit = now;
+      return TRUE;
+    }
+  transaction_schedule_flush_locked (self);
+  return FALSE;
+}
+
+static void
+transaction_emit_percent_progress (RpmostreedTransaction *self, const char *text,
+                                   guint percentage)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&priv->signal_lock);
+
+  /* Only the latest value matters */
+  g_clear_pointer (&priv->pending_percent_text, g_free);
+  if (transaction_progress_due_locked (self))
+    {
+      rpmostree_transaction_emit_percent_progress (RPMOSTREE_TRANSACTION (self), text, percentage);
+      return;
+    }
+  priv->pending_percent_text = g_strdup (text);
+  priv->pending_percent = percentage;
+}
+
+static void
+transaction_emit_download_progress (RpmostreedTransaction *self, GVariant *arg_time,
+                                    GVariant *arg_outstanding, GVariant *arg_metadata,
+                                    GVariant *arg_delta, GVariant *arg_content,
+                                    GVariant *arg_transfer)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&priv->signal_lock);
+
+  g_clear_pointer (&priv->pending_download, g_variant_unref);
+  if (transaction_progress_due_locked (self))
+    {
+      rpmostree_transaction_emit_download_progress (RPMOSTREE_TRANSACTION (self), arg_time,
+                                                    arg_outstanding, arg_metadata, arg_delta,
+                                                    arg_content, arg_transfer);
+      return;
+    }
+  priv->pending_download = g_variant_ref_sink (
+      g_variant_new ("(@(tt)@(uu)@(uuu)@(uuut)@(uu)@(tt))", arg_time, arg_outstanding,
+                     arg_metadata, arg_delta, arg_content, arg_transfer));
+}
+
+void
+rpmostreed_transaction_emit_progress_end (RpmostreedTransaction *transaction)
+{
+  g_assert (RPMOSTREED_IS_TRANSACTION (transaction));
+  g_autoptr (GMutexLocker) locker = transaction_flush_signals (transaction);
+  rpmostree_transaction_emit_progress_end (RPMOSTREE_TRANSACTION (transaction));
+}
+
 static void
 transaction_progress_changed_cb (OstreeAsyncProgress *progress, RPMOSTreeTransaction *transaction)
 {
@@ -243,7 +467,7 @@ transaction_progress_changed_cb (OstreeAsyncProgress *progress, RPMOSTreeTransac
         {
           g_print ("%s\n", status);
         }
-      rpmostree_transaction_emit_message (transaction, g_strdup (status));
+      transaction_emit_message (self, status);
       return;
     }
 
@@ -288,9 +512,8 @@ transaction_progress_changed_cb (OstreeAsyncProgress *progress, RPMOSTreeTransac
       g_print ("%s\n", msg.c_str ());
     }
 
-  /* This sinks the floating GVariant refs (I think...). */
-  rpmostree_transaction_emit_download_progress (transaction, arg_time, arg_outstanding,
-                                                arg_metadata, arg_delta, arg_content, arg_transfer);
+  transaction_emit_download_progress (self, arg_time, arg_outstanding, arg_metadata, arg_delta,
+                                      arg_content, arg_transfer);
 }
 
 static void
@@ -309,8 +532,279 @@ transaction_gpg_verify_result_cb (OstreeRepo *repo, const char *checksum,
       g_variant_builder_add (&builder, "v", ostree_gpg_verify_result_get_all (result, i));
     }
 
+  g_autoptr (GMutexLocker) locker
+      = transaction_flush_signals (RPMOSTREED_TRANSACTION (transaction));
   rpmostree_transaction_emit_signature_progress (transaction, g_variant_builder_end (&builder),
-                                                 g_strdup (checksum));
+                                                 checksum);
+}
+
+static void
+resource_sample_get (ResourceSample *sample)
+{
+  *sample = {};
+  sample->wall_usec = g_get_monotonic_time ();
+
+  struct rusage ru = {};
+  if (getrusage (RUSAGE_SELF, &ru) == 0)
+    {
+      sample->user_usec = (gint64)ru.ru_utime.tv_sec * G_USEC_PER_SEC + ru.ru_utime.tv_usec;
+      sample->system_usec = (gint64)ru.ru_stime.tv_sec * G_USEC_PER_SEC + ru.ru_stime.tv_usec;
+    }
+
+  /* Bytes that actually hit the storage layer, as opposed to rchar/wchar */
+  g_autofree char *io = NULL;
+  if (g_file_get_contents ("/proc/self/io", &io, NULL, NULL))
+    {
+      const char *p;
+      if ((p = strstr (io, "\nread_bytes: ")))
+        sample->read_bytes = g_ascii_strtoull (p + strlen ("\nread_bytes: "), NULL, 10);
+      if ((p = strstr (io, "\nwrite_bytes: ")))
+        sample->write_bytes = g_ascii_strtoull (p + strlen ("\nwrite_bytes: "), NULL, 10);
+    }
+}
+
+/* Returns the high water mark of our RSS since the last reset_peak_rss() */
+static guint64
+read_peak_rss (void)
+{
+  g_autofree char *status = NULL;
+  if (!g_file_get_contents ("/proc/self/status", &status, NULL, NULL))
+    return 0;
+  const char *p = strstr (status, "\nVmHWM:");
+  if (!p)
+    return 0;
+  return g_ascii_strtoull (p + strlen ("\nVmHWM:"), NULL, 10) * 1024;
+}
+
+static void
+reset_peak_rss (void)
+{
+  glnx_autofd int fd = open ("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  if (fd >= 0)
+    (void)TEMP_FAILURE_RETRY (write (fd, "5", 1));
+}
+
+/* The kernel only tracks a single peak RSS, so credit it to every phase in
+ * progress and start over whenever one begins or ends. */
+static void
+transaction_phases_update_peak_rss (RpmostreedTransaction *self)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  const guint64 peak_rss = read_peak_rss ();
+  for (guint i = 0; i < RPMOSTREE_N_PHASES; i++)
+    {
+      PhaseMetrics *metrics = &priv->phase_metrics[i];
+      if (metrics->depth > 0)
+        metrics->peak_rss = MAX (metrics->peak_rss, peak_rss);
+    }
+  reset_peak_rss ();
+}
+
+static GVariant *
+transaction_phase_metrics_to_variant (RpmostreedTransaction *self)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  GVariantBuilder builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sa{sv}}"));
+  for (guint i = 0; i < RPMOSTREE_N_PHASES; i++)
+    {
+      PhaseMetrics *metrics = &priv->phase_metrics[i];
+      if (metrics->count == 0)
+        continue;
+      g_autoptr (GVariantDict) dict = g_variant_dict_new (NULL);
+      g_variant_dict_insert (dict, "count", "u", metrics->count);
+      g_variant_dict_insert (dict, "wall-usec", "t", (guint64)metrics->total.wall_usec);
+      g_variant_dict_insert (dict, "user-usec", "t", (guint64)metrics->total.user_usec);
+      g_variant_dict_insert (dict, "system-usec", "t", (guint64)metrics->total.system_usec);
+      g_variant_dict_insert (dict, "peak-rss", "t", metrics->peak_rss);
+      g_variant_dict_insert (dict, "read-bytes", "t", metrics->total.read_bytes);
+      g_variant_dict_insert (dict, "write-bytes", "t", metrics->total.write_bytes);
+      g_variant_builder_add (&builder, "{s@a{sv}}", rpmostree_phase_to_string ((RpmOstreePhase)i),
+                             g_variant_dict_end (dict));
+    }
+  return g_variant_builder_end (&builder);
+}
+
+static void
+transaction_phase_begin (RpmostreedTransaction *self, RpmOstreePhase phase)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  PhaseMetrics *metrics = &priv->phase_metrics[phase];
+
+  transaction_phases_update_peak_rss (self);
+  if (metrics->depth++ > 0)
+    return;
+  metrics->count++;
+  resource_sample_get (&metrics->start);
+}
+
+static void
+transaction_phase_end (RpmostreedTransaction *self, RpmOstreePhase phase)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  PhaseMetrics *metrics = &priv->phase_metrics[phase];
+
+  if (metrics->depth == 0)
+    return;
+  transaction_phases_update_peak_rss (self);
+  if (--metrics->depth > 0)
+    return;
+
+  ResourceSample now;
+  resource_sample_get (&now);
+  metrics->total.wall_usec += now.wall_usec - metrics->start.wall_usec;
+  metrics->total.user_usec += now.user_usec - metrics->start.user_usec;
+  metrics->total.system_usec += now.system_usec - metrics->start.system_usec;
+  metrics->total.read_bytes += now.read_bytes - metrics->start.read_bytes;
+  metrics->total.write_bytes += now.write_bytes - metrics->start.write_bytes;
+
+  /* The generated skeleton takes care of notifying from the main thread */
+  rpmostree_transaction_set_phase_metrics (RPMOSTREE_TRANSACTION (self),
+                                           transaction_phase_metrics_to_variant (self));
+}
+
+static void
+transaction_log_phase_metrics (RpmostreedTransaction *self, const char *method)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  for (guint i = 0; i < RPMOSTREE_N_PHASES; i++)
+    {
+      PhaseMetrics *metrics = &priv->phase_metrics[i];
+      if (metrics->count == 0)
+        continue;
+      const char *phase = rpmostree_phase_to_string ((RpmOstreePhase)i);
+      const ResourceSample *total = &metrics->total;
+      g_autofree char *peak_rss = g_format_size (metrics->peak_rss);
+      sd_journal_send (
+          "MESSAGE_ID=" SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_TXN_PHASE),
+          "MESSAGE=Txn %s phase %s: %.2fs wall, %.2fs CPU, peak RSS %s", method, phase,
+          total->wall_usec / (double)G_USEC_PER_SEC,
+          (total->user_usec + total->system_usec) / (double)G_USEC_PER_SEC, peak_rss,
+          "TXN_METHOD=%s", method, "PHASE=%s", phase, "PHASE_COUNT=%u", metrics->count,
+          "PHASE_WALL_USEC=%" G_GINT64_FORMAT, total->wall_usec,
+          "PHASE_USER_USEC=%" G_GINT64_FORMAT, total->user_usec,
+          "PHASE_SYSTEM_USEC=%" G_GINT64_FORMAT, total->system_usec,
+          "PHASE_PEAK_RSS_BYTES=%" G_GUINT64_FORMAT, metrics->peak_rss,
+          "PHASE_READ_BYTES=%" G_GUINT64_FORMAT, total->read_bytes,
+          "PHASE_WRITE_BYTES=%" G_GUINT64_FORMAT, total->write_bytes, NULL);
+    }
+}
+
+/* Write the metrics of this transaction for the Prometheus node exporter's
+ * textfile collector; it is replaced atomically as the collector requires. */
+static gboolean
+transaction_write_metrics_file (RpmostreedTransaction *self, const char *method, gboolean success,
+                                GError **error)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  g_autoptr (GString) buf = g_string_new ("");
+
+  g_string_append (buf, "# HELP rpmostree_transaction_success Whether the last transaction "
+                        "succeeded.\n"
+                        "# TYPE rpmostree_transaction_success gauge\n");
+  g_string_append_printf (buf, "rpmostree_transaction_success{method=\"%s\"} %d\n", method,
+                          success ? 1 : 0);
+  g_string_append (buf, "# HELP rpmostree_transaction_completion_timestamp_seconds When the last "
+                        "transaction completed.\n"
+                        "# TYPE rpmostree_transaction_completion_timestamp_seconds gauge\n");
+  g_string_append_printf (buf,
+                          "rpmostree_transaction_completion_timestamp_seconds{method=\"%s\"} "
+                          "%" G_GINT64_FORMAT "\n",
+                          method, g_get_real_time () / G_USEC_PER_SEC);
+
+  static const struct
+  {
+    const char *name;
+    const char *help;
+  } metric_defs[] = {
+    { "count", "Number of times the phase was entered." },
+    { "wall_seconds", "Wall clock time spent in the phase." },
+    { "cpu_seconds", "CPU time used by the daemon during the phase." },
+    { "peak_rss_bytes", "Peak resident memory of the daemon during the phase." },
+    { "read_bytes", "Bytes read from storage by the daemon during the phase." },
+    { "write_bytes", "Bytes written to storage by the daemon during the phase." },
+  };
+  for (guint j = 0; j < G_N_ELEMENTS (metric_defs); j++)
+    {
+      const char *name = metric_defs[j].name;
+      g_string_append_printf (buf,
+                              "# HELP rpmostree_transaction_phase_%s %s\n"
+                              "# TYPE rpmostree_transaction_phase_%s gauge\n",
+                              name, metric_defs[j].help, name);
+      for (guint i = 0; i < RPMOSTREE_N_PHASES; i++)
+        {
+          PhaseMetrics *metrics = &priv->phase_metrics[i];
+          if (metrics->count == 0)
+            continue;
+          const ResourceSample *total = &metrics->total;
+          g_autofree char *labels
+              = g_strdup_printf ("method=\"%s\",phase=\"%s\"", method,
+                                 rpmostree_phase_to_string ((RpmOstreePhase)i));
+          const char *prefix = "rpmostree_transaction_phase_";
+          switch (j)
+            {
+            case 0:
+              g_string_append_printf (buf, "%s%s{%s} %u\n", prefix, name, labels, metrics->count);
+              break;
+            case 1:
+              g_string_append_printf (buf, "%s%s{%s} %.6f\n", prefix, name, labels,
+                                      total->wall_usec / (double)G_USEC_PER_SEC);
+              break;
+            case 2:
+              g_string_append_printf (buf, "%s%s{%s,mode=\"user\"} %.6f\n", prefix, name, labels,
+                                      total->user_usec / (double)G_USEC_PER_SEC);
+              g_string_append_printf (buf, "%s%s{%s,mode=\"system\"} %.6f\n", prefix, name,
+                                      labels, total->system_usec / (double)G_USEC_PER_SEC);
+              break;
+            case 3:
+              g_string_append_printf (buf, "%s%s{%s} %" G_GUINT64_FORMAT "\n", prefix, name,
+                                      labels, metrics->peak_rss);
+              break;
+            case 4:
+              g_string_append_printf (buf, "%s%s{%s} %" G_GUINT64_FORMAT "\n", prefix, name,
+                                      labels, total->read_bytes);
+              break;
+            case 5:
+              g_string_append_printf (buf, "%s%s{%s} %" G_GUINT64_FORMAT "\n", prefix, name,
+                                      labels, total->write_bytes);
+              break;
+            default:
+              g_assert_not_reached ();
+            }
+        }
+    }
+
+  return glnx_file_replace_contents_with_perms_at (AT_FDCWD, priv->metrics_file,
+                                                   (const guint8 *)buf->str, buf->len, 0644,
+                                                   (uid_t)-1, (gid_t)-1,
+                                                   GLNX_FILE_REPLACE_NODATASYNC, NULL, error);
+}
+
+/* Close out any phase left open by an error, and report the metrics */
+static void
+transaction_finish_phase_metrics (RpmostreedTransaction *self, gboolean success)
+{
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+  const char *method = g_dbus_method_invocation_get_method_name (priv->invocation);
+
+  for (guint i = 0; i < RPMOSTREE_N_PHASES; i++)
+    {
+      PhaseMetrics *metrics = &priv->phase_metrics[i];
+      if (metrics->depth == 0)
+        continue;
+      metrics->depth = 1;
+      transaction_phase_end (self, (RpmOstreePhase)i);
+    }
+
+  transaction_log_phase_metrics (self, method);
+
+  if (priv->metrics_file)
+    {
+      g_autoptr (GError) local_error = NULL;
+      if (!transaction_write_metrics_file (self, method, success, &local_error))
+        sd_journal_print (LOG_WARNING, "Failed to write %s: %s", priv->metrics_file,
+                          local_error->message);
+    }
 }
 
 static void
@@ -325,6 +819,18 @@ transaction_output_cb (RpmOstreeOutputType type, void *data, void *opaque)
   static bool progress_state_percent;
   static guint progress_state_n_items;
 
+  /* Phases are tracked regardless of where output goes */
+  if (type == RPMOSTREE_OUTPUT_PHASE_BEGIN)
+    {
+      transaction_phase_begin (self, static_cast<RpmOstreeOutputPhase *> (data)->phase);
+      return;
+    }
+  else if (type == RPMOSTREE_OUTPUT_PHASE_END)
+    {
+      transaction_phase_end (self, static_cast<RpmOstreeOutputPhase *> (data)->phase);
+      return;
+    }
+
   g_object_get (self, "output-to-self", &output_to_self, NULL);
   if (output_to_self)
     {
@@ -337,7 +843,7 @@ transaction_output_cb (RpmOstreeOutputType type, void *data, void *opaque)
   switch (type)
     {
     case RPMOSTREE_OUTPUT_MESSAGE:
-      rpmostree_transaction_emit_message (transaction, ((RpmOstreeOutputMessage *)data)->text);
+      transaction_emit_message (self, ((RpmOstreeOutputMessage *)data)->text);
       break;
     case RPMOSTREE_OUTPUT_PROGRESS_BEGIN:
       {
@@ -348,7 +854,7 @@ transaction_output_cb (RpmOstreeOutputType type, void *data, void *opaque)
         if (begin->percent)
           {
             progress_str = g_strdup (begin->prefix);
-            rpmostree_transaction_emit_percent_progress (transaction, progress_str, 0);
+            transaction_emit_percent_progress (self, progress_str, 0);
             progress_state_percent = true;
           }
         else if (begin->n > 0)
@@ -356,10 +862,11 @@ transaction_output_cb (RpmOstreeOutputType type, void *data, void *opaque)
             progress_str = g_strdup (begin->prefix);
             progress_state_n_items = begin->n;
             /* For backcompat, this is a percentage.  See below */
-            rpmostree_transaction_emit_percent_progress (transaction, progress_str, 0);
+            transaction_emit_percent_progress (self, progress_str, 0);
           }
         else
           {
+            g_autoptr (GMutexLocker) locker = transaction_flush_signals (self);
             rpmostree_transaction_emit_task_begin (transaction, begin->prefix);
           }
       }
@@ -380,11 +887,11 @@ transaction_output_cb (RpmOstreeOutputType type, void *data, void *opaque)
                                  : (update_c_float / nitems_percentage);
             g_autofree char *newtext
                 = g_strdup_printf ("%s (%u/%u)", progress_str, update->c, progress_state_n_items);
-            rpmostree_transaction_emit_percent_progress (transaction, newtext, percentage);
+            transaction_emit_percent_progress (self, newtext, percentage);
           }
         else
           {
-            rpmostree_transaction_emit_percent_progress (transaction, progress_str, update->c);
+            transaction_emit_percent_progress (self, progress_str, update->c);
           }
       }
       break;
@@ -397,14 +904,18 @@ transaction_output_cb (RpmOstreeOutputType type, void *data, void *opaque)
       {
         if (progress_state_percent || progress_state_n_items > 0)
           {
-            rpmostree_transaction_emit_progress_end (transaction);
+            rpmostreed_transaction_emit_progress_end (self);
           }
         else
           {
+            g_autoptr (GMutexLocker) locker = transaction_flush_signals (self);
             rpmostree_transaction_emit_task_end (transaction, "done");
           }
       }
       break;
+    case RPMOSTREE_OUTPUT_PHASE_BEGIN:
+    case RPMOSTREE_OUTPUT_PHASE_END:
+      g_assert_not_reached ();
     }
 }
 
@@ -429,6 +940,7 @@ transaction_execute_thread (GTask *task, gpointer source_object, gpointer task_d
   auto guard = rpmostreecxx::rpmostreed_daemon_tokio_enter (rpmostreed_daemon_get ());
 
   rpmostree_output_set_callback (transaction_output_cb, self);
+  const gboolean tracing = rpmostree_trace_session_begin ();
 
   try
     {
@@ -455,6 +967,19 @@ transaction_execute_thread (GTask *task, gpointer source_object, gpointer task_d
         }
     }
 
+  transaction_finish_phase_metrics (self, local_error == NULL);
+
+  if (tracing)
+    {
+      const char *method = g_dbus_method_invocation_get_method_name (priv->invocation);
+      g_autofree char *trace_path = NULL;
+      g_autoptr (GError) trace_error = NULL;
+      if (!rpmostree_trace_session_end (method, &trace_path, &trace_error))
+        sd_journal_print (LOG_WARNING, "Failed to write trace: %s", trace_error->message);
+      else if (trace_path)
+        sd_journal_print (LOG_INFO, "Wrote trace of txn %s to %s", method, trace_path);
+    }
+
   if (local_error != NULL)
     {
       /* Also log to journal in addition to the client, so it's recorded
@@ -510,7 +1035,10 @@ transaction_execute_done_cb (GObject *source_object, GAsyncResult *result, gpoin
   g_debug ("%s (%p): Finished%s%s%s", G_OBJECT_TYPE_NAME (self), self,
            success ? "" : " (error: ", success ? "" : error_message, success ? "" : ")");
 
-  rpmostree_transaction_emit_finished (RPMOSTREE_TRANSACTION (self), success, error_message);
+  {
+    g_autoptr (GMutexLocker) locker = transaction_flush_signals (self);
+    rpmostree_transaction_emit_finished (RPMOSTREE_TRANSACTION (self), success, error_message);
+  }
 
   /* Stash the Finished signal parameters in case we need
    * to emit the signal again on subsequent new connections. */
@@ -616,6 +1144,15 @@ transaction_finalize (GObject *object)
   g_free (priv->agent_id);
   g_free (priv->sd_unit);
 
+  /* The flush timeout holds a ref, so it can't be pending here */
+  g_assert (priv->signal_flush_id == 0);
+  g_free (priv->pending_percent_text);
+  g_clear_pointer (&priv->pending_download, g_variant_unref);
+  if (priv->pending_messages)
+    g_string_free (priv->pending_messages, TRUE);
+  g_mutex_clear (&priv->signal_lock);
+  g_free (priv->metrics_file);
+
   G_OBJECT_CLASS (rpmostreed_transaction_parent_class)->finalize (object);
 }
 
@@ -627,6 +1164,11 @@ transaction_constructed (GObject *object)
 
   G_OBJECT_CLASS (rpmostreed_transaction_parent_class)->constructed (object);
 
+  priv->metrics_file
+      = g_strdup (rpmostreed_get_transaction_metrics_file (rpmostreed_daemon_get ()));
+  rpmostree_transaction_set_phase_metrics ((RPMOSTreeTransaction *)self,
+                                           transaction_phase_metrics_to_variant (self));
+
   if (priv->invocation != NULL)
     {
       GDBusConnection *connection;
@@ -672,7 +1214,7 @@ rpmostreed_transaction_force_close (RpmostreedTransaction *transaction)
 static void
 on_sysroot_journal_msg (OstreeSysroot *sysroot, const char *msg, void *opaque)
 {
-  rpmostree_transaction_emit_message (RPMOSTREE_TRANSACTION (opaque), msg);
+  transaction_emit_message (RPMOSTREED_TRANSACTION (opaque), msg);
 }
 
 static gboolean
@@ -771,6 +1313,25 @@ transaction_handle_cancel (RPMOSTreeTransaction *transaction, GDBusMethodInvocat
   return TRUE;
 }
 
+static gboolean
+transaction_handle_set_progress_options (RPMOSTreeTransaction *transaction,
+                                         GDBusMethodInvocation *invocation, GVariant *arg_options)
+{
+  RpmostreedTransaction *self = RPMOSTREED_TRANSACTION (transaction);
+  RpmostreedTransactionPrivate *priv = rpmostreed_transaction_get_private (self);
+
+  gboolean full_verbosity = FALSE;
+  if (g_variant_lookup (arg_options, "full-verbosity", "b", &full_verbosity) && full_verbosity)
+    {
+      /* Signals go to every connected client, so this is sticky */
+      g_autoptr (GMutexLocker) locker = transaction_flush_signals (self);
+      priv->full_verbosity = TRUE;
+    }
+
+  rpmostree_transaction_complete_set_progress_options (transaction, invocation);
+  return TRUE;
+}
+
 static gboolean
 transaction_handle_start (RPMOSTreeTransaction *transaction, GDBusMethodInvocation *invocation)
 {
@@ -877,6 +1438,7 @@ rpmostreed_transaction_dbus_iface_init (RPMOSTreeTransactionIface *iface)
 {
   iface->handle_cancel = transaction_handle_cancel;
   iface->handle_start = transaction_handle_start;
+  iface->handle_set_progress_options = transaction_handle_set_progress_options;
 }
 
 static void
@@ -888,6 +1450,7 @@ rpmostreed_transaction_init (RpmostreedTransaction *self)
 
   self->priv->peer_connections
       = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, NULL);
+  g_mutex_init (&self->priv->signal_lock);
 }
 
 gboolean
@@ -63,5 +63,6 @@ void rpmostreed_transaction_connect_download_progress (RpmostreedTransaction *tr
 void rpmostreed_transaction_connect_signature_progress (RpmostreedTransaction *transaction,
                                                         OstreeRepo *repo);
 void rpmostreed_transaction_force_close (RpmostreedTransaction *transaction);
+void rpmostreed_transaction_emit_progress_end (RpmostreedTransaction *transaction);
 
 G_END_DECLS
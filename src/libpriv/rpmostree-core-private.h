@@ -25,7 +25,9 @@
 #include "libglnx.h"
 #include "rpmostree-core.h"
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-importer.h"
 #include "rpmostree-output.h"
+#include "rpmostree-worker-pool.h"
 
 G_BEGIN_DECLS
 
@@ -41,6 +43,7 @@ struct _RpmOstreeContext
   rpmostreecxx::Treefile *treefile_rs; /* For composes for now */
   gboolean empty;
   gboolean allow_empty_transaction;
+  guint64 import_mem_budget; /* 0 means the default */
   gboolean disable_selinux;
   char *ref;
 
@@ -54,15 +57,14 @@ struct _RpmOstreeContext
   gboolean unprivileged;
   gboolean repos_dir_configured;
   OstreeSePolicy *sepolicy;
+  GVariant *sepolicy_file_contexts; /* See rpmostree_context_load_sepolicy_file_contexts() */
+  RpmOstreeLabelCache *label_cache; /* For sepolicy; shared by importers and relabeling */
   char *passwd_dir;
 
+  RpmOstreeWorkerPool async_pool;
   guint async_index; /* Offset into array if applicable */
-  guint n_async_running;
-  guint n_async_max;
-  gboolean async_running;
   GCancellable *async_cancellable;
   std::unique_ptr<rpmostreecxx::Progress> async_progress;
-  GError *async_error;
   GPtrArray *pkgs; /* All packages */
   GPtrArray *pkgs_to_download;
   GPtrArray *pkgs_to_import;
@@ -70,11 +72,28 @@ struct _RpmOstreeContext
   GPtrArray *pkgs_to_relabel;
   guint n_async_pkgs_relabeled;
 
+  /* Pipelined download+import; see rpmostree_context_download_and_import() */
+  gboolean async_pipelined;
+  gboolean async_pipeline_downloading; /* Main thread only */
+  GMutex async_pipeline_lock;
+  GCond async_pipeline_cond;
+  GQueue async_pipeline_ready; /* Borrowed DnfPackage; downloaded, awaiting import */
+  guint async_pipeline_max_ready;
+  gboolean async_pipeline_aborted;
+  guint64 async_pipeline_download_size;       /* Total bytes the download thread will fetch */
+  gint async_pipeline_download_percent;       /* Atomic; written by the download thread */
+  gint async_pipeline_download_percent_shown; /* Main thread only */
+  RpmOstreeContentIndex *async_content_index; /* Borrowed; only set while importing */
+  guint64 async_mem_budget;                   /* Estimated bytes we allow imports to use */
+  guint64 async_mem_running;                  /* Estimated bytes used by running imports */
+
   GHashTable *pkgs_to_remove;  /* pkgname --> gv_nevra */
   GHashTable *pkgs_to_replace; /* source -> (new gv_nevra --> old gv_nevra) */
 
   GHashTable *fileoverride_pkgs; /* set of nevras */
 
+  GHashTable *header_cache; /* nevra -> RpmOstreeHeaderCacheEntry */
+
   gboolean filelists_exist;
 
   std::optional<rust::Box<rpmostreecxx::LockfileConfig>> lockfile;
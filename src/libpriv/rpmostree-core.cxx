@@ -30,18 +30,25 @@
 #include <rpm/rpmmacro.h>
 #include <rpm/rpmsq.h>
 #include <rpm/rpmts.h>
+#include <set>
+#include <string>
 #include <systemd/sd-journal.h>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "libdnf/dnf-context.h"
 #include "rpmostree-core-private.h"
 #include "rpmostree-cxxrs.h"
+#include "rpmostree-file-contexts.h"
 #include "rpmostree-importer.h"
+#include "rpmostree-label-cache.h"
 #include "rpmostree-kernel.h"
 #include "rpmostree-output.h"
 #include "rpmostree-postprocess.h"
 #include "rpmostree-rpm-util.h"
 #include "rpmostree-scripts.h"
+#include "rpmostree-trace.h"
 
 #include "libdnf/nevra.hpp"
 #include "rpmostree-util.h"
@@ -85,6 +92,8 @@ rpmostree_context_finalize (GObject *object)
   g_clear_pointer (&rctx->devino_cache, (GDestroyNotify)ostree_repo_devino_cache_unref);
 
   g_clear_object (&rctx->sepolicy);
+  g_clear_pointer (&rctx->sepolicy_file_contexts, g_variant_unref);
+  g_clear_pointer (&rctx->label_cache, rpmostree_label_cache_free);
 
   g_clear_pointer (&rctx->passwd_dir, g_free);
 
@@ -97,12 +106,17 @@ rpmostree_context_finalize (GObject *object)
   g_clear_pointer (&rctx->pkgs_to_replace, g_hash_table_unref);
 
   g_clear_pointer (&rctx->fileoverride_pkgs, g_hash_table_unref);
+  g_clear_pointer (&rctx->header_cache, g_hash_table_unref);
 
   (void)glnx_tmpdir_delete (&rctx->tmpdir, NULL, NULL);
   (void)glnx_tmpdir_delete (&rctx->repo_tmpdir, NULL, NULL);
 
   g_clear_pointer (&rctx->rootfs_usrlinks, g_hash_table_unref);
 
+  g_queue_clear (&rctx->async_pipeline_ready);
+  g_mutex_clear (&rctx->async_pipeline_lock);
+  g_cond_clear (&rctx->async_pipeline_cond);
+
   G_OBJECT_CLASS (rpmostree_context_parent_class)->finalize (object);
 }
 
@@ -121,6 +135,9 @@ rpmostree_context_init (RpmOstreeContext *self)
   self->enable_rofiles = TRUE;
   self->unprivileged = getuid () != 0;
   self->filelists_exist = FALSE;
+  g_mutex_init (&self->async_pipeline_lock);
+  g_cond_init (&self->async_pipeline_cond);
+  g_queue_init (&self->async_pipeline_ready);
 }
 
 static void
@@ -363,6 +380,15 @@ rpmostree_context_configure_from_deployment (RpmOstreeContext *self, OstreeSysro
                                              OstreeDeployment *cfg_deployment)
 {
   g_autofree char *cfg_deployment_root = rpmostree_get_deployment_root (sysroot, cfg_deployment);
+  rpmostree_context_configure_from_deployment_root (self, cfg_deployment_root);
+}
+
+/* Same as rpmostree_context_configure_from_deployment(), given the deployment's
+ * root path; this doesn't need the sysroot. */
+void
+rpmostree_context_configure_from_deployment_root (RpmOstreeContext *self,
+                                                  const char *cfg_deployment_root)
+{
   g_autofree char *reposdir = g_build_filename (cfg_deployment_root, "etc/yum.repos.d", NULL);
 
   /* point libhif to the yum.repos.d and os-release of the merge deployment */
@@ -387,6 +413,14 @@ rpmostree_context_set_allow_empty_transaction (RpmOstreeContext *self, gboolean
   self->allow_empty_transaction = allow;
 }
 
+/* Bound the memory concurrent imports are estimated to use to @budget bytes;
+ * 0 means half of physical memory. */
+void
+rpmostree_context_set_import_memory_budget (RpmOstreeContext *self, guint64 budget)
+{
+  self->import_mem_budget = budget;
+}
+
 void
 rpmostree_context_disable_selinux (RpmOstreeContext *self)
 {
@@ -422,6 +456,54 @@ void
 rpmostree_context_set_sepolicy (RpmOstreeContext *self, OstreeSePolicy *sepolicy)
 {
   g_set_object (&self->sepolicy, sepolicy);
+  g_clear_pointer (&self->sepolicy_file_contexts, g_variant_unref);
+  g_clear_pointer (&self->label_cache, rpmostree_label_cache_free);
+}
+
+/* Returns the label cache for our policy, shared by importing and relabeling,
+ * or %NULL if there's no policy to label with. Main thread only. */
+static RpmOstreeLabelCache *
+get_label_cache (RpmOstreeContext *self)
+{
+  if (!self->sepolicy || ostree_sepolicy_get_name (self->sepolicy) == NULL)
+    return NULL;
+  if (!self->label_cache)
+    self->label_cache = rpmostree_label_cache_new (self->sepolicy);
+  return self->label_cache;
+}
+
+/* Load the file_contexts of the policy given to rpmostree_context_set_sepolicy()
+ * from @rootfs_dfd, the root it was loaded from. Knowing those lets a later
+ * policy change only relabel the cached packages whose labels it affects. */
+gboolean
+rpmostree_context_load_sepolicy_file_contexts (RpmOstreeContext *self, int rootfs_dfd,
+                                               GCancellable *cancellable, GError **error)
+{
+  g_clear_pointer (&self->sepolicy_file_contexts, g_variant_unref);
+  if (!self->sepolicy)
+    return TRUE;
+
+  g_autoptr (GError) local_error = NULL;
+  self->sepolicy_file_contexts
+      = rpmostree_file_contexts_load (rootfs_dfd, self->sepolicy, cancellable, &local_error);
+  if (local_error)
+    {
+      g_propagate_error (error, util::move_nullify (local_error));
+      return glnx_prefix_error (error, "Loading SELinux file contexts");
+    }
+  return TRUE;
+}
+
+/* Remember the file_contexts of our policy in the pkgcache, for when packages
+ * labeled with it need relabeling. Must be called in a transaction. */
+static gboolean
+record_sepolicy_file_contexts (RpmOstreeContext *self, OstreeRepo *repo,
+                               GCancellable *cancellable, GError **error)
+{
+  if (!self->sepolicy || !self->sepolicy_file_contexts)
+    return TRUE;
+  return rpmostree_file_contexts_store (repo, ostree_sepolicy_get_csum (self->sepolicy),
+                                        self->sepolicy_file_contexts, cancellable, error);
 }
 
 void
@@ -833,6 +915,9 @@ rpmostree_context_setup (RpmOstreeContext *self, const char *install_root, const
       if (!self->is_system && ostree_sepolicy_get_name (sepolicy) == NULL)
         return glnx_throw (error, "Unable to load SELinux policy from /");
       rpmostree_context_set_sepolicy (self, sepolicy);
+      if (!rpmostree_context_load_sepolicy_file_contexts (self, host_rootfs_dfd, cancellable,
+                                                          error))
+        return FALSE;
     }
 
   return TRUE;
@@ -880,19 +965,105 @@ get_nevra_relpath (const char *nevra)
   return g_strdup_printf ("metarpm/%s.rpm", nevra);
 }
 
-static char *
-get_package_relpath (DnfPackage *pkg)
+/* An RPM header from the pkgcache. We parse each one at most once, and share
+ * the result between everything in assemble() that needs it (ordering,
+ * scripts, rpmfi overrides, and the rpmdb transaction).
+ */
+typedef struct
 {
-  return get_nevra_relpath (dnf_package_get_nevra (pkg));
+  GVariant *header_v; /* Lead + signature + header, as stored in the pkgcache commit */
+  Header hdr;
+  rpmfiles files;
+} RpmOstreeHeaderCacheEntry;
+
+static void
+header_cache_entry_free (RpmOstreeHeaderCacheEntry *entry)
+{
+  g_clear_pointer (&entry->header_v, g_variant_unref);
+  g_clear_pointer (&entry->hdr, headerFree);
+  g_clear_pointer (&entry->files, rpmfilesFree);
+  g_free (entry);
+}
+
+static RpmOstreeHeaderCacheEntry *
+header_cache_insert (RpmOstreeContext *self, const char *nevra, GVariant *header)
+{
+  if (!self->header_cache)
+    self->header_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify)header_cache_entry_free);
+  auto entry
+      = static_cast<RpmOstreeHeaderCacheEntry *> (g_hash_table_lookup (self->header_cache, nevra));
+  if (entry)
+    return entry;
+  entry = g_new0 (RpmOstreeHeaderCacheEntry, 1);
+  entry->header_v = g_variant_ref (header);
+  g_hash_table_insert (self->header_cache, g_strdup (nevra), entry);
+  return entry;
+}
+
+/* librpm wants to read headers from a file; this makes a new sealed memfd
+ * holding that of @entry. */
+static gboolean
+header_cache_entry_open (RpmOstreeHeaderCacheEntry *entry, const char *nevra, int *out_fd,
+                         GError **error)
+{
+  rust::Slice<const uint8_t> header_slice{
+    static_cast<const guint8 *> (g_variant_get_data (entry->header_v)),
+    g_variant_get_size (entry->header_v)
+  };
+  CXX_TRY_VAR (memfd, rpmostreecxx::sealed_memfd (nevra, header_slice), error);
+  *out_fd = memfd;
+  return TRUE;
+}
+
+/* Return the cached header for @pkg, loading it from the pkgcache commit
+ * metadata and parsing it if we haven't already. */
+static RpmOstreeHeaderCacheEntry *
+header_cache_get (RpmOstreeContext *self, DnfPackage *pkg, GError **error)
+{
+  const char *nevra = dnf_package_get_nevra (pkg);
+  RpmOstreeHeaderCacheEntry *entry = NULL;
+  if (self->header_cache)
+    entry = static_cast<RpmOstreeHeaderCacheEntry *> (
+        g_hash_table_lookup (self->header_cache, nevra));
+  if (!entry)
+    {
+      g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
+      auto cachebranch_rs = rust::Str (cachebranch);
+      OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
+      CXX_TRY_VAR (header, rpmostreecxx::get_header_variant (*pkgcache_repo, cachebranch_rs),
+                   error);
+      g_autoptr (GVariant) header_v = header;
+      entry = header_cache_insert (self, nevra, header_v);
+    }
+
+  if (entry->hdr)
+    return entry;
+
+  glnx_autofd int memfd = -1;
+  if (!header_cache_entry_open (entry, nevra, &memfd, error))
+    return NULL;
+
+  // We just care about reading the stuff librpm wants to put in the database, so no IMA etc.
+  auto flags = rpmostreecxx::rpm_importer_flags_new_empty ();
+  if (!rpmostree_importer_read_metainfo (memfd, *flags, &entry->hdr, NULL, NULL, error))
+    return (RpmOstreeHeaderCacheEntry *)glnx_prefix_error_null (error, "Parsing header for %s",
+                                                                nevra);
+  entry->files = rpmfilesNew (NULL, entry->hdr, RPMTAG_BASENAMES,
+                              RPMFI_FLAGS_QUERY | RPMFI_NOFILESIGNATURES);
+  return entry;
 }
 
-/* We maintain a temporary copy on disk of the RPM header value; librpm will
- * load this dynamically as the txn progresses.
+/* We maintain a temporary copy on disk of the RPM header value for libdnf,
+ * which wants a path to add the package to the sack. Everything else uses the
+ * in-memory header cache.
  */
 static gboolean
 checkout_pkg_metadata (RpmOstreeContext *self, const char *nevra, GVariant *header,
                        GCancellable *cancellable, GError **error)
 {
+  header_cache_insert (self, nevra, header);
+
   if (!rpmostree_context_ensure_tmpdir (self, "metarpm", error))
     return FALSE;
 
@@ -910,20 +1081,6 @@ checkout_pkg_metadata (RpmOstreeContext *self, const char *nevra, GVariant *head
       g_variant_get_size (header), GLNX_FILE_REPLACE_NODATASYNC, cancellable, error);
 }
 
-static gboolean
-checkout_pkg_metadata_by_dnfpkg (RpmOstreeContext *self, DnfPackage *pkg, GCancellable *cancellable,
-                                 GError **error)
-{
-  const char *nevra = dnf_package_get_nevra (pkg);
-  g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
-  auto cachebranch_rs = rust::Str (cachebranch);
-  OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
-  CXX_TRY_VAR (header, rpmostreecxx::get_header_variant (*pkgcache_repo, cachebranch_rs), error);
-  g_autoptr (GVariant) header_v = header;
-
-  return checkout_pkg_metadata (self, nevra, header_v, cancellable, error);
-}
-
 gboolean
 rpmostree_pkgcache_find_pkg_header (OstreeRepo *pkgcache, const char *nevra,
                                     const char *expected_sha256, GVariant **out_header,
@@ -976,6 +1133,8 @@ rpmostree_context_download_metadata (RpmOstreeContext *self, DnfContextSetupSack
 {
   g_assert (!self->empty);
 
+  rpmostreecxx::Phase phase (RPMOSTREE_PHASE_REFRESH_MD);
+
   /* https://github.com/rpm-software-management/libdnf/pull/416
    * https://github.com/projectatomic/rpm-ostree/issues/1127
    * As of libdnf 0.73.0 (commit f1ffeed5), filelists are disabled by default.
@@ -1209,13 +1368,144 @@ pkg_is_cached (DnfPackage *pkg)
   return g_file_test (dnf_package_get_filename (pkg), G_FILE_TEST_EXISTS);
 }
 
+/* A pkgcache commit loaded ahead of time by preload_pkgcache_commits() */
+typedef struct
+{
+  char *cachebranch;
+  char *rev;
+  GVariant *commit;
+  OstreeRepoCommitState commitstate;
+} RpmOstreePkgcacheCommit;
+
+static void
+pkgcache_commit_free (RpmOstreePkgcacheCommit *entry)
+{
+  g_free (entry->cachebranch);
+  g_free (entry->rev);
+  g_clear_pointer (&entry->commit, g_variant_unref);
+  g_free (entry);
+}
+
+/* Below this many packages, resolving each cache branch individually is
+ * cheaper than listing every ref under rpmostree/pkg. */
+#define PKGCACHE_PRELOAD_MIN_PKGS 16
+
+typedef struct
+{
+  OstreeRepo *repo;
+  GPtrArray *entries; /* RpmOstreePkgcacheCommit, not owned */
+  guint next;
+  GCancellable *cancellable;
+  RpmOstreeWorkerPool pool;
+} PkgcachePreloadData;
+
+static void
+preload_pkgcache_commit_in_thread (GTask *task, gpointer source, gpointer task_data,
+                                   GCancellable *cancellable)
+{
+  g_autoptr (GError) local_error = NULL;
+  auto repo = static_cast<OstreeRepo *> (source);
+  auto entry = static_cast<RpmOstreePkgcacheCommit *> (task_data);
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+  if (!ostree_repo_load_commit (repo, entry->rev, &entry->commit, &entry->commitstate,
+                                &local_error))
+    g_task_return_error (task, util::move_nullify (local_error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/* Called on completion of a commit load; runs on main thread */
+static void
+on_preload_pkgcache_commit_done (GObject *obj, GAsyncResult *res, gpointer user_data)
+{
+  auto data = static_cast<PkgcachePreloadData *> (user_data);
+  auto entry = static_cast<RpmOstreePkgcacheCommit *> (g_task_get_task_data (G_TASK (res)));
+  GError *local_error = NULL;
+  if (!g_task_propagate_boolean (G_TASK (res), &local_error))
+    g_prefix_error (&local_error, "Loading pkgcache branch %s: ", entry->cachebranch);
+  rpmostree_worker_pool_job_done (&data->pool, local_error);
+}
+
+static gboolean
+preload_pkgcache_commit_start (RpmOstreeWorkerPool *pool, gpointer user_data,
+                               gboolean *out_started, GError **error)
+{
+  auto data = static_cast<PkgcachePreloadData *> (user_data);
+  *out_started = data->next < data->entries->len;
+  if (!*out_started)
+    return TRUE;
+
+  auto entry = static_cast<RpmOstreePkgcacheCommit *> (data->entries->pdata[data->next++]);
+  g_autoptr (GTask) task
+      = g_task_new (data->repo, data->cancellable, on_preload_pkgcache_commit_done, data);
+  /* The entry is owned by the table, which outlives the pool */
+  g_task_set_task_data (task, entry, NULL);
+  g_task_run_in_thread (task, preload_pkgcache_commit_in_thread);
+  return TRUE;
+}
+
+/* Resolve the pkgcache state of all of @packages in one go: list the
+ * rpmostree/pkg refs once, then load the commits we need on the worker
+ * pool. The returned table maps cache branch to RpmOstreePkgcacheCommit;
+ * packages with no cache branch are simply absent. Returns a NULL table
+ * without error if there is no pkgcache repo or too few packages to bother.
+ */
+static gboolean
+preload_pkgcache_commits (RpmOstreeContext *self, GPtrArray *packages, GHashTable **out_commits,
+                          GCancellable *cancellable, GError **error)
+{
+  *out_commits = NULL;
+  OstreeRepo *repo = get_pkgcache_repo (self);
+  if (repo == NULL || packages->len < PKGCACHE_PRELOAD_MIN_PKGS)
+    return TRUE;
+
+  g_autoptr (GHashTable) refs = NULL;
+  if (!ostree_repo_list_refs_ext (repo, "rpmostree/pkg", &refs, OSTREE_REPO_LIST_REFS_EXT_NONE,
+                                  cancellable, error))
+    return FALSE;
+
+  g_autoptr (GHashTable) commits = g_hash_table_new_full (
+      g_str_hash, g_str_equal, NULL, (GDestroyNotify)pkgcache_commit_free);
+  g_autoptr (GPtrArray) to_load = g_ptr_array_new ();
+  for (guint i = 0; i < packages->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (packages->pdata[i]);
+      g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
+      auto rev = static_cast<const char *> (g_hash_table_lookup (refs, cachebranch));
+      if (!rev || g_hash_table_contains (commits, cachebranch))
+        continue;
+      auto entry = g_new0 (RpmOstreePkgcacheCommit, 1);
+      entry->cachebranch = util::move_nullify (cachebranch);
+      entry->rev = g_strdup (rev);
+      g_hash_table_insert (commits, entry->cachebranch, entry);
+      g_ptr_array_add (to_load, entry);
+    }
+
+  if (to_load->len > 0)
+    {
+      PkgcachePreloadData data = { repo, to_load, 0, cancellable };
+      /* This is mostly metadata I/O, but one thread per CPU is a reasonable bound */
+      rpmostree_worker_pool_init (&data.pool, g_get_num_processors (),
+                                  preload_pkgcache_commit_start, &data);
+      if (!rpmostree_worker_pool_run (&data.pool, error))
+        return FALSE;
+    }
+
+  *out_commits = util::move_nullify (commits);
+  return TRUE;
+}
+
 /* Given @pkg, return its state in the pkgcache repo. It could be not present,
  * or present but have been imported with a different SELinux policy version
- * (and hence in need of relabeling).
+ * (and hence in need of relabeling). If @preloaded is non-NULL, it is the table
+ * from preload_pkgcache_commits() and is used instead of hitting the repo.
  */
 static gboolean
 find_pkg_in_ostree (RpmOstreeContext *self, DnfPackage *pkg, OstreeSePolicy *sepolicy,
-                    gboolean *out_in_ostree, gboolean *out_selinux_match, GError **error)
+                    GHashTable *preloaded, gboolean *out_in_ostree, gboolean *out_selinux_match,
+                    GError **error)
 {
   OstreeRepo *repo = get_pkgcache_repo (self);
   /* Init output here, since we have several early returns */
@@ -1229,23 +1519,35 @@ find_pkg_in_ostree (RpmOstreeContext *self, DnfPackage *pkg, OstreeSePolicy *sep
     return TRUE; /* Note early return */
 
   g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
-  g_autofree char *cached_rev = NULL;
-  if (!ostree_repo_resolve_rev (repo, cachebranch, TRUE, &cached_rev, error))
-    return FALSE;
+  g_autoptr (GVariant) commit = NULL;
+  OstreeRepoCommitState commitstate;
+  if (preloaded)
+    {
+      auto entry
+          = static_cast<RpmOstreePkgcacheCommit *> (g_hash_table_lookup (preloaded, cachebranch));
+      if (!entry)
+        return TRUE; /* Note early return */
+      commit = g_variant_ref (entry->commit);
+      commitstate = entry->commitstate;
+    }
+  else
+    {
+      g_autofree char *cached_rev = NULL;
+      if (!ostree_repo_resolve_rev (repo, cachebranch, TRUE, &cached_rev, error))
+        return FALSE;
 
-  if (!cached_rev)
-    return TRUE; /* Note early return */
+      if (!cached_rev)
+        return TRUE; /* Note early return */
+
+      if (!ostree_repo_load_commit (repo, cached_rev, &commit, &commitstate, error))
+        return glnx_prefix_error (error, "Loading pkgcache branch %s", cachebranch);
+    }
+  g_assert (commit);
 
   /* Below here prefix with the branch */
   const char *errprefix = glnx_strjoina ("Loading pkgcache branch ", cachebranch);
   GLNX_AUTO_PREFIX_ERROR (errprefix, error);
 
-  g_autoptr (GVariant) commit = NULL;
-  OstreeRepoCommitState commitstate;
-  if (!ostree_repo_load_commit (repo, cached_rev, &commit, &commitstate, error))
-    return FALSE;
-  g_assert (commit);
-
   /* If the commit is partial, then we need to redownload. This can happen if e.g. corrupted
    * commit objects were deleted with `ostree fsck --delete`. */
   if (commitstate & OSTREE_REPO_COMMIT_STATE_PARTIAL)
@@ -1349,6 +1651,10 @@ sort_packages (RpmOstreeContext *self, GPtrArray *packages, GCancellable *cancel
   /* make sure all the non-cached pkgs have their repos set */
   rpmostree_set_repos_on_packages (dnfctx, packages);
 
+  g_autoptr (GHashTable) pkgcache_commits = NULL;
+  if (!preload_pkgcache_commits (self, packages, &pkgcache_commits, cancellable, error))
+    return FALSE;
+
   for (guint i = 0; i < packages->len; i++)
     {
       auto pkg = static_cast<DnfPackage *> (packages->pdata[i]);
@@ -1374,7 +1680,8 @@ sort_packages (RpmOstreeContext *self, GPtrArray *packages, GCancellable *cancel
         gboolean selinux_match = FALSE;
         gboolean cached = pkg_is_cached (pkg);
 
-        if (!find_pkg_in_ostree (self, pkg, self->sepolicy, &in_ostree, &selinux_match, error))
+        if (!find_pkg_in_ostree (self, pkg, self->sepolicy, pkgcache_commits, &in_ostree,
+                                 &selinux_match, error))
           return FALSE;
 
         if (is_locally_cached && !self->is_container)
@@ -1777,6 +2084,8 @@ rpmostree_context_prepare (RpmOstreeContext *self, gboolean enable_filelists,
 {
   g_assert (!self->empty);
 
+  rpmostreecxx::Phase phase (RPMOSTREE_PHASE_DEPSOLVE);
+
   DnfContext *dnfctx = self->dnfctx;
 
   auto packages = self->treefile_rs->get_packages ();
@@ -2450,51 +2759,139 @@ rpmostree_find_and_download_packages (const char *const *packages, const char *s
   return TRUE;
 }
 
-gboolean
-rpmostree_context_download (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+/* Print a summary of what we're about to fetch; returns FALSE if there's nothing
+ * to download. */
+static gboolean
+announce_download (RpmOstreeContext *self)
 {
   int n = self->pkgs_to_download->len;
+  if (n == 0)
+    return FALSE;
 
-  if (n > 0)
-    {
-      guint64 size = dnf_package_array_get_download_size (self->pkgs_to_download);
-      g_autofree char *sizestr = g_format_size (size);
-      rpmostree_output_message ("Will download: %u package%s (%s)", n, _NS (n), sizestr);
-    }
-  else
-    return TRUE;
+  guint64 size = dnf_package_array_get_download_size (self->pkgs_to_download);
+  g_autofree char *sizestr = g_format_size (size);
+  rpmostree_output_message ("Will download: %u package%s (%s)", n, _NS (n), sizestr);
 
   // For now just make this a warning for debugging https://github.com/coreos/rpm-ostree/issues/4565
   // It may be that people are actually relying on this behavior too...
   if (self->dnf_cache_policy == RPMOSTREE_CONTEXT_DNF_CACHE_FOREVER)
-    g_printerr ("warning: Found %u packages to download in cache-only mode\n",
-                self->pkgs_to_download->len);
+    g_printerr ("warning: Found %u packages to download in cache-only mode\n", n);
+  return TRUE;
+}
+
+gboolean
+rpmostree_context_download (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+{
+  if (!announce_download (self))
+    return TRUE;
+  rpmostreecxx::Phase phase (RPMOSTREE_PHASE_DOWNLOAD);
   return rpmostree_download_packages (self->pkgs_to_download, cancellable, error);
 }
 
 static gboolean async_imports_mainctx_iter (gpointer user_data);
 
+/* Tell the pipelined download thread (if any) to stop feeding us packages */
+static void
+async_pipeline_abort (RpmOstreeContext *self)
+{
+  if (!self->async_pipelined)
+    return;
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->async_pipeline_lock);
+  self->async_pipeline_aborted = TRUE;
+  g_cond_broadcast (&self->async_pipeline_cond);
+}
+
+/* Fixed cost of an import: libarchive and ostree write buffers, the header */
+#define IMPORT_MEM_BASE (16 * 1024 * 1024)
+
+/* Rough estimate of the peak memory needed to import @pkg. Beyond the fixed
+ * cost, the file lists, rpmfi overrides and mutable tree grow with the
+ * package; the installed size is the best proxy we have without opening it.
+ */
+static guint64
+estimate_import_memory (DnfPackage *pkg)
+{
+  return IMPORT_MEM_BASE + dnf_package_get_installsize (pkg) / 8;
+}
+
+/* Sort packages largest first, so that the longest imports start early
+ * rather than trailing everything else. Ties are broken by NEVRA to keep the
+ * schedule stable. */
+static gint
+compare_pkg_import_size (gconstpointer a, gconstpointer b)
+{
+  auto pkg_a = static_cast<DnfPackage *> (const_cast<gpointer> (a));
+  auto pkg_b = static_cast<DnfPackage *> (const_cast<gpointer> (b));
+  const guint64 size_a = dnf_package_get_installsize (pkg_a);
+  const guint64 size_b = dnf_package_get_installsize (pkg_b);
+  if (size_a != size_b)
+    return size_a > size_b ? -1 : 1;
+  return strcmp (dnf_package_get_nevra (pkg_a), dnf_package_get_nevra (pkg_b));
+}
+
+static gint
+compare_pkg_import_size_indirect (gconstpointer a, gconstpointer b)
+{
+  return compare_pkg_import_size (*(DnfPackage **)a, *(DnfPackage **)b);
+}
+
+static gint
+compare_pkg_import_size_data (gconstpointer a, gconstpointer b, gpointer unused)
+{
+  return compare_pkg_import_size (a, b);
+}
+
+/* Default budget for imports: half of physical memory */
+static guint64
+get_default_import_mem_budget (void)
+{
+  const long pages = sysconf (_SC_PHYS_PAGES);
+  const long pagesize = sysconf (_SC_PAGESIZE);
+  if (pages <= 0 || pagesize <= 0)
+    return G_MAXUINT64;
+  return ((guint64)pages * (guint64)pagesize) / 2;
+}
+
+/* Whether we can start importing @pkg now. We always admit work when nothing
+ * is running, so an oversized package can't stall the queue. */
+static gboolean
+import_fits_budget (RpmOstreeContext *self, DnfPackage *pkg)
+{
+  if (self->async_pool.n_running == 0)
+    return TRUE;
+  return self->async_mem_running + estimate_import_memory (pkg) <= self->async_mem_budget;
+}
+
+typedef struct
+{
+  RpmOstreeContext *self;
+  guint64 mem_estimate;
+} RpmOstreeAsyncImportData;
+
 /* Called on completion of an async import; runs on main thread */
 static void
 on_async_import_done (GObject *obj, GAsyncResult *res, gpointer user_data)
 {
   auto importer = (RpmOstreeImporter *)(obj);
-  auto self = static_cast<RpmOstreeContext *> (user_data);
-  g_autofree char *rev = rpmostree_importer_run_async_finish (
-      importer, res, self->async_error ? NULL : &self->async_error);
+  auto data = static_cast<RpmOstreeAsyncImportData *> (user_data);
+  auto self = data->self;
+  g_assert_cmpuint (self->async_mem_running, >=, data->mem_estimate);
+  self->async_mem_running -= data->mem_estimate;
+  g_free (data);
+  GError *local_error = NULL;
+  g_autofree char *rev = rpmostree_importer_run_async_finish (importer, res, &local_error);
   if (!rev)
     {
       if (self->async_cancellable)
         g_cancellable_cancel (self->async_cancellable);
-      g_assert (self->async_error != NULL);
+      g_assert (local_error != NULL);
+      async_pipeline_abort (self);
     }
 
   g_assert_cmpint (self->n_async_pkgs_imported, <, self->pkgs_to_import->len);
   self->n_async_pkgs_imported++;
-  g_assert_cmpint (self->n_async_running, >, 0);
-  self->n_async_running--;
   self->async_progress->nitems_update (self->n_async_pkgs_imported);
-  async_imports_mainctx_iter (self);
+  rpmostree_worker_pool_job_done (&self->async_pool, local_error);
 }
 
 /* Queue an asynchronous import of a package */
@@ -2516,100 +2913,393 @@ start_async_import_one_package (RpmOstreeContext *self, DnfPackage *pkg, GCancel
       &fd, ostreerepo, pkg, *importer_flags, self->sepolicy, cancellable, error);
   if (!unpacker)
     return glnx_prefix_error (error, "creating importer");
-
-  rpmostree_importer_run_async (unpacker, cancellable, on_async_import_done, self);
+  /* Only packages whose signature consume_package() verified may teach the
+   * content index; see rpmostree-importer.cxx */
+  if (self->async_content_index)
+    rpmostree_importer_set_content_index (unpacker, self->async_content_index,
+                                          dnf_package_get_trusted (pkg));
+  if (auto label_cache = get_label_cache (self))
+    rpmostree_importer_set_label_cache (unpacker, label_cache);
+
+  auto data = g_new0 (RpmOstreeAsyncImportData, 1);
+  data->self = self;
+  data->mem_estimate = estimate_import_memory (pkg);
+  self->async_mem_running += data->mem_estimate;
+  rpmostree_importer_run_async (unpacker, cancellable, on_async_import_done, data);
 
   return TRUE;
 }
 
-/* First function run on mainloop, and called after completion as well. Ensures
- * that we have a bounded number of tasks concurrently executing until
- * finishing.
+/* Return the next package to hand to an importer, or %NULL if none is ready
+ * (yet) or the next one doesn't fit in the memory budget. In pipelined mode,
+ * this pops from the queue fed by the download thread; otherwise it just walks
+ * pkgs_to_import. Both are kept sorted largest first.
  */
-static gboolean
-async_imports_mainctx_iter (gpointer user_data)
+static DnfPackage *
+next_pkg_to_import (RpmOstreeContext *self)
 {
-  auto self = static_cast<RpmOstreeContext *> (user_data);
-
-  while (self->async_index < self->pkgs_to_import->len && self->n_async_running < self->n_async_max
-         && self->async_error == NULL)
+  if (!self->async_pipelined)
     {
+      if (self->async_index >= self->pkgs_to_import->len)
+        return NULL;
       auto pkg = static_cast<DnfPackage *> (self->pkgs_to_import->pdata[self->async_index]);
-      if (!start_async_import_one_package (self, pkg, self->async_cancellable, &self->async_error))
-        {
-          g_cancellable_cancel (self->async_cancellable);
-          break;
-        }
-      self->async_index++;
-      self->n_async_running++;
+      return import_fits_budget (self, pkg) ? pkg : NULL;
     }
 
-  if (self->n_async_running == 0)
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->async_pipeline_lock);
+  auto pkg = static_cast<DnfPackage *> (g_queue_peek_head (&self->async_pipeline_ready));
+  if (!pkg || !import_fits_budget (self, pkg))
+    return NULL;
+  g_queue_pop_head (&self->async_pipeline_ready);
+  g_cond_signal (&self->async_pipeline_cond);
+  return pkg;
+}
+
+static gboolean
+async_import_start (RpmOstreeWorkerPool *pool, gpointer user_data, gboolean *out_started,
+                    GError **error)
+{
+  auto self = static_cast<RpmOstreeContext *> (user_data);
+  auto pkg = next_pkg_to_import (self);
+  *out_started = pkg != NULL;
+  if (!pkg)
+    return TRUE;
+  if (!start_async_import_one_package (self, pkg, self->async_cancellable, error))
     {
-      self->async_running = FALSE;
-      g_main_context_wakeup (g_main_context_get_thread_default ());
+      g_cancellable_cancel (self->async_cancellable);
+      async_pipeline_abort (self);
+      return FALSE;
     }
+  self->async_index++;
+  return TRUE;
+}
 
+/* Called on the main thread whenever the download thread has queued more
+ * packages for import */
+static gboolean
+async_imports_mainctx_iter (gpointer user_data)
+{
+  auto self = static_cast<RpmOstreeContext *> (user_data);
+  rpmostree_worker_pool_iter (&self->async_pool);
   return FALSE;
 }
 
-gboolean
-rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+/* Number of packages the download thread fetches at a time when pipelining */
+#define PIPELINE_DOWNLOAD_BATCH 8
+
+/* Shows the download thread's progress next to the import progress; runs on
+ * the main thread, since that's where output goes. */
+static gboolean
+pipelined_download_progress_mainctx (gpointer user_data)
 {
-  DnfContext *dnfctx = self->dnfctx;
-  const int n = self->pkgs_to_import->len;
-  if (n == 0)
-    return TRUE;
+  auto self = static_cast<RpmOstreeContext *> (user_data);
+  const gint percent = g_atomic_int_get (&self->async_pipeline_download_percent);
+  if (self->async_progress && percent != self->async_pipeline_download_percent_shown)
+    {
+      g_autofree char *msg = g_strdup_printf ("downloaded %d%%", percent);
+      self->async_progress->set_sub_message (msg);
+      self->async_pipeline_download_percent_shown = percent;
+    }
+  return FALSE;
+}
 
-  OstreeRepo *repo = get_pkgcache_repo (self);
-  g_assert (repo != NULL);
+typedef struct
+{
+  RpmOstreeContext *self;
+  GMainContext *mainctx;
+  guint64 done_size;  /* Bytes in batches already downloaded */
+  guint64 batch_size; /* Bytes in the batch being downloaded */
+} PipelinedDownloadProgress;
 
-  if (!dnf_transaction_import_keys (dnf_context_get_transaction (dnfctx), error))
-    return FALSE;
+/* Runs in the download thread */
+static void
+on_pipelined_download_percentage_changed (DnfState *hifstate, guint percentage, gpointer user_data)
+{
+  auto data = static_cast<PipelinedDownloadProgress *> (user_data);
+  RpmOstreeContext *self = data->self;
+  const guint64 total = MAX (self->async_pipeline_download_size, 1);
+  const guint64 done = data->done_size + data->batch_size * percentage / 100;
+  const gint percent = static_cast<gint> (MIN (done * 100 / total, 100));
+  if (g_atomic_int_get (&self->async_pipeline_download_percent) == percent)
+    return;
+  g_atomic_int_set (&self->async_pipeline_download_percent, percent);
+  g_main_context_invoke (data->mainctx, pipelined_download_progress_mainctx, self);
+}
 
-  g_auto (RpmOstreeRepoAutoTransaction) txn = {
-    0,
-  };
-  /* Note use of commit-on-failure */
-  if (!rpmostree_repo_auto_transaction_start (&txn, repo, TRUE, cancellable, error))
+/* Download @batch, which all come from @src, and queue them for import. Runs
+ * in the download thread. */
+static gboolean
+pipelined_download_batch (RpmOstreeContext *self, PipelinedDownloadProgress *progress,
+                          GHashTable *target_dirs, DnfRepo *src, GPtrArray *batch,
+                          GCancellable *cancellable, GError **error)
+{
+  auto target_dir = static_cast<const char *> (g_hash_table_lookup (target_dirs, src));
+  if (!target_dir)
+    {
+      char *dir = g_build_filename (dnf_repo_get_location (src), "/packages/", NULL);
+      g_hash_table_insert (target_dirs, src, dir);
+      if (!glnx_shutil_mkdir_p_at (AT_FDCWD, dir, 0755, cancellable, error))
+        return FALSE;
+      target_dir = dir;
+    }
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
 
-  self->async_running = TRUE;
-  self->async_index = 0;
-  self->n_async_running = 0;
-  /* We're CPU bound, so just use processors */
-  self->n_async_max = g_get_num_processors ();
-  self->async_cancellable = cancellable;
+  progress->batch_size = dnf_package_array_get_download_size (batch);
+  glnx_unref_object DnfState *hifstate = dnf_state_new ();
+  g_signal_connect (hifstate, "percentage-changed",
+                    G_CALLBACK (on_pipelined_download_percentage_changed), progress);
+  if (!dnf_repo_download_packages (src, batch, target_dir, hifstate, error))
+    return glnx_prefix_error (error, "Downloading from '%s'", dnf_repo_get_id (src));
+  progress->done_size += progress->batch_size;
 
-  self->async_progress
-      = rpmostreecxx::progress_nitems_begin (self->pkgs_to_import->len, "Importing packages");
-
-  /* Process imports */
-  GMainContext *mainctx = g_main_context_get_thread_default ();
   {
-    g_autoptr (GSource) src = g_timeout_source_new (0);
-    g_source_set_priority (src, G_PRIORITY_HIGH);
-    g_source_set_callback (src, async_imports_mainctx_iter, self, NULL);
-    g_source_attach (src, mainctx); /* Note takes a ref */
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->async_pipeline_lock);
+    for (guint i = 0; i < batch->len; i++)
+      g_queue_insert_sorted (&self->async_pipeline_ready, batch->pdata[i],
+                             compare_pkg_import_size_data, NULL);
   }
+  /* NB: this is dispatched at the same priority as the task completion
+   * below, so it's guaranteed to run before the import loop exits. */
+  g_main_context_invoke (progress->mainctx, async_imports_mainctx_iter, self);
+  return TRUE;
+}
+
+/* Runs in a worker thread; walks pkgs_to_download (sorted largest first) in
+ * windows of the next largest packages, whatever repo they come from. Each
+ * window is fetched with one librepo call per repo, so that librepo can
+ * download a repo's packages in parallel, and each call's packages are queued
+ * for import as soon as it's complete. Blocks while the import queue is full,
+ * so we don't race arbitrarily far ahead of the importers.
+ */
+static gboolean
+pipelined_download_impl (RpmOstreeContext *self, GMainContext *mainctx, GCancellable *cancellable,
+                         GError **error)
+{
+  PipelinedDownloadProgress progress = { self, mainctx, 0, 0 };
+  g_autoptr (GHashTable) target_dirs = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+  GPtrArray *pkgs = self->pkgs_to_download;
+  for (guint i = 0; i < pkgs->len;)
+    {
+      g_autoptr (GPtrArray) window = g_ptr_array_sized_new (PIPELINE_DOWNLOAD_BATCH);
+      for (; i < pkgs->len && window->len < PIPELINE_DOWNLOAD_BATCH; i++)
+        {
+          auto pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
+          /* ignore local packages */
+          if (!rpmostree_pkg_is_local (pkg))
+            g_ptr_array_add (window, pkg);
+        }
+
+      {
+        g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->async_pipeline_lock);
+        while (self->async_pipeline_ready.length >= self->async_pipeline_max_ready
+               && !self->async_pipeline_aborted)
+          g_cond_wait (&self->async_pipeline_cond, &self->async_pipeline_lock);
+        /* The main thread already has an error to report */
+        if (self->async_pipeline_aborted)
+          return TRUE;
+      }
+
+      /* Split the window by repo, starting with the repo of its largest package */
+      for (guint j = 0; j < window->len; j++)
+        {
+          auto first = static_cast<DnfPackage *> (window->pdata[j]);
+          if (!first)
+            continue;
+          DnfRepo *src = dnf_package_get_repo (first);
+          g_assert (src);
+          g_autoptr (GPtrArray) batch = g_ptr_array_sized_new (window->len - j);
+          for (guint k = j; k < window->len; k++)
+            {
+              auto pkg = static_cast<DnfPackage *> (window->pdata[k]);
+              if (pkg && dnf_package_get_repo (pkg) == src)
+                {
+                  g_ptr_array_add (batch, pkg);
+                  window->pdata[k] = NULL;
+                }
+            }
+
+          if (!pipelined_download_batch (self, &progress, target_dirs, src, batch, cancellable,
+                                         error))
+            return FALSE;
+
+          g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->async_pipeline_lock);
+          if (self->async_pipeline_aborted)
+            return TRUE;
+        }
+    }
+
+  return TRUE;
+}
 
-  self->async_error = NULL;
-  while (self->async_running)
-    g_main_context_iteration (mainctx, TRUE);
-  if (self->async_error)
+static void
+pipelined_download_in_thread (GTask *task, gpointer source, gpointer task_data,
+                              GCancellable *cancellable)
+{
+  g_autoptr (GError) local_error = NULL;
+  auto self = static_cast<RpmOstreeContext *> (source);
+  auto mainctx = static_cast<GMainContext *> (task_data);
+
+  if (!pipelined_download_impl (self, mainctx, cancellable, &local_error))
+    g_task_return_error (task, util::move_nullify (local_error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/* Called when the download thread exits; runs on main thread */
+static void
+on_pipelined_download_done (GObject *obj, GAsyncResult *res, gpointer user_data)
+{
+  auto self = static_cast<RpmOstreeContext *> (user_data);
+  GError *local_error = NULL;
+  if (!g_task_propagate_boolean (G_TASK (res), &local_error))
     {
-      g_propagate_error (error, util::move_nullify (self->async_error));
-      return glnx_prefix_error (error, "importing RPMs");
+      if (self->async_cancellable)
+        g_cancellable_cancel (self->async_cancellable);
     }
 
+  self->async_pipeline_downloading = FALSE;
+  rpmostree_output_phase_end (RPMOSTREE_PHASE_DOWNLOAD);
+  /* If an import already failed, that's the more interesting error */
+  rpmostree_worker_pool_release (&self->async_pool, local_error);
+}
+
+/* Say what we're about to do; the full order (largest first) is logged at debug level */
+static void
+print_import_schedule (RpmOstreeContext *self)
+{
+  g_autofree char *budget = self->async_mem_budget == G_MAXUINT64
+                                ? g_strdup ("unlimited")
+                                : g_format_size (self->async_mem_budget);
+  g_autoptr (GString) largest = g_string_new ("");
+  const guint n_shown = MIN (self->pkgs_to_import->len, 3);
+  for (guint i = 0; i < n_shown; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (self->pkgs_to_import->pdata[i]);
+      g_string_append_printf (largest, "%s%s", i > 0 ? ", " : "", dnf_package_get_name (pkg));
+    }
+  rpmostree_output_message (
+      "Importing %u package%s, up to %u at a time, memory budget %s; largest: %s",
+      self->pkgs_to_import->len, _NS (self->pkgs_to_import->len), self->async_pool.n_max, budget,
+      largest->str);
+
+  for (guint i = 0; i < self->pkgs_to_import->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (self->pkgs_to_import->pdata[i]);
+      g_autofree char *size = g_format_size (dnf_package_get_installsize (pkg));
+      g_debug ("Import schedule: %s (%s)", dnf_package_get_nevra (pkg), size);
+    }
+}
+
+static gboolean
+import_packages (RpmOstreeContext *self, gboolean pipelined, GCancellable *cancellable,
+                 GError **error)
+{
+  DnfContext *dnfctx = self->dnfctx;
+  const int n = self->pkgs_to_import->len;
+  if (n == 0)
+    return TRUE;
+
+  OstreeRepo *repo = get_pkgcache_repo (self);
+  g_assert (repo != NULL);
+
+  rpmostreecxx::Phase phase (RPMOSTREE_PHASE_IMPORT);
+
+  if (!dnf_transaction_import_keys (dnf_context_get_transaction (dnfctx), error))
+    return FALSE;
+
+  self->async_mem_budget = self->import_mem_budget ?: get_default_import_mem_budget ();
+
+  g_auto (RpmOstreeRepoAutoTransaction) txn = {
+    0,
+  };
+  /* Note use of commit-on-failure */
+  if (!rpmostree_repo_auto_transaction_start (&txn, repo, TRUE, cancellable, error))
+    return FALSE;
+
+  /* Lets importers skip rewriting files unchanged from previously imported packages */
+  g_autoptr (RpmOstreeContentIndex) content_index
+      = rpmostree_content_index_load (repo, cancellable, error);
+  if (!content_index)
+    return glnx_prefix_error (error, "Loading content index");
+  self->async_content_index = content_index;
+
+  self->async_index = 0;
+  /* We're CPU bound, so just use processors */
+  rpmostree_worker_pool_init (&self->async_pool, g_get_num_processors (), async_import_start,
+                              self);
+  self->async_cancellable = cancellable;
+  self->async_mem_running = 0;
+
+  /* Start the biggest imports first; in pipelined mode also download them first */
+  g_ptr_array_sort (self->pkgs_to_import, compare_pkg_import_size_indirect);
+  if (pipelined)
+    g_ptr_array_sort (self->pkgs_to_download, compare_pkg_import_size_indirect);
+  print_import_schedule (self);
+
+  GMainContext *mainctx = g_main_context_get_thread_default ();
+  self->async_pipelined = pipelined;
+  if (pipelined)
+    {
+      /* Everything which doesn't need downloading is ready to go right away */
+      g_autoptr (GHashTable) downloading = g_hash_table_new (NULL, NULL);
+      for (guint i = 0; i < self->pkgs_to_download->len; i++)
+        g_hash_table_add (downloading, self->pkgs_to_download->pdata[i]);
+      g_queue_clear (&self->async_pipeline_ready);
+      for (guint i = 0; i < self->pkgs_to_import->len; i++)
+        {
+          gpointer pkg = self->pkgs_to_import->pdata[i];
+          /* pkgs_to_import is sorted, so this keeps the queue sorted too */
+          if (!g_hash_table_contains (downloading, pkg))
+            g_queue_push_tail (&self->async_pipeline_ready, pkg);
+        }
+      self->async_pipeline_max_ready
+          = MAX (self->async_pipeline_ready.length,
+                 self->async_pool.n_max + PIPELINE_DOWNLOAD_BATCH);
+      self->async_pipeline_aborted = FALSE;
+      self->async_pipeline_downloading = TRUE;
+      self->async_pipeline_download_size
+          = dnf_package_array_get_download_size (self->pkgs_to_download);
+      self->async_pipeline_download_percent = 0;
+      self->async_pipeline_download_percent_shown = -1;
+
+      /* We also need to wait for the download thread to exit (which it will do
+       * promptly on error) since it references our state. */
+      rpmostree_worker_pool_hold (&self->async_pool);
+      rpmostree_output_phase_begin (RPMOSTREE_PHASE_DOWNLOAD);
+      g_autoptr (GTask) task = g_task_new (self, cancellable, on_pipelined_download_done, self);
+      g_task_set_task_data (task, g_main_context_ref (mainctx),
+                            (GDestroyNotify)g_main_context_unref);
+      g_task_run_in_thread (task, pipelined_download_in_thread);
+    }
+
+  self->async_progress = rpmostreecxx::progress_nitems_begin (
+      self->pkgs_to_import->len,
+      pipelined ? "Downloading and importing packages" : "Importing packages");
+
+  /* Process imports */
+  const gboolean imported = rpmostree_worker_pool_run (&self->async_pool, error);
+  self->async_pipelined = FALSE;
+  self->async_content_index = NULL;
+  g_queue_clear (&self->async_pipeline_ready);
+  if (!imported)
+    return glnx_prefix_error (error, "importing RPMs");
+
   g_autofree char *import_done_msg = g_strdup_printf ("done: %u", self->pkgs_to_import->len);
   self->async_progress->end (import_done_msg);
   self->async_progress.release ();
 
+  if (!record_sepolicy_file_contexts (self, repo, cancellable, error))
+    return FALSE;
+
   if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
     return FALSE;
   txn.initialized = FALSE;
 
+  if (!rpmostree_content_index_save (content_index, cancellable, error))
+    return FALSE;
+
   sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
                    SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_PKG_IMPORT), "MESSAGE=Imported %u pkg%s",
                    n, _NS (n), "IMPORTED_N_PKGS=%u", n, NULL);
@@ -2617,6 +3307,27 @@ rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GEr
   return TRUE;
 }
 
+gboolean
+rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable, GError **error)
+{
+  return import_packages (self, FALSE, cancellable, error);
+}
+
+/* Equivalent to rpmostree_context_download() followed by
+ * rpmostree_context_import(), except the two are overlapped: packages are
+ * downloaded in a worker thread and each one is handed to an importer as soon
+ * as it's on disk, rather than keeping either the network or the CPUs idle
+ * while the other phase runs.
+ */
+gboolean
+rpmostree_context_download_and_import (RpmOstreeContext *self, GCancellable *cancellable,
+                                       GError **error)
+{
+  if (!announce_download (self))
+    return import_packages (self, FALSE, cancellable, error);
+  return import_packages (self, TRUE, cancellable, error);
+}
+
 /* Given a single package, verify its GPG signature (if enabled), open a file
  * descriptor for it, and delete the on-disk downloaded copy.
  */
@@ -2680,6 +3391,129 @@ canonicalize_non_usrmove_path (RpmOstreeContext *self, const char *path)
   return g_build_filename (link, slash + 1, NULL);
 }
 
+/* Canonicalize an rpmfi path for the purposes of detecting packages which might
+ * write the same file. This deliberately errs on the side of folding paths
+ * together (e.g. /sbin and /usr/bin), since a false positive only costs us some
+ * checkout parallelism.
+ */
+static char *
+overlap_key_for_rpmfi_path (const char *path)
+{
+  path += strspn (path, "/");
+  g_autofree char *usrpath = NULL;
+  const char *usrmove_dirs[] = { "bin/", "sbin/", "lib/", "lib64/" };
+  for (guint i = 0; i < G_N_ELEMENTS (usrmove_dirs); i++)
+    {
+      if (g_str_has_prefix (path, usrmove_dirs[i]))
+        {
+          path = usrpath = g_strconcat ("usr/", path, NULL);
+          break;
+        }
+    }
+  if (g_str_has_prefix (path, "usr/sbin/"))
+    return g_strconcat ("usr/bin/", path + strlen ("usr/sbin/"), NULL);
+  return g_strdup (path);
+}
+
+/* Who ships a path, for detecting packages which can't be checked out
+ * concurrently */
+typedef struct
+{
+  DnfPackage *pkg;    /* First package to ship it */
+  guint32 mode;       /* Including file type */
+  const char *user;   /* Interned */
+  const char *group;  /* Interned */
+  GPtrArray *sharers; /* Other packages shipping the same directory */
+  gboolean conflicted;
+} OverlapEntry;
+
+static void
+overlap_entry_free (OverlapEntry *entry)
+{
+  g_clear_pointer (&entry->sharers, g_ptr_array_unref);
+  g_free (entry);
+}
+
+/* Record that @pkg ships the path with overlap key @key (taking ownership).
+ * Two packages shipping the same non-directory path conflict. Directories
+ * can be shared, as long as every package gives them the same metadata, so
+ * that it doesn't matter which checkout creates them. Otherwise, all the
+ * packages shipping it go in @pkgs_overlapping, since they are checked out in
+ * order then.
+ */
+static void
+record_overlap_path (GHashTable *path_to_entry, GHashTable *pkgs_overlapping, char *key,
+                     DnfPackage *pkg, guint32 mode, const char *user, const char *group)
+{
+  auto entry = static_cast<OverlapEntry *> (g_hash_table_lookup (path_to_entry, key));
+  if (!entry)
+    {
+      entry = g_new0 (OverlapEntry, 1);
+      entry->pkg = pkg;
+      entry->mode = mode;
+      entry->user = user;
+      entry->group = group;
+      g_hash_table_insert (path_to_entry, key, entry);
+      return;
+    }
+  g_free (key);
+
+  /* Packages are walked one at a time, so this is one we've already seen */
+  if (entry->pkg == pkg || (entry->sharers && entry->sharers->len > 0
+                            && entry->sharers->pdata[entry->sharers->len - 1] == pkg))
+    return;
+
+  if (!entry->conflicted && S_ISDIR (mode) && entry->mode == mode && entry->user == user
+      && entry->group == group)
+    {
+      if (!entry->sharers)
+        entry->sharers = g_ptr_array_new ();
+      g_ptr_array_add (entry->sharers, pkg);
+      return;
+    }
+
+  if (!entry->conflicted)
+    {
+      g_hash_table_add (pkgs_overlapping, entry->pkg);
+      for (guint i = 0; entry->sharers && i < entry->sharers->len; i++)
+        g_hash_table_add (pkgs_overlapping, entry->sharers->pdata[i]);
+      g_clear_pointer (&entry->sharers, g_ptr_array_unref);
+      entry->conflicted = TRUE;
+    }
+  g_hash_table_add (pkgs_overlapping, pkg);
+}
+
+/* Record the path of @fi for @pkg, as well as its parent directories, which
+ * the importer creates for any the package doesn't ship itself. @pkg_dirs
+ * holds the overlap keys of the directories recorded for @pkg so far. */
+static void
+record_overlap_rpmfi (GHashTable *path_to_entry, GHashTable *pkgs_overlapping, GHashTable *pkg_dirs,
+                      DnfPackage *pkg, rpmfi fi)
+{
+  const guint32 mode = rpmfiFMode (fi);
+  g_autofree char *key = overlap_key_for_rpmfi_path (rpmfiFN (fi));
+  if (S_ISDIR (mode))
+    {
+      /* File lists are sorted, so this normally comes before anything in it;
+       * if not, the importer's default metadata for it was already recorded
+       * and we go with that. */
+      if (!g_hash_table_add (pkg_dirs, g_strdup (key)))
+        return;
+    }
+  record_overlap_path (path_to_entry, pkgs_overlapping, g_strdup (key), pkg, mode,
+                       g_intern_string (rpmfiFUser (fi)), g_intern_string (rpmfiFGroup (fi)));
+
+  const char *root = g_intern_static_string ("root");
+  for (char *slash = strrchr (key, '/'); slash; slash = strrchr (key, '/'))
+    {
+      *slash = '\0';
+      if (!g_hash_table_add (pkg_dirs, g_strdup (key)))
+        break;
+      record_overlap_path (path_to_entry, pkgs_overlapping, g_strdup (key), pkg, S_IFDIR | 0755,
+                           root, root);
+    }
+}
+
 static void
 ht_insert_path_for_nevra (GHashTable *ht, const char *nevra, char *path, gpointer v)
 {
@@ -2699,11 +3533,17 @@ ht_insert_path_for_nevra (GHashTable *ht, const char *nevra, char *path, gpointe
  * - if adding a pkg owning a file that already exists in the base (or another added pkg),
  *   and they are both "coloured", we need to pick the preferred one
  *
+ * While we're walking the added files, we also compute the set of added packages
+ * which ship a path that another added package (other than @checked_out_pkg,
+ * which is already in the rootfs) also ships, except for directories they agree
+ * on the metadata of; the rest can be checked out in any order.
+ *
  * The librpm functions and APIs for these are unfortunately private since they're just run
  * as part of rpmtsRun(). XXX: see if we can make the rpmfs APIs public. */
 static gboolean
 handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
-                          GHashTable **out_files_skip_add, GHashTable **out_files_skip_delete,
+                          DnfPackage *checked_out_pkg, GHashTable **out_files_skip_add,
+                          GHashTable **out_files_skip_delete, GHashTable **out_pkgs_overlapping,
                           GCancellable *cancellable, GError **error)
 {
   /* we deal with color similarly to librpm (compare with skipInstallFiles()) */
@@ -2717,6 +3557,9 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
       g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   g_autoptr (GHashTable) files_added = /* map{nevra -> map{path -> color}} */
       g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_hash_table_unref);
+  g_autoptr (GHashTable) path_to_entry = /* map{overlap key -> OverlapEntry} */
+      g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)overlap_entry_free);
+  g_autoptr (GHashTable) pkgs_overlapping = g_hash_table_new (NULL, NULL);
 
   /* first pass to just collect added and removed files */
   const guint n_rpmts_elements = (guint)rpmtsNElements (ts);
@@ -2739,8 +3582,13 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
         {
           DnfPackage *pkg = (DnfPackage *)rpmteKey (te);
           const char *nevra = dnf_package_get_nevra (pkg);
+          g_autoptr (GHashTable) pkg_dirs
+              = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
           while (rpmfiNext (fi) >= 0)
             {
+              if (pkg != checked_out_pkg)
+                record_overlap_rpmfi (path_to_entry, pkgs_overlapping, pkg_dirs, pkg, fi);
+
               rpm_color_t color = rpmfiFColor (fi);
               if (color)
                 {
@@ -2880,6 +3728,7 @@ handle_file_dispositions (RpmOstreeContext *self, int tmprootfs_dfd, rpmts ts,
 
   *out_files_skip_add = util::move_nullify (files_skip_add);
   *out_files_skip_delete = util::move_nullify (files_skip_delete);
+  *out_pkgs_overlapping = util::move_nullify (pkgs_overlapping);
   return TRUE;
 }
 
@@ -2961,11 +3810,36 @@ checkout_package (OstreeRepo *repo, int dfd, const char *path, OstreeRepoDevInoC
   return ostree_repo_checkout_at (repo, &opts, dfd, path, pkg_commit, cancellable, error);
 }
 
+/* The below is currently needed only in the --unified-core path. We probably want to
+ * migrate that over to always use a separate cache repo eventually, which would allow us
+ * to completely drop the pkgcache_repo/ostreerepo dichotomy in the core. See:
+ * https://github.com/projectatomic/rpm-ostree/pull/1055 */
 static gboolean
-checkout_package_into_root (RpmOstreeContext *self, DnfPackage *pkg, int dfd, const char *path,
-                            OstreeRepoDevInoCache *devino_cache, const char *pkg_commit,
-                            GHashTable *files_skip, OstreeRepoCheckoutOverwriteMode ovwmode,
-                            GCancellable *cancellable, GError **error)
+link_package_content (RpmOstreeContext *self, DnfPackage *pkg, const char *pkg_commit,
+                      GCancellable *cancellable, GError **error)
+{
+  OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
+  if (pkgcache_repo == self->ostreerepo)
+    return TRUE;
+
+  if (!rpmostree_pull_content_only (self->ostreerepo, pkgcache_repo, pkg_commit, cancellable,
+                                    error))
+    {
+      g_prefix_error (error, "Linking cached content for %s: ", dnf_package_get_nevra (pkg));
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Check out @pkg's content, assuming link_package_content() was already done.
+ * This is safe to call from worker threads, as long as @devino_cache is %NULL
+ * (it isn't threadsafe). */
+static gboolean
+checkout_package_files_into_root (RpmOstreeContext *self, DnfPackage *pkg, int dfd,
+                                  const char *path, OstreeRepoDevInoCache *devino_cache,
+                                  const char *pkg_commit, GHashTable *files_skip,
+                                  OstreeRepoCheckoutOverwriteMode ovwmode,
+                                  GCancellable *cancellable, GError **error)
 {
   /* If called on compose-side, there may be files to remove from packages specified in the
    * treefile. */
@@ -2983,33 +3857,144 @@ checkout_package_into_root (RpmOstreeContext *self, DnfPackage *pkg, int dfd, co
       g_ptr_array_add (files_remove_regex, regex);
     }
 
-  OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
-
-  /* The below is currently TRUE only in the --unified-core path. We probably want to
-   * migrate that over to always use a separate cache repo eventually, which would allow us
-   * to completely drop the pkgcache_repo/ostreerepo dichotomy in the core. See:
-   * https://github.com/projectatomic/rpm-ostree/pull/1055 */
-  if (pkgcache_repo != self->ostreerepo)
-    {
-      if (!rpmostree_pull_content_only (self->ostreerepo, pkgcache_repo, pkg_commit, cancellable,
-                                        error))
-        {
-          g_prefix_error (error, "Linking cached content for %s: ", dnf_package_get_nevra (pkg));
-          return FALSE;
-        }
-    }
-
   GHashTable *pkg_files_skip = NULL;
   if (files_skip != NULL)
     pkg_files_skip
         = static_cast<GHashTable *> (g_hash_table_lookup (files_skip, dnf_package_get_nevra (pkg)));
-  if (!checkout_package (pkgcache_repo, dfd, path, devino_cache, pkg_commit, pkg_files_skip,
-                         files_remove_regex, ovwmode, !self->enable_rofiles, cancellable, error))
+  if (!checkout_package (get_pkgcache_repo (self), dfd, path, devino_cache, pkg_commit,
+                         pkg_files_skip, files_remove_regex, ovwmode, !self->enable_rofiles,
+                         cancellable, error))
     return glnx_prefix_error (error, "Checkout %s", dnf_package_get_nevra (pkg));
 
   return TRUE;
 }
 
+static gboolean
+checkout_package_into_root (RpmOstreeContext *self, DnfPackage *pkg, int dfd, const char *path,
+                            OstreeRepoDevInoCache *devino_cache, const char *pkg_commit,
+                            GHashTable *files_skip, OstreeRepoCheckoutOverwriteMode ovwmode,
+                            GCancellable *cancellable, GError **error)
+{
+  if (!link_package_content (self, pkg, pkg_commit, cancellable, error))
+    return FALSE;
+  return checkout_package_files_into_root (self, pkg, dfd, path, devino_cache, pkg_commit,
+                                           files_skip, ovwmode, cancellable, error);
+}
+
+typedef struct
+{
+  DnfPackage *pkg;
+  const char *commit;
+  GHashTable *files_skip;
+} CheckoutTaskData;
+
+static void
+checkout_in_thread (GTask *task, gpointer source, gpointer task_data, GCancellable *cancellable)
+{
+  g_autoptr (GError) local_error = NULL;
+  auto self = static_cast<RpmOstreeContext *> (source);
+  auto tdata = static_cast<CheckoutTaskData *> (task_data);
+
+  rpmostreecxx::TraceSpan span ("checkout", dnf_package_get_name (tdata->pkg));
+  if (!checkout_package_files_into_root (self, tdata->pkg, self->tmprootfs_dfd, ".", NULL,
+                                         tdata->commit, tdata->files_skip,
+                                         OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_IDENTICAL,
+                                         cancellable, &local_error))
+    g_task_return_error (task, util::move_nullify (local_error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+typedef struct
+{
+  RpmOstreeContext *self;
+  GPtrArray *pkgs;
+  GHashTable *pkg_to_ostree_commit;
+  GHashTable *files_skip;
+  rpmostreecxx::Progress *progress;
+  guint *n_done;
+} RpmOstreeAsyncCheckoutData;
+
+/* Called on completion of a parallel checkout; runs on main thread */
+static void
+on_async_checkout_done (GObject *obj, GAsyncResult *res, gpointer user_data)
+{
+  auto data = static_cast<RpmOstreeAsyncCheckoutData *> (user_data);
+  RpmOstreeContext *self = data->self;
+  auto tdata = static_cast<CheckoutTaskData *> (g_task_get_task_data (G_TASK (res)));
+  GError *local_error = NULL;
+  if (!g_task_propagate_boolean (G_TASK (res), &local_error))
+    {
+      if (self->async_cancellable)
+        g_cancellable_cancel (self->async_cancellable);
+    }
+
+  (*data->n_done)++;
+  data->progress->set_sub_message (dnf_package_get_name (tdata->pkg));
+  data->progress->nitems_update (*data->n_done);
+  rpmostree_worker_pool_job_done (&self->async_pool, local_error);
+}
+
+static gboolean
+async_checkout_start (RpmOstreeWorkerPool *pool, gpointer user_data, gboolean *out_started,
+                      GError **error)
+{
+  auto data = static_cast<RpmOstreeAsyncCheckoutData *> (user_data);
+  RpmOstreeContext *self = data->self;
+  *out_started = self->async_index < data->pkgs->len;
+  if (!*out_started)
+    return TRUE;
+
+  auto pkg = static_cast<DnfPackage *> (data->pkgs->pdata[self->async_index++]);
+  g_autoptr (GTask) task = g_task_new (self, self->async_cancellable, on_async_checkout_done, data);
+  CheckoutTaskData *tdata = g_new0 (CheckoutTaskData, 1);
+  /* We can assume lifetime is greater than the task */
+  tdata->pkg = pkg;
+  tdata->commit = static_cast<const char *> (g_hash_table_lookup (data->pkg_to_ostree_commit, pkg));
+  tdata->files_skip = data->files_skip;
+  g_task_set_task_data (task, tdata, g_free);
+  g_task_run_in_thread (task, checkout_in_thread);
+  return TRUE;
+}
+
+/* Check out @pkgs into the rootfs concurrently. The caller must have verified that
+ * none of them ship a path that another package in the transaction also ships
+ * (other than directories with identical metadata), since then the result
+ * would depend on ordering.
+ *
+ * The devino cache isn't threadsafe, so these checkouts don't use it; the
+ * rootfs commit checksums their files instead.
+ */
+static gboolean
+checkout_packages_parallel (RpmOstreeContext *self, GPtrArray *pkgs,
+                            GHashTable *pkg_to_ostree_commit, GHashTable *files_skip,
+                            rpmostreecxx::Progress &progress, guint *n_done,
+                            GCancellable *cancellable, GError **error)
+{
+  if (pkgs->len == 0)
+    return TRUE;
+
+  /* Pulling into the target repo isn't something we want to do concurrently */
+  for (guint i = 0; i < pkgs->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
+      auto commit = static_cast<const char *> (g_hash_table_lookup (pkg_to_ostree_commit, pkg));
+      if (!link_package_content (self, pkg, commit, cancellable, error))
+        return FALSE;
+    }
+
+  RpmOstreeAsyncCheckoutData data = {
+    self, pkgs, pkg_to_ostree_commit, files_skip, &progress, n_done,
+  };
+  self->async_index = 0;
+  /* This is mostly metadata I/O, but one thread per CPU is a reasonable bound */
+  rpmostree_worker_pool_init (&self->async_pool, g_get_num_processors (), async_checkout_start,
+                              &data);
+  self->async_cancellable = cancellable;
+
+  return rpmostree_worker_pool_run (&self->async_pool, error);
+}
+
 static Header
 get_rpmdb_pkg_header (rpmts rpmdb_ts, DnfPackage *pkg, GCancellable *cancellable, GError **error)
 {
@@ -3233,12 +4218,127 @@ typedef struct
   const char *name;
   const char *evr;
   const char *arch;
+  RpmOstreeFileContextsDiff *diff; /* Borrowed; NULL if everything must be relabeled */
+  RpmOstreeLabelCache *label_cache; /* Borrowed */
+  gboolean restamped;
 } RelabelTaskData;
 
+/* Commit @root as the new version of @cachebranch, with the metadata of
+ * @orig_commit updated for our policy. */
+static gboolean
+write_relabeled_commit (RpmOstreeContext *self, OstreeRepo *repo, const char *cachebranch,
+                        GVariant *orig_commit, GFile *root, char **out_commit_csum,
+                        GCancellable *cancellable, GError **error)
+{
+  /* let's just copy the metadata from the previous commit and only change the
+   * rpmostree.sepolicy value */
+  g_autoptr (GVariant) meta = g_variant_get_child_value (orig_commit, 0);
+  g_autoptr (GVariantDict) meta_dict = g_variant_dict_new (meta);
+
+  g_variant_dict_insert (meta_dict, "rpmostree.sepolicy", "s",
+                         ostree_sepolicy_get_csum (self->sepolicy));
+
+  g_autofree char *new_commit_csum = NULL;
+  if (!ostree_repo_write_commit (repo, NULL, "", "", g_variant_dict_end (meta_dict),
+                                 OSTREE_REPO_FILE (root), &new_commit_csum, cancellable, error))
+    return FALSE;
+
+  /* Queue an update to the ref */
+  ostree_repo_transaction_set_ref (repo, NULL, cachebranch, new_commit_csum);
+
+  if (out_commit_csum)
+    *out_commit_csum = util::move_nullify (new_commit_csum);
+  return TRUE;
+}
+
+/* Path in a package commit -> object holding its xattrs: a dirmeta for
+ * directories, the file object otherwise */
+typedef std::unordered_map<std::string, std::pair<OstreeObjectType, std::string> >
+    RelabelXattrSources;
+
+static gboolean
+collect_xattr_sources (OstreeRepo *repo, const char *dirtree_csum, std::string &path,
+                       RelabelXattrSources &sources, GError **error)
+{
+  g_autoptr (GVariant) dirtree = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_csum, &dirtree, error))
+    return FALSE;
+  g_autoptr (GVariant) files = g_variant_get_child_value (dirtree, 0);
+  g_autoptr (GVariant) dirs = g_variant_get_child_value (dirtree, 1);
+
+  const size_t origlen = path.size ();
+  const gsize n_files = g_variant_n_children (files);
+  for (gsize i = 0; i < n_files; i++)
+    {
+      const char *name;
+      g_autoptr (GVariant) csum_v = NULL;
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+      path.append ("/").append (name);
+      g_autofree char *csum = ostree_checksum_from_bytes_v (csum_v);
+      sources[path] = { OSTREE_OBJECT_TYPE_FILE, csum };
+      path.resize (origlen);
+    }
+
+  const gsize n_dirs = g_variant_n_children (dirs);
+  for (gsize i = 0; i < n_dirs; i++)
+    {
+      const char *name;
+      g_autoptr (GVariant) tree_csum_v = NULL;
+      g_autoptr (GVariant) meta_csum_v = NULL;
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &tree_csum_v, &meta_csum_v);
+      path.append ("/").append (name);
+      g_autofree char *meta_csum = ostree_checksum_from_bytes_v (meta_csum_v);
+      sources[path] = { OSTREE_OBJECT_TYPE_DIR_META, meta_csum };
+      g_autofree char *tree_csum = ostree_checksum_from_bytes_v (tree_csum_v);
+      if (!collect_xattr_sources (repo, tree_csum, path, sources, error))
+        return FALSE;
+      path.resize (origlen);
+    }
+
+  return TRUE;
+}
+
+typedef struct
+{
+  RpmOstreeLabelCache *label_cache;
+  RelabelXattrSources *sources;
+  GError *error;
+} RelabelXattrData;
+
+/* Labels each path through the shared label cache, keeping the other xattrs it
+ * had in the original commit. */
+static GVariant *
+relabel_xattr_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpointer user_data)
+{
+  auto data = static_cast<RelabelXattrData *> (user_data);
+  GError **error = data->error ? NULL : &data->error;
+
+  auto it = data->sources->find (path);
+  if (it == data->sources->end ())
+    return (GVariant *)glnx_null_throw (error, "No xattrs for %s", path);
+  auto &[objtype, csum] = it->second;
+
+  g_autoptr (GVariant) xattrs = NULL;
+  if (objtype == OSTREE_OBJECT_TYPE_DIR_META)
+    {
+      g_autoptr (GVariant) dirmeta = NULL;
+      if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_META, csum.c_str (), &dirmeta,
+                                     error))
+        return NULL;
+      xattrs = g_variant_get_child_value (dirmeta, 3);
+    }
+  else if (!ostree_repo_load_file (repo, csum.c_str (), NULL, NULL, &xattrs, NULL, error))
+    return NULL;
+
+  const guint32 mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
+  return rpmostree_label_cache_apply (data->label_cache, xattrs, path, mode, FALSE, error);
+}
+
 static gboolean
 relabel_in_thread_impl (RpmOstreeContext *self, const char *name, const char *evr, const char *arch,
-                        int tmpdir_dfd, gboolean *out_changed, GCancellable *cancellable,
-                        GError **error)
+                        int tmpdir_dfd, RpmOstreeFileContextsDiff *diff,
+                        RpmOstreeLabelCache *label_cache, gboolean *out_changed,
+                        gboolean *out_restamped, GCancellable *cancellable, GError **error)
 {
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return FALSE;
@@ -3260,6 +4360,28 @@ relabel_in_thread_impl (RpmOstreeContext *self, const char *name, const char *ev
     return FALSE;
   g_autofree char *orig_content_checksum = rpmostree_commit_content_checksum (orig_commit);
 
+  /* If none of the paths in the package may have changed label since it was
+   * last labeled, there's no need to touch the content. */
+  if (diff)
+    {
+      gboolean affected = FALSE;
+      if (!rpmostree_file_contexts_diff_matches_commit (repo, diff, commit_csum, &affected,
+                                                        cancellable, error))
+        return FALSE;
+      if (!affected)
+        {
+          g_autoptr (GFile) orig_root = NULL;
+          if (!ostree_repo_read_commit (repo, commit_csum, &orig_root, NULL, cancellable, error))
+            return FALSE;
+          if (!write_relabeled_commit (self, repo, cachebranch, orig_commit, orig_root, NULL,
+                                       cancellable, error))
+            return FALSE;
+          *out_changed = FALSE;
+          *out_restamped = TRUE;
+          return TRUE;
+        }
+    }
+
   /* checkout the pkg and relabel, breaking hardlinks */
   g_autoptr (OstreeRepoDevInoCache) cache = ostree_repo_devino_cache_new ();
 
@@ -3267,39 +4389,52 @@ relabel_in_thread_impl (RpmOstreeContext *self, const char *name, const char *ev
                          OSTREE_REPO_CHECKOUT_OVERWRITE_NONE, FALSE, cancellable, error))
     return FALSE;
 
+  /* The labels are looked up through the label cache rather than by the
+   * commit modifier, so we provide all the xattrs ourselves. */
+  RelabelXattrSources xattr_sources;
+  if (label_cache)
+    {
+      g_autoptr (GVariant) root_meta_csum_v = g_variant_get_child_value (orig_commit, 7);
+      g_autofree char *root_meta_csum = ostree_checksum_from_bytes_v (root_meta_csum_v);
+      xattr_sources["/"] = { OSTREE_OBJECT_TYPE_DIR_META, root_meta_csum };
+      g_autoptr (GVariant) root_tree_csum_v = g_variant_get_child_value (orig_commit, 6);
+      g_autofree char *root_tree_csum = ostree_checksum_from_bytes_v (root_tree_csum_v);
+      std::string path;
+      if (!collect_xattr_sources (repo, root_tree_csum, path, xattr_sources, error))
+        return FALSE;
+    }
+  RelabelXattrData xattr_data = { label_cache, &xattr_sources, NULL };
+
   /* write to the tree */
   g_autoptr (OstreeRepoCommitModifier) modifier = ostree_repo_commit_modifier_new (
       OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME, NULL, NULL, NULL);
   ostree_repo_commit_modifier_set_devino_cache (modifier, cache);
-  ostree_repo_commit_modifier_set_sepolicy (modifier, self->sepolicy);
+  if (label_cache)
+    ostree_repo_commit_modifier_set_xattr_callback (modifier, relabel_xattr_cb, NULL, &xattr_data);
+  else
+    ostree_repo_commit_modifier_set_sepolicy (modifier, self->sepolicy);
 
   g_autoptr (OstreeMutableTree) mtree = ostree_mutable_tree_new ();
   if (!ostree_repo_write_dfd_to_mtree (repo, tmpdir_dfd, pkg_dirname, mtree, modifier, cancellable,
                                        error))
-    return glnx_prefix_error (error, "Writing dfd");
+    {
+      g_clear_error (&xattr_data.error);
+      return glnx_prefix_error (error, "Writing dfd");
+    }
+  if (xattr_data.error)
+    {
+      g_propagate_error (error, util::move_nullify (xattr_data.error));
+      return FALSE;
+    }
 
   g_autoptr (GFile) root = NULL;
   if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
     return FALSE;
 
   /* build metadata and commit */
-  g_autoptr (GVariant) commit_var = NULL;
-  g_autoptr (GVariantDict) meta_dict = NULL;
-
-  if (!ostree_repo_load_commit (repo, commit_csum, &commit_var, NULL, error))
-    return FALSE;
-
-  /* let's just copy the metadata from the previous commit and only change the
-   * rpmostree.sepolicy value */
-  g_autoptr (GVariant) meta = g_variant_get_child_value (commit_var, 0);
-  meta_dict = g_variant_dict_new (meta);
-
-  g_variant_dict_insert (meta_dict, "rpmostree.sepolicy", "s",
-                         ostree_sepolicy_get_csum (self->sepolicy));
-
   g_autofree char *new_commit_csum = NULL;
-  if (!ostree_repo_write_commit (repo, NULL, "", "", g_variant_dict_end (meta_dict),
-                                 OSTREE_REPO_FILE (root), &new_commit_csum, cancellable, error))
+  if (!write_relabeled_commit (self, repo, cachebranch, orig_commit, root, &new_commit_csum,
+                               cancellable, error))
     return FALSE;
 
   /* Compute new content checksum */
@@ -3308,9 +4443,6 @@ relabel_in_thread_impl (RpmOstreeContext *self, const char *name, const char *ev
     return FALSE;
   g_autofree char *new_content_checksum = rpmostree_commit_content_checksum (new_commit);
 
-  /* Queue an update to the ref */
-  ostree_repo_transaction_set_ref (repo, NULL, cachebranch, new_commit_csum);
-
   /* Return whether or not we actually changed content */
   *out_changed = !g_str_equal (orig_content_checksum, new_content_checksum);
 
@@ -3325,8 +4457,10 @@ relabel_in_thread (GTask *task, gpointer source, gpointer task_data, GCancellabl
   auto tdata = static_cast<RelabelTaskData *> (task_data);
 
   gboolean changed = FALSE;
+  rpmostreecxx::TraceSpan span ("relabel", tdata->name);
   if (!relabel_in_thread_impl (self, tdata->name, tdata->evr, tdata->arch, tdata->tmpdir_dfd,
-                               &changed, cancellable, &local_error))
+                               tdata->diff, tdata->label_cache, &changed, &tdata->restamped,
+                               cancellable, &local_error))
     g_task_return_error (task, util::move_nullify (local_error));
   else
     g_task_return_int (task, changed ? 1 : 0);
@@ -3334,15 +4468,19 @@ relabel_in_thread (GTask *task, gpointer source, gpointer task_data, GCancellabl
 
 static void
 relabel_package_async (RpmOstreeContext *self, DnfPackage *pkg, int tmpdir_dfd,
-                       GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data)
+                       RpmOstreeFileContextsDiff *diff, RpmOstreeLabelCache *label_cache,
+                       GCancellable *cancellable, GAsyncReadyCallback callback,
+                       gpointer user_data)
 {
   g_autoptr (GTask) task = g_task_new (self, cancellable, callback, user_data);
-  RelabelTaskData *tdata = g_new (RelabelTaskData, 1);
+  RelabelTaskData *tdata = g_new0 (RelabelTaskData, 1);
   /* We can assume lifetime is greater than the task */
   tdata->tmpdir_dfd = tmpdir_dfd;
   tdata->name = dnf_package_get_name (pkg);
   tdata->evr = dnf_package_get_evr (pkg);
   tdata->arch = dnf_package_get_arch (pkg);
+  tdata->diff = diff;
+  tdata->label_cache = label_cache;
   g_task_set_task_data (task, tdata, g_free);
   g_task_run_in_thread (task, relabel_in_thread);
 }
@@ -3359,18 +4497,42 @@ typedef struct
   RpmOstreeContext *self;
   guint n_changed_files;
   guint n_changed_pkgs;
+  guint n_restamped_pkgs;
+  int tmpdir_dfd;
+  RpmOstreeLabelCache *label_cache;
+  std::vector<RpmOstreeFileContextsDiff *> *diffs; /* Indexed like pkgs_to_relabel */
 } RpmOstreeAsyncRelabelData;
 
+static void on_async_relabel_done (GObject *obj, GAsyncResult *res, gpointer user_data);
+
+/* Relabels go to free slots in the order of pkgs_to_relabel */
+static gboolean
+async_relabel_start (RpmOstreeWorkerPool *pool, gpointer user_data, gboolean *out_started,
+                     GError **error)
+{
+  auto data = static_cast<RpmOstreeAsyncRelabelData *> (user_data);
+  RpmOstreeContext *self = data->self;
+  *out_started = self->async_index < self->pkgs_to_relabel->len;
+  if (!*out_started)
+    return TRUE;
+
+  const guint i = self->async_index++;
+  auto pkg = static_cast<DnfPackage *> (self->pkgs_to_relabel->pdata[i]);
+  relabel_package_async (self, pkg, data->tmpdir_dfd, (*data->diffs)[i], data->label_cache,
+                         self->async_cancellable, on_async_relabel_done, data);
+  return TRUE;
+}
+
 static void
 on_async_relabel_done (GObject *obj, GAsyncResult *res, gpointer user_data)
 {
   auto data = static_cast<RpmOstreeAsyncRelabelData *> (user_data);
   RpmOstreeContext *self = data->self;
-  gssize n_relabeled
-      = relabel_package_async_finish (self, res, self->async_error ? NULL : &self->async_error);
+  GError *local_error = NULL;
+  gssize n_relabeled = relabel_package_async_finish (self, res, &local_error);
   if (n_relabeled < 0)
     {
-      g_assert (self->async_error != NULL);
+      g_assert (local_error != NULL);
       if (self->async_cancellable)
         g_cancellable_cancel (self->async_cancellable);
     }
@@ -3382,9 +4544,54 @@ on_async_relabel_done (GObject *obj, GAsyncResult *res, gpointer user_data)
       data->n_changed_files += n_relabeled;
       data->n_changed_pkgs++;
     }
+  auto tdata = static_cast<RelabelTaskData *> (g_task_get_task_data (G_TASK (res)));
+  if (tdata->restamped)
+    data->n_restamped_pkgs++;
   self->async_progress->nitems_update (self->n_async_pkgs_relabeled);
-  if (self->n_async_pkgs_relabeled == self->pkgs_to_relabel->len)
-    self->async_running = FALSE;
+  rpmostree_worker_pool_job_done (&self->async_pool, local_error);
+}
+
+/* Look up what changed between the policy @pkg was labeled with and ours, if
+ * we know both; @diffs caches the result for each old policy. */
+static gboolean
+get_relabel_diff (RpmOstreeContext *self, OstreeRepo *repo, DnfPackage *pkg, GHashTable *diffs,
+                  RpmOstreeFileContextsDiff **out_diff, GCancellable *cancellable, GError **error)
+{
+  *out_diff = NULL;
+  if (!self->sepolicy_file_contexts)
+    return TRUE;
+
+  g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
+  g_autofree char *rev = NULL;
+  if (!ostree_repo_resolve_rev (repo, cachebranch, FALSE, &rev, error))
+    return FALSE;
+  g_autoptr (GVariant) commit = NULL;
+  if (!ostree_repo_load_commit (repo, rev, &commit, NULL, error))
+    return FALSE;
+  g_autoptr (GVariant) metadata = g_variant_get_child_value (commit, 0);
+  g_autoptr (GVariantDict) metadata_dict = g_variant_dict_new (metadata);
+  const char *old_csum = NULL;
+  if (!g_variant_dict_lookup (metadata_dict, "rpmostree.sepolicy", "&s", &old_csum))
+    return TRUE;
+
+  gpointer diff = NULL;
+  if (!g_hash_table_lookup_extended (diffs, old_csum, NULL, &diff))
+    {
+      g_autoptr (GError) local_error = NULL;
+      g_autoptr (GVariant) old_file_contexts
+          = rpmostree_file_contexts_lookup (repo, old_csum, cancellable, &local_error);
+      if (local_error)
+        {
+          g_propagate_error (error, util::move_nullify (local_error));
+          return FALSE;
+        }
+      if (old_file_contexts)
+        diff = rpmostree_file_contexts_diff_new (old_file_contexts, self->sepolicy_file_contexts);
+      g_hash_table_insert (diffs, g_strdup (old_csum), diff);
+    }
+
+  *out_diff = static_cast<RpmOstreeFileContextsDiff *> (diff);
+  return TRUE;
 }
 
 static gboolean
@@ -3403,6 +4610,8 @@ relabel_if_necessary (RpmOstreeContext *self, GCancellable *cancellable, GError
 
   g_assert (ostreerepo != NULL);
 
+  rpmostreecxx::Phase phase (RPMOSTREE_PHASE_RELABEL);
+
   /* Prep a txn and tmpdir for all of the relabels */
   g_auto (RpmOstreeRepoAutoTransaction) txn = {
     0,
@@ -3417,44 +4626,64 @@ relabel_if_necessary (RpmOstreeContext *self, GCancellable *cancellable, GError
                        &relabel_tmpdir, error))
     return FALSE;
 
-  self->async_running = TRUE;
-  self->async_cancellable = cancellable;
-
-  RpmOstreeAsyncRelabelData data = {
-    self,
-    0,
-  };
   const guint n_to_relabel = self->pkgs_to_relabel->len;
-  self->async_progress = rpmostreecxx::progress_nitems_begin (n_to_relabel, "Relabeling");
+  /* Start the biggest packages first, so we don't end up waiting on one big
+   * package after everything else is done */
+  g_ptr_array_sort (self->pkgs_to_relabel, compare_pkg_import_size_indirect);
+  /* Old policy checksum -> diff against ours, or NULL if unknown */
+  g_autoptr (GHashTable) diffs = g_hash_table_new_full (
+      g_str_hash, g_str_equal, g_free, (GDestroyNotify)rpmostree_file_contexts_diff_free);
+  std::vector<RpmOstreeFileContextsDiff *> pkg_diffs (n_to_relabel);
   for (guint i = 0; i < n_to_relabel; i++)
     {
       auto pkg = static_cast<DnfPackage *> (self->pkgs_to_relabel->pdata[i]);
-      relabel_package_async (self, pkg, relabel_tmpdir.fd, cancellable, on_async_relabel_done,
-                             &data);
+      if (!get_relabel_diff (self, ostreerepo, pkg, diffs, &pkg_diffs[i], cancellable, error))
+        return FALSE;
     }
 
+  RpmOstreeLabelCache *label_cache = get_label_cache (self);
+  guint64 hits_before = 0, misses_before = 0;
+  if (label_cache)
+    rpmostree_label_cache_get_stats (label_cache, &hits_before, &misses_before);
+
+  RpmOstreeAsyncRelabelData data = {
+    self, 0, 0, 0, relabel_tmpdir.fd, label_cache, &pkg_diffs,
+  };
+  self->async_cancellable = cancellable;
+  self->async_index = 0;
+  /* We're CPU bound, so just use processors */
+  rpmostree_worker_pool_init (&self->async_pool, g_get_num_processors (), async_relabel_start,
+                              &data);
+  self->async_progress = rpmostreecxx::progress_nitems_begin (n_to_relabel, "Relabeling");
+
   /* Wait for all of the relabeling to complete */
-  GMainContext *mainctx = g_main_context_get_thread_default ();
-  self->async_error = NULL;
-  while (self->async_running)
-    g_main_context_iteration (mainctx, TRUE);
-  if (self->async_error)
-    {
-      g_propagate_error (error, util::move_nullify (self->async_error));
-      return glnx_prefix_error (error, "relabeling");
-    }
+  if (!rpmostree_worker_pool_run (&self->async_pool, error))
+    return glnx_prefix_error (error, "relabeling");
 
   self->async_progress->end ("");
   self->async_progress.release ();
 
+  if (!record_sepolicy_file_contexts (self, ostreerepo, cancellable, error))
+    return FALSE;
+
   /* Commit */
   if (!ostree_repo_commit_transaction (ostreerepo, NULL, cancellable, error))
     return FALSE;
 
+  guint64 hits = 0, misses = 0;
+  if (label_cache)
+    rpmostree_label_cache_get_stats (label_cache, &hits, &misses);
+  hits -= hits_before;
+  misses -= misses_before;
   sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
                    SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_SELINUX_RELABEL),
-                   "MESSAGE=Relabeled %u/%u pkgs", data.n_changed_pkgs, n_to_relabel,
-                   "RELABELED_PKGS=%u/%u", data.n_changed_pkgs, n_to_relabel, NULL);
+                   "MESSAGE=Relabeled %u/%u pkgs (%u unaffected by policy change; label cache: "
+                   "%" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses)",
+                   data.n_changed_pkgs, n_to_relabel, data.n_restamped_pkgs, hits, misses,
+                   "RELABELED_PKGS=%u/%u", data.n_changed_pkgs, n_to_relabel,
+                   "RESTAMPED_PKGS=%u", data.n_restamped_pkgs,
+                   "LABEL_CACHE_HITS=%" G_GUINT64_FORMAT, hits,
+                   "LABEL_CACHE_MISSES=%" G_GUINT64_FORMAT, misses, NULL);
 
   g_clear_pointer (&self->pkgs_to_relabel, (GDestroyNotify)g_ptr_array_unref);
   self->n_async_pkgs_relabeled = 0;
@@ -3473,6 +4702,10 @@ rpmostree_context_force_relabel (RpmOstreeContext *self, GCancellable *cancellab
       = dnf_goal_get_packages (dnf_context_get_goal (self->dnfctx), DNF_PACKAGE_INFO_INSTALL,
                                DNF_PACKAGE_INFO_UPDATE, DNF_PACKAGE_INFO_DOWNGRADE, -1);
 
+  g_autoptr (GHashTable) pkgcache_commits = NULL;
+  if (!preload_pkgcache_commits (self, packages, &pkgcache_commits, cancellable, error))
+    return FALSE;
+
   for (guint i = 0; i < packages->len; i++)
     {
       auto pkg = static_cast<DnfPackage *> (packages->pdata[i]);
@@ -3482,7 +4715,8 @@ rpmostree_context_force_relabel (RpmOstreeContext *self, GCancellable *cancellab
 
       /* This logic is equivalent to that in sort_packages() */
       gboolean in_ostree, selinux_match;
-      if (!find_pkg_in_ostree (self, pkg, self->sepolicy, &in_ostree, &selinux_match, error))
+      if (!find_pkg_in_ostree (self, pkg, self->sepolicy, pkgcache_commits, &in_ostree,
+                               &selinux_match, error))
         return FALSE;
 
       if (in_ostree && !selinux_match)
@@ -3495,7 +4729,9 @@ rpmostree_context_force_relabel (RpmOstreeContext *self, GCancellable *cancellab
 typedef struct
 {
   FD_t current_trans_fd;
+  int current_trans_memfd;
   RpmOstreeContext *ctx;
+  GError *error; /* The first failure to open a header */
 } TransactionData;
 
 static void *
@@ -3509,11 +4745,19 @@ ts_callback (const void *h, const rpmCallbackType what, const rpm_loff_t amount,
     case RPMCALLBACK_INST_OPEN_FILE:
       {
         auto pkg = static_cast<DnfPackage *> ((void *)key);
-        /* just bypass fdrel_abspath here since we know the dfd is not ATCWD and
-         * it saves us an allocation */
-        g_autofree char *relpath = get_package_relpath (pkg);
-        g_autofree char *path = g_build_filename (tdata->ctx->tmpdir.path, relpath, NULL);
+        const char *nevra = dnf_package_get_nevra (pkg);
+        /* We already loaded this header in rpmts_add_install(). librpm only
+         * has one package open at a time, so that's when we make a file of it,
+         * rather than keeping one open for every package. */
+        auto entry = static_cast<RpmOstreeHeaderCacheEntry *> (
+            g_hash_table_lookup (tdata->ctx->header_cache, nevra));
+        g_assert (entry);
         g_assert (tdata->current_trans_fd == NULL);
+        g_assert (tdata->current_trans_memfd == -1);
+        if (!header_cache_entry_open (entry, nevra, &tdata->current_trans_memfd,
+                                      tdata->error ? NULL : &tdata->error))
+          return NULL;
+        g_autofree char *path = g_strdup_printf ("/proc/self/fd/%d", tdata->current_trans_memfd);
         tdata->current_trans_fd = Fopen (path, "r.ufdio");
         return tdata->current_trans_fd;
       }
@@ -3521,6 +4765,7 @@ ts_callback (const void *h, const rpmCallbackType what, const rpm_loff_t amount,
 
     case RPMCALLBACK_INST_CLOSE_FILE:
       g_clear_pointer (&tdata->current_trans_fd, Fclose);
+      glnx_close_fd (&tdata->current_trans_memfd);
       break;
 
     default:
@@ -3530,17 +4775,20 @@ ts_callback (const void *h, const rpmCallbackType what, const rpm_loff_t amount,
   return NULL;
 }
 
+/* Get (a new reference to) the header and/or file info for @pkg */
 static gboolean
-get_package_metainfo (RpmOstreeContext *self, const char *path, Header *out_header, rpmfi *out_fi,
+get_package_metainfo (RpmOstreeContext *self, DnfPackage *pkg, Header *out_header, rpmfi *out_fi,
                       GError **error)
 {
-  glnx_autofd int metadata_fd = -1;
-  if (!glnx_openat_rdonly (self->tmpdir.fd, path, TRUE, &metadata_fd, error))
+  auto entry = header_cache_get (self, pkg, error);
+  if (!entry)
     return FALSE;
 
-  // We just care about reading the stuff librpm wants to put in the database, so no IMA etc.
-  auto flags = rpmostreecxx::rpm_importer_flags_new_empty ();
-  return rpmostree_importer_read_metainfo (metadata_fd, *flags, out_header, NULL, out_fi, error);
+  if (out_header)
+    *out_header = headerLink (entry->hdr);
+  if (out_fi)
+    *out_fi = rpmfilesIter (entry->files, RPMFI_ITER_FWD);
+  return TRUE;
 }
 
 typedef enum
@@ -3554,11 +4802,10 @@ rpmts_add_install (RpmOstreeContext *self, rpmts ts, DnfPackage *pkg,
                    RpmOstreeTsAddInstallFlags flags, GCancellable *cancellable, GError **error)
 {
   g_auto (Header) hdr = NULL;
-  g_autofree char *path = get_package_relpath (pkg);
 
   const bool use_kernel_install = self->treefile_rs->use_kernel_install ();
 
-  if (!get_package_metainfo (self, path, &hdr, NULL, error))
+  if (!get_package_metainfo (self, pkg, &hdr, NULL, error))
     return FALSE;
 
   if (!(flags & RPMOSTREE_TS_FLAG_NOVALIDATE_SCRIPTS))
@@ -3596,20 +4843,19 @@ rpmts_add_erase (RpmOstreeContext *self, rpmts ts, DnfPackage *pkg, GCancellable
  */
 static gboolean
 run_script_sync (RpmOstreeContext *self, int rootfs_dfd, GLnxTmpDir *var_lib_rpm_statedir,
-                 DnfPackage *pkg, RpmOstreeScriptKind kind, guint *out_n_run,
-                 GCancellable *cancellable, GError **error)
+                 RpmOstreeScriptSandbox *sandbox, DnfPackage *pkg, RpmOstreeScriptKind kind,
+                 guint *out_n_run, GCancellable *cancellable, GError **error)
 {
   g_auto (Header) hdr = NULL;
-  g_autofree char *path = get_package_relpath (pkg);
 
-  if (!get_package_metainfo (self, path, &hdr, NULL, error))
+  if (!get_package_metainfo (self, pkg, &hdr, NULL, error))
     return FALSE;
 
   const bool use_kernel_install = self->treefile_rs->use_kernel_install ();
 
   if (!rpmostree_script_run_sync (pkg, hdr, kind, rootfs_dfd, var_lib_rpm_statedir,
-                                  self->enable_rofiles, use_kernel_install, out_n_run, cancellable,
-                                  error))
+                                  self->enable_rofiles, use_kernel_install, sandbox, out_n_run,
+                                  cancellable, error))
     return FALSE;
 
   return TRUE;
@@ -3630,9 +4876,8 @@ apply_rpmfi_overrides (RpmOstreeContext *self, int tmprootfs_dfd, DnfPackage *pk
 
   g_auto (rpmfi) fi = NULL;
   gboolean emitted_nonusr_warning = FALSE;
-  g_autofree char *path = get_package_relpath (pkg);
 
-  if (!get_package_metainfo (self, path, NULL, &fi, error))
+  if (!get_package_metainfo (self, pkg, NULL, &fi, error))
     return FALSE;
 
   while (rpmfiNext (fi) >= 0)
@@ -3779,6 +5024,169 @@ apply_rpmfi_overrides (RpmOstreeContext *self, int tmprootfs_dfd, DnfPackage *pk
   return TRUE;
 }
 
+typedef struct
+{
+  RpmOstreeContext *self;
+  int rootfs_dfd;
+  std::vector<rpmte> added;
+  rpmostreecxx::PasswdEntries *passwd_entries;
+  GCancellable *cancellable;
+} PostScriptsParallel;
+
+/* Apply the overrides of a package right before its %post, like the serial loop */
+static gboolean
+post_script_prepare (guint idx, gpointer user_data, GError **error)
+{
+  auto data = static_cast<PostScriptsParallel *> (user_data);
+  auto pkg = static_cast<DnfPackage *> (rpmteKey (data->added[idx]));
+  if (!apply_rpmfi_overrides (data->self, data->rootfs_dfd, pkg, *data->passwd_entries,
+                              data->cancellable, error))
+    return glnx_prefix_error (error, "While applying overrides for pkg %s",
+                              dnf_package_get_name (pkg));
+  return TRUE;
+}
+
+/* Add the packages before @i which provide @name according to @providers */
+static void
+post_script_add_deps (std::set<guint> &deps, GHashTable *providers, const char *name, guint i)
+{
+  auto idxs = static_cast<GArray *> (g_hash_table_lookup (providers, name));
+  for (guint k = 0; idxs && k < idxs->len; k++)
+    {
+      guint j = g_array_index (idxs, guint, k);
+      if (j < i)
+        deps.insert (j);
+    }
+}
+
+/* Run %post of the added packages in @ordering_ts in parallel where possible.
+ * Only the scripts of the packages listed in the treefile's
+ * parallel-post-scripts may overlap: those wait for the scripts of the
+ * packages they have a Requires(post) on (possibly via packages without a
+ * %post). Any other script runs by itself, after all the earlier ones and
+ * before all the later ones. Only dependencies that come earlier in the
+ * ordering count, which keeps the graph acyclic the same way librpm breaks
+ * loops.
+ */
+static gboolean
+run_post_scripts_parallel (RpmOstreeContext *self, rpmts ordering_ts, int rootfs_dfd,
+                           GLnxTmpDir *var_lib_rpm_statedir,
+                           rpmostreecxx::PasswdEntries &passwd_entries, guint max_parallel,
+                           guint *out_n_run, GCancellable *cancellable, GError **error)
+{
+  const bool use_kernel_install = self->treefile_rs->use_kernel_install ();
+  std::set<std::string> parallel_pkgs;
+  for (auto &name : self->treefile_rs->get_parallel_post_scripts ())
+    parallel_pkgs.insert (std::string (name));
+
+  PostScriptsParallel data = { self, rootfs_dfd, {}, &passwd_entries, cancellable };
+  std::vector<rpmte> &added = data.added;
+
+  const guint n_rpmts_elements = (guint)rpmtsNElements (ordering_ts);
+  for (guint i = 0; i < n_rpmts_elements; i++)
+    {
+      rpmte te = rpmtsElement (ordering_ts, i);
+      if (rpmteType (te) == TR_ADDED)
+        added.push_back (te);
+    }
+
+  /* Versions are ignored, which can only add dependencies */
+  g_autoptr (GHashTable) providers /* provide name -> GArray of indices into added */
+      = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_array_unref);
+  for (guint i = 0; i < added.size (); i++)
+    {
+      rpmds provides = rpmdsInit (rpmteDS (added[i], RPMTAG_PROVIDENAME));
+      while (rpmdsNext (provides) >= 0)
+        {
+          const char *provname = rpmdsN (provides);
+          auto idxs = static_cast<GArray *> (g_hash_table_lookup (providers, provname));
+          if (!idxs)
+            {
+              idxs = g_array_new (FALSE, FALSE, sizeof (guint));
+              g_hash_table_insert (providers, (gpointer)provname, idxs);
+            }
+          g_array_append_val (idxs, i);
+        }
+    }
+
+  /* File dependencies like the script interpreter: walk each file list once,
+   * only looking for the paths some package has a Requires(post) on */
+  g_autoptr (GHashTable) file_providers /* path -> GArray of indices into added */
+      = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_array_unref);
+  for (guint i = 0; i < added.size (); i++)
+    {
+      rpmds requires = rpmdsInit (rpmteDS (added[i], RPMTAG_REQUIRENAME));
+      while (rpmdsNext (requires) >= 0)
+        {
+          const char *reqname = rpmdsN (requires);
+          if ((rpmdsFlags (requires) & RPMSENSE_SCRIPT_POST) && reqname[0] == '/'
+              && !g_hash_table_contains (file_providers, reqname))
+            g_hash_table_insert (file_providers, (gpointer)reqname,
+                                 g_array_new (FALSE, FALSE, sizeof (guint)));
+        }
+    }
+  for (guint i = 0; g_hash_table_size (file_providers) > 0 && i < added.size (); i++)
+    {
+      g_auto (rpmfiles) files = rpmteFiles (added[i]);
+      g_auto (rpmfi) fi = rpmfilesIter (files, RPMFI_ITER_FWD);
+      while (rpmfiNext (fi) >= 0)
+        {
+          auto idxs = static_cast<GArray *> (g_hash_table_lookup (file_providers, rpmfiFN (fi)));
+          if (idxs && (idxs->len == 0 || g_array_index (idxs, guint, idxs->len - 1) != i))
+            g_array_append_val (idxs, i);
+        }
+    }
+
+  g_autoptr (GPtrArray) jobs
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)rpmostree_script_job_free);
+  int last_serialized = -1;
+  std::vector<guint> since_serialized;
+  for (guint i = 0; i < added.size (); i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (rpmteKey (added[i]));
+      g_auto (Header) hdr = NULL;
+      if (!get_package_metainfo (self, pkg, &hdr, NULL, error))
+        return FALSE;
+      g_autoptr (RpmOstreeScriptJob) job = rpmostree_script_job_new (
+          pkg, hdr, RPMOSTREE_SCRIPT_POSTIN, use_kernel_install, error);
+      if (!job)
+        return FALSE;
+
+      std::set<guint> deps;
+      if (last_serialized >= 0)
+        deps.insert (last_serialized);
+      if (!rpmostree_script_job_is_noop (job)
+          && !parallel_pkgs.count (dnf_package_get_name (pkg)))
+        {
+          /* Wait for everything since, and have everything after wait for us */
+          deps.insert (since_serialized.begin (), since_serialized.end ());
+          since_serialized.clear ();
+          last_serialized = i;
+        }
+      else
+        {
+          since_serialized.push_back (i);
+          rpmds requires = rpmdsInit (rpmteDS (added[i], RPMTAG_REQUIRENAME));
+          while (rpmdsNext (requires) >= 0)
+            {
+              if (!(rpmdsFlags (requires) & RPMSENSE_SCRIPT_POST))
+                continue;
+              const char *reqname = rpmdsN (requires);
+              post_script_add_deps (deps, providers, reqname, i);
+              if (reqname[0] == '/')
+                post_script_add_deps (deps, file_providers, reqname, i);
+            }
+        }
+      for (guint dep : deps)
+        rpmostree_script_job_add_dep (job, dep);
+      g_ptr_array_add (jobs, util::move_nullify (job));
+    }
+
+  return rpmostree_script_jobs_run (jobs, max_parallel, rootfs_dfd, var_lib_rpm_statedir,
+                                    self->enable_rofiles, post_script_prepare, &data, out_n_run,
+                                    cancellable, error);
+}
+
 static gboolean
 add_install (RpmOstreeContext *self, DnfPackage *pkg, rpmts ts, gboolean is_upgrade,
              GHashTable *pkg_to_ostree_commit, GCancellable *cancellable, GError **error)
@@ -3804,9 +5212,6 @@ add_install (RpmOstreeContext *self, DnfPackage *pkg, rpmts ts, gboolean is_upgr
       g_assert (sepolicy_matches);
     }
 
-  if (!checkout_pkg_metadata_by_dnfpkg (self, pkg, cancellable, error))
-    return FALSE;
-
   auto flags = static_cast<RpmOstreeTsAddInstallFlags> (0);
   if (is_upgrade)
     flags = static_cast<RpmOstreeTsAddInstallFlags> (static_cast<int> (flags)
@@ -3820,10 +5225,29 @@ add_install (RpmOstreeContext *self, DnfPackage *pkg, rpmts ts, gboolean is_upgr
 
 /* Run %transfiletriggerin */
 static gboolean
-run_all_transfiletriggers (RpmOstreeContext *self, rpmts ts, int rootfs_dfd, guint *out_n_run,
+run_all_transfiletriggers (RpmOstreeContext *self, rpmts ts, int rootfs_dfd,
+                           RpmOstreeScriptSandbox *sandbox, guint *out_n_run,
                            GCancellable *cancellable, GError **error)
 {
   const gboolean use_kernel_install = self->treefile_rs->use_kernel_install ();
+  /* Shared across all triggers; after one ran, only changed directories are read again */
+  g_autoptr (RpmOstreeRootfsIndex) index = rpmostree_rootfs_index_new (rootfs_dfd);
+  g_autoptr (RpmOstreeTriggerCache) trigger_cache = NULL;
+  auto memoized = self->treefile_rs->get_memoize_file_triggers ();
+  if (!memoized.empty ())
+    {
+      trigger_cache = rpmostree_trigger_cache_new (get_pkgcache_repo (self), rootfs_dfd);
+      for (auto &name : memoized)
+        {
+          auto inputs = self->treefile_rs->get_memoize_file_trigger_inputs (name);
+          g_autoptr (GPtrArray) extra_inputs = g_ptr_array_new_with_free_func (g_free);
+          for (auto &input : inputs)
+            g_ptr_array_add (extra_inputs, g_strdup (input.c_str ()));
+          g_ptr_array_add (extra_inputs, NULL);
+          rpmostree_trigger_cache_allow (trigger_cache, name.c_str (),
+                                         (const char *const *)extra_inputs->pdata);
+        }
+    }
 
   /* Triggers from base packages, but only if we already have an rpmdb,
    * otherwise librpm will whine on our stderr.
@@ -3837,9 +5261,10 @@ run_all_transfiletriggers (RpmOstreeContext *self, rpmts ts, int rootfs_dfd, gui
       Header hdr;
       while ((hdr = rpmdbNextIterator (mi)) != NULL)
         {
-          if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, self->enable_rofiles,
-                                                     use_kernel_install, out_n_run, cancellable,
-                                                     error))
+          if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, index,
+                                                     self->enable_rofiles, use_kernel_install,
+                                                     sandbox, trigger_cache, out_n_run,
+                                                     cancellable, error))
             return FALSE;
         }
     }
@@ -3852,13 +5277,13 @@ run_all_transfiletriggers (RpmOstreeContext *self, rpmts ts, int rootfs_dfd, gui
       if (rpmteType (te) != TR_ADDED)
         continue;
       DnfPackage *pkg = (DnfPackage *)rpmteKey (te);
-      g_autofree char *path = get_package_relpath (pkg);
       g_auto (Header) hdr = NULL;
-      if (!get_package_metainfo (self, path, &hdr, NULL, error))
+      if (!get_package_metainfo (self, pkg, &hdr, NULL, error))
         return FALSE;
 
-      if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, self->enable_rofiles,
-                                                 use_kernel_install, out_n_run, cancellable, error))
+      if (!rpmostree_transfiletriggers_run_sync (hdr, rootfs_dfd, index, self->enable_rofiles,
+                                                 use_kernel_install, sandbox, trigger_cache,
+                                                 out_n_run, cancellable, error))
         return FALSE;
     }
   return TRUE;
@@ -4023,8 +5448,7 @@ write_rpmdb (RpmOstreeContext *self, int tmprootfs_dfd, GPtrArray *overlays,
 #endif
   rpmtsSetFlags (rpmdb_ts, trans_flags);
 
-  TransactionData tdata = { 0, NULL };
-  tdata.ctx = self;
+  TransactionData tdata = { NULL, -1, self, NULL };
   rpmtsSetNotifyCallback (rpmdb_ts, ts_callback, &tdata);
 
   /* Skip validating scripts since we already validated them above */
@@ -4081,6 +5505,12 @@ write_rpmdb (RpmOstreeContext *self, int tmprootfs_dfd, GPtrArray *overlays,
   flags |= RPMPROB_FILTER_REPLACENEWFILES | RPMPROB_FILTER_REPLACEOLDFILES;
 
   int r = rpmtsRun (rpmdb_ts, NULL, flags);
+  glnx_close_fd (&tdata.current_trans_memfd);
+  if (tdata.error)
+    {
+      g_propagate_error (error, util::move_nullify (tdata.error));
+      return glnx_prefix_error (error, "Failed to update rpmdb");
+    }
   if (r < 0)
     return glnx_throw (error, "Failed to update rpmdb (rpmtsRun code %d)", r);
   if (r > 0)
@@ -4310,6 +5740,7 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
   g_assert (n_rpmts_elements > 0);
   guint n_rpmts_done = 0;
 
+  rpmostreecxx::Phase checkout_phase (RPMOSTREE_PHASE_CHECKOUT);
   auto progress = rpmostreecxx::progress_nitems_begin (n_rpmts_elements, progress_msg);
 
   /* Okay so what's going on in Fedora with incestuous relationship
@@ -4355,8 +5786,10 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
 
   g_autoptr (GHashTable) files_skip_add = NULL;
   g_autoptr (GHashTable) files_skip_delete = NULL;
-  if (!handle_file_dispositions (self, tmprootfs_dfd, ordering_ts, &files_skip_add,
-                                 &files_skip_delete, cancellable, error))
+  g_autoptr (GHashTable) pkgs_overlapping = NULL;
+  if (!handle_file_dispositions (self, tmprootfs_dfd, ordering_ts, filesystem_package,
+                                 &files_skip_add, &files_skip_delete, &pkgs_overlapping,
+                                 cancellable, error))
     return FALSE;
 
   g_autoptr (GSequence) dirs_to_remove = g_sequence_new (g_free);
@@ -4393,6 +5826,11 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
     return FALSE;
   g_clear_pointer (&dirs_to_remove, g_sequence_free);
 
+  /* Packages which don't share any files with another package in the
+   * transaction can be checked out in any order, so we do those concurrently
+   * once the rest have been checked out in the rpmts order.
+   */
+  g_autoptr (GPtrArray) pkgs_checkout_parallel = g_ptr_array_new ();
   for (guint i = 0; i < n_rpmts_elements; i++)
     {
       rpmte te = rpmtsElement (ordering_ts, i);
@@ -4412,6 +5850,12 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
         /* we checkout those last */
         continue;
 
+      if (!g_hash_table_contains (pkgs_overlapping, pkg) && pkg != setup_package)
+        {
+          g_ptr_array_add (pkgs_checkout_parallel, pkg);
+          continue;
+        }
+
       /* The "setup" package currently contains /etc/passwd; in the treecompose
        * case we need to inject that beforehand, so use "add files" just for
        * that.
@@ -4429,6 +5873,11 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
       n_rpmts_done++;
       progress->nitems_update (n_rpmts_done);
     }
+  g_clear_pointer (&pkgs_overlapping, g_hash_table_unref);
+
+  if (!checkout_packages_parallel (self, pkgs_checkout_parallel, pkg_to_ostree_commit,
+                                   files_skip_add, *progress, &n_rpmts_done, cancellable, error))
+    return FALSE;
   g_clear_pointer (&files_skip_add, g_hash_table_unref);
 
   /* And last, any fileoverride RPMs. These *must* be done last. */
@@ -4455,6 +5904,7 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
     }
 
   progress->end ("");
+  checkout_phase.end ();
 
   /* Some packages expect to be able to make temporary files here
    * for obvious reasons, but we otherwise make `/var` read-only.
@@ -4534,9 +5984,14 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
        * this way is that we only need to read the passwd/group files once
        * before applying the overrides, rather than after each %pre.
        */
+      rpmostreecxx::Phase scripts_phase (RPMOSTREE_PHASE_SCRIPTS);
       {
         auto task = rpmostreecxx::progress_begin_task ("Running pre scripts");
         guint n_pre_scripts_run = 0;
+        g_autoptr (RpmOstreeScriptSandbox) sandbox = NULL;
+        if (!rpmostree_script_sandbox_new (tmprootfs_dfd, &var_lib_rpm_statedir,
+                                           self->enable_rofiles, &sandbox, cancellable, error))
+          return FALSE;
         for (guint i = 0; i < n_rpmts_elements; i++)
           {
             rpmte te = rpmtsElement (ordering_ts, i);
@@ -4547,10 +6002,12 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
             g_assert (pkg);
 
             task->set_sub_message (dnf_package_get_name (pkg));
-            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, pkg,
+            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, sandbox, pkg,
                                   RPMOSTREE_SCRIPT_PREIN, &n_pre_scripts_run, cancellable, error))
               return FALSE;
           }
+        if (sandbox && !rpmostree_script_sandbox_close (sandbox, error))
+          return FALSE;
         auto msg = g_strdup_printf ("%u done", n_pre_scripts_run);
         task->end (msg);
       }
@@ -4575,32 +6032,55 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
       {
         auto task = rpmostreecxx::progress_begin_task ("Running post scripts");
         guint n_post_scripts_run = 0;
+        const guint max_parallel = rpmostree_script_get_max_parallel ();
+        g_autoptr (RpmOstreeScriptSandbox) sandbox = NULL;
+        if (max_parallel == 1
+            && !rpmostree_script_sandbox_new (tmprootfs_dfd, &var_lib_rpm_statedir,
+                                              self->enable_rofiles, &sandbox, cancellable, error))
+          return FALSE;
 
         /* %post */
-        for (guint i = 0; i < n_rpmts_elements; i++)
+        if (max_parallel > 1)
           {
-            rpmte te = rpmtsElement (ordering_ts, i);
-            if (rpmteType (te) != TR_ADDED)
-              continue;
-
-            auto pkg = (DnfPackage *)(rpmteKey (te));
-            g_assert (pkg);
-
-            task->set_sub_message (dnf_package_get_name (pkg));
-            if (!apply_rpmfi_overrides (self, tmprootfs_dfd, pkg, *passwd_entries, cancellable,
-                                        error))
-              return glnx_prefix_error (error, "While applying overrides for pkg %s",
-                                        dnf_package_get_name (pkg));
-
-            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, pkg,
-                                  RPMOSTREE_SCRIPT_POSTIN, &n_post_scripts_run, cancellable, error))
+            if (!run_post_scripts_parallel (self, ordering_ts, tmprootfs_dfd,
+                                            &var_lib_rpm_statedir, *passwd_entries, max_parallel,
+                                            &n_post_scripts_run, cancellable, error))
               return FALSE;
           }
+        else
+          {
+            for (guint i = 0; i < n_rpmts_elements; i++)
+              {
+                rpmte te = rpmtsElement (ordering_ts, i);
+                if (rpmteType (te) != TR_ADDED)
+                  continue;
+
+                auto pkg = (DnfPackage *)(rpmteKey (te));
+                g_assert (pkg);
+
+                task->set_sub_message (dnf_package_get_name (pkg));
+                if (!apply_rpmfi_overrides (self, tmprootfs_dfd, pkg, *passwd_entries,
+                                            cancellable, error))
+                  return glnx_prefix_error (error, "While applying overrides for pkg %s",
+                                            dnf_package_get_name (pkg));
+
+                if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, sandbox, pkg,
+                                      RPMOSTREE_SCRIPT_POSTIN, &n_post_scripts_run, cancellable,
+                                      error))
+                  return FALSE;
+              }
+          }
+        if (sandbox && !rpmostree_script_sandbox_close (sandbox, error))
+          return FALSE;
       }
 
       {
         auto task = rpmostreecxx::progress_begin_task ("Running posttrans scripts");
         guint n_posttrans_scripts_run = 0;
+        g_autoptr (RpmOstreeScriptSandbox) sandbox = NULL;
+        if (!rpmostree_script_sandbox_new (tmprootfs_dfd, &var_lib_rpm_statedir,
+                                           self->enable_rofiles, &sandbox, cancellable, error))
+          return FALSE;
 
         /* %posttrans */
         for (guint i = 0; i < n_rpmts_elements; i++)
@@ -4613,20 +6093,30 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
             g_assert (pkg);
 
             task->set_sub_message (dnf_package_get_name (pkg));
-            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, pkg,
+            if (!run_script_sync (self, tmprootfs_dfd, &var_lib_rpm_statedir, sandbox, pkg,
                                   RPMOSTREE_SCRIPT_POSTTRANS, &n_posttrans_scripts_run, cancellable,
                                   error))
               return FALSE;
           }
+        if (sandbox && !rpmostree_script_sandbox_close (sandbox, error))
+          return FALSE;
+        g_clear_pointer (&sandbox, rpmostree_script_sandbox_free);
 
-        /* file triggers */
-        if (!run_all_transfiletriggers (self, ordering_ts, tmprootfs_dfd, &n_posttrans_scripts_run,
-                                        cancellable, error))
+        /* file triggers; these don't get /var/lib/rpm-state, so they can't
+         * share the container of the %posttrans scripts */
+        if (!rpmostree_script_sandbox_new (tmprootfs_dfd, NULL, self->enable_rofiles, &sandbox,
+                                           cancellable, error))
+          return FALSE;
+        if (!run_all_transfiletriggers (self, ordering_ts, tmprootfs_dfd, sandbox,
+                                        &n_posttrans_scripts_run, cancellable, error))
+          return FALSE;
+        if (sandbox && !rpmostree_script_sandbox_close (sandbox, error))
           return FALSE;
 
         auto msg = g_strdup_printf ("%u done", n_posttrans_scripts_run);
         task->end (msg);
       }
+      scripts_phase.end ();
 
       /* We want this to be the first error message if something went wrong
        * with a script; see https://github.com/projectatomic/rpm-ostree/pull/888
@@ -4668,9 +6158,11 @@ rpmostree_context_assemble (RpmOstreeContext *self, GCancellable *cancellable, G
 
   g_clear_pointer (&ordering_ts, rpmtsFree);
 
+  rpmostreecxx::Phase rpmdb_phase (RPMOSTREE_PHASE_RPMDB);
   if (!write_rpmdb (self, tmprootfs_dfd, overlays, overrides_replace, overrides_remove, cancellable,
                     error))
     return glnx_prefix_error (error, "Writing rpmdb");
+  rpmdb_phase.end ();
 
   return rpmostree_context_assemble_end (self, cancellable, error);
 }
@@ -4711,6 +6203,7 @@ rpmostree_context_commit (RpmOstreeContext *self, const char *parent,
   g_autoptr (OstreeRepoCommitModifier) commit_modifier = NULL;
   g_autofree char *ret_commit_checksum = NULL;
 
+  rpmostreecxx::Phase phase (RPMOSTREE_PHASE_COMMIT);
   auto task = rpmostreecxx::progress_begin_task ("Writing OSTree commit");
   CXX_TRY (rpmostreecxx::failpoint ("core::commit"), error);
 
@@ -4894,6 +6387,7 @@ rpmostree_context_commit (RpmOstreeContext *self, const char *parent,
     mtree = ostree_mutable_tree_new ();
 
     const guint64 start_time_ms = g_get_monotonic_time () / 1000;
+    rpmostreecxx::TraceSpan commit_span ("ostree", "write-commit");
     if (!ostree_repo_write_dfd_to_mtree (self->ostreerepo, self->tmprootfs_dfd, ".", mtree,
                                          commit_modifier, cancellable, error))
       return FALSE;
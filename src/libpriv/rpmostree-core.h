@@ -107,9 +107,12 @@ gboolean rpmostree_context_setup (RpmOstreeContext *self, const char *install_ro
 
 void rpmostree_context_configure_from_deployment (RpmOstreeContext *self, OstreeSysroot *sysroot,
                                                   OstreeDeployment *cfg_deployment);
+void rpmostree_context_configure_from_deployment_root (RpmOstreeContext *self,
+                                                       const char *cfg_deployment_root);
 
 void rpmostree_context_set_is_empty (RpmOstreeContext *self);
 void rpmostree_context_set_allow_empty_transaction (RpmOstreeContext *self, gboolean allow);
+void rpmostree_context_set_import_memory_budget (RpmOstreeContext *self, guint64 budget);
 void rpmostree_context_disable_selinux (RpmOstreeContext *self);
 const char *rpmostree_context_get_ref (RpmOstreeContext *self);
 
@@ -121,6 +124,9 @@ void rpmostree_context_set_devino_cache (RpmOstreeContext *self,
                                          OstreeRepoDevInoCache *devino_cache);
 void rpmostree_context_disable_rofiles (RpmOstreeContext *self);
 void rpmostree_context_set_sepolicy (RpmOstreeContext *self, OstreeSePolicy *sepolicy);
+gboolean rpmostree_context_load_sepolicy_file_contexts (RpmOstreeContext *self, int rootfs_dfd,
+                                                        GCancellable *cancellable,
+                                                        GError **error);
 
 gboolean rpmostree_dnf_add_checksum_goal (GChecksum *checksum, HyGoal goal,
                                           OstreeRepo *pkgcache_repo, GError **error);
@@ -166,6 +172,9 @@ gboolean rpmostree_context_consume_package (RpmOstreeContext *self, DnfPackage *
 gboolean rpmostree_context_import (RpmOstreeContext *self, GCancellable *cancellable,
                                    GError **error);
 
+gboolean rpmostree_context_download_and_import (RpmOstreeContext *self,
+                                                GCancellable *cancellable, GError **error);
+
 gboolean rpmostree_context_force_relabel (RpmOstreeContext *self, GCancellable *cancellable,
                                           GError **error);
 
@@ -0,0 +1,637 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Labels are a function of the policy's file_contexts, so a policy update
+ * only changes the labels of paths matched by one of the file_contexts
+ * entries it added, removed or changed. To make use of that when relabeling
+ * the pkgcache, the file_contexts of each policy we label packages with are
+ * recorded in the pkgcache repo under `rpmostree/sepolicy/`, keyed by the
+ * checksum that goes into the `rpmostree.sepolicy` metadata of package
+ * commits. A package whose paths don't match any changed entry keeps its
+ * labels and only needs its metadata updated.
+ *
+ * Anything we can't reason about (reordered entries, changed substitutions,
+ * regexes GRegex doesn't understand) makes us fall back to relabeling
+ * everything. */
+
+#include "config.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <libglnx.h>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "rpmostree-file-contexts.h"
+#include "rpmostree-util.h"
+
+#define FILE_CONTEXTS_REF_PREFIX "rpmostree/sepolicy/"
+/* filename -> contents */
+#define FILE_CONTEXTS_VARIANT_FORMAT "a{say}"
+
+/* The files holding specs, in the order libselinux loads them */
+static const char *const spec_files[]
+    = { "file_contexts", "file_contexts.homedirs", "file_contexts.local" };
+/* Path substitutions, applied before looking up a label */
+static const char *const subs_files[] = { "file_contexts.subs_dist", "file_contexts.subs" };
+
+struct RpmOstreeFileContextsDiff
+{
+  GPtrArray *changed; /* GRegex, one per added, removed or changed spec */
+  std::vector<std::pair<std::string, std::string> > subs;
+};
+
+static gboolean
+is_file_contexts_file (const char *name)
+{
+  for (guint i = 0; i < G_N_ELEMENTS (spec_files); i++)
+    {
+      if (g_str_equal (name, spec_files[i]))
+        return TRUE;
+    }
+  for (guint i = 0; i < G_N_ELEMENTS (subs_files); i++)
+    {
+      if (g_str_equal (name, subs_files[i]))
+        return TRUE;
+    }
+  return FALSE;
+}
+
+/* Read the file_contexts of @sepolicy from @rootfs_dfd, which must be the
+ * root it was loaded from. Returns %NULL without setting @error if there are
+ * none, e.g. because the policy only ships compiled file_contexts. */
+GVariant *
+rpmostree_file_contexts_load (int rootfs_dfd, OstreeSePolicy *sepolicy, GCancellable *cancellable,
+                              GError **error)
+{
+  const char *name = ostree_sepolicy_get_name (sepolicy);
+  if (!name)
+    return NULL;
+
+  /* Same lookup order as OstreeSePolicy */
+  static const char *const etcdirs[] = { "usr/etc", "etc" };
+  glnx_autofd int files_dfd = -1;
+  for (guint i = 0; i < G_N_ELEMENTS (etcdirs) && files_dfd < 0; i++)
+    {
+      g_autofree char *path
+          = g_strconcat (etcdirs[i], "/selinux/", name, "/contexts/files", NULL);
+      if (!glnx_fstatat_allow_noent (rootfs_dfd, path, NULL, 0, error))
+        return NULL;
+      if (errno == ENOENT)
+        continue;
+      if (!glnx_opendirat (rootfs_dfd, path, TRUE, &files_dfd, error))
+        return NULL;
+    }
+  if (files_dfd < 0)
+    return NULL;
+
+  g_autoptr (GVariantBuilder) builder
+      = g_variant_builder_new (G_VARIANT_TYPE (FILE_CONTEXTS_VARIANT_FORMAT));
+  gboolean have_specs = FALSE;
+  const char *const *lists[] = { spec_files, subs_files };
+  const guint list_lens[] = { G_N_ELEMENTS (spec_files), G_N_ELEMENTS (subs_files) };
+  for (guint i = 0; i < G_N_ELEMENTS (lists); i++)
+    {
+      for (guint j = 0; j < list_lens[i]; j++)
+        {
+          const char *filename = lists[i][j];
+          if (!glnx_fstatat_allow_noent (files_dfd, filename, NULL, 0, error))
+            return NULL;
+          if (errno == ENOENT)
+            continue;
+          glnx_autofd int fd = -1;
+          if (!glnx_openat_rdonly (files_dfd, filename, TRUE, &fd, error))
+            return NULL;
+          g_autoptr (GBytes) contents = glnx_fd_readall_bytes (fd, cancellable, error);
+          if (!contents)
+            return (GVariant *)glnx_prefix_error_null (error, "Reading %s", filename);
+          g_variant_builder_add (builder, "{s@ay}", filename,
+                                 g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING, contents,
+                                                           TRUE));
+          if (i == 0 && j == 0)
+            have_specs = TRUE;
+        }
+    }
+  if (!have_specs)
+    return NULL;
+
+  return g_variant_ref_sink (g_variant_builder_end (builder));
+}
+
+/* Record @file_contexts as those of the policy with checksum @policy_csum, if
+ * they aren't already. Must be called in a transaction. */
+gboolean
+rpmostree_file_contexts_store (OstreeRepo *repo, const char *policy_csum, GVariant *file_contexts,
+                               GCancellable *cancellable, GError **error)
+{
+  g_autofree char *ref = g_strconcat (FILE_CONTEXTS_REF_PREFIX, policy_csum, NULL);
+  g_autofree char *rev = NULL;
+  if (!ostree_repo_resolve_rev (repo, ref, TRUE, &rev, error))
+    return FALSE;
+  if (rev)
+    return TRUE;
+
+  GLNX_AUTO_PREFIX_ERROR ("Recording SELinux file contexts", error);
+
+  g_auto (GLnxTmpDir) staging = {
+    0,
+  };
+  if (!glnx_mkdtempat (ostree_repo_get_dfd (repo), "tmp/rpmostree-sepolicy.XXXXXX", 0755, &staging,
+                       error))
+    return FALSE;
+
+  GVariantIter iter;
+  g_variant_iter_init (&iter, file_contexts);
+  const char *filename;
+  GVariant *contents_v_owned;
+  while (g_variant_iter_next (&iter, "{&s@ay}", &filename, &contents_v_owned))
+    {
+      g_autoptr (GVariant) contents_v = contents_v_owned;
+      gsize len;
+      auto contents = static_cast<const guint8 *> (
+          g_variant_get_fixed_array (contents_v, &len, sizeof (guint8)));
+      if (!glnx_file_replace_contents_with_perms_at (staging.fd, filename, contents, len, 0644,
+                                                     (uid_t)-1, (gid_t)-1,
+                                                     GLNX_FILE_REPLACE_NODATASYNC, cancellable,
+                                                     error))
+        return FALSE;
+    }
+
+  g_autoptr (OstreeRepoCommitModifier) modifier = ostree_repo_commit_modifier_new (
+      static_cast<OstreeRepoCommitModifierFlags> (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME
+                                                  | OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS),
+      NULL, NULL, NULL);
+  g_autoptr (OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+  if (!ostree_repo_write_dfd_to_mtree (repo, staging.fd, ".", mtree, modifier, cancellable, error))
+    return FALSE;
+  g_autoptr (GFile) root = NULL;
+  if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
+    return FALSE;
+
+  g_autoptr (GVariantDict) meta_dict = g_variant_dict_new (NULL);
+  g_variant_dict_insert (meta_dict, "rpmostree.sepolicy", "s", policy_csum);
+  g_autofree char *commit_csum = NULL;
+  if (!ostree_repo_write_commit (repo, NULL, "", "", g_variant_dict_end (meta_dict),
+                                 OSTREE_REPO_FILE (root), &commit_csum, cancellable, error))
+    return FALSE;
+  ostree_repo_transaction_set_ref (repo, NULL, ref, commit_csum);
+  return TRUE;
+}
+
+/* Returns the file_contexts recorded for the policy with checksum
+ * @policy_csum, or %NULL without setting @error if we don't know them. */
+GVariant *
+rpmostree_file_contexts_lookup (OstreeRepo *repo, const char *policy_csum,
+                                GCancellable *cancellable, GError **error)
+{
+  g_autofree char *ref = g_strconcat (FILE_CONTEXTS_REF_PREFIX, policy_csum, NULL);
+  g_autofree char *rev = NULL;
+  if (!ostree_repo_resolve_rev (repo, ref, TRUE, &rev, error))
+    return NULL;
+  if (!rev)
+    return NULL;
+
+  g_autoptr (GFile) root = NULL;
+  if (!ostree_repo_read_commit (repo, rev, &root, NULL, cancellable, error))
+    return NULL;
+  g_autoptr (GFileEnumerator) direnum
+      = g_file_enumerate_children (root, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                   G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, cancellable, error);
+  if (!direnum)
+    return NULL;
+
+  g_autoptr (GVariantBuilder) builder
+      = g_variant_builder_new (G_VARIANT_TYPE (FILE_CONTEXTS_VARIANT_FORMAT));
+  while (TRUE)
+    {
+      GFileInfo *info = NULL;
+      GFile *child = NULL;
+      if (!g_file_enumerator_iterate (direnum, &info, &child, cancellable, error))
+        return NULL;
+      if (!info)
+        break;
+      const char *filename = g_file_info_get_name (info);
+      if (!is_file_contexts_file (filename))
+        continue;
+      g_autoptr (GBytes) contents = g_file_load_bytes (child, cancellable, NULL, error);
+      if (!contents)
+        return NULL;
+      g_variant_builder_add (
+          builder, "{s@ay}", filename,
+          g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING, contents, TRUE));
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (builder));
+}
+
+/* Forget the file_contexts of all but the @n_keep most recently recorded
+ * policies; packages labeled with older ones simply get fully relabeled. Must
+ * be called in a transaction. */
+gboolean
+rpmostree_file_contexts_prune (OstreeRepo *repo, guint n_keep, GCancellable *cancellable,
+                               GError **error)
+{
+  g_autoptr (GHashTable) refs = NULL;
+  if (!ostree_repo_list_refs_ext (repo, "rpmostree/sepolicy", &refs,
+                                  OSTREE_REPO_LIST_REFS_EXT_NONE, cancellable, error))
+    return FALSE;
+  if (g_hash_table_size (refs) <= n_keep)
+    return TRUE;
+
+  std::vector<std::pair<guint64, std::string> > by_age;
+  GLNX_HASH_TABLE_FOREACH_KV (refs, const char *, ref, const char *, rev)
+    {
+      g_autoptr (GVariant) commit = NULL;
+      if (!ostree_repo_load_commit (repo, rev, &commit, NULL, error))
+        return FALSE;
+      by_age.emplace_back (ostree_commit_get_timestamp (commit), ref);
+    }
+  std::sort (by_age.begin (), by_age.end (), std::greater<> ());
+
+  for (size_t i = n_keep; i < by_age.size (); i++)
+    ostree_repo_transaction_set_ref (repo, NULL, by_age[i].second.c_str (), NULL);
+  return TRUE;
+}
+
+/* Append the whitespace-separated fields of each non-comment line in
+ * @contents to @out, normalized so that formatting changes don't show up as
+ * changed entries. */
+static void
+parse_lines (GVariant *contents, std::vector<std::string> &out)
+{
+  gsize len;
+  auto data = static_cast<const char *> (
+      g_variant_get_fixed_array (contents, &len, sizeof (guint8)));
+  std::string buf (data, len);
+  g_auto (GStrv) lines = g_strsplit (buf.c_str (), "\n", -1);
+  for (char **it = lines; it && *it; it++)
+    {
+      std::string entry;
+      for (char *p = *it; *p;)
+        {
+          p += strspn (p, " \t\r");
+          if (!*p || (entry.empty () && *p == '#'))
+            break;
+          const size_t n = strcspn (p, " \t\r");
+          if (!entry.empty ())
+            entry += ' ';
+          entry.append (p, n);
+          p += n;
+        }
+      if (!entry.empty ())
+        out.push_back (std::move (entry));
+    }
+}
+
+static void
+parse_files (GVariant *file_contexts, const char *const *files, guint n_files,
+             std::vector<std::string> &out)
+{
+  g_autoptr (GVariantDict) dict = g_variant_dict_new (file_contexts);
+  for (guint i = 0; i < n_files; i++)
+    {
+      g_autoptr (GVariant) contents
+          = g_variant_dict_lookup_value (dict, files[i], G_VARIANT_TYPE_BYTESTRING);
+      if (contents)
+        parse_lines (contents, out);
+    }
+}
+
+/* Work out which file_contexts entries differ between @old_file_contexts and
+ * @new_file_contexts. Returns %NULL if we can't tell which paths may have
+ * changed label; all of them must be relabeled then. */
+RpmOstreeFileContextsDiff *
+rpmostree_file_contexts_diff_new (GVariant *old_file_contexts, GVariant *new_file_contexts)
+{
+  std::vector<std::string> old_subs, new_subs;
+  parse_files (old_file_contexts, subs_files, G_N_ELEMENTS (subs_files), old_subs);
+  parse_files (new_file_contexts, subs_files, G_N_ELEMENTS (subs_files), new_subs);
+  if (old_subs != new_subs)
+    {
+      g_debug ("file_contexts substitutions changed");
+      return NULL;
+    }
+
+  std::vector<std::string> old_specs, new_specs;
+  parse_files (old_file_contexts, spec_files, G_N_ELEMENTS (spec_files), old_specs);
+  parse_files (new_file_contexts, spec_files, G_N_ELEMENTS (spec_files), new_specs);
+
+  /* When several entries match a path the last one wins, so a path matching
+   * none of the changed entries only keeps its label if the entries present
+   * in both kept their relative order. */
+  std::set<std::string> old_set (old_specs.begin (), old_specs.end ());
+  std::set<std::string> new_set (new_specs.begin (), new_specs.end ());
+  std::vector<std::string> old_common, new_common;
+  std::copy_if (old_specs.begin (), old_specs.end (), std::back_inserter (old_common),
+                [&] (const std::string &s) { return new_set.count (s) > 0; });
+  std::copy_if (new_specs.begin (), new_specs.end (), std::back_inserter (new_common),
+                [&] (const std::string &s) { return old_set.count (s) > 0; });
+  if (old_common != new_common)
+    {
+      g_debug ("file_contexts entries were reordered");
+      return NULL;
+    }
+
+  std::vector<std::string> old_sorted (old_specs), new_sorted (new_specs), changed;
+  std::sort (old_sorted.begin (), old_sorted.end ());
+  std::sort (new_sorted.begin (), new_sorted.end ());
+  std::set_symmetric_difference (old_sorted.begin (), old_sorted.end (), new_sorted.begin (),
+                                 new_sorted.end (), std::back_inserter (changed));
+
+  g_autoptr (GPtrArray) regexes = g_ptr_array_new_with_free_func ((GDestroyNotify)g_regex_unref);
+  std::set<std::string> seen;
+  for (auto &spec : changed)
+    {
+      std::string re = spec.substr (0, spec.find (' '));
+      if (!seen.insert (re).second)
+        continue;
+      /* Anchored the same way libselinux does it */
+      g_autofree char *anchored = g_strconcat ("^", re.c_str (), "$", NULL);
+      g_autoptr (GError) local_error = NULL;
+      GRegex *regex = g_regex_new (anchored, G_REGEX_OPTIMIZE, static_cast<GRegexMatchFlags> (0),
+                                   &local_error);
+      if (!regex)
+        {
+          g_debug ("Failed to compile file_contexts regex %s: %s", re.c_str (),
+                   local_error->message);
+          return NULL;
+        }
+      g_ptr_array_add (regexes, regex);
+    }
+  g_debug ("%u file_contexts entries changed", regexes->len);
+
+  auto diff = new RpmOstreeFileContextsDiff ();
+  diff->changed = util::move_nullify (regexes);
+  for (auto &sub : new_subs)
+    {
+      const size_t sep = sub.find (' ');
+      if (sep == std::string::npos)
+        continue;
+      /* Only the first two fields are used */
+      std::string dest = sub.substr (sep + 1);
+      diff->subs.emplace_back (sub.substr (0, sep), dest.substr (0, dest.find (' ')));
+    }
+  return diff;
+}
+
+void
+rpmostree_file_contexts_diff_free (RpmOstreeFileContextsDiff *diff)
+{
+  if (!diff)
+    return;
+  g_clear_pointer (&diff->changed, g_ptr_array_unref);
+  delete diff;
+}
+
+static gboolean
+diff_matches_exact (RpmOstreeFileContextsDiff *diff, const char *path)
+{
+  for (guint i = 0; i < diff->changed->len; i++)
+    {
+      if (g_regex_match (static_cast<GRegex *> (diff->changed->pdata[i]), path,
+                         static_cast<GRegexMatchFlags> (0), NULL))
+        return TRUE;
+    }
+  return FALSE;
+}
+
+static gboolean
+diff_matches_subst (RpmOstreeFileContextsDiff *diff, const std::string &path)
+{
+  if (diff_matches_exact (diff, path.c_str ()))
+    return TRUE;
+  for (auto &[alias, dest] : diff->subs)
+    {
+      if (path.compare (0, alias.size (), alias) == 0
+          && (path.size () == alias.size () || path[alias.size ()] == '/'))
+        {
+          std::string substituted = dest + path.substr (alias.size ());
+          if (diff_matches_exact (diff, substituted.c_str ()))
+            return TRUE;
+        }
+    }
+  return FALSE;
+}
+
+/* Whether the label of @path may differ between the two policies */
+gboolean
+rpmostree_file_contexts_diff_matches (RpmOstreeFileContextsDiff *diff, const char *path)
+{
+  std::string p (path);
+  if (diff_matches_subst (diff, p))
+    return TRUE;
+  /* Content in /usr/etc is labeled as if it was in /etc */
+  if (g_str_has_prefix (path, "/usr/etc") && (path[8] == '\0' || path[8] == '/'))
+    return diff_matches_subst (diff, p.substr (4));
+  return FALSE;
+}
+
+static gboolean
+diff_matches_dirtree (OstreeRepo *repo, RpmOstreeFileContextsDiff *diff, const char *dirtree_csum,
+                      std::string &path, gboolean *out_matches, GCancellable *cancellable,
+                      GError **error)
+{
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  g_autoptr (GVariant) dirtree = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_csum, &dirtree, error))
+    return FALSE;
+  g_autoptr (GVariant) files = g_variant_get_child_value (dirtree, 0);
+  g_autoptr (GVariant) dirs = g_variant_get_child_value (dirtree, 1);
+
+  const size_t origlen = path.size ();
+  GVariantIter iter;
+  const char *name;
+  g_variant_iter_init (&iter, files);
+  while (g_variant_iter_next (&iter, "(&s@ay)", &name, NULL))
+    {
+      path.append ("/").append (name);
+      const gboolean matches = rpmostree_file_contexts_diff_matches (diff, path.c_str ());
+      path.resize (origlen);
+      if (matches)
+        {
+          *out_matches = TRUE;
+          return TRUE;
+        }
+    }
+
+  GVariant *subtree_csum_v;
+  g_variant_iter_init (&iter, dirs);
+  while (g_variant_iter_loop (&iter, "(&s@ay@ay)", &name, &subtree_csum_v, NULL))
+    {
+      path.append ("/").append (name);
+      if (rpmostree_file_contexts_diff_matches (diff, path.c_str ()))
+        *out_matches = TRUE;
+      else
+        {
+          g_autofree char *subtree_csum = ostree_checksum_from_bytes_v (subtree_csum_v);
+          if (!diff_matches_dirtree (repo, diff, subtree_csum, path, out_matches, cancellable,
+                                     error))
+            return FALSE;
+        }
+      path.resize (origlen);
+      if (*out_matches)
+        {
+          g_variant_unref (subtree_csum_v);
+          return TRUE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Sets @out_matches if any path in @commit_csum may have changed label. Only
+ * the directory metadata is read, not the content. */
+gboolean
+rpmostree_file_contexts_diff_matches_commit (OstreeRepo *repo, RpmOstreeFileContextsDiff *diff,
+                                             const char *commit_csum, gboolean *out_matches,
+                                             GCancellable *cancellable, GError **error)
+{
+  *out_matches = FALSE;
+
+  g_autoptr (GVariant) commit = NULL;
+  if (!ostree_repo_load_commit (repo, commit_csum, &commit, NULL, error))
+    return FALSE;
+  if (rpmostree_file_contexts_diff_matches (diff, "/"))
+    {
+      *out_matches = TRUE;
+      return TRUE;
+    }
+
+  g_autoptr (GVariant) root_csum_v = g_variant_get_child_value (commit, 6);
+  g_autofree char *root_csum = ostree_checksum_from_bytes_v (root_csum_v);
+  std::string path;
+  return diff_matches_dirtree (repo, diff, root_csum, path, out_matches, cancellable, error);
+}
+
+#ifdef BUILDOPT_BIN_UNIT_TESTS
+static GVariant *
+test_file_contexts (const char *specs, const char *subs)
+{
+  g_autoptr (GVariantBuilder) builder
+      = g_variant_builder_new (G_VARIANT_TYPE (FILE_CONTEXTS_VARIANT_FORMAT));
+  g_variant_builder_add (builder, "{s@ay}", "file_contexts",
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, specs, strlen (specs),
+                                                    sizeof (guint8)));
+  if (subs)
+    g_variant_builder_add (builder, "{s@ay}", "file_contexts.subs_dist",
+                           g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, subs, strlen (subs),
+                                                      sizeof (guint8)));
+  return g_variant_ref_sink (g_variant_builder_end (builder));
+}
+
+static void
+test_file_contexts_diff (void)
+{
+  const char *base = "/usr/bin(/.*)?\tsystem_u:object_r:bin_t:s0\n"
+                     "/usr/bin/foo\t--\tsystem_u:object_r:foo_exec_t:s0\n"
+                     "/etc/foo\\.conf\t--\tsystem_u:object_r:foo_conf_t:s0\n"
+                     "/root(/.*)?\tsystem_u:object_r:admin_home_t:s0\n";
+  const char *subs = "/var/roothome /root\n";
+  g_autoptr (GVariant) old_fc = test_file_contexts (base, subs);
+
+  /* Only formatting and comments changed */
+  {
+    g_autoptr (GVariant) new_fc = test_file_contexts (
+        "# A comment\n"
+        "/usr/bin(/.*)?    system_u:object_r:bin_t:s0\n"
+        "/usr/bin/foo -- system_u:object_r:foo_exec_t:s0\n\n"
+        "/etc/foo\\.conf\t--\tsystem_u:object_r:foo_conf_t:s0   \n"
+        "/root(/.*)?\tsystem_u:object_r:admin_home_t:s0\n",
+        subs);
+    g_autoptr (RpmOstreeFileContextsDiff) diff = rpmostree_file_contexts_diff_new (old_fc, new_fc);
+    g_assert (diff);
+    g_assert (!rpmostree_file_contexts_diff_matches (diff, "/"));
+    g_assert (!rpmostree_file_contexts_diff_matches (diff, "/usr/bin/foo"));
+  }
+
+  /* One label changed, one entry added */
+  {
+    g_autoptr (GVariant) new_fc = test_file_contexts (
+        "/usr/bin(/.*)?\tsystem_u:object_r:bin_t:s0\n"
+        "/usr/bin/foo\t--\tsystem_u:object_r:bar_exec_t:s0\n"
+        "/etc/foo\\.conf\t--\tsystem_u:object_r:foo_conf_t:s0\n"
+        "/root(/.*)?\tsystem_u:object_r:admin_home_t:s0\n"
+        "/root/\\.foo\t--\tsystem_u:object_r:foo_home_t:s0\n",
+        subs);
+    g_autoptr (RpmOstreeFileContextsDiff) diff = rpmostree_file_contexts_diff_new (old_fc, new_fc);
+    g_assert (diff);
+    g_assert (rpmostree_file_contexts_diff_matches (diff, "/usr/bin/foo"));
+    g_assert (!rpmostree_file_contexts_diff_matches (diff, "/usr/bin/foobar"));
+    g_assert (!rpmostree_file_contexts_diff_matches (diff, "/usr/bin"));
+    g_assert (rpmostree_file_contexts_diff_matches (diff, "/root/.foo"));
+    /* Via the substitution */
+    g_assert (rpmostree_file_contexts_diff_matches (diff, "/var/roothome/.foo"));
+    g_assert (!rpmostree_file_contexts_diff_matches (diff, "/var/roothomefoo/.foo"));
+  }
+
+  /* Content in /usr/etc is labeled as if it was in /etc */
+  {
+    g_autoptr (GVariant) new_fc = test_file_contexts (
+        "/usr/bin(/.*)?\tsystem_u:object_r:bin_t:s0\n"
+        "/usr/bin/foo\t--\tsystem_u:object_r:foo_exec_t:s0\n"
+        "/etc/foo\\.conf\t--\tsystem_u:object_r:etc_t:s0\n"
+        "/root(/.*)?\tsystem_u:object_r:admin_home_t:s0\n",
+        subs);
+    g_autoptr (RpmOstreeFileContextsDiff) diff = rpmostree_file_contexts_diff_new (old_fc, new_fc);
+    g_assert (diff);
+    g_assert (rpmostree_file_contexts_diff_matches (diff, "/etc/foo.conf"));
+    g_assert (rpmostree_file_contexts_diff_matches (diff, "/usr/etc/foo.conf"));
+    g_assert (!rpmostree_file_contexts_diff_matches (diff, "/usr/etcfoo.conf"));
+    g_assert (!rpmostree_file_contexts_diff_matches (diff, "/etc/fooXconf"));
+  }
+
+  /* Things we can't reason about */
+  {
+    g_autoptr (GVariant) reordered = test_file_contexts (
+        "/usr/bin/foo\t--\tsystem_u:object_r:foo_exec_t:s0\n"
+        "/usr/bin(/.*)?\tsystem_u:object_r:bin_t:s0\n"
+        "/etc/foo\\.conf\t--\tsystem_u:object_r:foo_conf_t:s0\n"
+        "/root(/.*)?\tsystem_u:object_r:admin_home_t:s0\n",
+        subs);
+    g_assert (rpmostree_file_contexts_diff_new (old_fc, reordered) == NULL);
+
+    g_autoptr (GVariant) new_subs = test_file_contexts (base, "/var/roothome /root\n/foo /bar\n");
+    g_assert (rpmostree_file_contexts_diff_new (old_fc, new_subs) == NULL);
+    g_autoptr (GVariant) no_subs = test_file_contexts (base, NULL);
+    g_assert (rpmostree_file_contexts_diff_new (old_fc, no_subs) == NULL);
+
+    g_autoptr (GVariant) bad_regex = test_file_contexts (
+        "/usr/bin(/.*)?\tsystem_u:object_r:bin_t:s0\n"
+        "/usr/bin/foo\t--\tsystem_u:object_r:foo_exec_t:s0\n"
+        "/etc/foo\\.conf\t--\tsystem_u:object_r:foo_conf_t:s0\n"
+        "/root(/.*)?\tsystem_u:object_r:admin_home_t:s0\n"
+        "/usr/lib/foo(\tsystem_u:object_r:lib_t:s0\n",
+        subs);
+    g_assert (rpmostree_file_contexts_diff_new (old_fc, bad_regex) == NULL);
+  }
+  g_print ("ok %s\n", G_STRFUNC);
+}
+#endif
+
+void
+rpmostree_file_contexts_tests (void)
+{
+#ifdef BUILDOPT_BIN_UNIT_TESTS
+  test_file_contexts_diff ();
+#endif
+}
@@ -0,0 +1,58 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+GVariant *rpmostree_file_contexts_load (int rootfs_dfd, OstreeSePolicy *sepolicy,
+                                        GCancellable *cancellable, GError **error);
+
+gboolean rpmostree_file_contexts_store (OstreeRepo *repo, const char *policy_csum,
+                                        GVariant *file_contexts, GCancellable *cancellable,
+                                        GError **error);
+
+GVariant *rpmostree_file_contexts_lookup (OstreeRepo *repo, const char *policy_csum,
+                                          GCancellable *cancellable, GError **error);
+
+gboolean rpmostree_file_contexts_prune (OstreeRepo *repo, guint n_keep, GCancellable *cancellable,
+                                        GError **error);
+
+typedef struct RpmOstreeFileContextsDiff RpmOstreeFileContextsDiff;
+
+RpmOstreeFileContextsDiff *rpmostree_file_contexts_diff_new (GVariant *old_file_contexts,
+                                                             GVariant *new_file_contexts);
+
+void rpmostree_file_contexts_diff_free (RpmOstreeFileContextsDiff *diff);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeFileContextsDiff, rpmostree_file_contexts_diff_free)
+
+gboolean rpmostree_file_contexts_diff_matches (RpmOstreeFileContextsDiff *diff, const char *path);
+
+gboolean rpmostree_file_contexts_diff_matches_commit (OstreeRepo *repo,
+                                                      RpmOstreeFileContextsDiff *diff,
+                                                      const char *commit_csum,
+                                                      gboolean *out_matches,
+                                                      GCancellable *cancellable, GError **error);
+
+void rpmostree_file_contexts_tests (void);
+
+G_END_DECLS
@@ -32,6 +32,7 @@
 #include "rpmostree-core.h"
 #include "rpmostree-importer.h"
 #include "rpmostree-rpm-util.h"
+#include "rpmostree-trace.h"
 #include "rpmostree-unpacker-core.h"
 #include "rpmostree-util.h"
 #include <archive.h>
@@ -49,6 +50,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* Uncompressed payload size above which we decompress in a separate thread */
+#define RPMOSTREE_THREADED_UNPACK_MIN_SIZE (64 * 1024 * 1024)
+
 typedef GObjectClass RpmOstreeImporterClass;
 
 struct RpmOstreeImporter
@@ -63,6 +67,16 @@ struct RpmOstreeImporter
   off_t cpio_offset;
   DnfPackage *pkg;
 
+  RpmOstreePayloadDigest *payload_digest; /* Only while learning into content_index */
+  RpmOstreeContentIndex *content_index;   /* borrowed */
+  gboolean content_index_learn;           /* Package signature was verified */
+  RpmOstreeLabelCache *label_cache;       /* borrowed, or own_label_cache */
+  RpmOstreeLabelCache *own_label_cache;
+  GHashTable *content_paths;   /* ostree path → rpmfi index */
+  GHashTable *content_pending; /* ostree path → content index key */
+  GHashTable *content_xattrs;  /* ostree path → final xattrs, until xattr_cb takes them */
+  guint n_content_reused;
+
   std::optional<rust::Box<rpmostreecxx::RpmImporter>> importer_rs;
 };
 
@@ -76,11 +90,17 @@ rpmostree_importer_finalize (GObject *object)
     headerFree (self->hdr);
   if (self->archive)
     archive_read_free (self->archive);
+  /* After the archive, which may read into it */
+  g_clear_pointer (&self->payload_digest, rpmostree_payload_digest_free);
   if (self->fi)
     (void)rpmfiFree (self->fi);
   glnx_close_fd (&self->fd);
   g_clear_object (&self->repo);
   g_clear_object (&self->sepolicy);
+  g_clear_pointer (&self->content_paths, g_hash_table_unref);
+  g_clear_pointer (&self->content_pending, g_hash_table_unref);
+  g_clear_pointer (&self->content_xattrs, g_hash_table_unref);
+  g_clear_pointer (&self->own_label_cache, rpmostree_label_cache_free);
 
   self->importer_rs.~optional ();
 
@@ -241,10 +261,6 @@ rpmostree_importer_new_take_fd (int *fd, OstreeRepo *repo, DnfPackage *pkg,
   g_auto (rpmfi) fi = NULL;
   gsize cpio_offset = 0;
 
-  g_autoptr (archive) ar = rpmostree_unpack_rpm2cpio (*fd, error);
-  if (ar == NULL)
-    return NULL;
-
   if (!rpmostree_importer_read_metainfo (*fd, flags, &hdr, &cpio_offset, &fi, error))
     return (RpmOstreeImporter *)glnx_prefix_error_null (error, "Reading metainfo");
   g_assert (hdr != NULL);
@@ -261,7 +277,6 @@ rpmostree_importer_new_take_fd (int *fd, OstreeRepo *repo, DnfPackage *pkg,
   ret->repo = (OstreeRepo *)g_object_ref (repo);
   ret->sepolicy = (OstreeSePolicy *)(sepolicy ? g_object_ref (sepolicy) : NULL);
   ret->fi = util::move_nullify (fi);
-  ret->archive = util::move_nullify (ar);
   ret->hdr = util::move_nullify (hdr);
   ret->cpio_offset = cpio_offset;
   ret->pkg = (DnfPackage *)(pkg ? g_object_ref (pkg) : NULL);
@@ -455,9 +470,410 @@ build_metadata_variant (RpmOstreeImporter *self, GVariant **out_variant, char **
   return TRUE;
 }
 
+/* The content index maps a digest of everything which determines the ostree
+ * content object for a file in an RPM payload (the RPM file digest, the final
+ * mode/uid/gid, xattrs and SELinux label) to the checksum of that object. This
+ * lets us link files which didn't change across package updates into the mtree
+ * without checksumming and writing them again. Entries are only hints; they're
+ * checked against the repo before being used. They're only learned from
+ * packages whose signature was verified, and whose payload matches the payload
+ * digest of their header, which we compute while importing it. The signature
+ * covers the header, so the file digests can be trusted then. Unsigned packages
+ * (local packages, gpgcheck=0) can pick any file digests they like, so they
+ * may link known objects but never teach the index new ones.
+ */
+#define RPMOSTREE_CONTENT_INDEX_DIR "extensions/rpmostree"
+#define RPMOSTREE_CONTENT_INDEX_PATH RPMOSTREE_CONTENT_INDEX_DIR "/pkgcache-content-index"
+#define CONTENT_INDEX_KEY_LEN OSTREE_SHA256_DIGEST_LEN
+#define CONTENT_INDEX_RECORD_LEN (CONTENT_INDEX_KEY_LEN + OSTREE_SHA256_DIGEST_LEN)
+/* On disk that's 16MiB; see rpmostree_content_index_save() */
+#define CONTENT_INDEX_MAX_ENTRIES (256 * 1024)
+
+struct RpmOstreeContentIndex
+{
+  OstreeRepo *repo;
+  GMutex lock;
+  GHashTable *entries; /* record (key, raw checksum, used flag) → checksum */
+  gboolean dirty;
+};
+
+static guint
+content_index_key_hash (gconstpointer v)
+{
+  /* Keys are SHA-256 digests already */
+  guint ret;
+  memcpy (&ret, v, sizeof (ret));
+  return ret;
+}
+
+static gboolean
+content_index_key_equal (gconstpointer a, gconstpointer b)
+{
+  return memcmp (a, b, CONTENT_INDEX_KEY_LEN) == 0;
+}
+
+/* In memory, records are followed by a byte which is set once the entry was
+ * looked up or learned by this process. */
+static void
+content_index_insert_record (RpmOstreeContentIndex *index, const guint8 *key,
+                             const guint8 *csum_bytes, gboolean used)
+{
+  auto rec = static_cast<guint8 *> (g_malloc (CONTENT_INDEX_RECORD_LEN + 1));
+  memcpy (rec, key, CONTENT_INDEX_KEY_LEN);
+  memcpy (rec + CONTENT_INDEX_KEY_LEN, csum_bytes, OSTREE_SHA256_DIGEST_LEN);
+  rec[CONTENT_INDEX_RECORD_LEN] = used ? 1 : 0;
+  g_hash_table_replace (index->entries, rec, rec + CONTENT_INDEX_KEY_LEN);
+}
+
+/*
+ * rpmostree_content_index_load:
+ * @repo: pkgcache repo
+ *
+ * Load the content index for @repo; a missing or corrupt index just
+ * yields an empty one.
+ */
+RpmOstreeContentIndex *
+rpmostree_content_index_load (OstreeRepo *repo, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (RpmOstreeContentIndex) index = g_new0 (RpmOstreeContentIndex, 1);
+  index->repo = (OstreeRepo *)g_object_ref (repo);
+  g_mutex_init (&index->lock);
+  index->entries
+      = g_hash_table_new_full (content_index_key_hash, content_index_key_equal, g_free, NULL);
+
+  int repo_dfd = ostree_repo_get_dfd (repo);
+  if (!glnx_fstatat_allow_noent (repo_dfd, RPMOSTREE_CONTENT_INDEX_PATH, NULL, 0, error))
+    return NULL;
+  if (errno == ENOENT)
+    return util::move_nullify (index);
+
+  glnx_autofd int fd = -1;
+  if (!glnx_openat_rdonly (repo_dfd, RPMOSTREE_CONTENT_INDEX_PATH, TRUE, &fd, error))
+    return NULL;
+  g_autoptr (GBytes) data = glnx_fd_readall_bytes (fd, cancellable, error);
+  if (!data)
+    return NULL;
+
+  gsize len;
+  auto buf = static_cast<const guint8 *> (g_bytes_get_data (data, &len));
+  if (len % CONTENT_INDEX_RECORD_LEN != 0)
+    {
+      g_debug ("Ignoring corrupt content index (%" G_GSIZE_FORMAT " bytes)", len);
+      index->dirty = TRUE;
+      return util::move_nullify (index);
+    }
+  len = MIN (len, CONTENT_INDEX_MAX_ENTRIES * CONTENT_INDEX_RECORD_LEN);
+  for (gsize off = 0; off < len; off += CONTENT_INDEX_RECORD_LEN)
+    content_index_insert_record (index, buf + off, buf + off + CONTENT_INDEX_KEY_LEN, FALSE);
+
+  return util::move_nullify (index);
+}
+
+/* Write out @index if it changed since it was loaded. Past
+ * %CONTENT_INDEX_MAX_ENTRIES, entries this process didn't use are dropped
+ * first; nothing else ever removes entries for objects which are still in
+ * the repo. */
+gboolean
+rpmostree_content_index_save (RpmOstreeContentIndex *index, GCancellable *cancellable,
+                              GError **error)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+  if (!index->dirty)
+    return TRUE;
+
+  const guint n = MIN (g_hash_table_size (index->entries), CONTENT_INDEX_MAX_ENTRIES);
+  g_autoptr (GByteArray) buf = g_byte_array_sized_new (n * CONTENT_INDEX_RECORD_LEN);
+  /* Used entries in the first pass, the rest in the second */
+  for (guint pass = 0; pass < 2; pass++)
+    {
+      const guint8 used = pass == 0 ? 1 : 0;
+      GHashTableIter it;
+      gpointer rec;
+      g_hash_table_iter_init (&it, index->entries);
+      while (buf->len < n * CONTENT_INDEX_RECORD_LEN && g_hash_table_iter_next (&it, &rec, NULL))
+        {
+          if (static_cast<guint8 *> (rec)[CONTENT_INDEX_RECORD_LEN] == used)
+            g_byte_array_append (buf, static_cast<guint8 *> (rec), CONTENT_INDEX_RECORD_LEN);
+        }
+    }
+
+  int repo_dfd = ostree_repo_get_dfd (index->repo);
+  if (!glnx_shutil_mkdir_p_at (repo_dfd, RPMOSTREE_CONTENT_INDEX_DIR, 0755, cancellable, error))
+    return FALSE;
+  if (!glnx_file_replace_contents_at (repo_dfd, RPMOSTREE_CONTENT_INDEX_PATH, buf->data, buf->len,
+                                      GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+    return glnx_prefix_error (error, "Writing content index");
+
+  index->dirty = FALSE;
+  return TRUE;
+}
+
+void
+rpmostree_content_index_free (RpmOstreeContentIndex *index)
+{
+  g_clear_object (&index->repo);
+  g_mutex_clear (&index->lock);
+  g_clear_pointer (&index->entries, g_hash_table_unref);
+  g_free (index);
+}
+
+/* Look up @key; @out_checksum is set to %NULL if there's no entry or its
+ * object is no longer in the repo (e.g. it was pruned). */
+static gboolean
+content_index_lookup (RpmOstreeContentIndex *index, const guint8 *key, char **out_checksum,
+                      GCancellable *cancellable, GError **error)
+{
+  *out_checksum = NULL;
+
+  guint8 csum_bytes[OSTREE_SHA256_DIGEST_LEN];
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+    auto found = static_cast<guint8 *> (g_hash_table_lookup (index->entries, key));
+    if (!found)
+      return TRUE;
+    memcpy (csum_bytes, found, sizeof (csum_bytes));
+    found[OSTREE_SHA256_DIGEST_LEN] = 1;
+  }
+
+  char checksum[OSTREE_SHA256_STRING_LEN + 1];
+  ostree_checksum_inplace_from_bytes (csum_bytes, checksum);
+  gboolean have_obj = FALSE;
+  if (!ostree_repo_has_object (index->repo, OSTREE_OBJECT_TYPE_FILE, checksum, &have_obj,
+                               cancellable, error))
+    return FALSE;
+  if (!have_obj)
+    {
+      g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+      g_hash_table_remove (index->entries, key);
+      index->dirty = TRUE;
+      return TRUE;
+    }
+
+  *out_checksum = g_strdup (checksum);
+  return TRUE;
+}
+
+static void
+content_index_insert (RpmOstreeContentIndex *index, const guint8 *key, const char *checksum)
+{
+  guint8 csum_bytes[OSTREE_SHA256_DIGEST_LEN];
+  ostree_checksum_inplace_to_bytes (checksum, csum_bytes);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&index->lock);
+  content_index_insert_record (index, key, csum_bytes, TRUE);
+  index->dirty = TRUE;
+}
+
+/*
+ * rpmostree_importer_set_content_index:
+ * @index: (transfer none): Content index, must outlive the import
+ * @learn: Whether the package signature was verified
+ *
+ * Reuse already imported file objects found in @index. If @learn is set,
+ * also record the ones written by this import into it.
+ */
+void
+rpmostree_importer_set_content_index (RpmOstreeImporter *self, RpmOstreeContentIndex *index,
+                                      gboolean learn)
+{
+  self->content_index = index;
+  self->content_index_learn = learn;
+}
+
+/**
+ * rpmostree_importer_set_label_cache:
+ * @cache: (transfer none): Label cache for the importer's policy, must outlive the import
+ *
+ * Look up SELinux labels through @cache rather than directly from the policy.
+ */
+void
+rpmostree_importer_set_label_cache (RpmOstreeImporter *self, RpmOstreeLabelCache *cache)
+{
+  g_assert (rpmostree_label_cache_get_sepolicy (cache) == self->sepolicy);
+  self->label_cache = cache;
+}
+
+/* Map the ostree path of each regular file in the payload to its rpmfi index */
+static void
+build_content_paths (RpmOstreeImporter *self)
+{
+  self->content_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->content_pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->content_xattrs
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+
+  int i;
+  rpmfiInit (self->fi, 0);
+  while ((i = rpmfiNext (self->fi)) >= 0)
+    {
+      /* The archive importer resolves hardlinks by path; leave those to it */
+      if (!S_ISREG (rpmfiFMode (self->fi)) || rpmfiFNlink (self->fi) > 1)
+        continue;
+      const char *fn = rpmfiFN (self->fi);
+      if (fn == NULL || fn[0] != '/')
+        continue;
+      auto translated = rpmostreecxx::translate_path_for_ostree (fn + 1);
+      g_autofree char *path = translated.size () != 0
+                                  ? g_strconcat ("/", translated.c_str (), NULL)
+                                  : g_strdup (fn);
+      g_hash_table_insert (self->content_paths, util::move_nullify (path), GINT_TO_POINTER (i));
+    }
+}
+
+static GVariant *build_final_xattrs (RpmOstreeImporter *self, const char *path, guint32 mode,
+                                     GError **error);
+
+/* Compute the content index key for the file at @path as it will be committed
+ * with @file_info, and the xattrs it will be committed with; returns %FALSE if
+ * it's not eligible. */
+static gboolean
+content_index_key_for_path (RpmOstreeImporter *self, const char *path, GFileInfo *file_info,
+                            guint8 *out_key, GVariant **out_xattrs)
+{
+  gpointer fi_index;
+  if (!g_hash_table_lookup_extended (self->content_paths, path, NULL, &fi_index))
+    return FALSE;
+  rpmfiInit (self->fi, GPOINTER_TO_INT (fi_index));
+  if (rpmfiNext (self->fi) < 0)
+    return FALSE;
+
+  int algo = 0;
+  g_autofree char *digest = rpmfiFDigestHex (self->fi, &algo);
+  if (digest == NULL || digest[0] == '\0')
+    return FALSE;
+
+  /* This includes the SELinux label; see import_rpm_to_repo() */
+  const guint32 mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
+  g_autoptr (GVariant) xattrs = build_final_xattrs (self, path, mode, NULL);
+  if (!xattrs)
+    return FALSE;
+
+  const guint32 ids[] = {
+    GUINT32_TO_BE ((guint32)algo),
+    GUINT32_TO_BE (mode),
+    GUINT32_TO_BE (g_file_info_get_attribute_uint32 (file_info, "unix::uid")),
+    GUINT32_TO_BE (g_file_info_get_attribute_uint32 (file_info, "unix::gid")),
+  };
+  g_autoptr (GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (checksum, (const guint8 *)digest, strlen (digest) + 1);
+  g_checksum_update (checksum, (const guint8 *)ids, sizeof (ids));
+  g_checksum_update (checksum, (const guint8 *)g_variant_get_data (xattrs),
+                     g_variant_get_size (xattrs));
+  gsize len = CONTENT_INDEX_KEY_LEN;
+  g_checksum_get_digest (checksum, out_key, &len);
+  *out_xattrs = util::move_nullify (xattrs);
+  return TRUE;
+}
+
+/* Find the directory @dirpath in @root; sets @out_dir to %NULL if it (or one
+ * of its parents) hasn't been created yet. */
+static gboolean
+mtree_lookup_dir (OstreeMutableTree *root, const char *dirpath, OstreeMutableTree **out_dir,
+                  GError **error)
+{
+  *out_dir = NULL;
+  g_autoptr (OstreeMutableTree) dir = (OstreeMutableTree *)g_object_ref (root);
+  g_auto (GStrv) parts = g_strsplit (dirpath, "/", -1);
+  for (char **it = parts; it && *it; it++)
+    {
+      if (**it == '\0' || g_str_equal (*it, "."))
+        continue;
+      g_autofree char *file_checksum = NULL;
+      g_autoptr (OstreeMutableTree) subdir = NULL;
+      g_autoptr (GError) local_error = NULL;
+      if (!ostree_mutable_tree_lookup (dir, *it, &file_checksum, &subdir, &local_error))
+        {
+          if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            return TRUE;
+          g_propagate_error (error, util::move_nullify (local_error));
+          return FALSE;
+        }
+      if (!subdir)
+        return TRUE;
+      g_clear_object (&dir);
+      dir = util::move_nullify (subdir);
+    }
+
+  *out_dir = util::move_nullify (dir);
+  return TRUE;
+}
+
+/* Called from the commit filter for regular files. If the content index
+ * already knows the object for this file, link it into @mtree directly and
+ * set @out_linked so the archive importer skips it; otherwise remember the
+ * key so we can record the checksum once the file has been written. */
+static gboolean
+content_index_try_link (RpmOstreeImporter *self, OstreeMutableTree *mtree, const char *path,
+                        GFileInfo *file_info, gboolean *out_linked, GError **error)
+{
+  *out_linked = FALSE;
+
+  guint8 key[CONTENT_INDEX_KEY_LEN];
+  g_autoptr (GVariant) xattrs = NULL;
+  if (!content_index_key_for_path (self, path, file_info, key, &xattrs))
+    return TRUE;
+
+  g_autofree char *checksum = NULL;
+  if (!content_index_lookup (self->content_index, key, &checksum, NULL, error))
+    return FALSE;
+  if (checksum)
+    {
+      /* The archive importer creates parents on demand; if it hasn't yet,
+       * just let it write the file normally. */
+      g_autofree char *dirpath = g_path_get_dirname (path);
+      g_autoptr (OstreeMutableTree) parent = NULL;
+      if (!mtree_lookup_dir (mtree, dirpath, &parent, error))
+        return FALSE;
+      if (parent)
+        {
+          g_autofree char *name = g_path_get_basename (path);
+          if (!ostree_mutable_tree_replace_file (parent, name, checksum, error))
+            return FALSE;
+          self->n_content_reused++;
+          *out_linked = TRUE;
+          return TRUE;
+        }
+    }
+
+  if (self->content_index_learn)
+    {
+      auto pending_key = static_cast<guint8 *> (g_malloc (CONTENT_INDEX_KEY_LEN));
+      memcpy (pending_key, key, CONTENT_INDEX_KEY_LEN);
+      g_hash_table_replace (self->content_pending, g_strdup (path), pending_key);
+    }
+  g_hash_table_replace (self->content_xattrs, g_strdup (path), util::move_nullify (xattrs));
+  return TRUE;
+}
+
+/* Record the checksums of the files we wrote in full into the content index */
+static gboolean
+content_index_learn (RpmOstreeImporter *self, OstreeMutableTree *mtree, GError **error)
+{
+  GLNX_HASH_TABLE_FOREACH_KV (self->content_pending, const char *, path, const guint8 *, key)
+    {
+      g_autofree char *dirpath = g_path_get_dirname (path);
+      g_autoptr (OstreeMutableTree) parent = NULL;
+      if (!mtree_lookup_dir (mtree, dirpath, &parent, error))
+        return FALSE;
+      if (!parent)
+        continue;
+      g_autofree char *name = g_path_get_basename (path);
+      g_autofree char *file_checksum = NULL;
+      g_autoptr (OstreeMutableTree) subdir = NULL;
+      if (!ostree_mutable_tree_lookup (parent, name, &file_checksum, &subdir, NULL))
+        continue;
+      if (!file_checksum)
+        continue;
+      content_index_insert (self->content_index, key, file_checksum);
+    }
+  g_hash_table_remove_all (self->content_pending);
+  g_hash_table_remove_all (self->content_xattrs);
+  return TRUE;
+}
+
 typedef struct
 {
   RpmOstreeImporter *self;
+  OstreeMutableTree *mtree;
   GError **error;
 } cb_data;
 
@@ -523,23 +939,22 @@ compose_filter_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpo
 
   (*self->importer_rs)->tweak_imported_file_info (*file_info);
 
+  if (self->content_paths && g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+    {
+      gboolean linked = FALSE;
+      if (!content_index_try_link (self, ((cb_data *)user_data)->mtree, path, file_info, &linked,
+                                   error))
+        return OSTREE_REPO_COMMIT_FILTER_SKIP;
+      if (linked)
+        return OSTREE_REPO_COMMIT_FILTER_SKIP;
+    }
+
   return OSTREE_REPO_COMMIT_FILTER_ALLOW;
 }
 
 static GVariant *
-xattr_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpointer user_data)
+build_xattrs (RpmOstreeImporter *self, const char *path, GError **error)
 {
-  // NOTE(lucab): `path` here is the ostree-compatible absolute filepath,
-  //  i.e. after translation by `translate_pathname` callback.
-
-  /* Sanity checks: path is absolute, data pointer is ok */
-  g_assert (path != NULL);
-  g_assert (*path == '/');
-  g_assert (user_data != NULL);
-
-  RpmOstreeImporter *self = ((cb_data *)user_data)->self;
-  GError **error = ((cb_data *)user_data)->error;
-
   const char *fcaps = NULL;
 
   GVariant *imasig = NULL;
@@ -565,6 +980,45 @@ xattr_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpointer use
   return g_variant_ref_sink (g_variant_builder_end (&builder));
 }
 
+/* The xattrs for @path as committed; with a label cache, that includes the
+ * SELinux label. */
+static GVariant *
+build_final_xattrs (RpmOstreeImporter *self, const char *path, guint32 mode, GError **error)
+{
+  g_autoptr (GVariant) xattrs = build_xattrs (self, path, error);
+  if (!xattrs || !self->label_cache)
+    return util::move_nullify (xattrs);
+  return rpmostree_label_cache_apply (self->label_cache, xattrs, path, mode, TRUE, error);
+}
+
+static GVariant *
+xattr_cb (OstreeRepo *repo, const char *path, GFileInfo *file_info, gpointer user_data)
+{
+  // NOTE(lucab): `path` here is the ostree-compatible absolute filepath,
+  //  i.e. after translation by `translate_pathname` callback.
+
+  /* Sanity checks: path is absolute, data pointer is ok */
+  g_assert (path != NULL);
+  g_assert (*path == '/');
+  g_assert (user_data != NULL);
+
+  RpmOstreeImporter *self = ((cb_data *)user_data)->self;
+  GError **error = ((cb_data *)user_data)->error;
+
+  /* Already computed for the content index key */
+  gpointer stolen_path, xattrs;
+  if (self->content_xattrs
+      && g_hash_table_steal_extended (self->content_xattrs, path, &stolen_path, &xattrs))
+    {
+      g_free (stolen_path);
+      return static_cast<GVariant *> (xattrs);
+    }
+
+  /* See import_rpm_to_repo() */
+  const guint32 mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
+  return build_final_xattrs (self, path, mode, error);
+}
+
 /* Given a path in an RPM archive, possibly translate it for ostree convention. */
 static char *
 handle_translate_pathname (OstreeRepo *_repo, const struct stat *_stbuf, const char *path,
@@ -584,21 +1038,69 @@ handle_translate_pathname (OstreeRepo *_repo, const struct stat *_stbuf, const c
     return NULL;
 }
 
+/* Open the payload for reading. When we'll learn file digests into the content
+ * index, also digest the payload as it streams through, so that we can check
+ * it against the header before trusting the file digests the header lists. */
+static gboolean
+open_payload (RpmOstreeImporter *self, GError **error)
+{
+  const char *payload_digest = headerGetString (self->hdr, RPMTAG_PAYLOADDIGEST);
+  if (self->content_index && payload_digest)
+    self->payload_digest = rpmostree_payload_digest_new (
+        headerGetNumber (self->hdr, RPMTAG_PAYLOADDIGESTALGO), self->cpio_offset);
+
+  /* Very large payloads (kernel modules, firmware, ...) otherwise dominate
+   * the tail of an import; decompress those in their own thread. */
+  const guint64 payload_size = headerGetNumber (self->hdr, RPMTAG_LONGARCHIVESIZE);
+  self->archive = payload_size >= RPMOSTREE_THREADED_UNPACK_MIN_SIZE
+                      ? rpmostree_unpack_rpm2cpio_threaded (self->fd, self->payload_digest, error)
+                      : rpmostree_unpack_rpm2cpio (self->fd, self->payload_digest, error);
+  return self->archive != NULL;
+}
+
+/* Check the payload we imported against the header, see open_payload() */
+static gboolean
+verify_payload_digest (RpmOstreeImporter *self, GError **error)
+{
+  g_autofree char *actual = rpmostree_payload_digest_finish (self->payload_digest, error);
+  if (!actual)
+    return FALSE;
+  const char *expected = headerGetString (self->hdr, RPMTAG_PAYLOADDIGEST);
+  if (!g_str_equal (actual, expected))
+    return glnx_throw (error, "Payload digest mismatch: expected %s, got %s", expected, actual);
+  return TRUE;
+}
+
 static gboolean
 import_rpm_to_repo (RpmOstreeImporter *self, char **out_csum, char **out_metadata_sha256,
                     GCancellable *cancellable, GError **error)
 {
   OstreeRepo *repo = self->repo;
+  g_autoptr (OstreeMutableTree) mtree = ostree_mutable_tree_new ();
   /* Passed to the commit modifier */
   GError *cb_error = NULL;
-  cb_data fdata = { self, &cb_error };
+  cb_data fdata = { self, mtree, &cb_error };
+
+  if (!open_payload (self, error))
+    return FALSE;
+  /* Without a payload digest, we can't trust the file digests of the header */
+  if (self->payload_digest && !self->content_paths)
+    build_content_paths (self);
+  /* Label through a cache of our own if we weren't given one, so that the
+   * label for the content index key is also the one which gets committed. */
+  if (self->content_paths && !self->label_cache && self->sepolicy
+      && ostree_sepolicy_get_name (self->sepolicy) != NULL)
+    self->label_cache = self->own_label_cache = rpmostree_label_cache_new (self->sepolicy);
 
   /* If changing this, also look at changing rpmostree-postprocess.cxx */
   int modifier_flags = OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED;
   g_autoptr (OstreeRepoCommitModifier) modifier = ostree_repo_commit_modifier_new (
       static_cast<OstreeRepoCommitModifierFlags> (modifier_flags), compose_filter_cb, &fdata, NULL);
   ostree_repo_commit_modifier_set_xattr_callback (modifier, xattr_cb, NULL, &fdata);
-  ostree_repo_commit_modifier_set_sepolicy (modifier, self->sepolicy);
+  /* With a label cache, xattr_cb adds the labels itself, so that lookups are
+   * shared with other importers and with relabeling. */
+  if (!self->label_cache)
+    ostree_repo_commit_modifier_set_sepolicy (modifier, self->sepolicy);
 
   OstreeRepoImportArchiveOptions opts = { 0 };
   opts.ignore_unsupported_content = TRUE;
@@ -606,7 +1108,6 @@ import_rpm_to_repo (RpmOstreeImporter *self, char **out_csum, char **out_metadat
   opts.translate_pathname = handle_translate_pathname;
   opts.translate_pathname_user_data = self;
 
-  g_autoptr (OstreeMutableTree) mtree = ostree_mutable_tree_new ();
   if (!ostree_repo_import_archive_to_mtree (repo, &opts, self->archive, mtree, modifier,
                                             cancellable, error))
     return glnx_prefix_error (error, "Importing archive");
@@ -618,6 +1119,15 @@ import_rpm_to_repo (RpmOstreeImporter *self, char **out_csum, char **out_metadat
       return FALSE;
     }
 
+  if (self->content_paths)
+    {
+      if (!verify_payload_digest (self, error))
+        return FALSE;
+      if (!content_index_learn (self, mtree, error))
+        return FALSE;
+      g_debug ("Reused %u file objects from content index", self->n_content_reused);
+    }
+
   /* Handle any data we've accumulated to write to tmpfiles.d.
    * I originally tried to do this entirely in memory but things
    * like selinux labeling only happen as callbacks out of using
@@ -717,6 +1227,9 @@ import_in_thread (GTask *task, gpointer source, gpointer task_data, GCancellable
   auto self = static_cast<RpmOstreeImporter *> (source);
   g_autofree char *rev = NULL;
 
+  g_autofree char *trace_name
+      = rpmostree_trace_enabled () ? rpmostree_importer_get_nevra (self) : NULL;
+  rpmostreecxx::TraceSpan span ("import", trace_name);
   if (!rpmostree_importer_run (self, &rev, NULL, cancellable, &local_error))
     g_task_return_error (task, local_error);
   else
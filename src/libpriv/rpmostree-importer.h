@@ -23,6 +23,7 @@
 #include <ostree.h>
 
 #include "libglnx.h"
+#include "rpmostree-label-cache.h"
 #include <libdnf/libdnf.h>
 #include <rpm/rpmlib.h>
 
@@ -60,4 +61,21 @@ char *rpmostree_importer_run_async_finish (RpmOstreeImporter *self, GAsyncResult
 
 char *rpmostree_importer_get_nevra (RpmOstreeImporter *self);
 
+typedef struct RpmOstreeContentIndex RpmOstreeContentIndex;
+
+RpmOstreeContentIndex *rpmostree_content_index_load (OstreeRepo *repo, GCancellable *cancellable,
+                                                     GError **error);
+
+gboolean rpmostree_content_index_save (RpmOstreeContentIndex *index, GCancellable *cancellable,
+                                       GError **error);
+
+void rpmostree_content_index_free (RpmOstreeContentIndex *index);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeContentIndex, rpmostree_content_index_free)
+
+void rpmostree_importer_set_content_index (RpmOstreeImporter *self, RpmOstreeContentIndex *index,
+                                           gboolean learn);
+
+void rpmostree_importer_set_label_cache (RpmOstreeImporter *self, RpmOstreeLabelCache *cache);
+
 G_END_DECLS
@@ -0,0 +1,156 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A memo of SELinux label lookups for one policy, shared by all the threads
+ * importing and relabeling packages. Each lookup is a walk over the
+ * file_contexts regexes, and the same paths come up over and over: every
+ * package has /usr, /usr/share/doc and friends, and importing a package looks
+ * up each of its paths twice (once for the content index key, once when
+ * committing). */
+
+#include "config.h"
+
+#include <atomic>
+#include <libglnx.h>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "rpmostree-label-cache.h"
+#include "rpmostree-util.h"
+
+/* Past this, lookups still work but aren't remembered */
+#define LABEL_CACHE_MAX_ENTRIES (256 * 1024)
+
+struct RpmOstreeLabelCache
+{
+  OstreeSePolicy *sepolicy;
+  GRWLock lock;
+  /* "<file type>:<path>" -> label, or nullopt if unlabeled */
+  std::unordered_map<std::string, std::optional<std::string> > labels;
+  std::atomic<guint64> n_hits;
+  std::atomic<guint64> n_misses;
+};
+
+RpmOstreeLabelCache *
+rpmostree_label_cache_new (OstreeSePolicy *sepolicy)
+{
+  auto cache = new RpmOstreeLabelCache ();
+  cache->sepolicy = static_cast<OstreeSePolicy *> (g_object_ref (sepolicy));
+  g_rw_lock_init (&cache->lock);
+  return cache;
+}
+
+void
+rpmostree_label_cache_free (RpmOstreeLabelCache *cache)
+{
+  g_debug ("label cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses",
+           cache->n_hits.load (), cache->n_misses.load ());
+  g_rw_lock_clear (&cache->lock);
+  g_clear_object (&cache->sepolicy);
+  delete cache;
+}
+
+OstreeSePolicy *
+rpmostree_label_cache_get_sepolicy (RpmOstreeLabelCache *cache)
+{
+  return cache->sepolicy;
+}
+
+/* Equivalent to ostree_sepolicy_get_label(). Only the file type bits of @mode
+ * are used by the lookup, so those are all that's part of the key. May be
+ * called from any thread. */
+gboolean
+rpmostree_label_cache_lookup (RpmOstreeLabelCache *cache, const char *path, guint32 mode,
+                              char **out_label, GError **error)
+{
+  std::string key = std::to_string (mode & S_IFMT);
+  key += ':';
+  key += path;
+
+  {
+    g_autoptr (GRWLockReaderLocker) locker = g_rw_lock_reader_locker_new (&cache->lock);
+    auto it = cache->labels.find (key);
+    if (it != cache->labels.end ())
+      {
+        cache->n_hits++;
+        *out_label = it->second ? g_strdup (it->second->c_str ()) : NULL;
+        return TRUE;
+      }
+  }
+
+  cache->n_misses++;
+  g_autofree char *label = NULL;
+  if (!ostree_sepolicy_get_label (cache->sepolicy, path, mode, &label, NULL, error))
+    return FALSE;
+
+  {
+    g_autoptr (GRWLockWriterLocker) locker = g_rw_lock_writer_locker_new (&cache->lock);
+    if (cache->labels.size () < LABEL_CACHE_MAX_ENTRIES)
+      cache->labels.emplace (std::move (key),
+                             label ? std::optional<std::string> (label) : std::nullopt);
+  }
+
+  *out_label = util::move_nullify (label);
+  return TRUE;
+}
+
+/* Returns @xattrs with the SELinux label replaced by the one for @path, the
+ * same way an OstreeRepoCommitModifier with a policy does it, so that this
+ * can be used from an xattr callback instead. Unlabeled paths keep their
+ * xattrs as is, unless @error_on_unlabeled is set. */
+GVariant *
+rpmostree_label_cache_apply (RpmOstreeLabelCache *cache, GVariant *xattrs, const char *path,
+                             guint32 mode, gboolean error_on_unlabeled, GError **error)
+{
+  g_autofree char *label = NULL;
+  if (!rpmostree_label_cache_lookup (cache, path, mode, &label, error))
+    return NULL;
+  if (!label)
+    {
+      if (error_on_unlabeled)
+        return (GVariant *)glnx_null_throw (error, "Failed to look up SELinux label for '%s'",
+                                            path);
+      return g_variant_ref (xattrs);
+    }
+
+  g_auto (GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ayay)"));
+  const gsize n = g_variant_n_children (xattrs);
+  for (gsize i = 0; i < n; i++)
+    {
+      g_autoptr (GVariant) xattr = g_variant_get_child_value (xattrs, i);
+      const char *name;
+      g_variant_get_child (xattr, 0, "^&ay", &name);
+      /* Drop any existing label so we don't end up with two */
+      if (g_str_equal (name, "security.selinux"))
+        continue;
+      g_variant_builder_add_value (&builder, xattr);
+    }
+  g_variant_builder_add (&builder, "(@ay@ay)", g_variant_new_bytestring ("security.selinux"),
+                         g_variant_new_bytestring (label));
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+void
+rpmostree_label_cache_get_stats (RpmOstreeLabelCache *cache, guint64 *out_hits,
+                                 guint64 *out_misses)
+{
+  *out_hits = cache->n_hits.load ();
+  *out_misses = cache->n_misses.load ();
+}
@@ -0,0 +1,46 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+typedef struct RpmOstreeLabelCache RpmOstreeLabelCache;
+
+RpmOstreeLabelCache *rpmostree_label_cache_new (OstreeSePolicy *sepolicy);
+
+void rpmostree_label_cache_free (RpmOstreeLabelCache *cache);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeLabelCache, rpmostree_label_cache_free)
+
+OstreeSePolicy *rpmostree_label_cache_get_sepolicy (RpmOstreeLabelCache *cache);
+
+gboolean rpmostree_label_cache_lookup (RpmOstreeLabelCache *cache, const char *path, guint32 mode,
+                                       char **out_label, GError **error);
+
+GVariant *rpmostree_label_cache_apply (RpmOstreeLabelCache *cache, GVariant *xattrs,
+                                       const char *path, guint32 mode,
+                                       gboolean error_on_unlabeled, GError **error);
+
+void rpmostree_label_cache_get_stats (RpmOstreeLabelCache *cache, guint64 *out_hits,
+                                      guint64 *out_misses);
+
+G_END_DECLS
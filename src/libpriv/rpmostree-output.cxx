@@ -24,6 +24,7 @@
 
 #include "rpmostree-cxxrs.h"
 #include "rpmostree-output.h"
+#include "rpmostree-trace.h"
 #include "rpmostree-util.h"
 
 /* These are helper functions that automatically determine whether data should
@@ -68,6 +69,10 @@ rpmostree_output_default_handler (RpmOstreeOutputType type, void *data, void *op
         rpmostreecxx::console_progress_end (util::ruststr_or_empty (end->msg));
         break;
       }
+    case RPMOSTREE_OUTPUT_PHASE_BEGIN:
+    case RPMOSTREE_OUTPUT_PHASE_END:
+      /* Only tracked by transactions */
+      break;
     }
 }
 
@@ -115,6 +120,53 @@ rpmostree_output_message (const char *format, ...)
   invoke_output (RPMOSTREE_OUTPUT_MESSAGE, &task);
 }
 
+const char *
+rpmostree_phase_to_string (RpmOstreePhase phase)
+{
+  switch (phase)
+    {
+    case RPMOSTREE_PHASE_REFRESH_MD:
+      return "refresh-md";
+    case RPMOSTREE_PHASE_DEPSOLVE:
+      return "depsolve";
+    case RPMOSTREE_PHASE_DOWNLOAD:
+      return "download";
+    case RPMOSTREE_PHASE_IMPORT:
+      return "import";
+    case RPMOSTREE_PHASE_RELABEL:
+      return "relabel";
+    case RPMOSTREE_PHASE_CHECKOUT:
+      return "checkout";
+    case RPMOSTREE_PHASE_SCRIPTS:
+      return "scripts";
+    case RPMOSTREE_PHASE_RPMDB:
+      return "rpmdb";
+    case RPMOSTREE_PHASE_COMMIT:
+      return "commit";
+    case RPMOSTREE_PHASE_DEPLOY:
+      return "deploy";
+    case RPMOSTREE_N_PHASES:
+      break;
+    }
+  g_assert_not_reached ();
+}
+
+void
+rpmostree_output_phase_begin (RpmOstreePhase phase)
+{
+  RpmOstreeOutputPhase task = { phase };
+  invoke_output (RPMOSTREE_OUTPUT_PHASE_BEGIN, &task);
+  rpmostree_trace_async_begin ("phase", rpmostree_phase_to_string (phase), phase);
+}
+
+void
+rpmostree_output_phase_end (RpmOstreePhase phase)
+{
+  RpmOstreeOutputPhase task = { phase };
+  invoke_output (RPMOSTREE_OUTPUT_PHASE_END, &task);
+  rpmostree_trace_async_end ("phase", rpmostree_phase_to_string (phase), phase);
+}
+
 namespace rpmostreecxx
 {
 
@@ -145,6 +197,9 @@ progress_begin_task (const rust::Str msg) noexcept
   RpmOstreeOutputProgressBegin begin = { msg_c.c_str (), false, 0 };
   invoke_output (RPMOSTREE_OUTPUT_PROGRESS_BEGIN, &begin);
   auto v = std::make_unique<Progress> (ProgressType::TASK);
+  v->trace_start = rpmostree_trace_now ();
+  if (v->trace_start)
+    v->trace_name = msg_c;
   g_debug ("init progress task serial=%" G_GUINT64_FORMAT " text=%s", v->serial, msg_c.c_str ());
   return v;
 }
@@ -166,6 +221,9 @@ progress_nitems_begin (guint n, const rust::Str msg) noexcept
   RpmOstreeOutputProgressBegin begin = { msg_c.c_str (), false, n };
   invoke_output (RPMOSTREE_OUTPUT_PROGRESS_BEGIN, &begin);
   auto v = std::make_unique<Progress> (ProgressType::N_ITEMS);
+  v->trace_start = rpmostree_trace_now ();
+  if (v->trace_start)
+    v->trace_name = msg_c;
   g_debug ("init progress nitems serial=%" G_GUINT64_FORMAT " text=%s", v->serial, msg_c.c_str ());
   return v;
 }
@@ -187,6 +245,9 @@ progress_percent_begin (const rust::Str msg) noexcept
   RpmOstreeOutputProgressBegin begin = { msg_c.c_str (), true, 0 };
   invoke_output (RPMOSTREE_OUTPUT_PROGRESS_BEGIN, &begin);
   auto v = std::make_unique<Progress> (ProgressType::PERCENT);
+  v->trace_start = rpmostree_trace_now ();
+  if (v->trace_start)
+    v->trace_name = msg_c;
   g_debug ("init progress percent serial=%" G_GUINT64_FORMAT " text=%s", v->serial, msg_c.c_str ());
   return v;
 }
@@ -209,6 +270,7 @@ Progress::end (const rust::Str msg)
   RpmOstreeOutputProgressEnd done = { final_msg };
   g_debug ("progress end serial=%" G_GUINT64_FORMAT, this->serial);
   invoke_output (RPMOSTREE_OUTPUT_PROGRESS_END, &done);
+  rpmostree_trace_complete ("progress", this->trace_name.c_str (), this->trace_start);
   this->ended = true;
 }
 
@@ -20,6 +20,7 @@
 
 #include "rust/cxx.h"
 #include <memory>
+#include <string>
 #include <stdbool.h>
 
 // C++ APIs here
@@ -56,10 +57,14 @@ public:
     ptype = t;
     ended = false;
     serial = _output_alloc_serial ();
+    trace_start = 0;
   }
   guint64 serial;
   ProgressType ptype;
   bool ended;
+  // See rpmostree-trace.h
+  gint64 trace_start;
+  std::string trace_name;
 };
 
 std::unique_ptr<Progress> progress_begin_task (rust::Str msg) noexcept;
@@ -77,6 +82,8 @@ typedef enum
   RPMOSTREE_OUTPUT_PROGRESS_UPDATE,
   RPMOSTREE_OUTPUT_PROGRESS_SUB_MESSAGE,
   RPMOSTREE_OUTPUT_PROGRESS_END,
+  RPMOSTREE_OUTPUT_PHASE_BEGIN,
+  RPMOSTREE_OUTPUT_PHASE_END,
 } RpmOstreeOutputType;
 
 void rpmostree_output_default_handler (RpmOstreeOutputType type, void *data, void *opaque);
@@ -117,4 +124,64 @@ typedef struct
   const char *msg;
 } RpmOstreeOutputProgressEnd;
 
-G_END_DECLS
\ No newline at end of file
+/* Coarse phases of a transaction, used to break down where time and resources
+ * go. Phases may nest or overlap (e.g. downloading and importing packages
+ * happen concurrently).
+ */
+typedef enum
+{
+  RPMOSTREE_PHASE_REFRESH_MD,
+  RPMOSTREE_PHASE_DEPSOLVE,
+  RPMOSTREE_PHASE_DOWNLOAD,
+  RPMOSTREE_PHASE_IMPORT,
+  RPMOSTREE_PHASE_RELABEL,
+  RPMOSTREE_PHASE_CHECKOUT,
+  RPMOSTREE_PHASE_SCRIPTS,
+  RPMOSTREE_PHASE_RPMDB,
+  RPMOSTREE_PHASE_COMMIT,
+  RPMOSTREE_PHASE_DEPLOY,
+  RPMOSTREE_N_PHASES
+} RpmOstreePhase;
+
+/* Phase begin/end */
+typedef struct
+{
+  RpmOstreePhase phase;
+} RpmOstreeOutputPhase;
+
+const char *rpmostree_phase_to_string (RpmOstreePhase phase);
+void rpmostree_output_phase_begin (RpmOstreePhase phase);
+void rpmostree_output_phase_end (RpmOstreePhase phase);
+
+G_END_DECLS
+
+namespace rpmostreecxx
+{
+
+// Marks a phase for the lifetime of the object, or until end() is called.
+struct Phase
+{
+public:
+  Phase (RpmOstreePhase p)
+  {
+    phase = p;
+    ended = false;
+    rpmostree_output_phase_begin (p);
+  }
+  ~Phase ()
+  {
+    if (!this->ended)
+      this->end ();
+  }
+  void
+  end ()
+  {
+    g_assert (!this->ended);
+    rpmostree_output_phase_end (this->phase);
+    this->ended = true;
+  }
+  RpmOstreePhase phase;
+  bool ended;
+};
+
+}
\ No newline at end of file
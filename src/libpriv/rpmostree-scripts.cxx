@@ -23,13 +23,23 @@
 #include "libglnx.h"
 #include "rpmostree-cxxrs.h"
 #include "rpmostree-output.h"
+#include "rpmostree-trace.h"
 #include "rpmostree-util.h"
+#include <algorithm>
 #include <err.h>
 #include <gio/gio.h>
+#include <glib-unix.h>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <sys/socket.h>
 #include <systemd/sd-journal.h>
+#include <vector>
 
 #include "rpmostree-rpm-util.h"
 #include "rpmostree-scripts.h"
+#include "rpmostree-worker-pool.h"
 
 #define RPMOSTREE_MESSAGE_PREPOST                                                                  \
   SD_ID128_MAKE (42, d3, 72, 22, dc, a2, 4a, 3b, 9d, 30, ce, d4, bb, bc, ac, d2)
@@ -256,21 +266,18 @@ rpmostree_script_txn_validate (DnfPackage *package, Header hdr, bool use_kernel_
   return TRUE;
 }
 
-/* Print the output of a script, with each line prefixed with
- * the script identifier (e.g. foo.post: bla bla bla).
+/* Print the output of a script read from @fdp, which is stolen, with each line
+ * prefixed with the script identifier (e.g. foo.post: bla bla bla).
  */
 static gboolean
-dump_buffered_output (const char *prefix, GLnxTmpfile *tmpf, GError **error)
+dump_output_fd (const char *prefix, int *fdp, GError **error)
 {
-  /* The tmpf won't be initialized in the journal case */
-  if (!tmpf->initialized)
-    return TRUE;
-  if (lseek (tmpf->fd, 0, SEEK_SET) < 0)
+  if (lseek (*fdp, 0, SEEK_SET) < 0)
     return glnx_throw_errno_prefix (error, "lseek");
-  g_autoptr (FILE) buf = fdopen (tmpf->fd, "r");
+  g_autoptr (FILE) buf = fdopen (*fdp, "r");
   if (!buf)
     return glnx_throw_errno_prefix (error, "fdopen");
-  tmpf->fd = -1; /* Ownership of fd was transferred */
+  *fdp = -1; /* Ownership of fd was transferred */
 
   while (TRUE)
     {
@@ -293,6 +300,15 @@ dump_buffered_output (const char *prefix, GLnxTmpfile *tmpf, GError **error)
   return TRUE;
 }
 
+static gboolean
+dump_buffered_output (const char *prefix, GLnxTmpfile *tmpf, GError **error)
+{
+  /* The tmpf won't be initialized in the journal case */
+  if (!tmpf->initialized)
+    return TRUE;
+  return dump_output_fd (prefix, &tmpf->fd, error);
+}
+
 /* Since it doesn't make sense to fatally error if printing output fails, catch
  * any errors there and print.
  */
@@ -304,22 +320,23 @@ dump_buffered_output_noerr (const char *prefix, GLnxTmpfile *tmpf)
     g_printerr ("While writing output: %s\n", local_error->message);
 }
 
-/* Lowest level script handler in this file; create a bwrap instance and run it
- * synchronously.
- */
-gboolean
-rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
-                                         gboolean enable_fuse, const char *name,
-                                         const char *scriptdesc, const char *interp,
-                                         const char *script, const char *script_arg,
-                                         int provided_stdin_fd, GCancellable *cancellable,
-                                         GError **error)
+/* glibc's locale scripts can't run under rofiles-fuse; see lua_replacements */
+static rpmostreecxx::BubblewrapMutability
+script_mutability (const char *pkg_script, gboolean enable_fuse)
 {
-  g_assert (name != NULL);
-  g_assert (name[0] != '\0');
-
-  const char *pkg_script = scriptdesc ? glnx_strjoina (name, ".", scriptdesc + 1) : name;
+  gboolean is_glibc_locales = strcmp (pkg_script, "glibc-all-langpacks.posttrans") == 0
+                              || strcmp (pkg_script, "glibc-common.post") == 0;
+  return (is_glibc_locales || !enable_fuse) ? rpmostreecxx::BubblewrapMutability::MutateFreely
+                                            : rpmostreecxx::BubblewrapMutability::RoFiles;
+}
 
+/* Set up the bwrap container that scripts run in, minus the child itself */
+static gboolean
+script_bwrap_new (int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
+                  rpmostreecxx::BubblewrapMutability mutability,
+                  std::optional<rust::Box<rpmostreecxx::Bubblewrap> > &out_bwrap,
+                  GCancellable *cancellable, GError **error)
+{
   // A dance just to pass a well-known fd for /dev/null to bwrap as fd 3
   // so that we can use it for --ro-bind-data.
   glnx_autofd int devnull_fd = -1;
@@ -328,18 +345,6 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
   const int devnull_target_fd = 3;
   g_autofree char *bwrap_devnull_fd = g_strdup_printf ("%d", devnull_target_fd);
 
-  /* We just did a ro bind mount over /var above. However we want a writable
-   * var/tmp, so we need to tmpfs mount on top of it. See also
-   * https://github.com/projectatomic/bubblewrap/issues/182
-   * Similarly for /var/lib/rpm-state.
-   *
-   * See above for why we special case glibc.
-   */
-  gboolean is_glibc_locales = strcmp (pkg_script, "glibc-all-langpacks.posttrans") == 0
-                              || strcmp (pkg_script, "glibc-common.post") == 0;
-  rpmostreecxx::BubblewrapMutability mutability
-      = (is_glibc_locales || !enable_fuse) ? rpmostreecxx::BubblewrapMutability::MutateFreely
-                                           : rpmostreecxx::BubblewrapMutability::RoFiles;
   CXX_TRY_VAR (bwrap, rpmostreecxx::bubblewrap_new_with_mutability (rootfs_fd, mutability), error);
   /* Scripts can see a /var with compat links like alternatives */
   CXX_TRY (bwrap->setup_compat_var (), error);
@@ -370,11 +375,14 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
   bwrap->append_bwrap_arg (bwrap_devnull_fd);
   bwrap->append_bwrap_arg ("/run/ostree-booted");
 
+  /* setup_compat_var() did a ro bind mount over /var, with a writable tmpfs
+   * var/tmp on top. See also
+   * https://github.com/projectatomic/bubblewrap/issues/182
+   * Similarly for /var/lib/rpm-state.
+   */
   if (var_lib_rpm_statedir)
     bwrap->bind_readwrite (var_lib_rpm_statedir->path, "/var/lib/rpm-state");
 
-  gboolean debugging_script = g_strcmp0 (g_getenv ("RPMOSTREE_SCRIPT_DEBUG"), pkg_script) == 0;
-
   const char *bridge_sysusers = g_getenv ("RPMOSTREE_EXP_BRIDGE_SYSUSERS");
   if (bridge_sysusers != NULL)
     bwrap->setenv ("RPMOSTREE_EXP_BRIDGE_SYSUSERS", rust::String (bridge_sysusers));
@@ -385,6 +393,53 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
    */
   bwrap->setenv ("SYSTEMD_OFFLINE", "1");
 
+  out_bwrap.emplace (std::move (bwrap));
+  return TRUE;
+}
+
+/* The output of a script run in the background, kept so that it can be logged
+ * later and in a deterministic order; see script_output_log().
+ */
+struct ScriptOutput
+{
+  gboolean to_journal;
+  GLnxTmpfile out; /* Also has stderr if not logging to the journal */
+  GLnxTmpfile err;
+};
+
+static void
+script_output_clear (ScriptOutput *output)
+{
+  glnx_tmpfile_clear (&output->out);
+  glnx_tmpfile_clear (&output->err);
+}
+
+/* Lowest level script handler in this file; create a bwrap instance and run it
+ * synchronously. If @capture is provided, the output is written there rather
+ * than logged.
+ */
+static gboolean
+run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
+                               gboolean enable_fuse, const char *name, const char *scriptdesc,
+                               const char *interp, const char *script, const char *script_arg,
+                               int provided_stdin_fd, ScriptOutput *capture,
+                               GCancellable *cancellable, GError **error)
+{
+  g_assert (name != NULL);
+  g_assert (name[0] != '\0');
+
+  const char *pkg_script = scriptdesc ? glnx_strjoina (name, ".", scriptdesc + 1) : name;
+  rpmostreecxx::TraceSpan span ("script", pkg_script);
+
+  std::optional<rust::Box<rpmostreecxx::Bubblewrap> > bwrap_owned;
+  if (!script_bwrap_new (rootfs_fd, var_lib_rpm_statedir,
+                         script_mutability (pkg_script, enable_fuse), bwrap_owned, cancellable,
+                         error))
+    return FALSE;
+  auto &bwrap = *bwrap_owned;
+
+  gboolean debugging_script = g_strcmp0 (g_getenv ("RPMOSTREE_SCRIPT_DEBUG"), pkg_script) == 0;
+
   /* FDs that need to be held open until we exec; they're
    * owned by the GSubprocessLauncher instance.
    */
@@ -422,7 +477,28 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
        * via `ex container`, and in these cases we want to output to stdout, which
        * is where other output will go.
        */
-      if (rpmostreecxx::running_in_systemd ())
+      if (capture)
+        {
+          capture->to_journal = rpmostreecxx::running_in_systemd ();
+          if (!glnx_open_anonymous_tmpfile (O_RDWR | O_CLOEXEC, &capture->out, error))
+            return FALSE;
+          stdout_fd = fcntl (capture->out.fd, F_DUPFD_CLOEXEC, 3);
+          if (stdout_fd < 0)
+            return glnx_throw_errno_prefix (error, "fcntl");
+          if (capture->to_journal)
+            {
+              bwrap->take_stdout_fd (stdout_fd);
+              if (!glnx_open_anonymous_tmpfile (O_RDWR | O_CLOEXEC, &capture->err, error))
+                return FALSE;
+              stderr_fd = fcntl (capture->err.fd, F_DUPFD_CLOEXEC, 3);
+              if (stderr_fd < 0)
+                return glnx_throw_errno_prefix (error, "fcntl");
+              bwrap->take_stderr_fd (stderr_fd);
+            }
+          else
+            bwrap->take_stdout_and_stderr_fd (stdout_fd);
+        }
+      else if (rpmostreecxx::running_in_systemd ())
         {
           stdout_fd = sd_journal_stream_fd (id, LOG_INFO, 0);
           if (stdout_fd < 0)
@@ -471,6 +547,428 @@ rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_
   return TRUE;
 }
 
+gboolean
+rpmostree_run_script_in_bwrap_container (int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
+                                         gboolean enable_fuse, const char *name,
+                                         const char *scriptdesc, const char *interp,
+                                         const char *script, const char *script_arg,
+                                         int provided_stdin_fd, GCancellable *cancellable,
+                                         GError **error)
+{
+  return run_script_in_bwrap_container (rootfs_fd, var_lib_rpm_statedir, enable_fuse, name,
+                                        scriptdesc, interp, script, script_arg, provided_stdin_fd,
+                                        NULL, cancellable, error);
+}
+
+/* An opt-in (RPMOSTREE_SCRIPT_SANDBOX=persistent) long-lived container that
+ * runs a phase's worth of scripts one after the other, rather than setting up
+ * (and with rofiles-fuse, mounting) a new one for each. A tiny shell executor
+ * runs in the container; for each script we write the interpreter, script and
+ * its argument and stdin to a directory shared with the container, send the
+ * executor its name, and read back its exit status. Output is captured in
+ * files next to it, and logged the same way as for a standalone container.
+ *
+ * Scripts in a phase share the container's /run, /tmp and /var/tmp.
+ */
+struct RpmOstreeScriptSandbox
+{
+  rpmostreecxx::BubblewrapMutability mutability;
+  GLnxTmpDir tmpdir = {};
+  std::optional<rust::Box<rpmostreecxx::Bubblewrap> > bwrap;
+  GCancellable *cancellable = NULL; /* Kills the container */
+  GThread *thread = NULL;
+  GError *exit_error = NULL; /* Set by the thread */
+  int cmd_fd = -1;
+  int result_fd = -1;
+  int exited_fd = -1;       /* Hangs up once the container exited */
+  int exited_fd_child = -1; /* Owned by the thread */
+  guint next_id = 0;
+};
+
+/* Where the tmpdir is mounted in the container */
+#define SCRIPT_SANDBOX_DIR "/run/rpmostree-scripts"
+#define SCRIPT_SANDBOX_CMD_FD 6
+#define SCRIPT_SANDBOX_RESULT_FD 7
+
+/* Reads script ids on fd 6, runs each, and writes "<id> <exit status>" to fd 7.
+ * The scripts themselves don't get either. */
+static const char script_sandbox_executor[]
+    = "while read -r id; do\n"
+      "  d=" SCRIPT_SANDBOX_DIR "/$id\n"
+      "  read -r interp <\"$d/interp\"\n"
+      "  set -- \"$d/script\"\n"
+      "  if test -f \"$d/arg\"; then read -r arg <\"$d/arg\"; set -- \"$@\" \"$arg\"; fi\n"
+      "  stdin=/dev/null\n"
+      "  if test -f \"$d/stdin\"; then stdin=\"$d/stdin\"; fi\n"
+      "  if test -f \"$d/merged\"; then\n"
+      "    \"$interp\" \"$@\" <\"$stdin\" >\"$d/stdout\" 2>&1 6<&- 7>&-\n"
+      "  else\n"
+      "    \"$interp\" \"$@\" <\"$stdin\" >\"$d/stdout\" 2>\"$d/stderr\" 6<&- 7>&-\n"
+      "  fi\n"
+      "  echo \"$id $?\" >&7\n"
+      "done <&6\n";
+
+static gpointer
+script_sandbox_thread (gpointer data)
+{
+  auto sandbox = static_cast<RpmOstreeScriptSandbox *> (data);
+  g_autoptr (GError) local_error = NULL;
+  if (!CXX ((*sandbox->bwrap)->run (*sandbox->cancellable), &local_error))
+    sandbox->exit_error = util::move_nullify (local_error);
+  glnx_close_fd (&sandbox->exited_fd_child);
+  return NULL;
+}
+
+/* Start a container for running many scripts in a row via
+ * rpmostree_script_run_sync() and rpmostree_transfiletriggers_run_sync(). Sets
+ * @out_sandbox to %NULL if this isn't enabled, or the rootfs has no shell for
+ * the executor; scripts then each get their own container as usual.
+ */
+gboolean
+rpmostree_script_sandbox_new (int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
+                              gboolean enable_fuse, RpmOstreeScriptSandbox **out_sandbox,
+                              GCancellable *cancellable, GError **error)
+{
+  *out_sandbox = NULL;
+  if (g_strcmp0 (g_getenv ("RPMOSTREE_SCRIPT_SANDBOX"), "persistent") != 0)
+    return TRUE;
+  if (!glnx_fstatat_allow_noent (rootfs_fd, "usr/bin/sh", NULL, 0, error))
+    return FALSE;
+  if (errno == ENOENT)
+    return TRUE;
+
+  g_autoptr (RpmOstreeScriptSandbox) sandbox = new RpmOstreeScriptSandbox ();
+  /* Scripts which need to mutate freely under rofiles-fuse still get their own */
+  sandbox->mutability = enable_fuse ? rpmostreecxx::BubblewrapMutability::RoFiles
+                                    : rpmostreecxx::BubblewrapMutability::MutateFreely;
+  if (!glnx_mkdtempat (AT_FDCWD, "/tmp/rpmostree-scripts.XXXXXX", 0700, &sandbox->tmpdir, error))
+    return FALSE;
+  if (!script_bwrap_new (rootfs_fd, var_lib_rpm_statedir, sandbox->mutability, sandbox->bwrap,
+                         cancellable, error))
+    return FALSE;
+  auto &bwrap = *sandbox->bwrap;
+  bwrap->bind_readwrite (sandbox->tmpdir.path, SCRIPT_SANDBOX_DIR);
+
+  /* Sockets rather than pipes so we don't get SIGPIPE if the container dies */
+  int cmd_fds[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, cmd_fds) < 0)
+    return glnx_throw_errno_prefix (error, "socketpair");
+  sandbox->cmd_fd = cmd_fds[0];
+  bwrap->take_fd (cmd_fds[1], SCRIPT_SANDBOX_CMD_FD);
+  int result_fds[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, result_fds) < 0)
+    return glnx_throw_errno_prefix (error, "socketpair");
+  sandbox->result_fd = result_fds[0];
+  bwrap->take_fd (result_fds[1], SCRIPT_SANDBOX_RESULT_FD);
+  int exited_fds[2];
+  if (!g_unix_open_pipe (exited_fds, FD_CLOEXEC, error))
+    return FALSE;
+  sandbox->exited_fd = exited_fds[0];
+  sandbox->exited_fd_child = exited_fds[1];
+
+  bwrap->append_child_arg ("/usr/bin/sh");
+  bwrap->append_child_arg ("-c");
+  bwrap->append_child_arg (script_sandbox_executor);
+
+  sandbox->cancellable = g_cancellable_new ();
+  sandbox->thread = g_thread_new ("rpmostree-scripts", script_sandbox_thread, sandbox);
+  *out_sandbox = util::move_nullify (sandbox);
+  return TRUE;
+}
+
+static void
+script_sandbox_join (RpmOstreeScriptSandbox *sandbox)
+{
+  if (sandbox->thread)
+    (void)g_thread_join (util::move_nullify (sandbox->thread));
+}
+
+static gboolean
+script_sandbox_throw_exited (RpmOstreeScriptSandbox *sandbox, GError **error)
+{
+  script_sandbox_join (sandbox);
+  if (sandbox->exit_error)
+    return glnx_throw (error, "Script sandbox exited: %s", sandbox->exit_error->message);
+  return glnx_throw (error, "Script sandbox exited unexpectedly");
+}
+
+/* Wait for the executor to report the exit status of script @id */
+static gboolean
+script_sandbox_wait (RpmOstreeScriptSandbox *sandbox, const char *id, int *out_status,
+                     GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GString) line = g_string_new ("");
+  while (!strchr (line->str, '\n'))
+    {
+      GPollFD fds[3] = {
+        { sandbox->result_fd, G_IO_IN, 0 },
+        { sandbox->exited_fd, G_IO_IN, 0 },
+      };
+      guint nfds = 2;
+      if (g_cancellable_make_pollfd (cancellable, &fds[nfds]))
+        nfds++;
+      int r = g_poll (fds, nfds, -1);
+      int errsv = errno;
+      if (nfds > 2)
+        g_cancellable_release_fd (cancellable);
+      if (r < 0 && errsv != EINTR)
+        return glnx_throw_errno_prefix (error, "poll");
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      if (fds[0].revents)
+        {
+          char buf[64];
+          ssize_t n = TEMP_FAILURE_RETRY (read (sandbox->result_fd, buf, sizeof (buf)));
+          if (n < 0)
+            return glnx_throw_errno_prefix (error, "read");
+          if (n == 0)
+            return script_sandbox_throw_exited (sandbox, error);
+          g_string_append_len (line, buf, n);
+        }
+      else if (fds[1].revents)
+        return script_sandbox_throw_exited (sandbox, error);
+    }
+
+  g_auto (GStrv) parts = g_strsplit (line->str, " ", 2);
+  if (g_strv_length (parts) != 2 || !g_str_equal (parts[0], id))
+    return glnx_throw (error, "Unexpected reply from script sandbox: %s", line->str);
+  *out_status = (int)g_ascii_strtoll (parts[1], NULL, 10);
+  return TRUE;
+}
+
+/* Log the captured output in @fd as if it came from a journal stream fd
+ * identified by @identifier.
+ */
+static gboolean
+journal_output_fd (int fd, const char *identifier, int priority, GError **error)
+{
+  if (lseek (fd, 0, SEEK_SET) < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+  g_autoptr (GBytes) bytes = glnx_fd_readall_bytes (fd, NULL, error);
+  if (!bytes)
+    return FALSE;
+
+  gsize len;
+  auto data = static_cast<const char *> (g_bytes_get_data (bytes, &len));
+  const char *end = data + len;
+  while (data < end)
+    {
+      auto eol = static_cast<const char *> (memchr (data, '\n', end - data));
+      const char *next = eol ? eol + 1 : end;
+      if (!eol)
+        eol = end;
+      sd_journal_send ("MESSAGE=%.*s", (int)(eol - data), data, "PRIORITY=%d", priority,
+                       "SYSLOG_IDENTIFIER=%s", identifier, NULL);
+      data = next;
+    }
+  return TRUE;
+}
+
+/* Open output a sandboxed script left in @dfd. The container can write there,
+ * so don't follow symlinks or block on FIFOs it may have put in its place. */
+static gboolean
+script_sandbox_open_output (int dfd, const char *name, int *out_fd, GError **error)
+{
+  glnx_autofd int fd = TEMP_FAILURE_RETRY (
+      openat (dfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC));
+  if (fd < 0)
+    return glnx_throw_errno_prefix (error, "openat(%s)", name);
+  struct stat stbuf;
+  if (!glnx_fstat (fd, &stbuf, error))
+    return FALSE;
+  if (!S_ISREG (stbuf.st_mode))
+    return glnx_throw (error, "%s: Not a regular file", name);
+  *out_fd = glnx_steal_fd (&fd);
+  return TRUE;
+}
+
+static gboolean
+journal_output_file (int dfd, const char *path, const char *identifier, int priority,
+                     GError **error)
+{
+  glnx_autofd int fd = -1;
+  if (!script_sandbox_open_output (dfd, path, &fd, error))
+    return FALSE;
+  return journal_output_fd (fd, identifier, priority, error);
+}
+
+/* Log what was captured by run_script_in_bwrap_container() */
+static void
+script_output_log (const char *pkg_script, ScriptOutput *output)
+{
+  g_autoptr (GError) local_error = NULL;
+  if (output->to_journal)
+    {
+      const char *id = glnx_strjoina ("rpm-ostree(", pkg_script, ")");
+      if ((output->out.initialized
+           && !journal_output_fd (output->out.fd, id, LOG_INFO, &local_error))
+          || (output->err.initialized
+              && !journal_output_fd (output->err.fd, id, LOG_ERR, &local_error)))
+        g_printerr ("While writing output: %s\n", local_error->message);
+    }
+  else
+    dump_buffered_output_noerr (pkg_script, &output->out);
+}
+
+static void
+script_sandbox_dump_output (int dfd, const char *pkg_script, const char *id, gboolean to_journal)
+{
+  g_autoptr (GError) local_error = NULL;
+  if (to_journal)
+    {
+      if (!journal_output_file (dfd, "stdout", id, LOG_INFO, &local_error)
+          || !journal_output_file (dfd, "stderr", id, LOG_ERR, &local_error))
+        g_printerr ("While writing output: %s\n", local_error->message);
+    }
+  else
+    {
+      glnx_autofd int fd = -1;
+      if (!script_sandbox_open_output (dfd, "stdout", &fd, &local_error)
+          || !dump_output_fd (pkg_script, &fd, &local_error))
+        g_printerr ("While writing output: %s\n", local_error->message);
+    }
+}
+
+static gboolean
+script_sandbox_run (RpmOstreeScriptSandbox *sandbox, const char *pkg_script, const char *interp,
+                    const char *script, const char *script_arg, int stdin_fd,
+                    GCancellable *cancellable, GError **error)
+{
+  rpmostreecxx::TraceSpan span ("script", pkg_script);
+
+  /* See rpmostree_run_script_in_bwrap_container() for where output goes */
+  const gboolean to_journal = rpmostreecxx::running_in_systemd ();
+  const char *id = glnx_strjoina ("rpm-ostree(", pkg_script, ")");
+
+  g_autofree char *script_id = g_strdup_printf ("%u", sandbox->next_id++);
+  if (!glnx_ensure_dir (sandbox->tmpdir.fd, script_id, 0755, error))
+    return FALSE;
+  glnx_autofd int dfd = -1;
+  if (!glnx_opendirat (sandbox->tmpdir.fd, script_id, FALSE, &dfd, error))
+    return FALSE;
+
+  g_autofree char *interp_line = g_strconcat (interp, "\n", NULL);
+  if (!glnx_file_replace_contents_at (dfd, "interp", (guint8 *)interp_line, -1,
+                                      GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+    return FALSE;
+  if (!glnx_file_replace_contents_at (dfd, "script", (guint8 *)script, -1,
+                                      GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+    return FALSE;
+  if (script_arg)
+    {
+      g_autofree char *arg_line = g_strconcat (script_arg, "\n", NULL);
+      if (!glnx_file_replace_contents_at (dfd, "arg", (guint8 *)arg_line, -1,
+                                          GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+        return FALSE;
+    }
+  if (stdin_fd != -1)
+    {
+      glnx_autofd int stdin_copy_fd = TEMP_FAILURE_RETRY (
+          openat (dfd, "stdin", O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644));
+      if (stdin_copy_fd < 0)
+        return glnx_throw_errno_prefix (error, "openat(stdin)");
+      if (glnx_regfile_copy_bytes (stdin_fd, stdin_copy_fd, (off_t)-1) < 0)
+        return glnx_throw_errno_prefix (error, "Copying stdin");
+    }
+  /* In the non-journal case we interleave stdout and stderr, like a standalone container */
+  if (!to_journal)
+    {
+      if (!glnx_file_replace_contents_at (dfd, "merged", (guint8 *)"", 0,
+                                          GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+        return FALSE;
+    }
+
+  g_autofree char *cmd = g_strconcat (script_id, "\n", NULL);
+  if (TEMP_FAILURE_RETRY (send (sandbox->cmd_fd, cmd, strlen (cmd), MSG_NOSIGNAL)) < 0)
+    {
+      if (errno == EPIPE)
+        return script_sandbox_throw_exited (sandbox, error);
+      return glnx_throw_errno_prefix (error, "Sending script to sandbox");
+    }
+
+  int status = 0;
+  if (!script_sandbox_wait (sandbox, script_id, &status, cancellable, error))
+    return FALSE;
+
+  script_sandbox_dump_output (dfd, pkg_script, id, to_journal);
+  (void)glnx_shutil_rm_rf_at (sandbox->tmpdir.fd, script_id, NULL, NULL);
+
+  if (status != 0)
+    {
+      /* Same as the error from a standalone container */
+      g_autofree char *msg
+          = g_strdup_printf ("bwrap(%s): Child process exited with code %d", interp, status);
+      /* If errors go to the journal, help the user/admin find them there */
+      if (to_journal)
+        return glnx_throw (error, "%s; run `journalctl -t '%s'` for more information", msg, id);
+      return glnx_throw (error, "%s", msg);
+    }
+
+  return TRUE;
+}
+
+/* Stop the container after the last script. It's an error if it didn't exit
+ * cleanly.
+ */
+gboolean
+rpmostree_script_sandbox_close (RpmOstreeScriptSandbox *sandbox, GError **error)
+{
+  /* The executor exits once it reads EOF */
+  glnx_close_fd (&sandbox->cmd_fd);
+  script_sandbox_join (sandbox);
+  if (sandbox->exit_error)
+    return glnx_throw (error, "Script sandbox: %s", sandbox->exit_error->message);
+  return TRUE;
+}
+
+void
+rpmostree_script_sandbox_free (RpmOstreeScriptSandbox *sandbox)
+{
+  glnx_close_fd (&sandbox->cmd_fd);
+  if (sandbox->thread)
+    {
+      /* We didn't get to close it, e.g. because a script failed */
+      g_cancellable_cancel (sandbox->cancellable);
+      script_sandbox_join (sandbox);
+    }
+  glnx_close_fd (&sandbox->result_fd);
+  glnx_close_fd (&sandbox->exited_fd);
+  glnx_close_fd (&sandbox->exited_fd_child);
+  g_clear_error (&sandbox->exit_error);
+  g_clear_object (&sandbox->cancellable);
+  /* Drops the launcher and thus our ends of the container's fds, and unmounts rofiles-fuse */
+  sandbox->bwrap.reset ();
+  (void)glnx_tmpdir_delete (&sandbox->tmpdir, NULL, NULL);
+  delete sandbox;
+}
+
+/* Run a script in @sandbox if there is one and the script can use it,
+ * otherwise in its own container.
+ */
+static gboolean
+run_script_in_container (RpmOstreeScriptSandbox *sandbox, int rootfs_fd,
+                         GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse, const char *name,
+                         const char *scriptdesc, const char *interp, const char *script,
+                         const char *script_arg, int stdin_fd, GCancellable *cancellable,
+                         GError **error)
+{
+  if (sandbox)
+    {
+      const char *pkg_script = glnx_strjoina (name, ".", scriptdesc + 1);
+      const gboolean debugging_script
+          = g_strcmp0 (g_getenv ("RPMOSTREE_SCRIPT_DEBUG"), pkg_script) == 0;
+      if (!debugging_script && stdin_fd != STDIN_FILENO
+          && script_mutability (pkg_script, enable_fuse) == sandbox->mutability)
+        return script_sandbox_run (sandbox, pkg_script, interp, script, script_arg, stdin_fd,
+                                   cancellable, error);
+    }
+
+  return rpmostree_run_script_in_bwrap_container (rootfs_fd, var_lib_rpm_statedir, enable_fuse,
+                                                  name, scriptdesc, interp, script, script_arg,
+                                                  stdin_fd, cancellable, error);
+}
+
 /* Check for a "magic comment" that signifies this lua script
  * should be skipped by us. For more, see docs/architecture-core.md
  */
@@ -491,15 +989,19 @@ lua_script_has_skip (const char *buf)
   return FALSE;
 }
 
-/* Medium level script entrypoint; we already validated it exists and isn't
- * ignored. Here we mostly compute arguments/input, then proceed into the lower
- * level bwrap execution.
+/* Work out the interpreter, script and argument to run for @rpmscript of @pkg,
+ * after replacements and macro expansion. Sets @out_interp to %NULL if there's
+ * nothing to run.
  */
 static gboolean
-impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Header hdr,
-                     int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse,
-                     GCancellable *cancellable, GError **error)
+rpm_script_prepare (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Header hdr,
+                    char **out_interp, char **out_script, const char **out_script_arg,
+                    GError **error)
 {
+  *out_interp = NULL;
+  *out_script = NULL;
+  *out_script_arg = NULL;
+
   struct rpmtd_s td;
   g_autofree char **args = NULL;
   if (headerGet (hdr, rpmscript->progtag, &td, (HEADERGET_ALLOC | HEADERGET_ARGV)))
@@ -590,57 +1092,96 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Heade
       break;
     }
 
+  *out_interp = g_strdup (interp);
+  *out_script = g_strdup (script);
+  *out_script_arg = script_arg;
+  return TRUE;
+}
+
+static void
+log_rpm_script_executed (const KnownRpmScriptKind *rpmscript, const char *pkg_name,
+                         guint64 elapsed_ms)
+{
+  sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
+                   SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_PREPOST),
+                   "MESSAGE=Executed %s for %s in %" G_GUINT64_FORMAT " ms", rpmscript->desc,
+                   pkg_name, elapsed_ms, "SCRIPT_TYPE=%s", rpmscript->desc, "PKG=%s", pkg_name,
+                   "EXEC_TIME_MS=%" G_GUINT64_FORMAT, elapsed_ms, NULL);
+}
+
+/* Medium level script entrypoint; we already validated it exists and isn't
+ * ignored. Here we mostly compute arguments/input, then proceed into the lower
+ * level bwrap execution.
+ */
+static gboolean
+impl_run_rpm_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Header hdr,
+                     int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse,
+                     RpmOstreeScriptSandbox *sandbox, GCancellable *cancellable, GError **error)
+{
+  g_autofree char *interp = NULL;
+  g_autofree char *script = NULL;
+  const char *script_arg = NULL;
+  if (!rpm_script_prepare (rpmscript, pkg, hdr, &interp, &script, &script_arg, error))
+    return FALSE;
+  if (!interp)
+    return TRUE;
+
   guint64 start_time_ms = g_get_monotonic_time () / 1000;
-  if (!rpmostree_run_script_in_bwrap_container (rootfs_fd, var_lib_rpm_statedir, enable_fuse,
-                                                dnf_package_get_name (pkg), rpmscript->desc, interp,
-                                                script, script_arg, -1, cancellable, error))
+  if (!run_script_in_container (sandbox, rootfs_fd, var_lib_rpm_statedir, enable_fuse,
+                                dnf_package_get_name (pkg), rpmscript->desc, interp, script,
+                                script_arg, -1, cancellable, error))
     return glnx_prefix_error (error, "Running %s for %s", rpmscript->desc,
                               dnf_package_get_name (pkg));
   guint64 end_time_ms = g_get_monotonic_time () / 1000;
   guint64 elapsed_ms = end_time_ms - start_time_ms;
 
-  sd_journal_send (
-      "MESSAGE_ID=" SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_PREPOST),
-      "MESSAGE=Executed %s for %s in %" G_GUINT64_FORMAT " ms", rpmscript->desc,
-      dnf_package_get_name (pkg), elapsed_ms, "SCRIPT_TYPE=%s", rpmscript->desc, "PKG=%s",
-      dnf_package_get_name (pkg), "EXEC_TIME_MS=%" G_GUINT64_FORMAT, elapsed_ms, NULL);
+  log_rpm_script_executed (rpmscript, dnf_package_get_name (pkg), elapsed_ms);
 
   return TRUE;
 }
 
-/* High level script entrypoint; check a package to see whether a script exists,
- * execute it if it exists (and it's not ignored).
- */
+/* Whether @pkg has a @rpmscript that isn't ignored */
 static gboolean
-run_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Header hdr, int rootfs_fd,
-            GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse, gboolean use_kernel_install,
-            gboolean *out_did_run, GCancellable *cancellable, GError **error)
+rpm_script_is_wanted (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Header hdr,
+                      gboolean use_kernel_install)
 {
   rpmTagVal tagval = rpmscript->tag;
   rpmTagVal progtagval = rpmscript->progtag;
 
-  *out_did_run = FALSE;
-
   if (!(headerIsEntry (hdr, tagval) || headerIsEntry (hdr, progtagval)))
-    return TRUE;
+    return FALSE;
 
   const char *script = headerGetString (hdr, tagval);
   if (!script)
-    return TRUE;
+    return FALSE;
 
   const char *desc = rpmscript->desc;
-  if (rpmostreecxx::script_is_ignored (dnf_package_get_name (pkg), desc, use_kernel_install))
+  return !rpmostreecxx::script_is_ignored (dnf_package_get_name (pkg), desc, use_kernel_install);
+}
+
+/* High level script entrypoint; check a package to see whether a script exists,
+ * execute it if it exists (and it's not ignored).
+ */
+static gboolean
+run_script (const KnownRpmScriptKind *rpmscript, DnfPackage *pkg, Header hdr, int rootfs_fd,
+            GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse, gboolean use_kernel_install,
+            RpmOstreeScriptSandbox *sandbox, gboolean *out_did_run, GCancellable *cancellable,
+            GError **error)
+{
+  *out_did_run = FALSE;
+
+  if (!rpm_script_is_wanted (rpmscript, pkg, hdr, use_kernel_install))
     return TRUE; /* Note early return */
 
   *out_did_run = TRUE;
   return impl_run_rpm_script (rpmscript, pkg, hdr, rootfs_fd, var_lib_rpm_statedir, enable_fuse,
-                              cancellable, error);
+                              sandbox, cancellable, error);
 }
 
 static gboolean
-write_filename (FILE *f, GString *prefix, GError **error)
+write_filename (FILE *f, const char *path, size_t len, GError **error)
 {
-  if (fwrite_unlocked (prefix->str, 1, prefix->len, f) != prefix->len)
+  if (fwrite_unlocked (path, 1, len, f) != len)
     return glnx_throw_errno_prefix (error, "fwrite");
   if (fputc_unlocked ('\n', f) == EOF)
     return glnx_throw_errno_prefix (error, "fputc");
@@ -663,7 +1204,7 @@ write_subdir (int dfd, const char *path, GString *prefix, FILE *f, guint *inout_
     {
       if (errno == ENOTDIR)
         {
-          if (!write_filename (f, prefix, error))
+          if (!write_filename (f, prefix->str, prefix->len, error))
             return FALSE;
           (*inout_n_matched)++;
         }
@@ -698,7 +1239,7 @@ write_subdir (int dfd, const char *path, GString *prefix, FILE *f, guint *inout_
         }
       else
         {
-          if (!write_filename (f, prefix, error))
+          if (!write_filename (f, prefix->str, prefix->len, error))
             return FALSE;
           (*inout_n_matched)++;
         }
@@ -708,13 +1249,210 @@ write_subdir (int dfd, const char *path, GString *prefix, FILE *f, guint *inout_
   return TRUE;
 }
 
+/* An in-memory, sorted list of every non-directory path under /usr in the
+ * rootfs, shared across all %transfiletriggerin runs in a transaction so that
+ * we don't re-walk e.g. /usr/lib once per trigger pattern. It's populated
+ * lazily on first use, i.e. after all %post scripts have run.
+ *
+ * A trigger that ran may have added or removed files which later triggers
+ * must see. Rather than walking /usr again, the next lookup then only stats
+ * the directories we know of, and re-reads those whose entries changed,
+ * which shows in their ctime.
+ */
+struct RootfsIndexDir
+{
+  ino_t ino;
+  struct timespec ctim;
+  bool racy; /* Changed too shortly before we read it to trust ctim */
+  std::vector<std::string> subdirs; /* Names */
+  std::set<std::string> files;      /* Names */
+};
+
+struct RpmOstreeRootfsIndex
+{
+  int rootfs_fd;
+  bool populated;
+  bool stale; /* A trigger ran since the last update */
+  std::set<std::string> paths;                /* Each with a leading '/' */
+  std::map<std::string, RootfsIndexDir> dirs; /* Keyed like paths */
+};
+
+RpmOstreeRootfsIndex *
+rpmostree_rootfs_index_new (int rootfs_fd)
+{
+  auto index = new RpmOstreeRootfsIndex ();
+  index->rootfs_fd = rootfs_fd;
+  return index;
+}
+
+void
+rpmostree_rootfs_index_free (RpmOstreeRootfsIndex *index)
+{
+  delete index;
+}
+
+/* Drop everything we know about directory @path and what's below it */
+static void
+rootfs_index_remove_dir (RpmOstreeRootfsIndex *index, const std::string &path)
+{
+  const std::string prefix = path + "/";
+  auto it = index->paths.lower_bound (prefix);
+  while (it != index->paths.end () && it->compare (0, prefix.size (), prefix) == 0)
+    it = index->paths.erase (it);
+  index->dirs.erase (path);
+  auto dit = index->dirs.lower_bound (prefix);
+  while (dit != index->dirs.end () && dit->first.compare (0, prefix.size (), prefix) == 0)
+    dit = index->dirs.erase (dit);
+}
+
+/* Bring the index up to date for directory @name in @dfd, which is at @path.
+ * Directories are only read if they're new or their entries changed, but we
+ * always descend, since changes deeper down don't show in the parents. */
+static gboolean
+rootfs_index_update_dir (RpmOstreeRootfsIndex *index, int dfd, const char *name,
+                         const std::string &path, const struct timespec *started,
+                         GCancellable *cancellable, GError **error)
+{
+  glnx_autofd int target_dfd = glnx_opendirat_with_errno (dfd, name, FALSE);
+  if (target_dfd < 0)
+    {
+      if (errno == ENOENT)
+        {
+          rootfs_index_remove_dir (index, path);
+          return TRUE;
+        }
+      return glnx_throw_errno_prefix (error, "opendirat");
+    }
+  struct stat stbuf;
+  if (!glnx_fstat (target_dfd, &stbuf, error))
+    return FALSE;
+
+  auto known = index->dirs.find (path);
+  if (known != index->dirs.end () && !known->second.racy && known->second.ino == stbuf.st_ino
+      && known->second.ctim.tv_sec == stbuf.st_ctim.tv_sec
+      && known->second.ctim.tv_nsec == stbuf.st_ctim.tv_nsec)
+    {
+      /* Copy, since the recursion may modify the map */
+      const std::vector<std::string> subdirs = known->second.subdirs;
+      for (auto &subdir : subdirs)
+        {
+          if (!rootfs_index_update_dir (index, target_dfd, subdir.c_str (), path + "/" + subdir,
+                                        started, cancellable, error))
+            return FALSE;
+        }
+      return TRUE;
+    }
+
+  RootfsIndexDir dir = {};
+  dir.ino = stbuf.st_ino;
+  dir.ctim = stbuf.st_ctim;
+  /* Timestamps are coarser than our clock; see git's "racy git" problem */
+  dir.racy = stbuf.st_ctim.tv_sec + 1 >= started->tv_sec;
+
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    0,
+  };
+  if (!glnx_dirfd_iterator_init_at (target_dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+      if (dent->d_type == DT_DIR)
+        dir.subdirs.emplace_back (dent->d_name);
+      else
+        dir.files.emplace (dent->d_name);
+    }
+
+  /* Apply the difference to what we had for it before */
+  if (known != index->dirs.end ())
+    {
+      for (auto &file : known->second.files)
+        {
+          if (dir.files.count (file) == 0)
+            index->paths.erase (path + "/" + file);
+        }
+      for (auto &subdir : known->second.subdirs)
+        {
+          if (std::find (dir.subdirs.begin (), dir.subdirs.end (), subdir) == dir.subdirs.end ())
+            rootfs_index_remove_dir (index, path + "/" + subdir);
+        }
+    }
+  for (auto &file : dir.files)
+    index->paths.insert (path + "/" + file);
+
+  const std::vector<std::string> subdirs = dir.subdirs;
+  index->dirs[path] = std::move (dir);
+  for (auto &subdir : subdirs)
+    {
+      if (!rootfs_index_update_dir (index, target_dfd, subdir.c_str (), path + "/" + subdir,
+                                    started, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+rootfs_index_ensure (RpmOstreeRootfsIndex *index, GCancellable *cancellable, GError **error)
+{
+  if (index->populated && !index->stale)
+    return TRUE;
+
+  struct timespec started;
+  if (clock_gettime (CLOCK_REALTIME, &started) < 0)
+    return glnx_throw_errno_prefix (error, "clock_gettime");
+  if (!rootfs_index_update_dir (index, index->rootfs_fd, "usr", "/usr", &started, cancellable,
+                                error))
+    return glnx_prefix_error (error, "Indexing /usr");
+  index->populated = true;
+  index->stale = false;
+  return TRUE;
+}
+
+/* Called after a trigger ran; the next lookup will pick up its changes */
+static void
+rootfs_index_mark_stale (RpmOstreeRootfsIndex *index)
+{
+  index->stale = true;
+}
+
+/* Write all paths in @index matching @abspath (which is either the file
+ * itself, or a directory prefix) to @f. */
+static gboolean
+rootfs_index_write_matches (RpmOstreeRootfsIndex *index, const char *abspath, FILE *f,
+                            guint *inout_n_matched, GError **error)
+{
+  if (index->paths.count (abspath) > 0)
+    {
+      if (!write_filename (f, abspath, strlen (abspath), error))
+        return FALSE;
+      (*inout_n_matched)++;
+    }
+
+  const std::string dirprefix = std::string (abspath) + "/";
+  for (auto it = index->paths.lower_bound (dirprefix);
+       it != index->paths.end () && it->compare (0, dirprefix.size (), dirprefix) == 0; ++it)
+    {
+      if (!write_filename (f, it->c_str (), it->size (), error))
+        return FALSE;
+      (*inout_n_matched)++;
+    }
+  return TRUE;
+}
+
 /* Given file trigger @pattern (really a subdirectory), traverse the
  * filesystem @rootfs_fd and write all matches as file names to @f.  Used
- * for %transfiletriggerin.
+ * for %transfiletriggerin. If @index is provided, it's consulted instead of
+ * walking the filesystem where possible.
  */
 static gboolean
-find_and_write_matching_files (int rootfs_fd, const char *pattern, FILE *f, guint *out_n_matches,
-                               GCancellable *cancellable, GError **error)
+find_and_write_matching_files (int rootfs_fd, RpmOstreeRootfsIndex *index, const char *pattern,
+                               FILE *f, guint *out_n_matches, GCancellable *cancellable,
+                               GError **error)
 {
   GLNX_AUTO_PREFIX_ERROR ("Finding matches", error);
 
@@ -733,41 +1471,61 @@ find_and_write_matching_files (int rootfs_fd, const char *pattern, FILE *f, guin
     g_string_truncate (buf, buf->len - 1);
 
   guint n_pattern_matches = 0;
-  if (!write_subdir (rootfs_fd, pattern, buf, f, &n_pattern_matches, cancellable, error))
-    return glnx_prefix_error (error, "pattern '%s'", pattern);
+  if (index)
+    {
+      struct stat stbuf;
+      if (!glnx_fstatat_allow_noent (rootfs_fd, pattern, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      /* The index doesn't follow symlinks, so for those (and for patterns
+       * that found nothing, which may be due to a symlinked parent directory)
+       * we fall through to a real walk. */
+      if (errno == 0 && !S_ISLNK (stbuf.st_mode))
+        {
+          if (!rootfs_index_ensure (index, cancellable, error))
+            return FALSE;
+          if (!rootfs_index_write_matches (index, buf->str, f, &n_pattern_matches, error))
+            return glnx_prefix_error (error, "pattern '%s'", pattern);
+        }
+    }
+  if (n_pattern_matches == 0)
+    {
+      if (!write_subdir (rootfs_fd, pattern, buf, f, &n_pattern_matches, cancellable, error))
+        return glnx_prefix_error (error, "pattern '%s'", pattern);
+    }
   *out_n_matches += n_pattern_matches;
 
   return TRUE;
 }
 
-/* Execute a supported script.  Note that @cancellable
- * does not currently kill a running script subprocess.
- */
-gboolean
-rpmostree_script_run_sync (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind, int rootfs_fd,
-                           GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse,
-                           gboolean use_kernel_install, guint *out_n_run, GCancellable *cancellable,
-                           GError **error)
+static const KnownRpmScriptKind *
+script_kind_lookup (RpmOstreeScriptKind kind)
 {
-  const KnownRpmScriptKind *scriptkind;
   switch (kind)
     {
     case RPMOSTREE_SCRIPT_PREIN:
-      scriptkind = &pre_script;
-      break;
+      return &pre_script;
     case RPMOSTREE_SCRIPT_POSTIN:
-      scriptkind = &post_script;
-      break;
+      return &post_script;
     case RPMOSTREE_SCRIPT_POSTTRANS:
-      scriptkind = &posttrans_script;
-      break;
+      return &posttrans_script;
     default:
       g_assert_not_reached ();
     }
+}
 
+/* Execute a supported script.  Note that @cancellable
+ * does not currently kill a running script subprocess.
+ */
+gboolean
+rpmostree_script_run_sync (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind, int rootfs_fd,
+                           GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse,
+                           gboolean use_kernel_install, RpmOstreeScriptSandbox *sandbox,
+                           guint *out_n_run, GCancellable *cancellable, GError **error)
+{
+  const KnownRpmScriptKind *scriptkind = script_kind_lookup (kind);
   gboolean did_run = FALSE;
   if (!run_script (scriptkind, pkg, hdr, rootfs_fd, var_lib_rpm_statedir, enable_fuse,
-                   use_kernel_install, &did_run, cancellable, error))
+                   use_kernel_install, sandbox, &did_run, cancellable, error))
     return FALSE;
 
   if (did_run)
@@ -775,12 +1533,277 @@ rpmostree_script_run_sync (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind
   return TRUE;
 }
 
+/* A script to run via rpmostree_script_jobs_run() */
+struct RpmOstreeScriptJob
+{
+  const KnownRpmScriptKind *rpmscript;
+  char *pkg_name;
+  gboolean wanted; /* Counts as run, even if there turns out to be nothing to do */
+  char *interp;    /* %NULL if there's nothing to run */
+  char *script;
+  const char *script_arg;
+  std::vector<guint> deps;
+
+  /* Set by the worker thread */
+  ScriptOutput output;
+  guint64 elapsed_ms;
+  GError *error;
+};
+
+/* Returns a job for the @kind script of @pkg; it's a no-op if there's no such
+ * script. Anything that's not thread-safe (e.g. macro expansion) happens here,
+ * rather than when running it.
+ */
+RpmOstreeScriptJob *
+rpmostree_script_job_new (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind,
+                          gboolean use_kernel_install, GError **error)
+{
+  g_autoptr (RpmOstreeScriptJob) job = new RpmOstreeScriptJob ();
+  job->rpmscript = script_kind_lookup (kind);
+  job->pkg_name = g_strdup (dnf_package_get_name (pkg));
+  if (!rpm_script_is_wanted (job->rpmscript, pkg, hdr, use_kernel_install))
+    return util::move_nullify (job);
+
+  job->wanted = TRUE;
+  if (!rpm_script_prepare (job->rpmscript, pkg, hdr, &job->interp, &job->script,
+                           &job->script_arg, error))
+    return NULL;
+  return util::move_nullify (job);
+}
+
+void
+rpmostree_script_job_free (RpmOstreeScriptJob *job)
+{
+  g_free (job->pkg_name);
+  g_free (job->interp);
+  g_free (job->script);
+  script_output_clear (&job->output);
+  g_clear_error (&job->error);
+  delete job;
+}
+
+/* Make @job wait for the job at index @dep_idx, which must come before it */
+void
+rpmostree_script_job_add_dep (RpmOstreeScriptJob *job, guint dep_idx)
+{
+  job->deps.push_back (dep_idx);
+}
+
+/* Whether there's nothing to run for @job */
+gboolean
+rpmostree_script_job_is_noop (RpmOstreeScriptJob *job)
+{
+  return job->interp == NULL;
+}
+
+/* How many scripts rpmostree_script_jobs_run() may run at once; this is opt-in
+ * via RPMOSTREE_SCRIPT_PARALLEL=<n>. Returns 1 if unset.
+ */
+guint
+rpmostree_script_get_max_parallel (void)
+{
+  const char *val = g_getenv ("RPMOSTREE_SCRIPT_PARALLEL");
+  if (!val || !*val)
+    return 1;
+  guint64 n = g_ascii_strtoull (val, NULL, 10);
+  return (guint)CLAMP (n, 1, 256);
+}
+
+typedef struct
+{
+  GPtrArray *jobs;
+  int rootfs_fd;
+  GLnxTmpDir *var_lib_rpm_statedir;
+  gboolean enable_fuse;
+  GCancellable *cancellable;
+  guint *out_n_run;
+  RpmOstreeScriptJobPrepareFunc prepare;
+  gpointer prepare_data;
+  std::vector<guint> n_pending_deps;
+  std::vector<std::vector<guint> > dependents;
+  std::vector<bool> done;
+  std::set<guint> ready; /* Started in transaction order */
+  guint next_to_log;
+  gboolean failed;
+  RpmOstreeWorkerPool pool;
+} ScriptJobsRun;
+
+typedef struct
+{
+  ScriptJobsRun *run;
+  guint idx;
+} ScriptJobTaskData;
+
+static void
+script_job_thread (GTask *task, gpointer source, gpointer task_data, GCancellable *cancellable)
+{
+  auto tdata = static_cast<ScriptJobTaskData *> (task_data);
+  auto run = tdata->run;
+  auto job = static_cast<RpmOstreeScriptJob *> (run->jobs->pdata[tdata->idx]);
+
+  guint64 start_time_ms = g_get_monotonic_time () / 1000;
+  if (!run_script_in_bwrap_container (run->rootfs_fd, run->var_lib_rpm_statedir,
+                                      run->enable_fuse, job->pkg_name, job->rpmscript->desc,
+                                      job->interp, job->script, job->script_arg, -1, &job->output,
+                                      cancellable, &job->error))
+    glnx_prefix_error (&job->error, "Running %s for %s", job->rpmscript->desc, job->pkg_name);
+  job->elapsed_ms = g_get_monotonic_time () / 1000 - start_time_ms;
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+script_jobs_mark_done (ScriptJobsRun *run, guint idx)
+{
+  run->done[idx] = true;
+  for (guint dependent : run->dependents[idx])
+    {
+      if (--run->n_pending_deps[dependent] == 0)
+        run->ready.insert (dependent);
+    }
+}
+
+/* Log the output of the jobs which are done, up to the first one which isn't */
+static void
+script_jobs_log_done (ScriptJobsRun *run)
+{
+  for (; run->next_to_log < run->jobs->len && run->done[run->next_to_log]; run->next_to_log++)
+    {
+      auto job = static_cast<RpmOstreeScriptJob *> (run->jobs->pdata[run->next_to_log]);
+      if (job->interp)
+        {
+          g_autofree char *pkg_script
+              = g_strconcat (job->pkg_name, ".", job->rpmscript->desc + 1, NULL);
+          script_output_log (pkg_script, &job->output);
+          log_rpm_script_executed (job->rpmscript, job->pkg_name, job->elapsed_ms);
+        }
+      if (job->wanted)
+        (*run->out_n_run)++;
+    }
+}
+
+static void
+on_script_job_done (GObject *obj, GAsyncResult *result, gpointer user_data)
+{
+  auto tdata = static_cast<ScriptJobTaskData *> (g_task_get_task_data (G_TASK (result)));
+  auto run = tdata->run;
+  auto job = static_cast<RpmOstreeScriptJob *> (run->jobs->pdata[tdata->idx]);
+  /* The job keeps its own error; see the end of rpmostree_script_jobs_run() */
+  if (job->error)
+    run->failed = TRUE;
+  else
+    script_jobs_mark_done (run, tdata->idx);
+  script_jobs_log_done (run);
+  rpmostree_worker_pool_job_done (&run->pool, NULL);
+}
+
+static gboolean
+script_job_start (RpmOstreeWorkerPool *pool, gpointer user_data, gboolean *out_started,
+                  GError **error)
+{
+  auto run = static_cast<ScriptJobsRun *> (user_data);
+  *out_started = FALSE;
+  while (!run->failed && !run->ready.empty ())
+    {
+      const guint idx = *run->ready.begin ();
+      run->ready.erase (run->ready.begin ());
+      if (run->prepare && !run->prepare (idx, run->prepare_data, error))
+        return FALSE;
+      auto job = static_cast<RpmOstreeScriptJob *> (run->jobs->pdata[idx]);
+      if (!job->interp)
+        {
+          script_jobs_mark_done (run, idx);
+          continue;
+        }
+
+      auto tdata = g_new0 (ScriptJobTaskData, 1);
+      tdata->run = run;
+      tdata->idx = idx;
+      g_autoptr (GTask) task = g_task_new (NULL, run->cancellable, on_script_job_done, NULL);
+      g_task_set_task_data (task, tdata, g_free);
+      g_task_run_in_thread (task, script_job_thread);
+      *out_started = TRUE;
+      break;
+    }
+  return TRUE;
+}
+
+/* Run @jobs, each in its own container, with up to @max_parallel at once. A
+ * job is started once all of its dependencies are done, right after calling
+ * @prepare for it (if set) on this thread; the output and the journal entry
+ * of each are logged in the order of @jobs regardless of when they ran. If a
+ * job or @prepare fails, no new ones are started, and once the running ones
+ * are done, the output of all the jobs that ran is logged and the error of
+ * @prepare or else of the first failed job is returned.
+ */
+gboolean
+rpmostree_script_jobs_run (GPtrArray *jobs, guint max_parallel, int rootfs_fd,
+                           GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_fuse,
+                           RpmOstreeScriptJobPrepareFunc prepare, gpointer prepare_data,
+                           guint *out_n_run, GCancellable *cancellable, GError **error)
+{
+  const guint n = jobs->len;
+  ScriptJobsRun run = {
+    jobs, rootfs_fd, var_lib_rpm_statedir, enable_fuse, cancellable, out_n_run, prepare,
+    prepare_data,
+  };
+  run.n_pending_deps.resize (n);
+  run.dependents.resize (n);
+  run.done.resize (n);
+  for (guint i = 0; i < n; i++)
+    {
+      auto job = static_cast<RpmOstreeScriptJob *> (jobs->pdata[i]);
+      for (guint dep : job->deps)
+        {
+          g_assert_cmpuint (dep, <, i);
+          run.dependents[dep].push_back (i);
+          run.n_pending_deps[i]++;
+        }
+      if (run.n_pending_deps[i] == 0)
+        run.ready.insert (i);
+    }
+
+  rpmostree_worker_pool_init (&run.pool, max_parallel, script_job_start, &run);
+  g_autoptr (GError) prepare_error = NULL;
+  const gboolean prepared = rpmostree_worker_pool_run (&run.pool, &prepare_error);
+  /* Jobs without a script at the end are marked done without ever running */
+  script_jobs_log_done (&run);
+  if (prepared && !run.failed)
+    {
+      g_assert_cmpuint (run.next_to_log, ==, n);
+      return TRUE;
+    }
+
+  /* Log whatever else ran, then return the first error */
+  RpmOstreeScriptJob *failed_job = NULL;
+  for (guint i = run.next_to_log; i < n; i++)
+    {
+      auto job = static_cast<RpmOstreeScriptJob *> (jobs->pdata[i]);
+      if (!job->interp || !(run.done[i] || job->error))
+        continue;
+      g_autofree char *pkg_script
+          = g_strconcat (job->pkg_name, ".", job->rpmscript->desc + 1, NULL);
+      script_output_log (pkg_script, &job->output);
+      if (job->error && !failed_job)
+        failed_job = job;
+    }
+  if (!prepared)
+    {
+      g_propagate_error (error, util::move_nullify (prepare_error));
+      return FALSE;
+    }
+  g_assert (failed_job);
+  g_propagate_error (error, util::move_nullify (failed_job->error));
+  return FALSE;
+}
+
 /* File triggers, as used by e.g. glib2.spec and vagrant.spec in Fedora. More
  * info at <http://rpm.org/user_doc/file_triggers.html>.
  */
 gboolean
-rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable_fuse,
-                                      gboolean use_kernel_install, guint *out_n_run,
+rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, RpmOstreeRootfsIndex *index,
+                                      gboolean enable_fuse, gboolean use_kernel_install,
+                                      RpmOstreeScriptSandbox *sandbox,
+                                      RpmOstreeTriggerCache *trigger_cache, guint *out_n_run,
                                       GCancellable *cancellable, GError **error)
 {
   const char *pkg_name = headerGetString (hdr, RPMTAG_NAME);
@@ -929,7 +1952,7 @@ rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable
           if (j > 0)
             g_string_append (patterns_joined, ", ");
           g_string_append (patterns_joined, pattern);
-          if (!find_and_write_matching_files (rootfs_fd, pattern, tmpf_file, &n_matched,
+          if (!find_and_write_matching_files (rootfs_fd, index, pattern, tmpf_file, &n_matched,
                                               cancellable, error))
             return FALSE;
           if (n_matched == 0)
@@ -948,18 +1971,45 @@ rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable
         return FALSE;
       /* Now, point back to the beginning so the script reads it from the start
          as stdin */
+      guint64 start_time_ms = g_get_monotonic_time () / 1000;
+      gboolean replayed = FALSE;
+      if (trigger_cache
+          && !rpmostree_trigger_cache_lookup (trigger_cache, hdr, i, interp, script,
+                                              fileno (tmpf_file), &replayed, cancellable, error))
+        return FALSE;
+      if (replayed)
+        {
+          guint64 elapsed_ms = g_get_monotonic_time () / 1000 - start_time_ms;
+          sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
+                           SD_ID128_FORMAT_VAL (RPMOSTREE_MESSAGE_FILETRIGGER),
+                           "MESSAGE=Replayed cached %%transfiletriggerin(%s) for %s in "
+                           "%" G_GUINT64_FORMAT " ms; %u matched files",
+                           patterns_joined->str, pkg_name, elapsed_ms, n_total_matched,
+                           "SCRIPT_TYPE=%%transfiletriggerin", "PKG=%s", pkg_name, "PATTERNS=%s",
+                           patterns_joined->str, "TRIGGER_N_MATCHES=%u", n_total_matched,
+                           "TRIGGER_CACHED=1", "EXEC_TIME_MS=%" G_GUINT64_FORMAT, elapsed_ms,
+                           NULL);
+          if (index)
+            rootfs_index_mark_stale (index);
+          continue;
+        }
+
       if (lseek (fileno (tmpf_file), 0, SEEK_SET) < 0)
         return glnx_throw_errno_prefix (error, "lseek");
 
       /* Run it, and log the result */
-      guint64 start_time_ms = g_get_monotonic_time () / 1000;
-      if (!rpmostree_run_script_in_bwrap_container (rootfs_fd, NULL, enable_fuse, pkg_name,
-                                                    "%transfiletriggerin", interp, script, NULL,
-                                                    fileno (tmpf_file), cancellable, error))
+      if (!run_script_in_container (sandbox, rootfs_fd, NULL, enable_fuse, pkg_name,
+                                    "%transfiletriggerin", interp, script, NULL,
+                                    fileno (tmpf_file), cancellable, error))
         return FALSE;
+      if (index)
+        rootfs_index_mark_stale (index);
       guint64 end_time_ms = g_get_monotonic_time () / 1000;
       guint64 elapsed_ms = end_time_ms - start_time_ms;
 
+      if (trigger_cache && !rpmostree_trigger_cache_store (trigger_cache, cancellable, error))
+        return FALSE;
+
       (*out_n_run)++;
 
       sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
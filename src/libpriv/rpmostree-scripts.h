@@ -31,6 +31,7 @@
 #include <rpm/rpmts.h>
 
 #include "libglnx.h"
+#include "rpmostree-trigger-cache.h"
 
 G_BEGIN_DECLS
 
@@ -41,17 +42,67 @@ typedef enum
   RPMOSTREE_SCRIPT_POSTTRANS,
 } RpmOstreeScriptKind;
 
+typedef struct RpmOstreeScriptSandbox RpmOstreeScriptSandbox;
+
+gboolean rpmostree_script_sandbox_new (int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
+                                       gboolean enable_fuse, RpmOstreeScriptSandbox **out_sandbox,
+                                       GCancellable *cancellable, GError **error);
+
+gboolean rpmostree_script_sandbox_close (RpmOstreeScriptSandbox *sandbox, GError **error);
+
+void rpmostree_script_sandbox_free (RpmOstreeScriptSandbox *sandbox);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeScriptSandbox, rpmostree_script_sandbox_free)
+
 gboolean rpmostree_script_txn_validate (DnfPackage *package, Header hdr, bool use_kernel_install,
                                         GCancellable *cancellable, GError **error);
 
 gboolean rpmostree_script_run_sync (DnfPackage *pkg, Header hdr, RpmOstreeScriptKind kind,
                                     int rootfs_fd, GLnxTmpDir *var_lib_rpm_statedir,
                                     gboolean enable_rofiles, gboolean use_kernel_install,
+                                    RpmOstreeScriptSandbox *sandbox, guint *out_n_run,
+                                    GCancellable *cancellable, GError **error);
+
+typedef struct RpmOstreeScriptJob RpmOstreeScriptJob;
+
+RpmOstreeScriptJob *rpmostree_script_job_new (DnfPackage *pkg, Header hdr,
+                                              RpmOstreeScriptKind kind,
+                                              gboolean use_kernel_install, GError **error);
+
+void rpmostree_script_job_free (RpmOstreeScriptJob *job);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeScriptJob, rpmostree_script_job_free)
+
+void rpmostree_script_job_add_dep (RpmOstreeScriptJob *job, guint dep_idx);
+
+gboolean rpmostree_script_job_is_noop (RpmOstreeScriptJob *job);
+
+guint rpmostree_script_get_max_parallel (void);
+
+/* Called right before the job at @idx starts (or is skipped as a no-op) */
+typedef gboolean (*RpmOstreeScriptJobPrepareFunc) (guint idx, gpointer user_data,
+                                                   GError **error);
+
+gboolean rpmostree_script_jobs_run (GPtrArray *jobs, guint max_parallel, int rootfs_fd,
+                                    GLnxTmpDir *var_lib_rpm_statedir, gboolean enable_rofiles,
+                                    RpmOstreeScriptJobPrepareFunc prepare, gpointer prepare_data,
                                     guint *out_n_run, GCancellable *cancellable, GError **error);
 
-gboolean rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd, gboolean enable_rofiles,
-                                               gboolean use_kernel_install, guint *out_n_run,
-                                               GCancellable *cancellable, GError **error);
+typedef struct RpmOstreeRootfsIndex RpmOstreeRootfsIndex;
+
+RpmOstreeRootfsIndex *rpmostree_rootfs_index_new (int rootfs_fd);
+
+void rpmostree_rootfs_index_free (RpmOstreeRootfsIndex *index);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeRootfsIndex, rpmostree_rootfs_index_free)
+
+gboolean rpmostree_transfiletriggers_run_sync (Header hdr, int rootfs_fd,
+                                               RpmOstreeRootfsIndex *index, gboolean enable_rofiles,
+                                               gboolean use_kernel_install,
+                                               RpmOstreeScriptSandbox *sandbox,
+                                               RpmOstreeTriggerCache *trigger_cache,
+                                               guint *out_n_run, GCancellable *cancellable,
+                                               GError **error);
 
 gboolean rpmostree_deployment_sanitycheck_true (int rootfs_fd, GCancellable *cancellable,
                                                 GError **error);
@@ -0,0 +1,400 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A trigram index over the names and summaries of the packages in each rpm-md
+ * repo, kept next to the repo's cached metadata. It is only used to narrow the
+ * set of package names a Search has to look at; the actual matching is still
+ * done by libdnf queries, so the index may (and does) return false positives
+ * but never misses a package. */
+
+#include "config.h"
+
+#include <algorithm>
+#include <iterator>
+#include <libglnx.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "rpmostree-rpm-util.h"
+#include "rpmostree-search-index.h"
+#include "rpmostree-util.h"
+
+#define SEARCH_INDEX_FILENAME "rpmostree-search.idx"
+/* Bump this whenever the format or the tokenization changes */
+#define SEARCH_INDEX_VERSION 1
+/* version, repomd stamp, sorted package names, (trigram, sorted name indices) sorted by trigram */
+#define SEARCH_INDEX_VARIANT_FORMAT "(usasa(uau))"
+
+/* Identifies the metadata an index was built from; same inputs as the daemon's
+ * sack cache key. Returns %NULL if the repo has no cached metadata. */
+static char *
+repo_metadata_stamp (DnfRepo *repo)
+{
+  g_autofree char *repomd
+      = g_build_filename (dnf_repo_get_location (repo), "repodata", "repomd.xml", NULL);
+  struct stat stbuf = {};
+  if (!glnx_fstatat_allow_noent (AT_FDCWD, repomd, &stbuf, 0, NULL) || errno == ENOENT)
+    return NULL;
+  return g_strdup_printf ("%" G_GUINT64_FORMAT ".%ld:%" G_GUINT64_FORMAT,
+                          (guint64)stbuf.st_mtim.tv_sec, stbuf.st_mtim.tv_nsec,
+                          (guint64)stbuf.st_size);
+}
+
+static inline guint32
+trigram_at (const char *s)
+{
+  return ((guint32)(guint8)g_ascii_tolower (s[0]) << 16)
+         | ((guint32)(guint8)g_ascii_tolower (s[1]) << 8) | (guint8)g_ascii_tolower (s[2]);
+}
+
+static void
+add_trigrams (const char *text, std::set<guint32> &out)
+{
+  if (!text)
+    return;
+  const size_t len = strlen (text);
+  for (size_t i = 0; i + 3 <= len; i++)
+    out.insert (trigram_at (text + i));
+}
+
+/* Returns %FALSE if @term can't be narrowed down via the index: terms that are
+ * too short to contain a trigram, globs, and anything outside of ASCII, where
+ * libsolv's case folding may differ from ours. */
+static gboolean
+term_trigrams (const char *term, std::set<guint32> &out)
+{
+  if (strlen (term) < 3 || strpbrk (term, "*?["))
+    return FALSE;
+  for (const char *p = term; *p; p++)
+    {
+      if (!g_ascii_isprint (*p))
+        return FALSE;
+    }
+  add_trigrams (term, out);
+  return TRUE;
+}
+
+/* A package name and summary to index */
+typedef std::pair<const char *, const char *> SearchIndexEntry;
+
+static GVariant *
+build_index (const char *stamp, const std::vector<SearchIndexEntry> &entries)
+{
+  /* Index by name rather than by package; that's what Search filters on and
+   * it lets us merge all the versions of a package into a single entry. */
+  std::map<std::string, std::set<guint32> > name_trigrams;
+  for (auto &[name, summary] : entries)
+    {
+      auto &trigrams = name_trigrams[name];
+      add_trigrams (name, trigrams);
+      add_trigrams (summary, trigrams);
+    }
+
+  std::map<guint32, std::vector<guint32> > postings;
+  g_autoptr (GVariantBuilder) names_builder = g_variant_builder_new (G_VARIANT_TYPE ("as"));
+  guint32 idx = 0;
+  for (auto &[name, trigrams] : name_trigrams)
+    {
+      g_variant_builder_add (names_builder, "s", name.c_str ());
+      for (auto trigram : trigrams)
+        postings[trigram].push_back (idx);
+      idx++;
+    }
+
+  g_autoptr (GVariantBuilder) postings_builder
+      = g_variant_builder_new (G_VARIANT_TYPE ("a(uau)"));
+  for (auto &[trigram, idxs] : postings)
+    {
+      GVariant *v = g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, idxs.data (), idxs.size (),
+                                               sizeof (guint32));
+      g_variant_builder_add (postings_builder, "(u@au)", trigram, v);
+    }
+
+  return g_variant_ref_sink (g_variant_new (SEARCH_INDEX_VARIANT_FORMAT, SEARCH_INDEX_VERSION,
+                                            stamp, names_builder, postings_builder));
+}
+
+static GVariant *
+build_repo_index (DnfSack *sack, DnfRepo *repo, const char *stamp)
+{
+  hy_autoquery HyQuery query = hy_query_create (sack);
+  hy_query_filter (query, HY_PKG_REPONAME, HY_EQ, dnf_repo_get_id (repo));
+  g_autoptr (GPtrArray) pkgs = hy_query_run (query);
+
+  std::vector<SearchIndexEntry> entries;
+  entries.reserve (pkgs->len);
+  for (guint i = 0; i < pkgs->len; i++)
+    {
+      auto pkg = static_cast<DnfPackage *> (pkgs->pdata[i]);
+      entries.emplace_back (dnf_package_get_name (pkg), dnf_package_get_summary (pkg));
+    }
+  return build_index (stamp, entries);
+}
+
+/* Returns %NULL if there is no usable index for @stamp on disk */
+static GVariant *
+load_repo_index (const char *path, const char *stamp)
+{
+  g_autoptr (GMappedFile) mfile = g_mapped_file_new (path, FALSE, NULL);
+  if (!mfile)
+    return NULL;
+  g_autoptr (GBytes) bytes = g_mapped_file_get_bytes (mfile);
+  g_autoptr (GVariant) index = g_variant_ref_sink (
+      g_variant_new_from_bytes (G_VARIANT_TYPE (SEARCH_INDEX_VARIANT_FORMAT), bytes, FALSE));
+
+  guint32 version;
+  const char *index_stamp;
+  g_variant_get_child (index, 0, "u", &version);
+  g_variant_get_child (index, 1, "&s", &index_stamp);
+  if (version != SEARCH_INDEX_VERSION || !g_str_equal (index_stamp, stamp))
+    return NULL;
+
+  return util::move_nullify (index);
+}
+
+/* Returns the up to date index for @repo, building and writing it out if
+ * needed. Returns %NULL without setting @error if the repo has no metadata to
+ * index. */
+static GVariant *
+ensure_repo_index (DnfSack *sack, DnfRepo *repo, GCancellable *cancellable, GError **error)
+{
+  g_autofree char *stamp = repo_metadata_stamp (repo);
+  if (!stamp)
+    return NULL;
+
+  g_autofree char *path = g_build_filename (dnf_repo_get_location (repo), SEARCH_INDEX_FILENAME,
+                                            NULL);
+  g_autoptr (GVariant) index = load_repo_index (path, stamp);
+  if (index)
+    return util::move_nullify (index);
+
+  index = build_repo_index (sack, repo, stamp);
+  if (!glnx_file_replace_contents_at (
+          AT_FDCWD, path, static_cast<const guint8 *> (g_variant_get_data (index)),
+          g_variant_get_size (index), GLNX_FILE_REPLACE_NODATASYNC, cancellable, error))
+    return (GVariant *)glnx_prefix_error_null (error, "Writing search index for repo %s",
+                                               dnf_repo_get_id (repo));
+
+  g_debug ("Wrote search index for repo %s", dnf_repo_get_id (repo));
+  return util::move_nullify (index);
+}
+
+/* Regenerate the search index of every enabled repo whose metadata changed;
+ * called after refreshing rpm-md. */
+gboolean
+rpmostree_search_index_update (DnfContext *dnfctx, GCancellable *cancellable, GError **error)
+{
+  DnfSack *sack = dnf_context_get_sack (dnfctx);
+  g_autoptr (GPtrArray) repos
+      = rpmostree_get_enabled_rpmmd_repos (dnfctx, DNF_REPO_ENABLED_PACKAGES);
+  for (guint i = 0; i < repos->len; i++)
+    {
+      auto repo = static_cast<DnfRepo *> (repos->pdata[i]);
+      g_autoptr (GError) local_error = NULL;
+      g_autoptr (GVariant) index = ensure_repo_index (sack, repo, cancellable, &local_error);
+      if (local_error)
+        {
+          g_propagate_error (error, util::move_nullify (local_error));
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
+/* Returns the posting list for @trigram, or an empty one */
+static const guint32 *
+lookup_posting (GVariant *postings, guint32 trigram, gsize *out_len)
+{
+  gsize lo = 0;
+  gsize hi = g_variant_n_children (postings);
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+      g_autoptr (GVariant) entry = g_variant_get_child_value (postings, mid);
+      guint32 entry_trigram;
+      g_variant_get_child (entry, 0, "u", &entry_trigram);
+      if (entry_trigram == trigram)
+        {
+          g_autoptr (GVariant) idxs = g_variant_get_child_value (entry, 1);
+          /* Backed by the index, which the caller holds a ref on */
+          return static_cast<const guint32 *> (
+              g_variant_get_fixed_array (idxs, out_len, sizeof (guint32)));
+        }
+      else if (entry_trigram < trigram)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  *out_len = 0;
+  return NULL;
+}
+
+/* Add the names in @index which contain all the trigrams in @term_sets to
+ * @candidates */
+static void
+index_lookup (GVariant *index, const std::vector<std::set<guint32> > &term_sets,
+              std::set<std::string> &candidates)
+{
+  g_autoptr (GVariant) names = g_variant_get_child_value (index, 2);
+  g_autoptr (GVariant) postings = g_variant_get_child_value (index, 3);
+
+  /* Intersect the posting lists of every trigram of every term; what's
+   * left are names that may match all the terms. */
+  std::vector<guint32> matches;
+  gboolean first = TRUE;
+  for (auto &trigrams : term_sets)
+    {
+      for (auto trigram : trigrams)
+        {
+          gsize n = 0;
+          const guint32 *posting = lookup_posting (postings, trigram, &n);
+          if (first)
+            {
+              matches.assign (posting, posting + n);
+              first = FALSE;
+            }
+          else
+            {
+              std::vector<guint32> narrowed;
+              std::set_intersection (matches.begin (), matches.end (), posting, posting + n,
+                                     std::back_inserter (narrowed));
+              matches = std::move (narrowed);
+            }
+          if (matches.empty ())
+            break;
+        }
+      if (matches.empty ())
+        break;
+    }
+
+  const gsize n_names = g_variant_n_children (names);
+  for (auto idx : matches)
+    {
+      if (idx >= n_names)
+        continue;
+      const char *name;
+      g_variant_get_child (names, idx, "&s", &name);
+      candidates.insert (name);
+    }
+}
+
+/* Narrow down a Search for @terms to the package names that contain all the
+ * trigrams of every term in either their name or summary, in any repo.
+ *
+ * Returns %NULL without setting @error if the index can't help, e.g. because
+ * none of the terms are long enough or a repo couldn't be indexed; the caller
+ * must then consider every package. */
+char **
+rpmostree_search_index_lookup (DnfContext *dnfctx, const char *const *terms,
+                               GCancellable *cancellable, GError **error)
+{
+  std::vector<std::set<guint32> > term_sets;
+  for (const char *const *it = terms; it && *it; it++)
+    {
+      std::set<guint32> trigrams;
+      if (term_trigrams (*it, trigrams))
+        term_sets.push_back (std::move (trigrams));
+    }
+  if (term_sets.empty ())
+    return NULL;
+
+  DnfSack *sack = dnf_context_get_sack (dnfctx);
+  g_autoptr (GPtrArray) repos
+      = rpmostree_get_enabled_rpmmd_repos (dnfctx, DNF_REPO_ENABLED_PACKAGES);
+  std::set<std::string> candidates;
+  for (guint i = 0; i < repos->len; i++)
+    {
+      auto repo = static_cast<DnfRepo *> (repos->pdata[i]);
+      g_autoptr (GVariant) index = ensure_repo_index (sack, repo, cancellable, error);
+      if (!index)
+        return NULL;
+      index_lookup (index, term_sets, candidates);
+    }
+
+  g_autoptr (GPtrArray) ret = g_ptr_array_new ();
+  for (auto &name : candidates)
+    g_ptr_array_add (ret, g_strdup (name.c_str ()));
+  g_ptr_array_add (ret, NULL);
+  return (char **)g_ptr_array_free (util::move_nullify (ret), FALSE);
+}
+
+#ifdef BUILDOPT_BIN_UNIT_TESTS
+/* Look up @terms in @index; returns the candidates joined with spaces */
+static std::string
+test_lookup (GVariant *index, std::vector<const char *> terms)
+{
+  std::vector<std::set<guint32> > term_sets;
+  for (auto term : terms)
+    {
+      std::set<guint32> trigrams;
+      g_assert (term_trigrams (term, trigrams));
+      term_sets.push_back (std::move (trigrams));
+    }
+  std::set<std::string> candidates;
+  index_lookup (index, term_sets, candidates);
+  std::string ret;
+  for (auto &name : candidates)
+    ret += (ret.empty () ? "" : " ") + name;
+  return ret;
+}
+
+static void
+test_search_index_lookup (void)
+{
+  std::vector<SearchIndexEntry> entries = {
+    { "vim-enhanced", "A version of the VIM editor which includes recent enhancements" },
+    { "emacs", "GNU Emacs text editor" },
+    { "tmux", "A terminal multiplexer" },
+    /* Another version of the same package */
+    { "tmux", "Terminal multiplexer" },
+    { "zsh", NULL },
+  };
+  g_autoptr (GVariant) index = build_index ("stamp", entries);
+
+  /* Names are merged across versions */
+  g_autoptr (GVariant) names = g_variant_get_child_value (index, 2);
+  g_assert_cmpuint (g_variant_n_children (names), ==, 4);
+
+  g_assert_cmpstr (test_lookup (index, { "editor" }).c_str (), ==, "emacs vim-enhanced");
+  /* Matching is case insensitive */
+  g_assert_cmpstr (test_lookup (index, { "EDITOR" }).c_str (), ==, "emacs vim-enhanced");
+  /* All the terms have to match, in either the name or the summary */
+  g_assert_cmpstr (test_lookup (index, { "vim", "editor" }).c_str (), ==, "vim-enhanced");
+  g_assert_cmpstr (test_lookup (index, { "multiplex" }).c_str (), ==, "tmux");
+  g_assert_cmpstr (test_lookup (index, { "zsh" }).c_str (), ==, "zsh");
+  g_assert_cmpstr (test_lookup (index, { "kernel" }).c_str (), ==, "");
+  g_assert_cmpstr (test_lookup (index, { "editor", "kernel" }).c_str (), ==, "");
+
+  /* Terms the index can't narrow down */
+  std::set<guint32> trigrams;
+  g_assert (!term_trigrams ("vi", trigrams));
+  g_assert (!term_trigrams ("vim*", trigrams));
+  g_assert (!term_trigrams ("caf\xc3\xa9", trigrams));
+  g_print ("ok %s\n", G_STRFUNC);
+}
+#endif
+
+void
+rpmostree_search_index_tests (void)
+{
+#ifdef BUILDOPT_BIN_UNIT_TESTS
+  test_search_index_lookup ();
+#endif
+}
@@ -0,0 +1,34 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <libdnf/libdnf.h>
+
+G_BEGIN_DECLS
+
+gboolean rpmostree_search_index_update (DnfContext *dnfctx, GCancellable *cancellable,
+                                        GError **error);
+
+char **rpmostree_search_index_lookup (DnfContext *dnfctx, const char *const *terms,
+                                      GCancellable *cancellable, GError **error);
+
+void rpmostree_search_index_tests (void);
+
+G_END_DECLS
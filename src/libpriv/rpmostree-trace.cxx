@@ -0,0 +1,216 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <libglnx.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "rpmostree-trace.h"
+#include "rpmostree-util.h"
+
+/* Opt-in tracing of what the daemon is doing, e.g. which threads are busy
+ * importing or relabeling and how long each script runs. If
+ * RPMOSTREE_TRACE_DIR is set, each session (i.e. transaction) is written there
+ * as a JSON file in the Chrome trace event format, which can be loaded into
+ * https://ui.perfetto.dev or chrome://tracing.
+ *
+ * Spans may be recorded from any thread; they all end up in the session
+ * that's active at the time. */
+
+static gint trace_active;
+static GMutex trace_lock;
+static char *trace_dir;
+static GString *trace_events;
+static GHashTable *trace_tids; /* tids we've emitted a thread_name for */
+
+static void
+append_json_string (GString *buf, const char *s)
+{
+  g_string_append_c (buf, '"');
+  for (const char *p = s; *p; p++)
+    {
+      const guchar c = *p;
+      if (c == '"' || c == '\\')
+        {
+          g_string_append_c (buf, '\\');
+          g_string_append_c (buf, c);
+        }
+      else if (c < 0x20)
+        g_string_append_printf (buf, "\\u%04x", c);
+      else
+        g_string_append_c (buf, c);
+    }
+  g_string_append_c (buf, '"');
+}
+
+/* Start an event and return with trace_lock held, or %FALSE if there's no
+ * session. Events are separated by ",\n" so they're easy to diff. */
+static gboolean
+trace_event_begin (const char *ph, const char *cat, const char *name, gint64 ts)
+{
+  g_mutex_lock (&trace_lock);
+  if (!trace_events)
+    {
+      g_mutex_unlock (&trace_lock);
+      return FALSE;
+    }
+
+  const pid_t pid = getpid ();
+  const pid_t tid = gettid ();
+  if (!g_hash_table_contains (trace_tids, GINT_TO_POINTER (tid)))
+    {
+      char thread_name[16] = "";
+      (void)pthread_getname_np (pthread_self (), thread_name, sizeof (thread_name));
+      g_hash_table_add (trace_tids, GINT_TO_POINTER (tid));
+      g_string_append_printf (trace_events,
+                              ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                              "\"args\":{\"name\":",
+                              pid, tid);
+      append_json_string (trace_events, thread_name);
+      g_string_append (trace_events, "}}");
+    }
+
+  g_string_append (trace_events, ",\n{\"name\":");
+  append_json_string (trace_events, name);
+  g_string_append_printf (trace_events,
+                          ",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%" G_GINT64_FORMAT
+                          ",\"pid\":%d,\"tid\":%d",
+                          cat, ph, ts, pid, tid);
+  return TRUE;
+}
+
+static void
+trace_event_end (void)
+{
+  g_string_append_c (trace_events, '}');
+  g_mutex_unlock (&trace_lock);
+}
+
+/* Start recording spans if RPMOSTREE_TRACE_DIR is set; returns whether a
+ * session was started. Only one session can be active at a time. */
+gboolean
+rpmostree_trace_session_begin (void)
+{
+  const char *dir = g_getenv ("RPMOSTREE_TRACE_DIR");
+  if (!dir || !*dir)
+    return FALSE;
+
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&trace_lock);
+  if (trace_events)
+    return FALSE;
+  trace_dir = g_strdup (dir);
+  trace_events = g_string_new ("");
+  trace_tids = g_hash_table_new (NULL, NULL);
+  g_atomic_int_set (&trace_active, 1);
+  return TRUE;
+}
+
+/* Stop recording and write out the trace as @name in the trace directory. If
+ * there was no session, returns %TRUE and sets @out_path to %NULL. */
+gboolean
+rpmostree_trace_session_end (const char *name, char **out_path, GError **error)
+{
+  *out_path = NULL;
+
+  g_autofree char *dir = NULL;
+  g_autoptr (GString) events = NULL;
+  {
+    g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&trace_lock);
+    if (!trace_events)
+      return TRUE;
+    g_atomic_int_set (&trace_active, 0);
+    dir = util::move_nullify (trace_dir);
+    events = util::move_nullify (trace_events);
+    g_clear_pointer (&trace_tids, g_hash_table_unref);
+  }
+
+  g_autoptr (GString) buf = g_string_new ("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  g_string_append_printf (buf, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,"
+                               "\"args\":{\"name\":",
+                          getpid ());
+  append_json_string (buf, name);
+  g_string_append (buf, "}}");
+  g_string_append_len (buf, events->str, events->len);
+  g_string_append (buf, "\n]}\n");
+
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, dir, 0755, NULL, error))
+    return FALSE;
+  g_autoptr (GDateTime) now = g_date_time_new_now_utc ();
+  g_autofree char *timestamp = g_date_time_format (now, "%Y%m%dT%H%M%SZ");
+  g_autofree char *filename = g_strdup_printf ("%s-%s-%d.json", name, timestamp, getpid ());
+  g_autofree char *path = g_build_filename (dir, filename, NULL);
+  if (!glnx_file_replace_contents_at (AT_FDCWD, path, (const guint8 *)buf->str, buf->len,
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, error))
+    return glnx_prefix_error (error, "Writing trace");
+
+  *out_path = util::move_nullify (path);
+  return TRUE;
+}
+
+gboolean
+rpmostree_trace_enabled (void)
+{
+  return g_atomic_int_get (&trace_active);
+}
+
+/* Returns the timestamp to later pass to rpmostree_trace_complete(), or 0 if
+ * tracing is disabled. */
+gint64
+rpmostree_trace_now (void)
+{
+  if (!g_atomic_int_get (&trace_active))
+    return 0;
+  return g_get_monotonic_time ();
+}
+
+/* Record a span from @start until now on the calling thread */
+void
+rpmostree_trace_complete (const char *cat, const char *name, gint64 start)
+{
+  if (!g_atomic_int_get (&trace_active) || start == 0)
+    return;
+  const gint64 end = g_get_monotonic_time ();
+  if (!trace_event_begin ("X", cat, name, start))
+    return;
+  g_string_append_printf (trace_events, ",\"dur\":%" G_GINT64_FORMAT, end - start);
+  trace_event_end ();
+}
+
+/* Spans that may overlap with others on the same thread; they're drawn on
+ * their own track, matched up by @cat, @name and @id. */
+void
+rpmostree_trace_async_begin (const char *cat, const char *name, guint64 id)
+{
+  if (!g_atomic_int_get (&trace_active))
+    return;
+  if (!trace_event_begin ("b", cat, name, g_get_monotonic_time ()))
+    return;
+  g_string_append_printf (trace_events, ",\"id\":%" G_GUINT64_FORMAT, id);
+  trace_event_end ();
+}
+
+void
+rpmostree_trace_async_end (const char *cat, const char *name, guint64 id)
+{
+  if (!g_atomic_int_get (&trace_active))
+    return;
+  if (!trace_event_begin ("e", cat, name, g_get_monotonic_time ()))
+    return;
+  g_string_append_printf (trace_events, ",\"id\":%" G_GUINT64_FORMAT, id);
+  trace_event_end ();
+}
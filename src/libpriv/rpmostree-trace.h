@@ -0,0 +1,61 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <string>
+
+G_BEGIN_DECLS
+
+gboolean rpmostree_trace_session_begin (void);
+gboolean rpmostree_trace_session_end (const char *name, char **out_path, GError **error);
+
+gboolean rpmostree_trace_enabled (void);
+gint64 rpmostree_trace_now (void);
+void rpmostree_trace_complete (const char *cat, const char *name, gint64 start);
+void rpmostree_trace_async_begin (const char *cat, const char *name, guint64 id);
+void rpmostree_trace_async_end (const char *cat, const char *name, guint64 id);
+
+G_END_DECLS
+
+namespace rpmostreecxx
+{
+
+// Records a span on the calling thread for the lifetime of the object, if
+// tracing is enabled.  A NULL name disables the span, so callers can skip
+// computing one when tracing is off.
+struct TraceSpan
+{
+public:
+  TraceSpan (const char *cat, const char *name)
+  {
+    this->cat = cat;
+    this->start = name ? rpmostree_trace_now () : 0;
+    if (this->start)
+      this->name = name;
+  }
+  ~TraceSpan ()
+  {
+    if (this->start)
+      rpmostree_trace_complete (this->cat, this->name.c_str (), this->start);
+  }
+  const char *cat;
+  std::string name;
+  gint64 start;
+};
+
+}
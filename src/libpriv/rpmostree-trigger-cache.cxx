@@ -0,0 +1,799 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A cache of the changes made by %transfiletriggerin scripts, for packages
+ * listed in the treefile's `memoize-file-triggers`. Those are assumed to be
+ * pure functions of the files they match (think ldconfig or
+ * glib-compile-schemas), so if the package, the script and the matched files
+ * are all the same as last time, we can replay what the script did last time
+ * instead of running it. Anything else a script reads (e.g. ldconfig reads
+ * /etc/ld.so.conf) must be declared as an extra input of its package, and is
+ * then part of the key too.
+ *
+ * Each trigger script gets a single slot in the pkgcache repo, a commit under
+ * `rpmostree/trigger/` holding the files the script added or changed, with
+ * the key and the paths it removed in the commit metadata. Keeping only the
+ * last result per script bounds the cache to one commit per allowlisted
+ * trigger. */
+
+#include "config.h"
+
+#include <algorithm>
+#include <libglnx.h>
+#include <memory>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "rpmostree-rpm-util.h"
+#include "rpmostree-trigger-cache.h"
+#include "rpmostree-util.h"
+
+#define TRIGGER_CACHE_REF_PREFIX "rpmostree/trigger/"
+/* Bump this whenever the key or the recorded delta changes */
+#define TRIGGER_CACHE_VERSION "1"
+#define TRIGGER_CACHE_META_KEY "rpmostree.trigger.key"
+#define TRIGGER_CACHE_META_NEVRA "rpmostree.trigger.nevra"
+#define TRIGGER_CACHE_META_REMOVED "rpmostree.trigger.removed"
+
+/* Where file triggers may write; /var and /run are not persisted from
+ * scripts. */
+static const char *const snapshot_roots[] = { "usr", "etc" };
+
+struct TreeStat
+{
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtim;
+  struct timespec ctim;
+};
+
+typedef std::unordered_map<std::string, TreeStat> TreeSnapshot;
+
+struct RpmOstreeTriggerCache
+{
+  OstreeRepo *repo;
+  int rootfs_fd;
+  std::map<std::string, std::vector<std::string> > allowed; /* package → extra inputs */
+
+  /* Set by a lookup that missed, for the following store */
+  char *pending_ref;
+  char *pending_key;
+  char *pending_nevra;
+  TreeSnapshot *pending_snapshot;
+
+  guint n_hits;
+  guint n_misses;
+};
+
+RpmOstreeTriggerCache *
+rpmostree_trigger_cache_new (OstreeRepo *repo, int rootfs_fd)
+{
+  auto cache = new RpmOstreeTriggerCache ();
+  cache->repo = static_cast<OstreeRepo *> (g_object_ref (repo));
+  cache->rootfs_fd = rootfs_fd;
+  return cache;
+}
+
+/* Cache the file triggers of @pkg_name, which besides the files they match
+ * only read the (absolute) paths in @extra_inputs. */
+void
+rpmostree_trigger_cache_allow (RpmOstreeTriggerCache *cache, const char *pkg_name,
+                               const char *const *extra_inputs)
+{
+  auto &inputs = cache->allowed[pkg_name];
+  for (const char *const *it = extra_inputs; it && *it; it++)
+    inputs.emplace_back (*it + strspn (*it, "/"));
+}
+
+static void
+trigger_cache_clear_pending (RpmOstreeTriggerCache *cache)
+{
+  g_clear_pointer (&cache->pending_ref, g_free);
+  g_clear_pointer (&cache->pending_key, g_free);
+  g_clear_pointer (&cache->pending_nevra, g_free);
+  delete cache->pending_snapshot;
+  cache->pending_snapshot = NULL;
+}
+
+void
+rpmostree_trigger_cache_free (RpmOstreeTriggerCache *cache)
+{
+  if (cache->n_hits + cache->n_misses > 0)
+    g_debug ("file trigger cache: %u hits, %u misses", cache->n_hits, cache->n_misses);
+  trigger_cache_clear_pending (cache);
+  g_clear_object (&cache->repo);
+  delete cache;
+}
+
+/* Feed @path and its content (or symlink target) into @checksum */
+static gboolean
+checksum_matched_file (GChecksum *checksum, int rootfs_fd, const char *path, guint8 *buf,
+                       gsize bufsize, GCancellable *cancellable, GError **error)
+{
+  g_checksum_update (checksum, (const guint8 *)path, strlen (path) + 1);
+
+  struct stat stbuf;
+  if (!glnx_fstatat_allow_noent (rootfs_fd, path, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+  if (errno == ENOENT)
+    {
+      g_checksum_update (checksum, (const guint8 *)"-", 2);
+      return TRUE;
+    }
+
+  g_autofree char *header = g_strdup_printf ("%u:%" G_GUINT64_FORMAT, (guint)stbuf.st_mode,
+                                             (guint64)stbuf.st_size);
+  g_checksum_update (checksum, (const guint8 *)header, strlen (header) + 1);
+
+  if (S_ISLNK (stbuf.st_mode))
+    {
+      g_autofree char *target = glnx_readlinkat_malloc (rootfs_fd, path, cancellable, error);
+      if (!target)
+        return FALSE;
+      g_checksum_update (checksum, (const guint8 *)target, strlen (target) + 1);
+    }
+  else if (S_ISREG (stbuf.st_mode))
+    {
+      glnx_autofd int fd = -1;
+      if (!glnx_openat_rdonly (rootfs_fd, path, FALSE, &fd, error))
+        return FALSE;
+      while (TRUE)
+        {
+          ssize_t n = TEMP_FAILURE_RETRY (read (fd, buf, bufsize));
+          if (n < 0)
+            return glnx_throw_errno_prefix (error, "read(%s)", path);
+          if (n == 0)
+            break;
+          g_checksum_update (checksum, buf, n);
+        }
+    }
+
+  return TRUE;
+}
+
+/* Like checksum_matched_file(), but directories are fed in recursively, in a
+ * stable order */
+static gboolean
+checksum_extra_input (GChecksum *checksum, int rootfs_fd, const std::string &path, guint8 *buf,
+                      gsize bufsize, GCancellable *cancellable, GError **error)
+{
+  struct stat stbuf;
+  if (!glnx_fstatat_allow_noent (rootfs_fd, path.c_str (), &stbuf, AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+  if (errno == ENOENT || !S_ISDIR (stbuf.st_mode))
+    return checksum_matched_file (checksum, rootfs_fd, path.c_str (), buf, bufsize, cancellable,
+                                  error);
+
+  /* A directory's size depends on the filesystem, so leave that out */
+  g_checksum_update (checksum, (const guint8 *)path.c_str (), path.size () + 1);
+  g_autofree char *header = g_strdup_printf ("%u", (guint)stbuf.st_mode);
+  g_checksum_update (checksum, (const guint8 *)header, strlen (header) + 1);
+
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    0,
+  };
+  if (!glnx_dirfd_iterator_init_at (rootfs_fd, path.c_str (), FALSE, &dfd_iter, error))
+    return FALSE;
+  std::vector<std::string> names;
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+      names.emplace_back (dent->d_name);
+    }
+  std::sort (names.begin (), names.end ());
+  for (auto &name : names)
+    {
+      if (!checksum_extra_input (checksum, rootfs_fd, path + "/" + name, buf, bufsize, cancellable,
+                                 error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+/* The key covers everything the script may depend on: the package it came
+ * from, the script itself, the paths and contents of the files it's fed on
+ * stdin, and those of the declared @extra_inputs. */
+static char *
+trigger_cache_compute_key (RpmOstreeTriggerCache *cache, const char *nevra,
+                           const std::vector<std::string> &extra_inputs, const char *interp,
+                           const char *script, int matches_fd, GCancellable *cancellable,
+                           GError **error)
+{
+  if (lseek (matches_fd, 0, SEEK_SET) < 0)
+    return (char *)glnx_null_throw_errno_prefix (error, "lseek");
+  g_autofree char *matches = glnx_fd_readall_utf8 (matches_fd, NULL, cancellable, error);
+  if (!matches)
+    return NULL;
+
+  g_autoptr (GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  const char *prefix = "rpmostree-trigger-cache-" TRIGGER_CACHE_VERSION;
+  g_checksum_update (checksum, (const guint8 *)prefix, strlen (prefix) + 1);
+  g_checksum_update (checksum, (const guint8 *)nevra, strlen (nevra) + 1);
+  g_checksum_update (checksum, (const guint8 *)interp, strlen (interp) + 1);
+  g_checksum_update (checksum, (const guint8 *)script, strlen (script) + 1);
+
+  const gsize bufsize = 64 * 1024;
+  g_autofree guint8 *buf = (guint8 *)g_malloc (bufsize);
+  g_auto (GStrv) lines = g_strsplit (matches, "\n", -1);
+  for (char **it = lines; it && *it; it++)
+    {
+      /* Paths in the list have a leading '/' */
+      const char *path = *it + strspn (*it, "/");
+      if (!*path)
+        continue;
+      if (!checksum_matched_file (checksum, cache->rootfs_fd, path, buf, bufsize, cancellable,
+                                  error))
+        return NULL;
+    }
+
+  /* Keep these apart from the matched files */
+  g_checksum_update (checksum, (const guint8 *)"extra", strlen ("extra") + 1);
+  for (auto &path : extra_inputs)
+    {
+      if (!checksum_extra_input (checksum, cache->rootfs_fd, path, buf, bufsize, cancellable,
+                                 error))
+        return NULL;
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+static gboolean
+snapshot_dir (int dfd, const char *name, std::string &prefix, TreeSnapshot &snapshot,
+              GCancellable *cancellable, GError **error)
+{
+  g_auto (GLnxDirFdIterator) dfd_iter = {
+    0,
+  };
+  if (!glnx_dirfd_iterator_init_at (dfd, name, FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (dent == NULL)
+        break;
+
+      struct stat stbuf;
+      if (!glnx_fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+
+      const size_t origlen = prefix.size ();
+      prefix += '/';
+      prefix += dent->d_name;
+      snapshot[prefix] = TreeStat{ stbuf.st_mode, stbuf.st_uid, stbuf.st_gid, stbuf.st_dev,
+                                   stbuf.st_ino,  stbuf.st_size, stbuf.st_mtim, stbuf.st_ctim };
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          if (!snapshot_dir (dfd_iter.fd, dent->d_name, prefix, snapshot, cancellable, error))
+            return FALSE;
+        }
+      prefix.resize (origlen);
+    }
+
+  return TRUE;
+}
+
+/* Record the metadata of everything a trigger may touch, so we can find out
+ * afterwards what it changed. Note this is a stat() of every file in /usr;
+ * that's why it's only done for allowlisted triggers, and only on a miss. */
+static gboolean
+snapshot_rootfs (int rootfs_fd, TreeSnapshot &snapshot, GCancellable *cancellable, GError **error)
+{
+  for (guint i = 0; i < G_N_ELEMENTS (snapshot_roots); i++)
+    {
+      const char *root = snapshot_roots[i];
+      struct stat stbuf;
+      if (!glnx_fstatat_allow_noent (rootfs_fd, root, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+      if (errno == ENOENT || !S_ISDIR (stbuf.st_mode))
+        continue;
+      std::string prefix (root);
+      if (!snapshot_dir (rootfs_fd, root, prefix, snapshot, cancellable, error))
+        return glnx_prefix_error (error, "Snapshotting /%s", root);
+    }
+  return TRUE;
+}
+
+static bool
+tree_stat_changed (const TreeStat &a, const TreeStat &b)
+{
+  /* A directory only shows up in the delta if it's new */
+  if (S_ISDIR (a.mode) && S_ISDIR (b.mode))
+    return false;
+  return a.mode != b.mode || a.uid != b.uid || a.gid != b.gid || a.dev != b.dev || a.ino != b.ino
+         || a.size != b.size || a.mtim.tv_sec != b.mtim.tv_sec || a.mtim.tv_nsec != b.mtim.tv_nsec
+         || a.ctim.tv_sec != b.ctim.tv_sec || a.ctim.tv_nsec != b.ctim.tv_nsec;
+}
+
+/* Look up the result of running @script (the @script_idx'th file trigger of
+ * @hdr) on the files listed in @matches_fd. If it's cached, the changes are
+ * applied to the rootfs and @out_replayed is set; the caller should then skip
+ * running the script. Otherwise, the state of the rootfs is recorded so that
+ * a rpmostree_trigger_cache_store() after running the script can add it to
+ * the cache. Triggers from packages that aren't allowlisted are left alone. */
+gboolean
+rpmostree_trigger_cache_lookup (RpmOstreeTriggerCache *cache, Header hdr, guint script_idx,
+                                const char *interp, const char *script, int matches_fd,
+                                gboolean *out_replayed, GCancellable *cancellable, GError **error)
+{
+  GLNX_AUTO_PREFIX_ERROR ("Looking up file trigger cache", error);
+
+  *out_replayed = FALSE;
+  trigger_cache_clear_pending (cache);
+
+  const char *pkg_name = headerGetString (hdr, RPMTAG_NAME);
+  if (!pkg_name)
+    return TRUE;
+  auto allowed = cache->allowed.find (pkg_name);
+  if (allowed == cache->allowed.end ())
+    return TRUE;
+
+  g_autofree char *nevra = headerGetAsString (hdr, RPMTAG_NEVRA);
+  g_autofree char *key
+      = trigger_cache_compute_key (cache, nevra, allowed->second, interp, script, matches_fd,
+                                   cancellable, error);
+  if (!key)
+    return FALSE;
+
+  /* Package names may contain characters that aren't valid in refs */
+  g_autofree char *slot_name = g_strdup_printf ("%s:%u", pkg_name, script_idx);
+  g_autofree char *slot
+      = g_compute_checksum_for_string (G_CHECKSUM_SHA256, slot_name, strlen (slot_name));
+  g_autofree char *ref = g_strconcat (TRIGGER_CACHE_REF_PREFIX, slot, NULL);
+
+  g_autofree char *rev = NULL;
+  if (!ostree_repo_resolve_rev (cache->repo, ref, TRUE, &rev, error))
+    return FALSE;
+  g_autoptr (GVariant) commit = NULL;
+  if (rev && !ostree_repo_load_commit (cache->repo, rev, &commit, NULL, error))
+    return FALSE;
+
+  g_autoptr (GVariant) meta = commit ? g_variant_get_child_value (commit, 0) : NULL;
+  g_autoptr (GVariantDict) meta_dict = meta ? g_variant_dict_new (meta) : NULL;
+  const char *cached_key = NULL;
+  if (!meta_dict
+      || !g_variant_dict_lookup (meta_dict, TRIGGER_CACHE_META_KEY, "&s", &cached_key)
+      || !g_str_equal (cached_key, key))
+    {
+      cache->n_misses++;
+      g_autoptr (GError) local_error = NULL;
+      auto snapshot = new TreeSnapshot ();
+      if (!snapshot_rootfs (cache->rootfs_fd, *snapshot, cancellable, &local_error))
+        {
+          delete snapshot;
+          g_propagate_error (error, util::move_nullify (local_error));
+          return FALSE;
+        }
+      cache->pending_snapshot = snapshot;
+      cache->pending_ref = util::move_nullify (ref);
+      cache->pending_key = util::move_nullify (key);
+      cache->pending_nevra = util::move_nullify (nevra);
+      return TRUE;
+    }
+
+  g_autofree const char **removed = NULL;
+  if (!g_variant_dict_lookup (meta_dict, TRIGGER_CACHE_META_REMOVED, "^a&s", &removed))
+    return glnx_throw (error, "Missing %s in %s", TRIGGER_CACHE_META_REMOVED, rev);
+  for (const char **it = removed; it && *it; it++)
+    {
+      if (!glnx_shutil_rm_rf_at (cache->rootfs_fd, *it, cancellable, error))
+        return FALSE;
+    }
+
+  OstreeRepoCheckoutAtOptions opts = {
+    OSTREE_REPO_CHECKOUT_MODE_USER,
+    OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES,
+  };
+  if (ostree_repo_get_mode (cache->repo) == OSTREE_REPO_MODE_BARE)
+    opts.mode = OSTREE_REPO_CHECKOUT_MODE_NONE;
+  /* Later scripts may well modify these in place (e.g. ld.so.cache), so make
+   * sure we never hand out hardlinks into the repo. */
+  opts.force_copy = TRUE;
+  if (!ostree_repo_checkout_at (cache->repo, &opts, cache->rootfs_fd, ".", rev, cancellable,
+                                error))
+    return FALSE;
+
+  cache->n_hits++;
+  *out_replayed = TRUE;
+  return TRUE;
+}
+
+/* Create @path in @staging_fd as a directory with the same metadata as in
+ * the rootfs, if it doesn't exist yet */
+static gboolean
+stage_dir (int rootfs_fd, int staging_fd, const char *path, GError **error)
+{
+  struct stat stbuf;
+  if (!glnx_fstatat (rootfs_fd, path, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+  if (mkdirat (staging_fd, path, 0700) < 0)
+    {
+      if (errno == EEXIST)
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "mkdirat(%s)", path);
+    }
+  if (fchownat (staging_fd, path, stbuf.st_uid, stbuf.st_gid, AT_SYMLINK_NOFOLLOW) < 0)
+    return glnx_throw_errno_prefix (error, "fchownat(%s)", path);
+  if (fchmodat (staging_fd, path, stbuf.st_mode & 07777, 0) < 0)
+    return glnx_throw_errno_prefix (error, "fchmodat(%s)", path);
+  return TRUE;
+}
+
+/* Copy @path (including its parents) from the rootfs into @staging_fd */
+static gboolean
+stage_path (int rootfs_fd, int staging_fd, const std::string &path, GCancellable *cancellable,
+            GError **error)
+{
+  for (size_t pos = path.find ('/'); pos != std::string::npos; pos = path.find ('/', pos + 1))
+    {
+      if (!stage_dir (rootfs_fd, staging_fd, path.substr (0, pos).c_str (), error))
+        return FALSE;
+    }
+
+  struct stat stbuf;
+  if (!glnx_fstatat (rootfs_fd, path.c_str (), &stbuf, AT_SYMLINK_NOFOLLOW, error))
+    return FALSE;
+  if (S_ISDIR (stbuf.st_mode))
+    return stage_dir (rootfs_fd, staging_fd, path.c_str (), error);
+  /* Labels are applied when the rootfs is committed */
+  return glnx_file_copy_at (rootfs_fd, path.c_str (), &stbuf, staging_fd, path.c_str (),
+                            GLNX_FILE_COPY_NOXATTRS, cancellable, error);
+}
+
+/* Add what the script changed since the last rpmostree_trigger_cache_lookup()
+ * to the cache, if that was a miss. */
+gboolean
+rpmostree_trigger_cache_store (RpmOstreeTriggerCache *cache, GCancellable *cancellable,
+                               GError **error)
+{
+  if (!cache->pending_snapshot)
+    return TRUE;
+
+  GLNX_AUTO_PREFIX_ERROR ("Storing file trigger result", error);
+
+  g_autofree char *ref = util::move_nullify (cache->pending_ref);
+  g_autofree char *key = util::move_nullify (cache->pending_key);
+  g_autofree char *nevra = util::move_nullify (cache->pending_nevra);
+  std::unique_ptr<TreeSnapshot> before (cache->pending_snapshot);
+  cache->pending_snapshot = NULL;
+
+  TreeSnapshot after;
+  if (!snapshot_rootfs (cache->rootfs_fd, after, cancellable, error))
+    return FALSE;
+
+  std::vector<std::string> changed;
+  for (auto &[path, st] : after)
+    {
+      auto it = before->find (path);
+      if (it == before->end () || tree_stat_changed (it->second, st))
+        {
+          /* We can only replay plain files, symlinks and directories */
+          if (!(S_ISREG (st.mode) || S_ISLNK (st.mode) || S_ISDIR (st.mode)))
+            {
+              g_debug ("Not caching file trigger for %s: changed %s", nevra, path.c_str ());
+              return TRUE;
+            }
+          changed.push_back (path);
+        }
+    }
+  std::vector<std::string> removed;
+  for (auto &[path, st] : *before)
+    {
+      if (after.count (path) == 0)
+        removed.push_back (path);
+    }
+  /* Sorting puts parent directories before their children */
+  std::sort (changed.begin (), changed.end ());
+  std::sort (removed.begin (), removed.end ());
+
+  g_auto (RpmOstreeRepoAutoTransaction) txn = {
+    0,
+  };
+  if (!rpmostree_repo_auto_transaction_start (&txn, cache->repo, FALSE, cancellable, error))
+    return FALSE;
+
+  g_auto (GLnxTmpDir) staging = {
+    0,
+  };
+  if (!glnx_mkdtempat (ostree_repo_get_dfd (cache->repo), "tmp/rpmostree-trigger.XXXXXX", 0700,
+                       &staging, error))
+    return FALSE;
+  /* The root dirmeta is that of the rootfs, not our tmpdir */
+  struct stat root_stbuf;
+  if (!glnx_fstat (cache->rootfs_fd, &root_stbuf, error))
+    return FALSE;
+  if (!glnx_fchmod (staging.fd, root_stbuf.st_mode & 07777, error))
+    return FALSE;
+
+  for (auto &path : changed)
+    {
+      if (!stage_path (cache->rootfs_fd, staging.fd, path, cancellable, error))
+        return FALSE;
+    }
+
+  g_autoptr (OstreeRepoCommitModifier) modifier = ostree_repo_commit_modifier_new (
+      static_cast<OstreeRepoCommitModifierFlags> (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_CONSUME
+                                                  | OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS),
+      NULL, NULL, NULL);
+  g_autoptr (OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+  if (!ostree_repo_write_dfd_to_mtree (cache->repo, staging.fd, ".", mtree, modifier, cancellable,
+                                       error))
+    return FALSE;
+  g_autoptr (GFile) root = NULL;
+  if (!ostree_repo_write_mtree (cache->repo, mtree, &root, cancellable, error))
+    return FALSE;
+
+  g_autoptr (GPtrArray) removed_strv = g_ptr_array_new ();
+  for (auto &path : removed)
+    g_ptr_array_add (removed_strv, (gpointer)path.c_str ());
+  g_autoptr (GVariantDict) meta_dict = g_variant_dict_new (NULL);
+  g_variant_dict_insert (meta_dict, TRIGGER_CACHE_META_KEY, "s", key);
+  g_variant_dict_insert (meta_dict, TRIGGER_CACHE_META_NEVRA, "s", nevra);
+  g_variant_dict_insert_value (
+      meta_dict, TRIGGER_CACHE_META_REMOVED,
+      g_variant_new_strv ((const char *const *)removed_strv->pdata, removed_strv->len));
+
+  g_autofree char *commit_csum = NULL;
+  if (!ostree_repo_write_commit (cache->repo, NULL, "", "", g_variant_dict_end (meta_dict),
+                                 OSTREE_REPO_FILE (root), &commit_csum, cancellable, error))
+    return FALSE;
+  ostree_repo_transaction_set_ref (cache->repo, NULL, ref, commit_csum);
+  if (!ostree_repo_commit_transaction (cache->repo, NULL, cancellable, error))
+    return FALSE;
+
+  g_debug ("Cached file trigger result for %s: %zu changed, %zu removed", nevra, changed.size (),
+           removed.size ());
+  return TRUE;
+}
+
+/* Delete cached trigger results from packages whose cache branch isn't in
+ * @referenced_pkgs, i.e. that no deployment has anymore. Must be called in a
+ * transaction. */
+gboolean
+rpmostree_trigger_cache_prune (OstreeRepo *repo, GHashTable *referenced_pkgs, guint *out_n_freed,
+                               GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GHashTable) refs = NULL;
+  if (!ostree_repo_list_refs_ext (repo, "rpmostree/trigger", &refs,
+                                  OSTREE_REPO_LIST_REFS_EXT_NONE, cancellable, error))
+    return FALSE;
+
+  guint n_freed = 0;
+  GLNX_HASH_TABLE_FOREACH_KV (refs, const char *, ref, const char *, rev)
+    {
+      g_autoptr (GVariant) commit = NULL;
+      if (!ostree_repo_load_commit (repo, rev, &commit, NULL, error))
+        return FALSE;
+      g_autoptr (GVariant) meta = g_variant_get_child_value (commit, 0);
+      g_autoptr (GVariantDict) meta_dict = g_variant_dict_new (meta);
+      const char *nevra = NULL;
+      g_autofree char *cachebranch = NULL;
+      if (g_variant_dict_lookup (meta_dict, TRIGGER_CACHE_META_NEVRA, "&s", &nevra)
+          && !rpmostree_nevra_to_cache_branch (nevra, &cachebranch, error))
+        return FALSE;
+      if (cachebranch && g_hash_table_contains (referenced_pkgs, cachebranch))
+        continue;
+
+      ostree_repo_transaction_set_ref (repo, NULL, ref, NULL);
+      n_freed++;
+    }
+
+  *out_n_freed = n_freed;
+  return TRUE;
+}
+
+#ifdef BUILDOPT_BIN_UNIT_TESTS
+static void
+test_write_file (int dfd, const char *path, const char *contents)
+{
+  g_autoptr (GError) local_error = NULL;
+  glnx_file_replace_contents_at (dfd, path, (const guint8 *)contents, -1,
+                                 GLNX_FILE_REPLACE_NODATASYNC, NULL, &local_error);
+  g_assert_no_error (local_error);
+}
+
+/* Compute the key for a script fed @matches on stdin */
+static char *
+test_trigger_key (RpmOstreeTriggerCache *cache, int tmp_dfd, const char *nevra,
+                  const std::vector<std::string> &extra_inputs, const char *script,
+                  const char *matches)
+{
+  g_autoptr (GError) local_error = NULL;
+  test_write_file (tmp_dfd, "matches", matches);
+  glnx_autofd int matches_fd = -1;
+  glnx_openat_rdonly (tmp_dfd, "matches", TRUE, &matches_fd, &local_error);
+  g_assert_no_error (local_error);
+  char *key = trigger_cache_compute_key (cache, nevra, extra_inputs, "/bin/sh", script,
+                                         matches_fd, NULL, &local_error);
+  g_assert_no_error (local_error);
+  g_assert (key);
+  return key;
+}
+
+static void
+test_trigger_cache_key (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_auto (GLnxTmpDir) tmpdir = {
+    0,
+  };
+  glnx_mkdtemp ("rpmostree-trigger-cache-XXXXXX", 0700, &tmpdir, &local_error);
+  g_assert_no_error (local_error);
+  glnx_shutil_mkdir_p_at (tmpdir.fd, "rootfs/usr/lib64", 0755, NULL, &local_error);
+  g_assert_no_error (local_error);
+  glnx_shutil_mkdir_p_at (tmpdir.fd, "rootfs/etc/ld.so.conf.d", 0755, NULL, &local_error);
+  g_assert_no_error (local_error);
+  glnx_autofd int rootfs_fd = -1;
+  glnx_opendirat (tmpdir.fd, "rootfs", TRUE, &rootfs_fd, &local_error);
+  g_assert_no_error (local_error);
+  test_write_file (rootfs_fd, "usr/lib64/libfoo.so.1", "foo");
+  test_write_file (rootfs_fd, "usr/lib64/libbar.so.1", "bar");
+  test_write_file (rootfs_fd, "etc/ld.so.conf", "include ld.so.conf.d/*.conf\n");
+
+  RpmOstreeTriggerCache cache = {};
+  cache.rootfs_fd = rootfs_fd;
+  const char *nevra = "glibc-2.40-1.x86_64";
+  const char *script = "/sbin/ldconfig";
+  const char *matches = "/usr/lib64/libfoo.so.1\n/usr/lib64/libbar.so.1\n";
+  std::vector<std::string> extra = { "etc/ld.so.conf", "etc/ld.so.conf.d" };
+
+  g_autofree char *key = test_trigger_key (&cache, tmpdir.fd, nevra, extra, script, matches);
+  g_autofree char *again = test_trigger_key (&cache, tmpdir.fd, nevra, extra, script, matches);
+  g_assert_cmpstr (key, ==, again);
+
+  /* Everything the script depends on is part of the key */
+  g_autofree char *other_nevra
+      = test_trigger_key (&cache, tmpdir.fd, "glibc-2.40-2.x86_64", extra, script, matches);
+  g_assert_cmpstr (key, !=, other_nevra);
+  g_autofree char *other_script
+      = test_trigger_key (&cache, tmpdir.fd, nevra, extra, "/sbin/ldconfig -X", matches);
+  g_assert_cmpstr (key, !=, other_script);
+  g_autofree char *fewer_matches = test_trigger_key (&cache, tmpdir.fd, nevra, extra, script,
+                                                     "/usr/lib64/libfoo.so.1\n");
+  g_assert_cmpstr (key, !=, fewer_matches);
+  g_autofree char *no_extra = test_trigger_key (&cache, tmpdir.fd, nevra, {}, script, matches);
+  g_assert_cmpstr (key, !=, no_extra);
+  /* Matched files and extra inputs are kept apart */
+  g_autofree char *moved
+      = test_trigger_key (&cache, tmpdir.fd, nevra, { "usr/lib64/libbar.so.1" }, script,
+                          "/usr/lib64/libfoo.so.1\n");
+  g_assert_cmpstr (moved, !=, no_extra);
+
+  /* So are the contents of matched files... */
+  test_write_file (rootfs_fd, "usr/lib64/libfoo.so.1", "foo2");
+  g_autofree char *changed_match
+      = test_trigger_key (&cache, tmpdir.fd, nevra, extra, script, matches);
+  g_assert_cmpstr (key, !=, changed_match);
+  test_write_file (rootfs_fd, "usr/lib64/libfoo.so.1", "foo");
+  g_autofree char *restored = test_trigger_key (&cache, tmpdir.fd, nevra, extra, script, matches);
+  g_assert_cmpstr (key, ==, restored);
+
+  /* ...and of extra inputs, including the contents of directories */
+  test_write_file (rootfs_fd, "etc/ld.so.conf.d/local.conf", "/usr/local/lib64\n");
+  g_autofree char *changed_extra
+      = test_trigger_key (&cache, tmpdir.fd, nevra, extra, script, matches);
+  g_assert_cmpstr (key, !=, changed_extra);
+
+  /* Files the script doesn't see are not */
+  test_write_file (rootfs_fd, "usr/lib64/libbaz.so.1", "baz");
+  g_autofree char *unrelated
+      = test_trigger_key (&cache, tmpdir.fd, nevra, extra, script, matches);
+  g_assert_cmpstr (changed_extra, ==, unrelated);
+  g_print ("ok %s\n", G_STRFUNC);
+}
+
+/* Commit an empty trigger result for @nevra to @repo, returning its ref */
+static char *
+test_write_trigger_result (OstreeRepo *repo, int empty_dfd, const char *nevra)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autofree char *slot = g_compute_checksum_for_string (G_CHECKSUM_SHA256, nevra, -1);
+  g_autofree char *ref = g_strconcat (TRIGGER_CACHE_REF_PREFIX, slot, NULL);
+  g_autoptr (GVariantDict) meta_dict = g_variant_dict_new (NULL);
+  g_variant_dict_insert (meta_dict, TRIGGER_CACHE_META_NEVRA, "s", nevra);
+
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &local_error);
+  g_assert_no_error (local_error);
+  g_autoptr (OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+  ostree_repo_write_dfd_to_mtree (repo, empty_dfd, ".", mtree, NULL, NULL, &local_error);
+  g_assert_no_error (local_error);
+  g_autoptr (GFile) root = NULL;
+  ostree_repo_write_mtree (repo, mtree, &root, NULL, &local_error);
+  g_assert_no_error (local_error);
+  g_autofree char *commit_csum = NULL;
+  ostree_repo_write_commit (repo, NULL, "", "", g_variant_dict_end (meta_dict),
+                            OSTREE_REPO_FILE (root), &commit_csum, NULL, &local_error);
+  g_assert_no_error (local_error);
+  ostree_repo_transaction_set_ref (repo, NULL, ref, commit_csum);
+  ostree_repo_commit_transaction (repo, NULL, NULL, &local_error);
+  g_assert_no_error (local_error);
+  return util::move_nullify (ref);
+}
+
+static void
+test_trigger_cache_prune (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_auto (GLnxTmpDir) tmpdir = {
+    0,
+  };
+  glnx_mkdtemp ("rpmostree-trigger-cache-XXXXXX", 0700, &tmpdir, &local_error);
+  g_assert_no_error (local_error);
+  g_autoptr (OstreeRepo) repo = ostree_repo_create_at (
+      tmpdir.fd, "repo", OSTREE_REPO_MODE_BARE_USER_ONLY, NULL, NULL, &local_error);
+  g_assert_no_error (local_error);
+  glnx_shutil_mkdir_p_at (tmpdir.fd, "empty", 0755, NULL, &local_error);
+  g_assert_no_error (local_error);
+  glnx_autofd int empty_dfd = -1;
+  glnx_opendirat (tmpdir.fd, "empty", TRUE, &empty_dfd, &local_error);
+  g_assert_no_error (local_error);
+
+  g_autofree char *kept_ref = test_write_trigger_result (repo, empty_dfd, "glibc-2.40-1.x86_64");
+  g_autofree char *removed_ref
+      = test_write_trigger_result (repo, empty_dfd, "gtk3-1:3.24.43-1.x86_64");
+
+  /* Only glibc is still in a deployment */
+  g_autoptr (GHashTable) referenced_pkgs
+      = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autofree char *glibc_branch = NULL;
+  rpmostree_nevra_to_cache_branch ("glibc-2.40-1.x86_64", &glibc_branch, &local_error);
+  g_assert_no_error (local_error);
+  g_hash_table_add (referenced_pkgs, util::move_nullify (glibc_branch));
+
+  guint n_freed = 0;
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &local_error);
+  g_assert_no_error (local_error);
+  rpmostree_trigger_cache_prune (repo, referenced_pkgs, &n_freed, NULL, &local_error);
+  g_assert_no_error (local_error);
+  ostree_repo_commit_transaction (repo, NULL, NULL, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_cmpuint (n_freed, ==, 1);
+
+  g_autofree char *rev = NULL;
+  ostree_repo_resolve_rev (repo, kept_ref, TRUE, &rev, &local_error);
+  g_assert_no_error (local_error);
+  g_assert (rev);
+  g_clear_pointer (&rev, g_free);
+  ostree_repo_resolve_rev (repo, removed_ref, TRUE, &rev, &local_error);
+  g_assert_no_error (local_error);
+  g_assert (!rev);
+  g_print ("ok %s\n", G_STRFUNC);
+}
+#endif
+
+void
+rpmostree_trigger_cache_tests (void)
+{
+#ifdef BUILDOPT_BIN_UNIT_TESTS
+  test_trigger_cache_key ();
+  test_trigger_cache_prune ();
+#endif
+}
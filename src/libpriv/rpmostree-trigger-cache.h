@@ -0,0 +1,52 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <ostree.h>
+#include <rpm/rpmlib.h>
+
+G_BEGIN_DECLS
+
+typedef struct RpmOstreeTriggerCache RpmOstreeTriggerCache;
+
+RpmOstreeTriggerCache *rpmostree_trigger_cache_new (OstreeRepo *repo, int rootfs_fd);
+
+void rpmostree_trigger_cache_allow (RpmOstreeTriggerCache *cache, const char *pkg_name,
+                                    const char *const *extra_inputs);
+
+void rpmostree_trigger_cache_free (RpmOstreeTriggerCache *cache);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreeTriggerCache, rpmostree_trigger_cache_free)
+
+gboolean rpmostree_trigger_cache_lookup (RpmOstreeTriggerCache *cache, Header hdr, guint script_idx,
+                                         const char *interp, const char *script, int matches_fd,
+                                         gboolean *out_replayed, GCancellable *cancellable,
+                                         GError **error);
+
+gboolean rpmostree_trigger_cache_store (RpmOstreeTriggerCache *cache, GCancellable *cancellable,
+                                        GError **error);
+
+gboolean rpmostree_trigger_cache_prune (OstreeRepo *repo, GHashTable *referenced_pkgs,
+                                        guint *out_n_freed, GCancellable *cancellable,
+                                        GError **error);
+
+void rpmostree_trigger_cache_tests (void);
+
+G_END_DECLS
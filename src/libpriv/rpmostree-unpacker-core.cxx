@@ -31,12 +31,14 @@
 #include <gio/gunixinputstream.h>
 #include <grp.h>
 #include <pwd.h>
+#include <rpm/rpmcrypto.h>
 #include <rpm/rpmfi.h>
 #include <rpm/rpmlib.h>
 #include <rpm/rpmlog.h>
 #include <rpm/rpmts.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 
 /**
  * throw_libarchive_error:
@@ -65,9 +67,143 @@ throw_libarchive_error (struct archive *ar, GError **error, char const *prefix)
 
 typedef int (*archive_setup_func) (struct archive *);
 
+/* Enable the subset of libarchive filters necessary for RPM payloads */
+static gboolean
+setup_rpm2cpio_filters (struct archive *ar, GError **error)
+{
+  archive_setup_func archive_setup_funcs[]
+      = { archive_read_support_filter_rpm,  archive_read_support_filter_lzma,
+          archive_read_support_filter_gzip, archive_read_support_filter_xz,
+          archive_read_support_filter_bzip2,
+#ifdef HAVE_LIBARCHIVE_ZSTD
+          archive_read_support_filter_zstd,
+#endif
+        };
+
+  for (guint i = 0; i < G_N_ELEMENTS (archive_setup_funcs); i++)
+    {
+      if (archive_setup_funcs[i](ar) != ARCHIVE_OK)
+        {
+          (void)throw_libarchive_error (ar, error, "Setting up rpm2cpio");
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+#define PAYLOAD_READ_BUFSIZE 10240
+
+typedef struct ThreadedUnpack ThreadedUnpack;
+
+struct RpmOstreePayloadDigest
+{
+  DIGEST_CTX ctx;
+  guint64 payload_offset; /* Where the payload starts in the package */
+  guint64 offset;         /* Offset of the next byte read from fd */
+  int fd;                 /* Borrowed, set once an archive reads through us */
+  ThreadedUnpack *tu;     /* Borrowed, set if that archive is threaded */
+  guint8 buf[PAYLOAD_READ_BUFSIZE];
+};
+
+/**
+ * rpmostree_payload_digest_new:
+ * @algo: A PGPHASHALGO_ value, as in RPMTAG_PAYLOADDIGESTALGO
+ * @payload_offset: Offset of the payload in the package
+ *
+ * Returns: (transfer full) (nullable): A digest of the payload of a package,
+ * to be passed when creating its archive; %NULL if @algo isn't supported.
+ */
+RpmOstreePayloadDigest *
+rpmostree_payload_digest_new (int algo, guint64 payload_offset)
+{
+  DIGEST_CTX ctx = rpmDigestInit (algo, RPMDIGEST_NONE);
+  if (ctx == NULL)
+    return NULL;
+  auto digest = g_new0 (RpmOstreePayloadDigest, 1);
+  digest->ctx = ctx;
+  digest->payload_offset = payload_offset;
+  digest->fd = -1;
+  return digest;
+}
+
+void
+rpmostree_payload_digest_free (RpmOstreePayloadDigest *digest)
+{
+  if (digest->ctx)
+    rpmDigestFinal (digest->ctx, NULL, NULL, 0);
+  g_free (digest);
+}
+
+/* Read the next chunk of the package, digesting whatever is part of the payload */
+static ssize_t
+payload_digest_read_chunk (RpmOstreePayloadDigest *digest)
+{
+  ssize_t n = TEMP_FAILURE_RETRY (read (digest->fd, digest->buf, sizeof (digest->buf)));
+  if (n <= 0)
+    return n;
+  if (digest->offset + n > digest->payload_offset)
+    {
+      guint64 skip = 0;
+      if (digest->offset < digest->payload_offset)
+        skip = digest->payload_offset - digest->offset;
+      rpmDigestUpdate (digest->ctx, digest->buf + skip, n - skip);
+    }
+  digest->offset += n;
+  return n;
+}
+
+static la_ssize_t
+payload_digest_read (struct archive *ar, void *client_data, const void **out_buf)
+{
+  auto digest = static_cast<RpmOstreePayloadDigest *> (client_data);
+  ssize_t n = payload_digest_read_chunk (digest);
+  if (n < 0)
+    {
+      archive_set_error (ar, errno, "Reading package");
+      return -1;
+    }
+  *out_buf = digest->buf;
+  return n;
+}
+
+/* The decompressor may stop short of the end of the payload (e.g. before
+ * the stream footer); digest the rest of it too. */
+static gboolean
+payload_digest_drain (RpmOstreePayloadDigest *digest, GError **error)
+{
+  ssize_t n;
+  while ((n = payload_digest_read_chunk (digest)) > 0)
+    ;
+  if (n < 0)
+    return glnx_throw_errno_prefix (error, "Reading package");
+  return TRUE;
+}
+
+/* Make @ar read @fd, feeding @digest along the way if set */
+static int
+archive_read_open_package (struct archive *ar, int fd, RpmOstreePayloadDigest *digest)
+{
+  if (!digest)
+    return archive_read_open_fd (ar, fd, PAYLOAD_READ_BUFSIZE);
+
+  g_assert_cmpint (digest->fd, ==, -1);
+  off_t offset = lseek (fd, 0, SEEK_CUR);
+  if (offset < 0)
+    {
+      archive_set_error (ar, errno, "lseek");
+      return ARCHIVE_FATAL;
+    }
+  digest->fd = fd;
+  digest->offset = offset;
+  return archive_read_open (ar, digest, NULL, payload_digest_read, NULL);
+}
+
 /**
  * rpmostree_unpack_rpm2cpio:
  * @fd: An open file descriptor for an RPM package
+ * @digest: (nullable): Digest the payload into this while it's read; see
+ *   rpmostree_payload_digest_finish()
  * @error: GError
  *
  * Parse CPIO content of @fd via libarchive.  Note that the CPIO data
@@ -75,7 +211,7 @@ typedef int (*archive_setup_func) (struct archive *);
  * filesystem capabilities are part of a separate header, etc.
  */
 struct archive *
-rpmostree_unpack_rpm2cpio (int fd, GError **error)
+rpmostree_unpack_rpm2cpio (int fd, RpmOstreePayloadDigest *digest, GError **error)
 {
   g_autoptr (archive) ar = archive_read_new ();
   if (ar == NULL)
@@ -83,25 +219,219 @@ rpmostree_unpack_rpm2cpio (int fd, GError **error)
                                               "Failed to initialize rpm2cpio archive object");
 
   /* We only do the subset necessary for RPM */
-  {
-    archive_setup_func archive_setup_funcs[]
-        = { archive_read_support_filter_rpm,   archive_read_support_filter_lzma,
-            archive_read_support_filter_gzip,  archive_read_support_filter_xz,
-            archive_read_support_filter_bzip2,
-#ifdef HAVE_LIBARCHIVE_ZSTD
-            archive_read_support_filter_zstd,
-#endif
-            archive_read_support_format_cpio };
+  if (!setup_rpm2cpio_filters (ar, error))
+    return NULL;
+  if (archive_read_support_format_cpio (ar) != ARCHIVE_OK)
+    return throw_libarchive_error (ar, error, "Setting up rpm2cpio");
+
+  if (archive_read_open_package (ar, fd, digest) != ARCHIVE_OK)
+    return throw_libarchive_error (ar, error, "Reading rpm2cpio");
 
-    for (guint i = 0; i < G_N_ELEMENTS (archive_setup_funcs); i++)
-      {
-        if (archive_setup_funcs[i](ar) != ARCHIVE_OK)
-          return throw_libarchive_error (ar, error, "Setting up rpm2cpio");
-      }
-  }
+  return util::move_nullify (ar);
+}
 
-  if (archive_read_open_fd (ar, fd, 10240) != ARCHIVE_OK)
+#define THREADED_UNPACK_BUFSIZE (128 * 1024)
+
+/* State shared between a threaded rpm2cpio archive and its decoder thread */
+struct ThreadedUnpack
+{
+  int src_fd;      /* Our own open of the package, with its own file offset */
+  int sock_fds[2]; /* [0] is read by the cpio reader, [1] written by the decoder */
+  GThread *thread;
+  char *errmsg;                   /* Set by the decoder thread on failure */
+  RpmOstreePayloadDigest *digest; /* Borrowed; only used by the decoder thread */
+  guint8 readbuf[THREADED_UNPACK_BUFSIZE];
+};
+
+static void
+threaded_unpack_free (ThreadedUnpack *tu)
+{
+  /* Closing our end makes any pending send() in the decoder fail */
+  glnx_close_fd (&tu->sock_fds[0]);
+  if (tu->thread)
+    g_thread_join (tu->thread);
+  glnx_close_fd (&tu->sock_fds[1]);
+  glnx_close_fd (&tu->src_fd);
+  g_free (tu->errmsg);
+  g_free (tu);
+}
+
+/* Decompress the payload of src_fd and stream the raw CPIO data into the
+ * socket. Runs in the decoder thread. */
+static gboolean
+threaded_unpack_decode (ThreadedUnpack *tu, GError **error)
+{
+  g_autoptr (archive) ar = archive_read_new ();
+  if (ar == NULL)
+    return glnx_throw (error, "Failed to initialize payload decoder");
+  if (!setup_rpm2cpio_filters (ar, error))
+    return FALSE;
+
+  struct archive_entry *entry;
+  if (archive_read_support_format_raw (ar) != ARCHIVE_OK
+      || archive_read_open_package (ar, tu->src_fd, tu->digest) != ARCHIVE_OK
+      || archive_read_next_header (ar, &entry) != ARCHIVE_OK)
+    {
+      (void)throw_libarchive_error (ar, error, "Decoding payload");
+      return FALSE;
+    }
+
+  g_autofree guint8 *buf = (guint8 *)g_malloc (THREADED_UNPACK_BUFSIZE);
+  while (TRUE)
+    {
+      la_ssize_t n = archive_read_data (ar, buf, THREADED_UNPACK_BUFSIZE);
+      if (n < 0)
+        {
+          (void)throw_libarchive_error (ar, error, "Decoding payload");
+          return FALSE;
+        }
+      if (n == 0)
+        break;
+      for (la_ssize_t off = 0; off < n;)
+        {
+          ssize_t written
+              = TEMP_FAILURE_RETRY (send (tu->sock_fds[1], buf + off, n - off, MSG_NOSIGNAL));
+          /* The reader went away (e.g. it errored out); nothing left to do */
+          if (written < 0)
+            return TRUE;
+          off += written;
+        }
+    }
+
+  if (tu->digest && !payload_digest_drain (tu->digest, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+static gpointer
+threaded_unpack_thread (gpointer data)
+{
+  auto tu = static_cast<ThreadedUnpack *> (data);
+  g_autoptr (GError) local_error = NULL;
+  if (!threaded_unpack_decode (tu, &local_error))
+    tu->errmsg = g_strdup (local_error->message);
+  /* Signals EOF to the reader */
+  glnx_close_fd (&tu->sock_fds[1]);
+  return NULL;
+}
+
+static la_ssize_t
+threaded_unpack_read (struct archive *ar, void *client_data, const void **out_buf)
+{
+  auto tu = static_cast<ThreadedUnpack *> (client_data);
+  ssize_t n = TEMP_FAILURE_RETRY (read (tu->sock_fds[0], tu->readbuf, sizeof (tu->readbuf)));
+  if (n < 0)
+    {
+      archive_set_error (ar, errno, "Reading decoded payload");
+      return -1;
+    }
+  if (n == 0 && tu->thread)
+    {
+      g_thread_join (util::move_nullify (tu->thread));
+      if (tu->errmsg)
+        {
+          archive_set_error (ar, ARCHIVE_ERRNO_MISC, "%s", tu->errmsg);
+          return -1;
+        }
+    }
+  *out_buf = tu->readbuf;
+  return n;
+}
+
+static int
+threaded_unpack_close (struct archive *ar, void *client_data)
+{
+  threaded_unpack_free (static_cast<ThreadedUnpack *> (client_data));
+  return ARCHIVE_OK;
+}
+
+/**
+ * rpmostree_unpack_rpm2cpio_threaded:
+ * @fd: An open file descriptor for an RPM package
+ * @digest: (nullable): Digest the payload into this while it's read; see
+ *   rpmostree_payload_digest_finish()
+ * @error: GError
+ *
+ * Like rpmostree_unpack_rpm2cpio(), but the payload is decompressed in a
+ * dedicated thread which streams the CPIO data to the returned archive. This
+ * overlaps decompression with whatever the caller does with the entries
+ * (checksumming, writing objects), which matters for very large packages
+ * where a single import otherwise dominates the wall clock time.
+ */
+struct archive *
+rpmostree_unpack_rpm2cpio_threaded (int fd, RpmOstreePayloadDigest *digest, GError **error)
+{
+  g_autoptr (archive) ar = archive_read_new ();
+  if (ar == NULL)
+    return (struct archive *)glnx_null_throw (error,
+                                              "Failed to initialize rpm2cpio archive object");
+  if (archive_read_support_format_cpio (ar) != ARCHIVE_OK)
+    return throw_libarchive_error (ar, error, "Setting up rpm2cpio");
+
+  auto tu = g_new0 (ThreadedUnpack, 1);
+  tu->src_fd = tu->sock_fds[0] = tu->sock_fds[1] = -1;
+  g_autofree char *abspath = g_strdup_printf ("/proc/self/fd/%d", fd);
+  if (!glnx_openat_rdonly (AT_FDCWD, abspath, TRUE, &tu->src_fd, error))
+    {
+      threaded_unpack_free (tu);
+      return NULL;
+    }
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, tu->sock_fds) < 0)
+    {
+      glnx_throw_errno_prefix (error, "socketpair");
+      threaded_unpack_free (tu);
+      return NULL;
+    }
+  if (digest)
+    {
+      tu->digest = digest;
+      digest->tu = tu;
+    }
+  tu->thread = g_thread_new ("rpmostree-unpack", threaded_unpack_thread, tu);
+
+  /* From here on, @tu is owned by the archive and freed by its close callback */
+  if (archive_read_open (ar, tu, NULL, threaded_unpack_read, threaded_unpack_close) != ARCHIVE_OK)
     return throw_libarchive_error (ar, error, "Reading rpm2cpio");
 
   return util::move_nullify (ar);
 }
+
+/**
+ * rpmostree_payload_digest_finish:
+ * @digest: Digest passed when creating an archive which was read to its end
+ * @error: GError
+ *
+ * Digest what's left of the package and return the digest of its payload,
+ * to compare with RPMTAG_PAYLOADDIGEST. This must be called before the
+ * archive is freed.
+ *
+ * Returns: (transfer full): The hex digest of the payload
+ */
+char *
+rpmostree_payload_digest_finish (RpmOstreePayloadDigest *digest, GError **error)
+{
+  g_assert (digest->ctx != NULL);
+
+  ThreadedUnpack *tu = digest->tu;
+  if (tu)
+    {
+      /* The decoder may still hand over data past the CPIO trailer; take it
+       * so it can finish, digesting the rest of the package. */
+      while (TEMP_FAILURE_RETRY (read (tu->sock_fds[0], tu->readbuf, sizeof (tu->readbuf))) > 0)
+        ;
+      if (tu->thread)
+        g_thread_join (util::move_nullify (tu->thread));
+      if (tu->errmsg)
+        return (char *)glnx_null_throw (error, "%s", tu->errmsg);
+    }
+  else if (!payload_digest_drain (digest, error))
+    return NULL;
+  g_assert_cmpint (digest->fd, !=, -1);
+
+  char *hexdigest = NULL;
+  rpmDigestFinal (util::move_nullify (digest->ctx), (void **)&hexdigest, NULL, 1);
+  g_autofree char *ret = g_strdup (hexdigest);
+  free (hexdigest);
+  return util::move_nullify (ret);
+}
@@ -32,6 +32,20 @@ G_BEGIN_DECLS
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (archive, archive_read_free);
 
-struct archive *rpmostree_unpack_rpm2cpio (int fd, GError **error);
+typedef struct RpmOstreePayloadDigest RpmOstreePayloadDigest;
+
+RpmOstreePayloadDigest *rpmostree_payload_digest_new (int algo, guint64 payload_offset);
+
+void rpmostree_payload_digest_free (RpmOstreePayloadDigest *digest);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RpmOstreePayloadDigest, rpmostree_payload_digest_free);
+
+char *rpmostree_payload_digest_finish (RpmOstreePayloadDigest *digest, GError **error);
+
+struct archive *rpmostree_unpack_rpm2cpio (int fd, RpmOstreePayloadDigest *digest,
+                                           GError **error);
+
+struct archive *rpmostree_unpack_rpm2cpio_threaded (int fd, RpmOstreePayloadDigest *digest,
+                                                    GError **error);
 
 G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,125 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* The bounded scheduler shared by everything we do concurrently on worker
+ * threads: package imports, pkgcache commit loads, checkouts and relabeling,
+ * local RPM imports and scriptlets. The jobs themselves are driven by the caller;
+ * this just does the accounting of how many are in flight, and spins the
+ * thread-default main context until they're all done. */
+
+#include "config.h"
+
+#include <libglnx.h>
+
+#include "rpmostree-util.h"
+#include "rpmostree-worker-pool.h"
+
+void
+rpmostree_worker_pool_init (RpmOstreeWorkerPool *pool, guint n_max,
+                            RpmOstreeWorkerPoolStartFunc start, gpointer user_data)
+{
+  g_assert_cmpuint (n_max, >, 0);
+  *pool = {};
+  pool->start = start;
+  pool->user_data = user_data;
+  pool->n_max = n_max;
+}
+
+static void
+worker_pool_take_error (RpmOstreeWorkerPool *pool, GError *error)
+{
+  if (!error)
+    return;
+  /* The first error is the interesting one */
+  if (pool->error)
+    g_error_free (error);
+  else
+    pool->error = error;
+}
+
+/* Start as many jobs as there are free slots and ready jobs; called on the
+ * main context, both to start and whenever more jobs may have become ready. */
+void
+rpmostree_worker_pool_iter (RpmOstreeWorkerPool *pool)
+{
+  while (pool->n_running < pool->n_max && pool->error == NULL)
+    {
+      gboolean started = FALSE;
+      g_autoptr (GError) local_error = NULL;
+      if (!pool->start (pool, pool->user_data, &started, &local_error))
+        {
+          worker_pool_take_error (pool, util::move_nullify (local_error));
+          break;
+        }
+      if (!started)
+        break;
+      pool->n_running++;
+    }
+
+  if (pool->n_running == 0 && pool->n_holds == 0 && pool->running)
+    {
+      pool->running = FALSE;
+      g_main_context_wakeup (g_main_context_get_thread_default ());
+    }
+}
+
+/* Called on the main context when a job finishes; takes ownership of @error */
+void
+rpmostree_worker_pool_job_done (RpmOstreeWorkerPool *pool, GError *error)
+{
+  g_assert_cmpuint (pool->n_running, >, 0);
+  pool->n_running--;
+  worker_pool_take_error (pool, error);
+  rpmostree_worker_pool_iter (pool);
+}
+
+/* Keep rpmostree_worker_pool_run() from returning even with no jobs running,
+ * e.g. while another thread is still producing them. */
+void
+rpmostree_worker_pool_hold (RpmOstreeWorkerPool *pool)
+{
+  pool->n_holds++;
+}
+
+/* Drop a hold; takes ownership of @error */
+void
+rpmostree_worker_pool_release (RpmOstreeWorkerPool *pool, GError *error)
+{
+  g_assert_cmpuint (pool->n_holds, >, 0);
+  pool->n_holds--;
+  worker_pool_take_error (pool, error);
+  rpmostree_worker_pool_iter (pool);
+}
+
+/* Run jobs until they're all done, or until one failed and the running ones
+ * are done. */
+gboolean
+rpmostree_worker_pool_run (RpmOstreeWorkerPool *pool, GError **error)
+{
+  pool->running = TRUE;
+  rpmostree_worker_pool_iter (pool);
+  GMainContext *mainctx = g_main_context_get_thread_default ();
+  while (pool->running)
+    g_main_context_iteration (mainctx, TRUE);
+  if (pool->error)
+    {
+      g_propagate_error (error, util::move_nullify (pool->error));
+      return FALSE;
+    }
+  return TRUE;
+}
@@ -0,0 +1,61 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2 of the licence or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct RpmOstreeWorkerPool RpmOstreeWorkerPool;
+
+/* Start the next job, e.g. via g_task_run_in_thread(), arranging for
+ * rpmostree_worker_pool_job_done() to be called on the main context once it's
+ * finished. Set @out_started to %FALSE if no job can be started right now. */
+typedef gboolean (*RpmOstreeWorkerPoolStartFunc) (RpmOstreeWorkerPool *pool, gpointer user_data,
+                                                  gboolean *out_started, GError **error);
+
+/* Keeps up to @n_max asynchronous jobs running from a thread's main context.
+ * Whenever one finishes, the next one goes to the free slot. After the first
+ * error, no new jobs are started; we just wait for the running ones. Usually
+ * lives on the stack of the function running the jobs. */
+struct RpmOstreeWorkerPool
+{
+  RpmOstreeWorkerPoolStartFunc start;
+  gpointer user_data;
+  guint n_max;
+  guint n_running;
+  guint n_holds;
+  gboolean running;
+  GError *error;
+};
+
+void rpmostree_worker_pool_init (RpmOstreeWorkerPool *pool, guint n_max,
+                                 RpmOstreeWorkerPoolStartFunc start, gpointer user_data);
+
+void rpmostree_worker_pool_iter (RpmOstreeWorkerPool *pool);
+
+void rpmostree_worker_pool_job_done (RpmOstreeWorkerPool *pool, GError *error);
+
+void rpmostree_worker_pool_hold (RpmOstreeWorkerPool *pool);
+
+void rpmostree_worker_pool_release (RpmOstreeWorkerPool *pool, GError *error);
+
+gboolean rpmostree_worker_pool_run (RpmOstreeWorkerPool *pool, GError **error);
+
+G_END_DECLS
@@ -162,6 +162,8 @@ EOF
         case $section in
         requires)
             echo "Requires: $arg" >> $spec;;
+        requires_post)
+            echo "Requires(post): $arg" >> $spec;;
         recommends)
             echo "Recommends: $arg" >> $spec;;
         provides)
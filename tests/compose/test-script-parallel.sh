@@ -0,0 +1,78 @@
+#!/bin/bash
+set -xeuo pipefail
+
+dn=$(cd "$(dirname "$0")" && pwd)
+# shellcheck source=libcomposetest.sh
+. "${dn}/libcomposetest.sh"
+
+# Run independent %post scripts concurrently
+export RPMOSTREE_SCRIPT_PARALLEL=4
+
+# Add a local rpm-md repo so we can mutate local test packages
+treefile_append "repos" '["test-repo"]'
+# Only these may run concurrently
+treefile_append "parallel-post-scripts" '["parallel-base", "parallel-user",
+                                          "parallel-independent-1", "parallel-independent-2",
+                                          "parallel-independent-3", "parallel-independent-4"]'
+# A %post must still wait for the ones of packages it has a Requires(post) on
+build_rpm parallel-base \
+          post "sleep 2; echo parallel-base > /usr/share/parallel-base.txt"
+build_rpm parallel-user \
+          requires_post parallel-base \
+          post "cat /usr/share/parallel-base.txt > /usr/share/parallel-user.txt"
+# And the scripts of any other package must not overlap; this fails if another
+# one holds the lock
+for x in 1 2 3; do
+  build_rpm parallel-shared-${x} \
+            post "set -e
+                  test ! -e /usr/share/parallel-shared.lock
+                  touch /usr/share/parallel-shared.lock
+                  sleep 1
+                  echo parallel-shared-${x} >> /usr/share/parallel-shared.txt
+                  rm /usr/share/parallel-shared.lock"
+done
+for x in 1 2 3 4; do
+  build_rpm parallel-independent-${x} \
+            post "sleep 1; echo parallel-independent-${x} > /usr/share/parallel-independent-${x}.txt"
+done
+
+echo gpgcheck=0 >> yumrepo.repo
+ln "$PWD/yumrepo.repo" config/yumrepo.repo
+# the top-level manifest doesn't have any packages, so just set it
+treefile_append "packages" '["parallel-base parallel-user",
+                             "parallel-shared-1 parallel-shared-2 parallel-shared-3",
+                             "parallel-independent-1 parallel-independent-2",
+                             "parallel-independent-3 parallel-independent-4"]'
+
+# Do the compose
+runcompose
+echo "ok compose"
+
+ostree --repo=${repo} cat ${treeref} /usr/share/parallel-user.txt > out.txt
+assert_file_has_content out.txt parallel-base
+echo "ok parallel scripts Requires(post)"
+
+ostree --repo=${repo} cat ${treeref} /usr/share/parallel-shared.txt > out.txt
+assert_streq "$(wc -l < out.txt)" 3
+for x in 1 2 3; do
+  assert_file_has_content out.txt parallel-shared-${x}
+done
+ostree --repo=${repo} ls ${treeref} /usr/share > out.txt
+assert_not_file_has_content out.txt parallel-shared.lock
+echo "ok parallel scripts serialized by default"
+
+for x in 1 2 3 4; do
+  ostree --repo=${repo} cat ${treeref} /usr/share/parallel-independent-${x}.txt > out.txt
+  assert_file_has_content out.txt parallel-independent-${x}
+done
+echo "ok parallel scripts independent"
+
+# A failing script fails the compose, even with others still running
+build_rpm parallel-fail \
+          post "exit 42"
+treefile_append "packages" '["parallel-fail"]'
+if runcompose &>err.txt; then
+  fatal "compose unexpectedly succeeded"
+fi
+assert_file_has_content err.txt 'Running %post for parallel-fail.*Child process exited with code 42'
+echo "ok parallel scripts failure"
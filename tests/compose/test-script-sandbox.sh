@@ -0,0 +1,50 @@
+#!/bin/bash
+set -xeuo pipefail
+
+dn=$(cd "$(dirname "$0")" && pwd)
+# shellcheck source=libcomposetest.sh
+. "${dn}/libcomposetest.sh"
+
+# Run all the scripts of a phase in one long-lived container
+export RPMOSTREE_SCRIPT_SANDBOX=persistent
+
+# Add a local rpm-md repo so we can mutate local test packages
+treefile_append "repos" '["test-repo"]'
+build_rpm sandbox-pre \
+          pre "echo sandbox-pre > /usr/share/sandbox-pre.txt"
+build_rpm sandbox-post \
+          requires sandbox-pre \
+          post "set -eu
+                test -f /usr/share/sandbox-pre.txt
+                echo sandbox-post \$1 > /usr/share/sandbox-post.txt"
+build_rpm sandbox-posttrans \
+          requires sandbox-post \
+          posttrans "cat /usr/share/sandbox-post.txt > /usr/share/sandbox-posttrans.txt"
+
+echo gpgcheck=0 >> yumrepo.repo
+ln "$PWD/yumrepo.repo" config/yumrepo.repo
+# the top-level manifest doesn't have any packages, so just set it
+treefile_append "packages" '["sandbox-pre sandbox-post sandbox-posttrans"]'
+
+# Do the compose
+runcompose
+echo "ok compose"
+
+ostree --repo=${repo} cat ${treeref} /usr/share/sandbox-pre.txt > out.txt
+assert_file_has_content out.txt sandbox-pre
+ostree --repo=${repo} cat ${treeref} /usr/share/sandbox-post.txt > out.txt
+# The script argument makes it through to %post
+assert_file_has_content out.txt 'sandbox-post 1'
+ostree --repo=${repo} cat ${treeref} /usr/share/sandbox-posttrans.txt > out.txt
+assert_file_has_content out.txt 'sandbox-post 1'
+echo "ok scripts in persistent sandbox"
+
+# A failing script fails the compose the same way as without the sandbox
+build_rpm sandbox-fail \
+          post "echo sandbox-fail-output; exit 42"
+treefile_append "packages" '["sandbox-fail"]'
+if runcompose &>err.txt; then
+  fatal "compose unexpectedly succeeded"
+fi
+assert_file_has_content err.txt 'Running %post for sandbox-fail.*Child process exited with code 42'
+echo "ok failing script in persistent sandbox"
@@ -243,6 +243,53 @@ rpm-ostree status > out.txt
 assert_file_has_content_literal out.txt 'State: idle'
 echo "ok auto-cancel not-started transaction"
 
+# With TransactionQueue, a transaction request made while another one runs
+# waits for it instead of failing. Slow transactions down so they overlap.
+cp /etc/rpm-ostreed.conf{,.bak}
+echo 'TransactionQueue=true' >> /etc/rpm-ostreed.conf
+mkdir -p /run/systemd/system/rpm-ostreed.service.d
+cat > /run/systemd/system/rpm-ostreed.service.d/failpoints.conf <<'EOF'
+[Service]
+Environment=FAILPOINTS=transaction::execute=sleep(5000)
+EOF
+systemctl daemon-reload
+systemctl restart rpm-ostreed
+# Clients use this to know they must not time out while queued
+busctl get-property org.projectatomic.rpmostree1 /org/projectatomic/rpmostree1/Sysroot \
+  org.projectatomic.rpmostree1.Sysroot TransactionQueue > out.txt
+assert_file_has_content_literal out.txt 'b true'
+cursor=$(journalctl -o json -n 1 | jq -r '.["__CURSOR"]')
+rpm-ostree cleanup -p &
+first=$!
+journal_poll -u rpm-ostreed --after-cursor "${cursor}" --grep="Initiated txn Cleanup"
+rpm-ostree cleanup -m
+wait ${first}
+journal_poll -u rpm-ostreed --after-cursor "${cursor}" --grep="Queued Cleanup for caller .* \(position 1\)"
+journal_poll -u rpm-ostreed --after-cursor "${cursor}" --grep="Starting queued Cleanup"
+echo "ok queued transaction"
+
+# Queued requests of clients which went away are dropped
+cursor=$(journalctl -o json -n 1 | jq -r '.["__CURSOR"]')
+rpm-ostree cleanup -p &
+first=$!
+journal_poll -u rpm-ostreed --after-cursor "${cursor}" --grep="Initiated txn Cleanup"
+if timeout 2 rpm-ostree cleanup -m; then
+    fatal "queued cleanup unexpectedly finished"
+fi
+wait ${first}
+journal_poll -u rpm-ostreed --after-cursor "${cursor}" --grep="Dropping queued Cleanup; caller .* disconnected"
+if journalctl -u rpm-ostreed --after-cursor "${cursor}" --grep="Starting queued Cleanup"; then
+    fatal "started dropped queued transaction"
+fi
+rpm-ostree status > out.txt
+assert_file_has_content_literal out.txt 'State: idle'
+echo "ok drop queued transaction of vanished caller"
+
+rm /run/systemd/system/rpm-ostreed.service.d/failpoints.conf
+systemctl daemon-reload
+mv /etc/rpm-ostreed.conf{.bak,}
+systemctl restart rpm-ostreed
+
 # See rpmostree-scripts.c
 grep ^DEFAULT /etc/crypto-policies/config
 echo "ok crypto-policies DEFAULT backend"